@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "antlr4-runtime.h"
+#include "asmxtoyLexer.h"
+#include "asmxtoyParser.h"
+#include "asmxtoyBaseListener.h"
+#include "xasm.h"
+
+using namespace antlr4;
+
+
+// Turns the parse tree into statements. ANTLR counts positions in code points, so only in an ASCII source does a
+// token's start index find its text in the source, otherwise the text ANTLR hands out is kept in parsed.
+class XToyCollectListener : public asmxtoyBaseListener {
+public:
+  XToyCollectListener(std::string_view source, ParsedSource &parsed)
+    : source(source), parsed(parsed),
+      ascii(std::none_of(source.begin(), source.end(), [](char c) { return c & 0x80; })) {}
+
+  void exitInstruction(asmxtoyParser::InstructionContext *) override;
+  void exitDirective(asmxtoyParser::DirectiveContext *) override;
+  void exitLabel(asmxtoyParser::LabelContext *) override;
+
+private:
+  SourceToken Collect(Token *token);
+
+  std::string_view source;
+  ParsedSource &parsed;
+  bool ascii;
+};
+
+SourceToken XToyCollectListener::Collect(Token *token) {
+  std::string_view text;
+  if (ascii) {
+    text = source.substr(token->getStartIndex(), token->getStopIndex() - token->getStartIndex() + 1);
+  } else {
+    text = parsed.strings.emplace_back(token->getText());
+  }
+  return {text, static_cast<uint32_t>(token->getLine()), static_cast<uint32_t>(token->getCharPositionInLine())};
+}
+
+void XToyCollectListener::exitInstruction(asmxtoyParser::InstructionContext *instructionCtx) {
+  Statement statement{StatementKind::Instruction, Collect(instructionCtx->MNEMONIC()->getSymbol()), 0, {}};
+
+  for (asmxtoyParser::ArgumentContext *argumentCtx : instructionCtx->argument()) {
+    if (statement.argumentCount < statement.arguments.size()) {
+      SourceArgument &argument = statement.arguments[statement.argumentCount];
+      if (argumentCtx->REGISTER()) {
+        argument = {ArgumentKind::Register, Collect(argumentCtx->REGISTER()->getSymbol())};
+      } else if (argumentCtx->HALFWORD()) {
+        argument = {ArgumentKind::HalfWord, Collect(argumentCtx->HALFWORD()->getSymbol())};
+      } else {
+        argument = {ArgumentKind::Label, Collect(argumentCtx->LABEL()->getSymbol())};
+      }
+    }
+    ++statement.argumentCount;
+  }
+
+  parsed.statements.push_back(statement);
+}
+
+void XToyCollectListener::exitDirective(asmxtoyParser::DirectiveContext *directiveCtx) {
+  Statement statement{StatementKind::Directive, Collect(directiveCtx->DIRECTIVE()->getSymbol()), 1, {}};
+  statement.arguments[0] = {ArgumentKind::Word, Collect(directiveCtx->WORD()->getSymbol())};
+  parsed.statements.push_back(statement);
+}
+
+void XToyCollectListener::exitLabel(asmxtoyParser::LabelContext *labelCtx) {
+  parsed.statements.push_back({StatementKind::Label, Collect(labelCtx->LABEL()->getSymbol()), 0, {}});
+}
+
+// Collects syntax errors as diagnostics in place of ANTLR printing them
+class XToyErrorListener : public BaseErrorListener {
+public:
+  explicit XToyErrorListener(std::vector<Diagnostic> &diagnostics) : diagnostics(diagnostics) {}
+
+  void syntaxError(Recognizer *, Token *offendingSymbol, size_t line, size_t charPositionInLine,
+      const std::string &msg, std::exception_ptr) override {
+    diagnostics.push_back({static_cast<uint32_t>(line), static_cast<uint32_t>(charPositionInLine),
+      offendingSymbol ? offendingSymbol->getText() : "", msg});
+  }
+
+private:
+  std::vector<Diagnostic> &diagnostics;
+};
+
+bool ParseAntlr(std::string_view source, ParsedSource &parsed, std::vector<Diagnostic> &diagnostics) {
+  XToyErrorListener errorListener(diagnostics);
+  ANTLRInputStream input(source);
+  asmxtoyLexer lexer(&input);
+  lexer.removeErrorListeners();
+  lexer.addErrorListener(&errorListener);
+  CommonTokenStream tokens(&lexer);
+  asmxtoyParser parser(&tokens);
+  parser.removeErrorListeners();
+  parser.addErrorListener(&errorListener);
+
+  tree::ParseTree* tree = parser.file();
+
+  // ANTLR carries on past syntax errors once it has reported them, stop here so both front ends accept the same
+  // sources
+  if (lexer.getNumberOfSyntaxErrors() != 0 || parser.getNumberOfSyntaxErrors() != 0) {
+    return false;
+  }
+
+  XToyCollectListener collectListener(source, parsed);
+  tree::ParseTreeWalker::DEFAULT.walk(&collectListener, tree);
+  return true;
+}
@@ -0,0 +1,287 @@
+#include <inttypes.h> // PRIX8, PRIX16, PRIX32, uint8_t, uint16_t, uint32_t
+#include <stdbool.h>  // bool, false, true
+#include <stdio.h>    // FILE, fprintf, fputs, stderr
+#include <string.h>   // memset
+
+#include "emulator.h"
+
+static const char *mnemonics[] = {
+  "hlt", "add", "sub", "and", "xor", "asl", "asr", "lda",
+  "lod", "str", "ldi", "sti", "brz", "brp", "jmp", "jsr"
+};
+
+// Shared by every generated program, port handling matches handleStdin/handleStdout and interpret() is the
+// fallback for computed jumps outside of the compiled code and for programs that overwrite their own code. Running
+// out of input ends the program the way hlt does, where the interpreters stop with STOP_NO_INPUT.
+static const char *aotRuntime =
+  "static bool readPort(void) {\n"
+  "  uint32_t value;\n"
+  "  int matched;\n"
+  "  printf(\"input: \\n\");\n"
+  "  while ((matched = scanf(\"%4\" SCNx32, &value)) != 1) {\n"
+  "    if (matched == EOF) return false;\n"
+  "    printf(\"input: \\n\");\n"
+  "    scanf(\"%*s\");\n"
+  "  }\n"
+  "  putchar('\\n');\n"
+  "  memory[PORT] = value;\n"
+  "  return true;\n"
+  "}\n"
+  "\n"
+  "static void writePort(void) {\n"
+  "  printf(\"output: %04\" PRIX32 \"(%\" PRId32 \")\\n\\n\", (uint32_t)memory[PORT], (int32_t)memory[PORT]);\n"
+  "}\n"
+  "\n"
+  "static int interpret(uint32_t *r, uint8_t pc) {\n"
+  "  while (true) {\n"
+  "    uint16_t inst = memory[pc];\n"
+  "    uint8_t rd = (inst >> 8) & 0xF, rs = (inst >> 4) & 0xF, rt = inst & 0xF, addr = inst & 0xFF;\n"
+  "    uint8_t nextPC = pc + 1;\n"
+  "    switch (inst >> 12) {\n"
+  "      case 0x0:\n"
+  "        if (inst != 0x0FFF) return 0;\n"
+  "        puts(\"32 bit mode is not supported in compiled programs\");\n"
+  "        return 1;\n"
+  "      case 0x1: r[rd] = r[rs] + r[rt]; break;\n"
+  "      case 0x2: r[rd] = r[rs] - r[rt]; break;\n"
+  "      case 0x3: r[rd] = r[rs] & r[rt]; break;\n"
+  "      case 0x4: r[rd] = r[rs] ^ r[rt]; break;\n"
+  "      case 0x5: r[rd] = r[rs] << (r[rt] & 31); break;\n"
+  "      case 0x6: r[rd] = r[rs] >> (r[rt] & 31); break;\n"
+  "      case 0x7: r[rd] = addr; break;\n"
+  "      case 0xA: addr = r[rt]; // fall through\n"
+  "      case 0x8: if (addr == PORT && !readPort()) return 0; r[rd] = memory[addr]; break;\n"
+  "      case 0xB: addr = r[rt]; // fall through\n"
+  "      case 0x9: memory[addr] = r[rd]; if (addr == PORT) writePort(); break;\n"
+  "      case 0xC: if (r[rd] == 0) nextPC = addr; break;\n"
+  "      case 0xD: if (r[rd] > 0) nextPC = addr; break;\n"
+  "      case 0xE: nextPC = r[rd]; break;\n"
+  "      case 0xF: r[rd] = nextPC; nextPC = addr; break;\n"
+  "    }\n"
+  "    r[0] = 0;\n"
+  "    pc = nextPC;\n"
+  "  }\n"
+  "}\n"
+  "\n";
+
+static void aotReg(FILE *out, uint8_t reg) {
+  if (reg) {
+    fprintf(out, "r%" PRIX8, reg);
+  } else {
+    fputs("0", out);
+  }
+}
+
+// Target for a register write, writes to r0 are dropped but the read still happens for the port
+static void aotDest(FILE *out, uint8_t reg) {
+  if (reg) {
+    fprintf(out, "r%" PRIX8 " = ", reg);
+  } else {
+    fputs("(void)", out);
+  }
+}
+
+// Leaves compiled code for the interpreter once a store changes a word that was compiled as code
+static void aotCheckCode(FILE *out, const bool *reachable, const uint16_t *memory, uint8_t addr, uint8_t nextPC) {
+  if (!reachable[addr]) return;
+  fprintf(out, "  if (memory[0x%02" PRIX8 "] != 0x%04" PRIX16 ") { pc = 0x%02" PRIX8 "; goto fallback; }\n",
+    addr, memory[addr], nextPC);
+}
+
+// Writes a C program that runs the 16 bit image in cpuState the same way runCpu16 does. Every instruction
+// reachable from pc gets its own label, computed jumps go through a switch over those labels.
+// Returns false if the image can't be compiled.
+bool emitAot16(cpu *cpuState, FILE *out, const char *source) {
+  const uint16_t *memory = cpuState->memory16;
+  bool reachable[MEM_SIZE_16];
+  bool usesDispatch = false, usesIndirect = false;
+  uint8_t worklist[MEM_SIZE_16 * 2];
+  uint32_t pending = 0;
+
+  memset(reachable, 0, sizeof(reachable));
+  worklist[pending++] = cpuState->pc;
+  while (pending) {
+    uint8_t pc = worklist[--pending];
+    if (reachable[pc]) continue;
+    reachable[pc] = true;
+
+    uint16_t inst = memory[pc];
+    uint8_t addr = inst & 0xFF;
+    switch (inst >> 12) {
+      case 0x0:
+        if (inst == 0x0FFF) {
+          fprintf(stderr, "Error: 32 bit mode switch at %02" PRIX8 " can't be compiled\n", pc);
+          return false;
+        }
+        break;
+      case 0xC:
+      case 0xD:
+        worklist[pending++] = addr;
+        worklist[pending++] = pc + 1;
+        break;
+      case 0xA:
+      case 0xB:
+        usesIndirect = true;
+        worklist[pending++] = pc + 1;
+        break;
+      case 0xE:
+        usesDispatch = true;
+        break;
+      case 0xF:
+        // pc + 1 is the return address
+        worklist[pending++] = addr;
+        worklist[pending++] = pc + 1;
+        break;
+      default:
+        worklist[pending++] = pc + 1;
+        break;
+    }
+  }
+
+  fprintf(out, "// Generated by emulator --aot from %s\n", source);
+  fputs("#include <inttypes.h>\n#include <stdbool.h>\n#include <stdio.h>\n\n", out);
+  fputs("// Every reachable address gets a label whether anything jumps to it or not\n", out);
+  fputs("#ifdef __GNUC__\n#pragma GCC diagnostic ignored \"-Wunused-label\"\n#endif\n\n", out);
+  fprintf(out, "#define PORT 0x%02" PRIX16 "\n\n", stdInOutAddr16);
+  fputs("#define IMAGE {", out);
+  for (uint32_t i = 0; i < MEM_SIZE_16; ++i) {
+    fprintf(out, "%s0x%04" PRIX16 ",", i % 8 ? " " : " \\\n  ", memory[i]);
+  }
+  fputs(" \\\n}\n\n", out);
+  fputs("static uint16_t memory[256] = IMAGE;\n", out);
+  if (usesIndirect) {
+    // ldi/sti need to know which words were compiled as code and what they were
+    fputs("static const uint16_t image[256] = IMAGE;\n", out);
+    fputs("static const bool code[256] = {", out);
+    for (uint32_t i = 0; i < MEM_SIZE_16; ++i) {
+      fprintf(out, "%s%d,", i % 16 ? " " : "\n  ", reachable[i]);
+    }
+    fputs("\n};\n", out);
+  }
+  fputs("\n", out);
+  fputs(aotRuntime, out);
+
+  fputs("int main(void) {\n", out);
+  fputs("  uint32_t r1 = 0, r2 = 0, r3 = 0, r4 = 0, r5 = 0, r6 = 0, r7 = 0, r8 = 0;\n", out);
+  fputs("  uint32_t r9 = 0, rA = 0, rB = 0, rC = 0, rD = 0, rE = 0, rF = 0;\n", out);
+  fprintf(out, "  uint8_t pc%s;\n", usesIndirect ? ", addr" : "");
+  fprintf(out, "  goto L%02" PRIX16 ";\n\n", cpuState->pc);
+
+  if (usesDispatch) {
+    fputs("dispatch:\n  switch (pc) {\n", out);
+    for (uint32_t i = 0; i < MEM_SIZE_16; ++i) {
+      if (reachable[i]) fprintf(out, "    case 0x%02" PRIX32 ": goto L%02" PRIX32 ";\n", i, i);
+    }
+    fputs("    default: goto fallback;\n  }\n\n", out);
+  }
+
+  fputs("fallback: {\n", out);
+  fputs("    uint32_t r[16] = {0, r1, r2, r3, r4, r5, r6, r7, r8, r9, rA, rB, rC, rD, rE, rF};\n", out);
+  fputs("    return interpret(r, pc);\n  }\n", out);
+
+  for (uint32_t i = 0; i < MEM_SIZE_16; ++i) {
+    if (!reachable[i]) continue;
+
+    uint16_t inst = memory[i];
+    uint8_t opcode = inst >> 12;
+    uint8_t rd = (inst >> 8) & 0xF;
+    uint8_t rs = (inst >> 4) & 0xF;
+    uint8_t rt = inst & 0xF;
+    uint8_t addr = inst & 0xFF;
+    uint8_t nextPC = i + 1;
+
+    fprintf(out, "\nL%02" PRIX32 ": // %04" PRIX16 " %s\n", i, inst, mnemonics[opcode]);
+    switch (opcode) {
+      case 0x0:
+        fputs("  return 0;\n", out);
+        continue;
+      case 0x1:
+      case 0x2:
+      case 0x3:
+      case 0x4: {
+        static const char *ops = " +-&^";
+        if (!rd) break;
+        fputs("  ", out);
+        aotDest(out, rd);
+        aotReg(out, rs);
+        fprintf(out, " %c ", ops[opcode]);
+        aotReg(out, rt);
+        fputs(";\n", out);
+        break;
+      }
+      case 0x5:
+      case 0x6:
+        if (!rd) break;
+        fputs("  ", out);
+        aotDest(out, rd);
+        aotReg(out, rs);
+        fputs(opcode == 0x5 ? " << (" : " >> (", out);
+        aotReg(out, rt);
+        fputs(" & 31);\n", out);
+        break;
+      case 0x7:
+        if (!rd) break;
+        fputs("  ", out);
+        aotDest(out, rd);
+        fprintf(out, "0x%02" PRIX8 ";\n", addr);
+        break;
+      case 0x8:
+        if (addr == stdInOutAddr16) fputs("  if (!readPort()) return 0;\n", out);
+        fputs("  ", out);
+        aotDest(out, rd);
+        fprintf(out, "memory[0x%02" PRIX8 "];\n", addr);
+        if (addr == stdInOutAddr16) aotCheckCode(out, reachable, memory, addr, nextPC);
+        break;
+      case 0x9:
+        fprintf(out, "  memory[0x%02" PRIX8 "] = ", addr);
+        aotReg(out, rd);
+        fputs(";\n", out);
+        if (addr == stdInOutAddr16) fputs("  writePort();\n", out);
+        aotCheckCode(out, reachable, memory, addr, nextPC);
+        break;
+      case 0xA:
+        fputs("  addr = ", out);
+        aotReg(out, rt);
+        fputs(";\n  if (addr == PORT && !readPort()) return 0;\n  ", out);
+        aotDest(out, rd);
+        fputs("memory[addr];\n", out);
+        if (reachable[stdInOutAddr16]) {
+          fprintf(out, "  if (addr == PORT && memory[PORT] != image[PORT]) { pc = 0x%02" PRIX8 "; goto fallback; }\n", nextPC);
+        }
+        break;
+      case 0xB:
+        fputs("  memory[addr = ", out);
+        aotReg(out, rt);
+        fputs("] = ", out);
+        aotReg(out, rd);
+        fputs(";\n  if (addr == PORT) writePort();\n", out);
+        fprintf(out, "  if (code[addr] && memory[addr] != image[addr]) { pc = 0x%02" PRIX8 "; goto fallback; }\n", nextPC);
+        break;
+      case 0xC:
+        if (rd) {
+          fprintf(out, "  if (r%" PRIX8 " == 0) goto L%02" PRIX8 ";\n", rd, addr);
+        } else {
+          fprintf(out, "  goto L%02" PRIX8 ";\n", addr);
+          continue;
+        }
+        break;
+      case 0xD:
+        if (rd) fprintf(out, "  if (r%" PRIX8 " > 0) goto L%02" PRIX8 ";\n", rd, addr);
+        break;
+      case 0xE:
+        fputs("  pc = ", out);
+        aotReg(out, rd);
+        fputs(";\n  goto dispatch;\n", out);
+        continue;
+      case 0xF:
+        if (rd) fprintf(out, "  r%" PRIX8 " = 0x%02" PRIX8 ";\n", rd, nextPC);
+        fprintf(out, "  goto L%02" PRIX8 ";\n", addr);
+        continue;
+    }
+
+    // Only needed where the next address isn't the next label written out
+    if (i == ADDR_MASK_16) fprintf(out, "  goto L%02" PRIX8 ";\n", nextPC);
+  }
+  fputs("}\n", out);
+  return true;
+}
@@ -0,0 +1,373 @@
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "image.h"
+#include "xasm.h"
+
+
+// A label used before it was defined, its address is or'd into the word once every label is known
+struct Fixup {
+  std::size_t address;
+  SourceToken label;
+};
+
+// Everything one Assemble call keeps between statements. Errors are added to the diagnostics and then thrown to
+// unwind back to Assemble.
+class Assembler {
+public:
+  Assembler(Assembly &assembly, std::ostream *debug, bool relocatable)
+    : assembly(assembly), debug(debug), relocatable(relocatable) {}
+
+  void AssembleInstruction(const Statement &statement);
+  void AssembleDirective(const Statement &statement);
+  void AssembleLabel(const Statement &statement);
+  void PatchFixups();
+
+private:
+  [[noreturn]] void Error(const SourceToken &token, const std::string &message);
+  void SetMemoryLocation(uint16_t word, const SourceToken &token);
+
+  Assembly &assembly;
+  std::ostream *debug;
+  // Building an object, labels the source doesn't define are left to the linker and every label operand gets a
+  // relocation
+  bool relocatable;
+
+  std::size_t memoryLocation = 0x10;
+  std::unordered_map<std::string_view, std::size_t> labels;
+  std::vector<Fixup> fixups;
+};
+
+
+void Assembler::Error(const SourceToken &token, const std::string &message) {
+  assembly.diagnostics.push_back({token.line, token.column, std::string(token.text), message});
+  throw std::exception();
+}
+
+void Assembler::SetMemoryLocation(uint16_t word, const SourceToken &token) {
+  Image &memory = assembly.image;
+  if (memoryLocation >= MemorySize) {
+    Error(token, "Memory address has exceeded max size");
+  }
+  if (memory.used[memoryLocation]) {
+    Error(token, "Memory address hit an existing adddress which is not allowed");
+  }
+
+  memory.used[memoryLocation] = true;
+  memory.words[memoryLocation] = word;
+  memory.lines[memoryLocation] = token.line;
+  ++memoryLocation;
+}
+
+// The lexer only lets through uppercase hex digits
+static uint16_t HexValue(std::string_view digits) {
+  uint16_t value = 0;
+  for (char digit : digits) {
+    value = value << 4 | (digit <= '9' ? digit - '0' : digit - 'A' + 10);
+  }
+  return value;
+}
+
+
+void Assembler::AssembleInstruction(const Statement &statement) {
+  const SourceToken &mnemonicToken = statement.name;
+  std::string_view mnemonic = mnemonicToken.text;
+
+  const Instruction *instructionIter = Instructions.Find(mnemonic);
+  if (!instructionIter) {
+    Error(mnemonicToken, "Found invalid instruction " + std::string(mnemonic));
+  }
+
+  const Instruction &instruction = *instructionIter;
+  std::size_t argumentCount = statement.argumentCount;
+  if (instruction.registerCount != argumentCount) {
+    Error(mnemonicToken, "Instruction " + std::string(mnemonic) + " has incorrect argument count "
+      + std::to_string(argumentCount) + ", expected " + std::to_string(instruction.registerCount));
+  }
+
+  if (debug) {
+    *debug << "Found instruction " << mnemonic << " with " << argumentCount << " arguments" << std::endl;
+  }
+
+  // Operands fill the word from the top nibble down after the opcode
+  uint16_t word = instruction.opcode << 12;
+  int shift = 12;
+  std::size_t argumentIdx = 0;
+  for (enum OperandType operandType : instruction.operandTypes) {
+    const SourceArgument *argument = argumentIdx < argumentCount ? &statement.arguments[argumentIdx] : nullptr;
+    const SourceToken *argumentToken = nullptr;
+    const char *argumentName = nullptr;
+
+    switch (operandType) {
+      case End:
+        break;
+      case Zero:
+        shift -= 4;
+        break;
+      case Register: {
+        // TODO: Report error
+        if (!argument) {
+          throw std::exception();
+        }
+
+        if (argument->kind != ArgumentKind::Register) {
+          Error(mnemonicToken, "Instruction " + std::string(mnemonic) + " has incorrect argument at position "
+            + std::to_string(argumentIdx) + ", expected register");
+        }
+        argumentToken = &argument->token;
+        argumentName = "  Register: ";
+
+        shift -= 4;
+        word |= HexValue(argumentToken->text.substr(1)) << shift;
+        break;
+      }
+      case Address:
+        // TODO: Report error
+        if (!argument) {
+          throw std::exception();
+        }
+
+        if (argument->kind == ArgumentKind::HalfWord) {
+          if (argument->token.text.length() != 2) {
+            Error(mnemonicToken, "Instruction " + std::string(mnemonic) + " has incorrect argument at position "
+              + std::to_string(argumentIdx) + ", expected 2 digit memory address");
+          }
+          argumentToken = &argument->token;
+          argumentName = "   Address: ";
+          word |= HexValue(argumentToken->text);
+        } else if (argument->kind == ArgumentKind::Label) {
+          argumentToken = &argument->token;
+          argumentName = "     Label: ";
+          auto labelIter = labels.find(argumentToken->text);
+          if (labelIter != labels.end()) {
+            word |= labelIter->second;
+            if (relocatable) {
+              assembly.relocations.push_back({memoryLocation, ""});
+            }
+          } else {
+            fixups.push_back({memoryLocation, *argumentToken});
+          }
+        }
+
+        if (!argumentToken) {
+          Error(mnemonicToken, "Instruction " + std::string(mnemonic) + " has incorrect argument at position "
+            + std::to_string(argumentIdx) + ", expected memory address or label");
+        }
+        shift -= 8;
+        break;
+    }
+
+    if (argumentToken) {
+      if (debug) {
+        *debug << argumentName << argumentToken->text << std::endl;
+      }
+      ++argumentIdx;
+    }
+  }
+
+  SetMemoryLocation(word, mnemonicToken);
+  if (memoryLocation >= MemorySize) {
+    Error(mnemonicToken, "Memory address has exceeded max size");
+  }
+}
+
+void Assembler::AssembleDirective(const Statement &statement) {
+  const SourceToken &directiveToken = statement.name;
+  const SourceToken &argumentToken = statement.arguments[0].token;
+  std::string_view directive = directiveToken.text.substr(1);
+  std::string_view argument = argumentToken.text;
+
+  if (debug) {
+    *debug << "Found directive " << directive << " with argument " << argument << std::endl;
+  }
+
+  const Directive *directiveIter = Directives.Find(directive);
+  if (!directiveIter) {
+    Error(directiveToken, "directive " + std::string(directive) + " does not exist");
+  }
+
+  const Directive &directiveInfo = *directiveIter;
+  if (argument.length() != directiveInfo.argumentLength) {
+    Error(argumentToken, "directive " + std::string(directive) + " expects an argument of length "
+      + std::to_string(directiveInfo.argumentLength) + " but one of length " + std::to_string(argument.length())
+      + " given");
+  }
+
+  switch (directiveInfo.name) {
+    case DirectiveName::ORG: {
+      // The linker moves an object as one run of words, so where the source puts them is left to it
+      if (relocatable) {
+        Error(directiveToken, "ORG directive is not allowed in an object");
+      }
+      std::size_t newMemoryLocation = HexValue(argument);
+      if (newMemoryLocation >= MemorySize || assembly.image.used[newMemoryLocation]) {
+        Error(argumentToken, "ORG directive with an existing adddress is not allowed");
+      }
+
+      memoryLocation = newMemoryLocation;
+      }
+      break;
+    case DirectiveName::WORD:
+      SetMemoryLocation(HexValue(argument), argumentToken);
+      break;
+  }
+
+}
+
+void Assembler::AssembleLabel(const Statement &statement) {
+  const SourceToken &labelToken = statement.name;
+
+  if (debug) {
+    *debug << std::uppercase << std::hex << "Found label " << labelToken.text << " with address "
+      << memoryLocation << std::dec << std::endl;
+  }
+
+  if (!labels.emplace(labelToken.text, memoryLocation).second) {
+    Error(labelToken, "Cannot redefine label");
+  }
+  if (relocatable) {
+    assembly.symbols.push_back({std::string(labelToken.text), memoryLocation});
+  }
+}
+
+void Assembler::PatchFixups() {
+  for (const Fixup &fixup : fixups) {
+    auto labelIter = labels.find(fixup.label.text);
+    if (labelIter == labels.end()) {
+      if (!relocatable) {
+        Error(fixup.label, "Cannot reference undefined label");
+      }
+      assembly.relocations.push_back({fixup.address, std::string(fixup.label.text)});
+      continue;
+    }
+
+    assembly.image.words[fixup.address] |= labelIter->second;
+    if (relocatable) {
+      assembly.relocations.push_back({fixup.address, ""});
+    }
+  }
+}
+
+
+// Checks and encodes the statements in source order, label references ahead of their label are patched at the end
+static bool Assemble(const ParsedSource &parsed, Assembly &assembly, std::ostream *debug, bool relocatable) {
+  assembly = Assembly{};
+  Assembler assembler(assembly, debug, relocatable);
+
+  try {
+    for (const Statement &statement : parsed.statements) {
+      switch (statement.kind) {
+        case StatementKind::Instruction:
+          assembler.AssembleInstruction(statement);
+          break;
+        case StatementKind::Directive:
+          assembler.AssembleDirective(statement);
+          break;
+        case StatementKind::Label:
+          assembler.AssembleLabel(statement);
+          break;
+      }
+    }
+    assembler.PatchFixups();
+  } catch (const std::exception &) {
+    return false;
+  }
+
+  return true;
+}
+
+bool Assemble(const ParsedSource &parsed, Assembly &assembly, std::ostream *debug) {
+  return Assemble(parsed, assembly, debug, false);
+}
+
+bool AssembleObject(const ParsedSource &parsed, Assembly &object, std::ostream *debug) {
+  return Assemble(parsed, object, debug, true);
+}
+
+bool Assemble(std::string_view source, Assembly &assembly, std::ostream *debug) {
+  ParsedSource parsed;
+  std::vector<Diagnostic> diagnostics;
+  if (!ParseDirect(source, parsed, diagnostics)) {
+    assembly = Assembly{};
+    assembly.diagnostics = std::move(diagnostics);
+    return false;
+  }
+
+  return Assemble(parsed, assembly, debug);
+}
+
+
+std::string BinaryImage(const Image &image) {
+  std::vector<imageSegment> segments;
+  for (std::size_t i = 0; i < MemorySize; ++i) {
+    if (!image.used[i]) {
+      continue;
+    }
+
+    if (i == 0 || !image.used[i - 1]) {
+      segments.push_back({static_cast<uint32_t>(i), 0});
+    }
+    segments.back().wordCount++;
+  }
+
+  imageHeader header{};
+  std::memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.version = IMAGE_VERSION;
+  header.wordBits = 16;
+  header.segmentCount = segments.size();
+
+  std::string out(reinterpret_cast<const char *>(&header), sizeof(header));
+  for (const imageSegment &segment : segments) {
+    out.append(reinterpret_cast<const char *>(&segment), sizeof(segment));
+    out.append(reinterpret_cast<const char *>(&image.words[segment.address]), segment.wordCount * sizeof(uint16_t));
+  }
+  return out;
+}
+
+void PrintWords(const Image &image, std::ostream &out) {
+  out << std::setfill('0') << std::uppercase << std::hex;
+  for (std::size_t i = 0; i < MemorySize; ++i) {
+    if (image.used[i]) {
+      out << std::setw(2) << i << ": " << std::setw(4) << image.words[i] << '\n';
+    }
+  }
+  out << std::dec;
+}
+
+void PrintListing(const Image &image, std::string_view source, std::ostream &out) {
+  std::vector<std::size_t> lineAddresses;
+  for (std::size_t i = 0; i < MemorySize; ++i) {
+    if (image.used[i]) {
+      if (image.lines[i] >= lineAddresses.size()) {
+        lineAddresses.resize(image.lines[i] + 1, MemorySize);
+      }
+      lineAddresses[image.lines[i]] = i;
+    }
+  }
+
+  out << std::setfill('0') << std::uppercase << std::hex;
+  for (uint32_t line = 1; !source.empty(); ++line) {
+    std::size_t lineEnd = source.find('\n');
+    std::string_view text = source.substr(0, lineEnd);
+    source.remove_prefix(lineEnd == std::string_view::npos ? source.size() : lineEnd + 1);
+    if (!text.empty() && text.back() == '\r') {
+      text.remove_suffix(1);
+    }
+
+    if (line < lineAddresses.size() && lineAddresses[line] != MemorySize) {
+      std::size_t address = lineAddresses[line];
+      out << std::setw(2) << address << ": " << std::setw(4) << image.words[address] << "  ";
+    } else {
+      out << "          ";
+    }
+    out << text << '\n';
+  }
+  out << std::dec;
+}
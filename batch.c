@@ -0,0 +1,541 @@
+#include <ctype.h>    // isspace
+#include <inttypes.h> // PRIu64, PRIX32, uint8_t, uint32_t, uint64_t
+#include <pthread.h>  // pthread_create, pthread_join, pthread_mutex_destroy, pthread_mutex_init, pthread_mutex_lock, pthread_mutex_t, pthread_mutex_unlock, pthread_t
+#include <stdbool.h>  // bool, false, true
+#include <stdio.h>    // FILE, fclose, fopen, fprintf, fputc, fputs, fscanf, puts, stderr
+#include <stdlib.h>   // calloc, free, malloc, qsort, realloc
+#include <string.h>   // memcpy, memset, strcmp, strdup
+#include <time.h>     // clock_gettime, CLOCK_MONOTONIC, timespec
+#include <unistd.h>   // sysconf, _SC_NPROCESSORS_ONLN
+
+#include "emulator.h"
+
+// Jobs each worker runs together with --lockstep
+#define BATCH_LOCKSTEP_LANES (uint32_t)64
+
+typedef struct {
+  uint32_t *words;
+  size_t   len, cap;
+  // Some output couldn't be kept for lack of memory, the job is reported as failed
+  bool     truncated;
+} batchOutput;
+
+// An image run up to its first read of the I/O port, every job for that image forks from here rather than loading
+// it and running the same prefix again
+typedef struct {
+  pthread_mutex_t lock;
+  char            *path;
+  bool            booted;
+  bool            loaded;
+  cpu             cpuState;
+  batchOutput     output;
+  // Every job using the image counted together, including the boot run once
+  cpuProfile      *profile;
+} batchImage;
+
+typedef struct {
+  char       *imagePath;
+  char       *inputPath;
+  batchImage *image;
+
+  bool       loaded;
+  bool       halted;
+  stopReason stop;
+  uint64_t   cycles;
+  uint16_t   pc;
+  uint32_t   registers[REG_COUNT];
+  batchOutput output;
+} batchJob;
+
+// Feeds the I/O port from the job's input file and collects everything written to it
+typedef struct {
+  ioPort      port;
+  FILE        *input;
+  batchOutput *output;
+} batchIo;
+
+// Jobs [next, end) belong to a worker, it takes from the front and thieves take from the back
+typedef struct {
+  pthread_mutex_t lock;
+  size_t next, end;
+} batchQueue;
+
+typedef struct {
+  batchJob   *jobs;
+  batchQueue *queues;
+  uint32_t   queueCount;
+  uint32_t   self;
+  uint64_t   cycleLimit;
+  bool       lockstep;
+  bool       profiling;
+  bool       started;
+} batchWorker;
+
+
+static bool batchRead(ioPort *port, uint32_t *word, bool wide) {
+  batchIo *io = (batchIo *)port;
+  unsigned int value;
+  if (!io->input || fscanf(io->input, wide ? "%8x" : "%4x", &value) != 1) return false;
+  *word = value;
+  return true;
+}
+
+static void appendOutput(batchOutput *output, const uint32_t *words, size_t count) {
+  if (!count) return;
+  if (output->len + count > output->cap) {
+    size_t cap = output->cap ? output->cap : 16;
+    while (cap < output->len + count) cap *= 2;
+    uint32_t *grown = realloc(output->words, cap * sizeof(uint32_t));
+    if (!grown) {
+      output->truncated = true;
+      return;
+    }
+    output->words = grown;
+    output->cap = cap;
+  }
+  memcpy(output->words + output->len, words, count * sizeof(uint32_t));
+  output->len += count;
+}
+
+static void batchWrite(ioPort *port, uint32_t word, bool wide) {
+  (void)wide;
+  appendOutput(((batchIo *)port)->output, &word, 1);
+}
+
+// Stops the boot run at the first read
+static bool bootRead(ioPort *port, uint32_t *word, bool wide) {
+  (void)port;
+  (void)word;
+  (void)wide;
+  return false;
+}
+
+static bool takeJob(batchQueue *queue, size_t *job) {
+  pthread_mutex_lock(&queue->lock);
+  bool found = queue->next < queue->end;
+  if (found) *job = queue->next++;
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+// Moves the back half of the first non-empty victim queue into the worker's own queue, only one lock is ever
+// held at a time so workers stealing from each other can't deadlock
+static bool stealJobs(batchWorker *worker) {
+  for (uint32_t i = 1; i < worker->queueCount; ++i) {
+    batchQueue *victim = worker->queues + (worker->self + i) % worker->queueCount;
+
+    pthread_mutex_lock(&victim->lock);
+    size_t remaining = victim->end - victim->next;
+    size_t end = victim->end;
+    size_t start = end - (remaining + 1) / 2;
+    if (remaining) victim->end = start;
+    pthread_mutex_unlock(&victim->lock);
+    if (!remaining) continue;
+
+    batchQueue *own = worker->queues + worker->self;
+    pthread_mutex_lock(&own->lock);
+    own->next = start;
+    own->end = end;
+    pthread_mutex_unlock(&own->lock);
+    return true;
+  }
+  return false;
+}
+
+static void bootImage(batchImage *image, char *imagePath, uint64_t cycleLimit, bool profiling) {
+  batchIo io = {{bootRead, batchWrite, NULL}, NULL, &image->output};
+  cpu *cpuState = &image->cpuState;
+
+  initCpuConfig(cpuState);
+  cpuState->debug = false;
+  cpuState->io = &io.port;
+  cpuState->cycleLimit = cycleLimit;
+  if (profiling) cpuState->profile = image->profile = newProfile();
+
+  image->loaded = loadImage(cpuState, imagePath, false);
+  if (image->loaded && profiling) {
+    runCpu16Profiled(cpuState);
+  } else if (image->loaded) {
+    runCpu16Threaded(cpuState);
+  }
+  // Jobs count into their own profiles, a fork must not carry this one along
+  cpuState->io = NULL;
+  cpuState->profile = NULL;
+  image->booted = true;
+}
+
+// Sets cpuState up as a fork of the job's booted image, cpuState must have been through initCpuConfig
+static bool loadJob(batchJob *job, cpu *cpuState, batchIo *io, uint64_t cycleLimit, bool profiling) {
+  batchImage *image = job->image;
+  *io = (batchIo){{batchRead, batchWrite, NULL}, NULL, &job->output};
+
+  pthread_mutex_lock(&image->lock);
+  if (!image->booted) bootImage(image, job->imagePath, cycleLimit, profiling);
+  job->loaded = image->loaded;
+  if (job->loaded) {
+    freeCpuMemory(cpuState);
+    if (!forkCpu(cpuState, &image->cpuState)) {
+      job->loaded = false;
+      job->stop = STOP_OUT_OF_MEMORY;
+    }
+  }
+  pthread_mutex_unlock(&image->lock);
+
+  if (job->loaded && job->inputPath && !(io->input = fopen(job->inputPath, "r"))) {
+    job->loaded = false;
+  }
+  if (!job->loaded) return false;
+
+  // Waiting for input was only ever the boot run running out of it
+  if (cpuState->stop == STOP_NO_INPUT) cpuState->stop = STOP_NONE;
+  cpuState->io = &io->port;
+  appendOutput(&job->output, image->output.words, image->output.len);
+  job->output.truncated |= image->output.truncated;
+  return true;
+}
+
+static void finishJob(batchJob *job, cpu *cpuState, batchIo *io) {
+  if (io->input) fclose(io->input);
+
+  job->halted = cpuState->halted;
+  job->stop = cpuState->stop;
+  job->cycles = cpuState->cycles;
+  job->pc = cpuState->pc;
+  memcpy(job->registers, cpuState->registers, sizeof(job->registers));
+}
+
+static bool nextJob(batchWorker *worker, size_t *job) {
+  batchQueue *own = worker->queues + worker->self;
+  return takeJob(own, job) || (stealJobs(worker) && takeJob(own, job));
+}
+
+static void *batchWorkerMain(void *arg) {
+  batchWorker *worker = arg;
+  uint32_t laneCount = worker->lockstep ? BATCH_LOCKSTEP_LANES : 1;
+
+  // Reused for every job this worker runs
+  cpu *cpus = malloc(laneCount * sizeof(cpu));
+  cpu **lanes = malloc(laneCount * sizeof(cpu *));
+  batchIo *ios = malloc(laneCount * sizeof(batchIo));
+  batchJob **laneJobs = malloc(laneCount * sizeof(batchJob *));
+  if (!cpus || !lanes || !ios || !laneJobs) {
+    free(cpus);
+    free(lanes);
+    free(ios);
+    free(laneJobs);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < laneCount; ++i) initCpuConfig(cpus + i);
+  cpuProfile *profile = worker->profiling ? newProfile() : NULL;
+
+  size_t job;
+  bool more = true;
+  while (more) {
+    uint32_t count = 0;
+    while (count < laneCount && (more = nextJob(worker, &job))) {
+      batchJob *next = worker->jobs + job;
+      if (!loadJob(next, cpus + count, ios + count, worker->cycleLimit, worker->profiling)) continue;
+      lanes[count] = cpus + count;
+      laneJobs[count++] = next;
+    }
+    if (!count) continue;
+
+    if (worker->lockstep) {
+      runCpu16Lockstep(lanes, count);
+    } else if (!lanes[0]->halted && profile) {
+      lanes[0]->profile = profile;
+      runCpu16Profiled(lanes[0]);
+      lanes[0]->profile = NULL;
+    } else if (!lanes[0]->halted) {
+      runCpu16Threaded(lanes[0]);
+    }
+    for (uint32_t i = 0; i < count; ++i) finishJob(laneJobs[i], lanes[i], ios + i);
+
+    if (profile) {
+      batchImage *image = laneJobs[0]->image;
+      pthread_mutex_lock(&image->lock);
+      mergeProfile(image->profile, profile);
+      pthread_mutex_unlock(&image->lock);
+      resetProfile(profile);
+    }
+  }
+
+  for (uint32_t i = 0; i < laneCount; ++i) freeCpuMemory(cpus + i);
+  freeProfile(profile);
+  free(cpus);
+  free(lanes);
+  free(ios);
+  free(laneJobs);
+  return NULL;
+}
+
+
+static int compareImagePaths(const void *a, const void *b) {
+  return strcmp((*(batchJob *const *)a)->imagePath, (*(batchJob *const *)b)->imagePath);
+}
+
+// Gives jobs that share an image path the same batchImage
+static batchImage *groupImages(batchJob *jobs, size_t jobCount, size_t *imageCount) {
+  batchJob **sorted = malloc(jobCount * sizeof(batchJob *));
+  batchImage *images = calloc(jobCount, sizeof(batchImage));
+  if (!sorted || !images) {
+    free(sorted);
+    free(images);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < jobCount; ++i) sorted[i] = jobs + i;
+  qsort(sorted, jobCount, sizeof(batchJob *), compareImagePaths);
+
+  size_t count = 0;
+  for (size_t i = 0; i < jobCount; ++i) {
+    if (!i || strcmp(sorted[i - 1]->imagePath, sorted[i]->imagePath)) {
+      images[count].path = sorted[i]->imagePath;
+      pthread_mutex_init(&images[count++].lock, NULL);
+    }
+    sorted[i]->image = images + count - 1;
+  }
+
+  free(sorted);
+  *imageCount = count;
+  return images;
+}
+
+// Reads "image [input]" lines, blank lines and lines starting with # are skipped
+static bool readManifest(char *manifestPath, batchJob **jobList, size_t *jobCount) {
+  FILE *fp;
+  char *line, *buf = NULL;
+  size_t bufsiz = 0, lineLen;
+  batchJob *jobs = NULL;
+  size_t count = 0, cap = 0;
+  bool ok = true;
+
+  if (!(fp = fopen(manifestPath, "r"))) {
+    puts("Manifest path is invalid");
+    return false;
+  }
+
+  while ((line = readLine(fp, &lineLen, &buf, &bufsiz))) {
+    if (lineLen && line[lineLen - 1] == '\n') --lineLen;
+    char *fields[2] = {NULL, NULL};
+    uint8_t fieldCount = 0;
+    char *text = malloc(lineLen + 1);
+    if (!text) {
+      ok = false;
+      break;
+    }
+    memcpy(text, line, lineLen);
+    text[lineLen] = '\0';
+
+    char *p = text;
+    while (*p && fieldCount < 2) {
+      while (isspace((unsigned char)*p)) ++p;
+      if (!*p || *p == '#') break;
+      fields[fieldCount++] = p;
+      while (*p && !isspace((unsigned char)*p)) ++p;
+      if (*p) *p++ = '\0';
+    }
+
+    if (fieldCount) {
+      if (count == cap) {
+        cap = cap ? cap * 2 : 64;
+        batchJob *grown = realloc(jobs, cap * sizeof(batchJob));
+        if (!grown) {
+          free(text);
+          ok = false;
+          break;
+        }
+        jobs = grown;
+      }
+      batchJob *job = jobs + count++;
+      memset(job, 0, sizeof(batchJob));
+      job->imagePath = strdup(fields[0]);
+      job->inputPath = fieldCount > 1 ? strdup(fields[1]) : NULL;
+      if (!job->imagePath || (fieldCount > 1 && !job->inputPath)) {
+        free(text);
+        ok = false;
+        break;
+      }
+    }
+    free(text);
+  }
+
+  free(buf);
+  fclose(fp);
+  *jobList = jobs;
+  *jobCount = count;
+  if (!ok) puts("Out of memory");
+  return ok;
+}
+
+static const char *jobStatus(batchJob *job) {
+  if (job->output.truncated || job->stop == STOP_OUT_OF_MEMORY) return "out-of-memory";
+  if (!job->loaded) return "load-error";
+  if (job->halted) return "halted";
+  switch (job->stop) {
+    case STOP_CYCLE_LIMIT:
+      return "cycle-limit";
+    case STOP_NO_INPUT:
+      return "no-input";
+    default:
+      return "running";
+  }
+}
+
+static void writeResults(FILE *out, batchJob *jobs, size_t jobCount) {
+  fputs("# index image status cycles pc registers(r0-rF) output\n", out);
+  for (size_t i = 0; i < jobCount; ++i) {
+    batchJob *job = jobs + i;
+    fprintf(out, "%zu\t%s\t%s\t%" PRIu64 "\t%02X\t", i, job->imagePath, jobStatus(job), job->cycles, job->pc);
+    for (uint8_t r = 0; r < REG_COUNT; ++r) {
+      fprintf(out, r ? " %04" PRIX32 : "%04" PRIX32, job->registers[r]);
+    }
+    fputc('\t', out);
+    for (size_t w = 0; w < job->output.len; ++w) {
+      fprintf(out, w ? " %04" PRIX32 : "%04" PRIX32, job->output.words[w]);
+    }
+    fputc('\n', out);
+  }
+}
+
+// Writes the --profile report and --folded stacks with a section of each for every image that loaded
+static bool writeProfiles(batchImage *images, size_t imageCount, char *profilePath, char *foldedPath) {
+  FILE *report = profilePath ? fopen(profilePath, "w") : NULL;
+  FILE *folded = foldedPath ? fopen(foldedPath, "w") : NULL;
+  bool ok = (report || !profilePath) && (folded || !foldedPath);
+  if (!ok) puts("Profile path is invalid");
+
+  for (size_t i = 0; ok && i < imageCount; ++i) {
+    batchImage *image = images + i;
+    if (!image->loaded) continue;
+    if (report) {
+      if (i) fputc('\n', report);
+      writeProfileReport(report, image->profile, image->cpuState.memory16, image->path);
+    }
+    if (folded) writeFoldedStacks(folded, image->profile, image->path);
+  }
+
+  if (report) fclose(report);
+  if (folded) fclose(folded);
+  return ok;
+}
+
+// Frees the jobs and images along with everything they hold, images may be NULL
+static void freeBatch(batchJob *jobs, size_t jobCount, batchImage *images, size_t imageCount) {
+  for (size_t i = 0; i < jobCount; ++i) {
+    free(jobs[i].imagePath);
+    free(jobs[i].inputPath);
+    free(jobs[i].output.words);
+  }
+  for (size_t i = 0; images && i < imageCount; ++i) {
+    pthread_mutex_destroy(&images[i].lock);
+    if (images[i].booted) freeCpuMemory(&images[i].cpuState);
+    freeProfile(images[i].profile);
+    free(images[i].output.words);
+  }
+  free(images);
+  free(jobs);
+}
+
+// Runs every image listed in the manifest headless across threadCount workers, 0 means one per online core.
+// Jobs are dealt out in contiguous ranges and idle workers steal from busy ones so a few long running images
+// don't leave the other cores waiting. Each distinct image is loaded and run up to its first input once, every job
+// using it starts from a copy on write fork of that point. With lockstep each worker runs BATCH_LOCKSTEP_LANES jobs at a time through
+// the SIMD engine. With a profile path jobs run through runCpu16Profiled instead and are profiled per image.
+// Results are written in manifest order once every job has finished, a job that ran out of memory for its output or
+// its pages is reported as out-of-memory and fails the batch.
+int runBatch(char *manifestPath, char *resultsPath, uint32_t threadCount, uint64_t cycleLimit, bool lockstep,
+             char *profilePath, char *foldedPath) {
+  bool profiling = profilePath || foldedPath;
+  if (profiling && lockstep) {
+    puts("--lockstep can't be profiled");
+    return 1;
+  }
+
+  batchJob *jobs = NULL;
+  size_t jobCount = 0;
+  if (!readManifest(manifestPath, &jobs, &jobCount)) {
+    freeBatch(jobs, jobCount, NULL, 0);
+    return 1;
+  }
+  if (!jobCount) {
+    puts("Manifest has no jobs");
+    freeBatch(jobs, jobCount, NULL, 0);
+    return 1;
+  }
+
+  size_t imageCount = 0;
+  batchImage *images = groupImages(jobs, jobCount, &imageCount);
+  if (!images) {
+    puts("Out of memory");
+    freeBatch(jobs, jobCount, NULL, 0);
+    return 1;
+  }
+
+  FILE *out = fopen(resultsPath, "w");
+  if (!out) {
+    puts("Results path is invalid");
+    freeBatch(jobs, jobCount, images, imageCount);
+    return 1;
+  }
+
+  if (!threadCount) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = cores > 0 ? cores : 1;
+  }
+  if (threadCount > jobCount) threadCount = jobCount;
+
+  batchQueue *queues = calloc(threadCount, sizeof(batchQueue));
+  batchWorker *workers = calloc(threadCount, sizeof(batchWorker));
+  pthread_t *threads = calloc(threadCount, sizeof(pthread_t));
+  if (!queues || !workers || !threads) {
+    puts("Out of memory");
+    fclose(out);
+    free(queues);
+    free(workers);
+    free(threads);
+    freeBatch(jobs, jobCount, images, imageCount);
+    return 1;
+  }
+
+  for (uint32_t i = 0; i < threadCount; ++i) {
+    pthread_mutex_init(&queues[i].lock, NULL);
+    queues[i].next = jobCount * i / threadCount;
+    queues[i].end = jobCount * (i + 1) / threadCount;
+    workers[i] = (batchWorker){jobs, queues, threadCount, i, cycleLimit, lockstep, profiling, false};
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // The calling thread does its share as worker 0, the queue of any thread that fails to start just gets stolen
+  for (uint32_t i = 1; i < threadCount; ++i) {
+    workers[i].started = !pthread_create(threads + i, NULL, batchWorkerMain, workers + i);
+  }
+  batchWorkerMain(workers);
+  for (uint32_t i = 1; i < threadCount; ++i) {
+    if (workers[i].started) pthread_join(threads[i], NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  uint64_t cycles = 0;
+  for (size_t i = 0; i < jobCount; ++i) cycles += jobs[i].cycles;
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "Ran %zu jobs on %" PRIu32 " threads, %" PRIu64 " instructions in %.6fs (%.0f instructions/s)\n",
+    jobCount, threadCount, cycles, seconds, seconds > 0 ? cycles / seconds : 0);
+
+  writeResults(out, jobs, jobCount);
+  fclose(out);
+  int status = profiling && !writeProfiles(images, imageCount, profilePath, foldedPath) ? 1 : 0;
+  for (size_t i = 0; i < jobCount; ++i) {
+    if (jobs[i].output.truncated || jobs[i].stop == STOP_OUT_OF_MEMORY) status = 1;
+  }
+
+  for (uint32_t i = 0; i < threadCount; ++i) pthread_mutex_destroy(&queues[i].lock);
+  free(threads);
+  free(workers);
+  free(queues);
+  freeBatch(jobs, jobCount, images, imageCount);
+  return status;
+}
@@ -0,0 +1,362 @@
+#include <fcntl.h>    // open, O_CREAT, O_RDONLY, O_TRUNC, O_WRONLY
+#include <inttypes.h> // PRIu64, PRIX16, UINT64_MAX, uint16_t, uint32_t, uint64_t
+#include <stdbool.h>  // bool, false, true
+#include <stdio.h>    // FILE, fclose, fflush, fgets, fopen, fprintf, fputs, getchar, printf, putchar, puts, stderr, stdin
+#include <stdlib.h>   // exit, strtoul, strtoull
+#include <string.h>   // strcmp, strncmp
+#include <time.h>     // clock_gettime, CLOCK_MONOTONIC, timespec
+#include <unistd.h>   // close, STDIN_FILENO, STDOUT_FILENO
+
+#include "emulator.h"
+
+// Writes whichever of the --profile report and the --folded stacks were asked for
+static bool saveProfile(cpu *cpuState, char *name, char *reportPath, char *foldedPath) {
+  FILE *out;
+  if (reportPath) {
+    if (!(out = fopen(reportPath, "w"))) {
+      puts("Profile path is invalid");
+      return false;
+    }
+    writeProfileReport(out, cpuState->profile, cpuState->memory16, name);
+    fclose(out);
+  }
+
+  if (foldedPath) {
+    if (!(out = fopen(foldedPath, "w"))) {
+      puts("Folded stacks path is invalid");
+      return false;
+    }
+    writeFoldedStacks(out, cpuState->profile, NULL);
+    fclose(out);
+  }
+  return true;
+}
+
+// Points cpuState at breakpoints, making them the first time
+static cpuBreaks *getBreaks(cpu *cpuState) {
+  if (!cpuState->breaks && !(cpuState->breaks = newBreaks())) {
+    puts("Out of memory");
+    exit(1);
+  }
+  return cpuState->breaks;
+}
+
+// Shows where and why the cpu stopped
+static void printStop(cpu *cpuState) {
+  char reason[128];
+  if (cpuState->stop == STOP_BREAK) {
+    describeBreak(cpuState->breaks, reason, sizeof(reason));
+    puts(reason);
+  } else if (cpuState->stop == STOP_HISTORY_START) {
+    printf("Reached the oldest recorded cycle, %" PRIu64 "\n", historyStart(cpuState));
+  } else if (cpuState->halted) {
+    puts("Halted");
+  }
+  bool debug = cpuState->debug;
+  cpuState->debug = true;
+  printCpuState(cpuState);
+  cpuState->debug = debug;
+}
+
+// Continues from a stop, a breakpoint at pc is what stopped the cpu so it isn't hit again
+static void resumeCpu(cpu *cpuState, uint64_t cycleLimit) {
+  uint64_t oldLimit = cpuState->cycleLimit;
+  if (cycleLimit < oldLimit) cpuState->cycleLimit = cycleLimit;
+  if (cpuState->breaks) cpuState->breaks->resume = true;
+  cpuState->stop = STOP_NONE;
+  runCpu16(cpuState);
+  cpuState->cycleLimit = oldLimit;
+}
+
+// With breakpoints the run is only shown where it stops, continuing on enter. With history it stops at the halt
+// too and takes commands: enter or c continues, s steps, r steps back, rc runs back to the last breakpoint and w ADDR
+// finds the last store to ADDR.
+static void runInteractive(cpu *cpuState) {
+  bool history = cpuState->history;
+  if (!cpuState->breaks && !history) {
+    runCpu16(cpuState);
+    return;
+  }
+
+  cpuState->debug = false;
+  runCpu16(cpuState);
+  char line[64];
+  // Running on after a lost store would only show a program that never ran
+  while ((history || cpuState->stop == STOP_BREAK) && cpuState->stop != STOP_OUT_OF_MEMORY) {
+    printStop(cpuState);
+    if (!history) {
+      getchar();
+      resumeCpu(cpuState, UINT64_MAX);
+      continue;
+    }
+
+    bool ran = false;
+    while (!ran) {
+      printf("> ");
+      fflush(stdout);
+      if (!fgets(line, sizeof(line), stdin)) return;
+
+      ran = true;
+      if (strcmp(line, "\n") == 0 || strcmp(line, "c\n") == 0) {
+        resumeCpu(cpuState, UINT64_MAX);
+      } else if (strcmp(line, "s\n") == 0) {
+        resumeCpu(cpuState, cpuState->cycles + 1);
+      } else if (strcmp(line, "r\n") == 0) {
+        runBackwards(cpuState, 1);
+      } else if (strcmp(line, "rc\n") == 0) {
+        runBackwards(cpuState, UINT64_MAX);
+      } else if (strncmp(line, "w ", 2) == 0) {
+        uint16_t addr = strtoul(line + 2, NULL, 16);
+        uint64_t cycle;
+        uint16_t pc;
+        if (findLastWrite(cpuState, addr, cpuState->cycles, &cycle, &pc)) {
+          printf("M[%02" PRIX16 "] last written at cycle %" PRIu64 " by pc %02" PRIX16 "\n", addr, cycle, pc);
+        } else {
+          printf("M[%02" PRIX16 "] not written since cycle %" PRIu64 "\n", addr, historyStart(cpuState));
+        }
+        ran = false;
+      } else {
+        puts("Commands are c, s, r, rc and w ADDR");
+        ran = false;
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  cpu cpuState;
+  char *path = NULL;
+  char *aotPath = NULL;
+  char *batchPath = NULL, *resultsPath = NULL;
+  char *servePath = NULL, *sessionsPath = NULL;
+  char *ioMode = NULL, *recordPath = NULL, *replayPath = NULL;
+  char *tracePath = NULL, *profilePath = NULL, *foldedPath = NULL;
+  char *gdbAddress = NULL;
+  regCondition condition;
+  coreConfig cores = {0};
+  uint32_t threadCount = 0, fps = 0;
+  bool headless = false, threaded = true, jit = false, lockstep = false;
+
+  initCpuConfig(&cpuState);
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--headless") == 0) {
+      headless = true;
+    } else if (strcmp(argv[i], "--aot") == 0 && i + 1 < argc) {
+      aotPath = argv[++i];
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      headless = jit = true;
+    } else if (strcmp(argv[i], "--headless-switch") == 0) {
+      headless = true;
+      threaded = false;
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batchPath = argv[++i];
+    } else if (strcmp(argv[i], "--results") == 0 && i + 1 < argc) {
+      resultsPath = argv[++i];
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      servePath = argv[++i];
+    } else if (strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+      sessionsPath = argv[++i];
+    } else if (strcmp(argv[i], "--lockstep") == 0) {
+      lockstep = true;
+    } else if (strcmp(argv[i], "--cores") == 0 && i + 1 < argc) {
+      cores.coreCount = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--quantum") == 0 && i + 1 < argc) {
+      cores.quantum = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--free") == 0) {
+      cores.freeRunning = true;
+    } else if (strcmp(argv[i], "--sync") == 0 && i + 1 < argc) {
+      uint16_t addr = strtoul(argv[++i], NULL, 16);
+      cores.sync[addr >> 6] |= (uint64_t)1 << (addr & 63);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threadCount = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+      fps = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--cycle-limit") == 0 && i + 1 < argc) {
+      cpuState.cycleLimit = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+      ioMode = argv[++i];
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      recordPath = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replayPath = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      tracePath = argv[++i];
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profilePath = argv[++i];
+    } else if (strcmp(argv[i], "--folded") == 0 && i + 1 < argc) {
+      foldedPath = argv[++i];
+    } else if (strcmp(argv[i], "--break") == 0 && i + 1 < argc) {
+      setBreakpoint(getBreaks(&cpuState), strtoul(argv[++i], NULL, 16), true);
+    } else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc) {
+      setWatchpoint(getBreaks(&cpuState), strtoul(argv[++i], NULL, 16), false, true, true);
+    } else if (strcmp(argv[i], "--rwatch") == 0 && i + 1 < argc) {
+      setWatchpoint(getBreaks(&cpuState), strtoul(argv[++i], NULL, 16), true, false, true);
+    } else if (strcmp(argv[i], "--break-if") == 0 && i + 1 < argc) {
+      if (!parseCondition(argv[++i], &condition)) {
+        printf("Invalid condition %s\n", argv[i]);
+        return 1;
+      } else if (!addCondition(getBreaks(&cpuState), condition)) {
+        puts("Too many conditions");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--gdb") == 0 && i + 1 < argc) {
+      gdbAddress = argv[++i];
+    } else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+      freeHistory(cpuState.history);
+      if (!(cpuState.history = newHistory((size_t)strtoul(argv[++i], NULL, 10) << 20))) {
+        puts("History is too small or can't be allocated");
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--", 2) == 0) {
+      printf("Unknown option %s\n", argv[i]);
+      return 1;
+    } else {
+      path = argv[i];
+    }
+  }
+
+  if (batchPath) {
+    if (!resultsPath) {
+      puts("No results path given");
+      return 1;
+    }
+    return runBatch(batchPath, resultsPath, threadCount, cpuState.cycleLimit, lockstep, profilePath, foldedPath);
+  }
+
+  if (servePath) return serveJobs(servePath, threadCount, cpuState.cycleLimit);
+  if (sessionsPath) return serveSessions(sessionsPath, threadCount, cpuState.cycleLimit);
+
+  if (!path) {
+    puts("No path given");
+    return 1;
+  }
+
+  // Only the interactive mode shows the image as it's loaded
+  if (!loadImage(&cpuState, path, !headless && !aotPath && !gdbAddress && !cores.coreCount)) return 1;
+
+  if (aotPath) {
+    FILE *out = fopen(aotPath, "w");
+    if (!out) {
+      puts("Output path is invalid");
+      return 1;
+    }
+
+    bool compiled = emitAot16(&cpuState, out, path);
+    fclose(out);
+    return compiled ? 0 : 1;
+  }
+
+  // The console stays the default, --io swaps it for buffered stdin/stdout and the log wraps whichever is in use
+  if (ioMode) {
+    if (strcmp(ioMode, "text") && strcmp(ioMode, "binary")) {
+      printf("Unknown I/O mode %s\n", ioMode);
+      return 1;
+    }
+    if (!(cpuState.io = openStreamIo(STDIN_FILENO, STDOUT_FILENO, strcmp(ioMode, "binary") == 0))) {
+      puts("Out of memory");
+      return 1;
+    }
+  }
+
+  int logFd = -1;
+  if (recordPath && replayPath) {
+    puts("Only one of --record and --replay can be given");
+    return 1;
+  } else if (recordPath || replayPath) {
+    logFd = recordPath ? open(recordPath, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(replayPath, O_RDONLY);
+    if (logFd < 0) {
+      puts("Log path is invalid");
+      return 1;
+    }
+    if (!(cpuState.io = openLogIo(cpuState.io, logFd, replayPath != NULL))) {
+      puts("Out of memory");
+      return 1;
+    }
+  }
+
+  // Cores run headless on their own interpreter, which has none of the debugging
+  if (cores.coreCount) {
+    if (tracePath || profilePath || foldedPath || cpuState.breaks || cpuState.history || gdbAddress) {
+      puts("--cores can't be traced, profiled or debugged");
+      return 1;
+    }
+    int status = runCores(&cpuState, &cores);
+    closeIo(cpuState.io);
+    if (logFd >= 0) close(logFd);
+    return status;
+  }
+
+  if (tracePath && !(cpuState.trace = openTrace(tracePath, &cpuState))) return 1;
+  if (profilePath || foldedPath) cpuState.profile = newProfile();
+
+  // Once the debugger detaches the rest of the run is headless
+  if (gdbAddress) {
+    bool detached;
+    cpuState.debug = false;
+    if (!serveGdb(&cpuState, gdbAddress, &detached)) return 1;
+    if (!detached) {
+      closeTrace(cpuState.trace);
+      closeIo(cpuState.io);
+      if (logFd >= 0) close(logFd);
+      freeHistory(cpuState.history);
+      return 0;
+    }
+    cpuState.breaks->resume = true;
+    headless = true;
+  }
+
+  if (headless) {
+    cpuState.debug = false;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (cpuState.halted) {
+      // Left halted by the debugger
+    } else if (cpuState.trace || cpuState.history || (cpuState.profile && cpuState.breaks)) {
+      runCpu16(&cpuState);
+    } else if (cpuState.breaks) {
+      runCpu16Debug(&cpuState);
+    } else if (cpuState.profile) {
+      runCpu16Profiled(&cpuState);
+    } else if (jit) {
+      runCpu16Jit(&cpuState);
+    } else if (threaded) {
+      runCpu16Threaded(&cpuState);
+    } else {
+      runCpu16Headless(&cpuState);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    closeTrace(cpuState.trace);
+    closeIo(cpuState.io);
+    if (logFd >= 0) close(logFd);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Executed %" PRIu64 " instructions in %.6fs (%.0f instructions/s)\n",
+      cpuState.cycles, seconds, seconds > 0 ? cpuState.cycles / seconds : 0);
+    if (cpuState.stop == STOP_CYCLE_LIMIT) fputs("Stopped at the cycle limit\n", stderr);
+    if (cpuState.stop == STOP_BREAK) {
+      char reason[128];
+      describeBreak(cpuState.breaks, reason, sizeof(reason));
+      fprintf(stderr, "%s, pc %02" PRIX16 "\n", reason, cpuState.pc);
+    }
+    if (cpuState.stop == STOP_OUT_OF_MEMORY) fputs("Out of memory\n", stderr);
+    freeHistory(cpuState.history);
+    if (cpuState.profile && !saveProfile(&cpuState, path, profilePath, foldedPath)) return 1;
+    return cpuState.stop == STOP_OUT_OF_MEMORY ? 1 : 0;
+  }
+
+  if (fps && !startLiveView(fps)) fputs("--fps needs a terminal, scrolling instead\n", stderr);
+  printCpuState(&cpuState);
+  putchar('\n');
+
+  runInteractive(&cpuState);
+  if (cpuState.stop == STOP_OUT_OF_MEMORY) puts("Out of memory");
+  closeTrace(cpuState.trace);
+  closeIo(cpuState.io);
+  if (logFd >= 0) close(logFd);
+  freeHistory(cpuState.history);
+
+  if (cpuState.profile && !saveProfile(&cpuState, path, profilePath, foldedPath)) return 1;
+  return cpuState.stop == STOP_OUT_OF_MEMORY ? 1 : 0;
+}
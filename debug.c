@@ -0,0 +1,142 @@
+#include <inttypes.h> // PRIX16, PRIX32, uint8_t, uint16_t, uint32_t, uint64_t
+#include <stdbool.h>  // bool, false, true
+#include <stdio.h>    // snprintf
+#include <stdlib.h>   // calloc, strtoul
+
+#include "emulator.h"
+
+static const char *conditionOps[] = {"==", "!=", "<", ">"};
+
+
+// NULL if it can't be allocated
+cpuBreaks *newBreaks(void) {
+  return calloc(1, sizeof(cpuBreaks));
+}
+
+static void setBit(uint64_t *bits, uint16_t addr, bool on) {
+  if (on) {
+    bits[addr >> 6] |= (uint64_t)1 << (addr & 63);
+  } else {
+    bits[addr >> 6] &= ~((uint64_t)1 << (addr & 63));
+  }
+}
+
+void setBreakpoint(cpuBreaks *breaks, uint16_t addr, bool on) {
+  setBit(breaks->code, addr, on);
+}
+
+// Turns watching reads and/or writes of addr on or off, the other kind is left alone
+void setWatchpoint(cpuBreaks *breaks, uint16_t addr, bool read, bool write, bool on) {
+  if (read) setBit(breaks->reads, addr, on);
+  if (write) setBit(breaks->writes, addr, on);
+}
+
+// Parses conditions like "r3==0010", the register is a hex digit and the value hex
+bool parseCondition(const char *text, regCondition *condition) {
+  if (*text != 'r' && *text != 'R') return false;
+  char *rest;
+  uint32_t reg = strtoul(text + 1, &rest, 16);
+  if (rest != text + 2 || reg >= REG_COUNT) return false;
+
+  uint8_t op = 0;
+  while (op < 4 && !(rest[0] == conditionOps[op][0] && (!conditionOps[op][1] || rest[1] == conditionOps[op][1]))) {
+    ++op;
+  }
+  if (op == 4) return false;
+  text = rest + (conditionOps[op][1] ? 2 : 1);
+
+  condition->reg = reg;
+  condition->op = op;
+  condition->value = strtoul(text, &rest, 16);
+  return rest != text && !*rest;
+}
+
+static void updateMask(cpuBreaks *breaks) {
+  breaks->regMask = 0;
+  for (uint8_t i = 0; i < breaks->conditionCount; ++i) breaks->regMask |= 1 << breaks->conditions[i].reg;
+}
+
+// Returns false once BREAK_CONDITIONS are set
+bool addCondition(cpuBreaks *breaks, regCondition condition) {
+  if (breaks->conditionCount == BREAK_CONDITIONS) return false;
+  breaks->conditions[breaks->conditionCount++] = condition;
+  updateMask(breaks);
+  return true;
+}
+
+bool removeCondition(cpuBreaks *breaks, regCondition condition) {
+  for (uint8_t i = 0; i < breaks->conditionCount; ++i) {
+    regCondition *other = breaks->conditions + i;
+    if (other->reg != condition.reg || other->op != condition.op || other->value != condition.value) continue;
+    *other = breaks->conditions[--breaks->conditionCount];
+    updateMask(breaks);
+    return true;
+  }
+  return false;
+}
+
+// Called with the value just written to a register in regMask, records a hit if it meets any of its conditions
+bool checkConditions(cpuBreaks *breaks, uint8_t reg, uint32_t value) {
+  for (uint8_t i = 0; i < breaks->conditionCount; ++i) {
+    regCondition *condition = breaks->conditions + i;
+    if (condition->reg != reg) continue;
+
+    bool met;
+    switch (condition->op) {
+      case COND_EQ:
+        met = value == condition->value;
+        break;
+      case COND_NE:
+        met = value != condition->value;
+        break;
+      case COND_LT:
+        met = value < condition->value;
+        break;
+      default:
+        met = value > condition->value;
+        break;
+    }
+    if (met) {
+      breaks->hit = BREAK_REGISTER;
+      breaks->hitAddr = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Memory access checks for the reference interpreter, runCpu16Debug tests the bitmaps inline
+void breakOnRead(cpuBreaks *breaks, uint16_t addr) {
+  if (!BREAK_BIT(breaks->reads, addr)) return;
+  breaks->hit = BREAK_READ;
+  breaks->hitAddr = addr;
+}
+
+void breakOnWrite(cpuBreaks *breaks, uint16_t addr) {
+  if (!BREAK_BIT(breaks->writes, addr)) return;
+  breaks->hit = BREAK_WRITE;
+  breaks->hitAddr = addr;
+}
+
+void describeBreak(cpuBreaks *breaks, char *buf, size_t size) {
+  switch (breaks->hit) {
+    case BREAK_CODE:
+      snprintf(buf, size, "Breakpoint at %02" PRIX16, breaks->hitAddr);
+      break;
+    case BREAK_READ:
+      snprintf(buf, size, "Watchpoint read M[%02" PRIX16 "]", breaks->hitAddr);
+      break;
+    case BREAK_WRITE:
+      snprintf(buf, size, "Watchpoint write M[%02" PRIX16 "]", breaks->hitAddr);
+      break;
+    case BREAK_REGISTER: {
+      regCondition *condition = breaks->conditions + breaks->hitAddr;
+      snprintf(buf, size, "Condition R[%X] %s %04" PRIX32 " met", condition->reg, conditionOps[condition->op],
+        condition->value);
+      break;
+    }
+    default:
+      snprintf(buf, size, "No breakpoint hit");
+      break;
+  }
+}
@@ -1,93 +1,110 @@
 #include <ctype.h>    // isspace
 #include <errno.h>    // error, ERANGE
-#include <inttypes.h> // PRIX8, PRIX16, PRIX32, SCNx32, UINT8_MAX, uint8_t, UINT16_MAX, uint16_t, uint32_t
+#include <inttypes.h> // PRIX32, SCNx32, UINT16_MAX, UINT64_MAX, uint8_t, uint16_t, uint32_t, uint64_t
 #include <stdbool.h>  // bool, false, true
-#include <stdio.h>    // FILE, feof, ferror, fopen, getchar, printf, puts, stderr
+#include <stdio.h>    // FILE, fclose, feof, ferror, fopen, getchar, printf, puts, stderr
 #include <stdlib.h>   // exit, free, malloc, realloc, strtoul
 #include <string.h>   // strcmp, strlen, strncmp
 
-#define REG_COUNT   (uint8_t)16
-#define MEM_SIZE_16 (uint32_t)(UINT8_MAX + 1)
-#define MEM_SIZE_32 (uint32_t)(UINT16_MAX + 1)
+#include "emulator.h"
 
-static bool step = false;
-static bool debug = true;
-
-static uint8_t  windowSize = 6;
 static uint32_t memMaxValue16 = UINT16_MAX;
 // static uint32_t memMaxValue32 = UINT32_MAX;
-static uint16_t stdInOutAddr16 = 0xFF;
-static uint16_t stdInOutAddr32 = 0x7F; // 0xFF/2
+uint16_t stdInOutAddr16 = 0xFF;
+uint16_t stdInOutAddr32 = 0x7F; // 0xFF/2
 
+// Decoded form of a 16 bit instruction, handler is resolved by the dispatch loop
 typedef struct {
-  bool     halted;
-  bool     in32Bit;
-  
-  bool     pcModified;
-  uint16_t oldPC, pc;
-  
-  bool     readReg1, readReg2, wroteReg;
-  uint8_t  lastReadReg1, lastReadReg2, lastWriteReg;
-  uint32_t registers[REG_COUNT];
-  
-  bool     readMem, wroteMem;
-  uint16_t lastReadAddr, lastWriteAddr;
-  union {
-    uint16_t memory16[MEM_SIZE_16];
-    uint32_t memory32[MEM_SIZE_32];
-  };
-} cpu;
+  const void *handler;
+  uint8_t     rd, rs, rt, imm;
+} decodedOp16;
 
-// TODO: Test with memory32
-void handleStdin(cpu *cpuState, uint16_t nextReadAddr) {
-  char *fmt;
-  void *addr;
-  if (cpuState->in32Bit) {
-    if (nextReadAddr != stdInOutAddr32) {
-      return;
-    }
-    fmt = "%8" SCNx32;
-    addr = cpuState->memory32 + stdInOutAddr32;
-  } else {
-    if (nextReadAddr != stdInOutAddr16) {
-      return;
-    }
-    fmt = "%4" SCNx32;
-    addr = cpuState->memory16 + stdInOutAddr16;
-  }
+// Extra handlers for lod/str with a constant stdin/stdout address so the port check happens at decode time
+enum {
+  OP16_LOD_IO = 0x10,
+  OP16_STR_IO,
+  OP16_HANDLER_COUNT
+};
+
+// 32 bit code is decoded the first time it runs rather than all 64K words up front, stores just mark the word for
+// decoding again
+struct decodedOp32 {
+  const void *handler;
+  uint16_t    imm;
+  uint8_t     rd, rs, rt;
+};
+
+// The same for 32 bit mode plus the mode switch, which hlt would otherwise have to tell apart when it runs
+enum {
+  OP32_LOD_IO = 0x10,
+  OP32_STR_IO,
+  OP32_MODE,
+  OP32_HANDLER_COUNT
+};
 
+// Prompts until a hex word is entered, returns false at the end of stdin
+bool readConsole(uint32_t *word, bool wide) {
+  char *fmt = wide ? "%8" SCNx32 : "%4" SCNx32;
+  flushLiveView();
   printf("input: \n");
-  while (scanf(fmt, addr) != 1) {
+  int matched;
+  while ((matched = scanf(fmt, word)) != 1) {
+    if (matched == EOF) return false;
     printf("input: \n");
     scanf("%*s");
   }
   
   putchar('\n');
+  return true;
 }
 
-// TODO: Test with memory32
-void handleStdout(cpu *cpuState, uint16_t lastWriteAddr) {
+void writeConsole(uint32_t word, bool wide) {
   // TODO: Fix mem mess, requires flipping 16 bit bytes based on host endianness(big = nothing, small = flip)
   // This is different from common endian functions which use native byte sizes(normally 8 bits)
-  char *fmt;
-  uint32_t mem;
-  if (cpuState->in32Bit) {
-    if (lastWriteAddr != stdInOutAddr32) {
-      return;
-    }
-    fmt = "%08" PRIX32;
-    mem = cpuState->memory32[stdInOutAddr32];
+  printf("output: ");
+  printf(wide ? "%08" PRIX32 : "%04" PRIX32, word);
+  printf("(%" PRId16 ")\n\n", word);
+}
+
+// TODO: Test with memory32
+// Returns false if nextReadAddr is the I/O port and there is no input left
+bool handleStdin(cpu *cpuState, uint16_t nextReadAddr) {
+  bool wide = cpuState->in32Bit;
+  if (nextReadAddr != (wide ? stdInOutAddr32 : stdInOutAddr16)) {
+    return true;
+  }
+
+  uint32_t word;
+  ioPort *io = cpuState->io;
+  if (cpuState->history && replayInput(cpuState, &word)) {
+    // Already read the first time this cycle ran
+  } else if (!(io ? io->read(io, &word, wide) : readConsole(&word, wide))) {
+    return false;
+  }
+  if (cpuState->history) historyInput(cpuState, nextReadAddr, word);
+  if (wide) {
+    memWrite32(cpuState, stdInOutAddr32, word);
   } else {
-    if (lastWriteAddr != stdInOutAddr16) {
-      return;
-    }
-    fmt = "%04" PRIX32;
-    mem = cpuState->memory16[stdInOutAddr16];
+    cpuState->memory16[stdInOutAddr16] = word;
   }
+  return true;
+}
 
-  printf("output: ");
-  printf(fmt, mem);
-  printf("(%" PRId16 ")\n\n", mem);
+// TODO: Test with memory32
+void handleStdout(cpu *cpuState, uint16_t lastWriteAddr) {
+  bool wide = cpuState->in32Bit;
+  if (lastWriteAddr != (wide ? stdInOutAddr32 : stdInOutAddr16)) {
+    return;
+  }
+  // A replayed write was already output the first time round
+  if (cpuState->history && historyReplaying(cpuState)) return;
+
+  uint32_t word = wide ? memRead32(cpuState, stdInOutAddr32) : cpuState->memory16[stdInOutAddr16];
+  if (cpuState->io) {
+    cpuState->io->write(cpuState->io, word, wide);
+  } else {
+    writeConsole(word, wide);
+  }
 }
 
 
@@ -97,7 +114,8 @@ void writePC(cpu *cpuState, uint16_t newPC, bool cycleIncrement) {
   if (cpuState->pcModified && cycleIncrement) return;
   
   cpuState->oldPC = cpuState->pc;
-  cpuState->pc = newPC;
+  // 16 bit mode only has 8 bit addresses so wrap instead of running past memory16
+  cpuState->pc = cpuState->in32Bit ? newPC : newPC & ADDR_MASK_16;
   cpuState->pcModified |= !cycleIncrement;
 }
 
@@ -127,22 +145,33 @@ void writeRegister(cpu *cpuState, uint8_t reg, uint32_t value) {
   if (reg != 0) {
     cpuState->wroteReg = true;
     cpuState->lastWriteReg = reg;
+    if (cpuState->breaks && cpuState->breaks->regMask >> reg & 1) checkConditions(cpuState->breaks, reg, value);
+    if (cpuState->history) historyRegister(cpuState, reg);
   }
   cpuState->registers[reg] = value;
 }
 
 uint32_t readMemory(cpu *cpuState, uint16_t addr) {
-  handleStdin(cpuState, addr);
+  if (!cpuState->in32Bit) addr &= ADDR_MASK_16;
+  if (!handleStdin(cpuState, addr)) {
+    cpuState->stop = STOP_NO_INPUT;
+    return 0;
+  }
   cpuState->readMem = true;
   cpuState->lastReadAddr = addr;
-  return cpuState->in32Bit ? cpuState->memory32[addr] : cpuState->memory16[addr];
+  if (cpuState->breaks) breakOnRead(cpuState->breaks, addr);
+  if (cpuState->history) historyRead(cpuState, addr);
+  return cpuState->in32Bit ? memRead32(cpuState, addr) : cpuState->memory16[addr];
 }
 
 void writeMemory(cpu *cpuState, uint16_t addr, uint32_t value) {
+  if (!cpuState->in32Bit) addr &= ADDR_MASK_16;
   cpuState->lastWriteAddr = addr;
+  if (cpuState->breaks) breakOnWrite(cpuState->breaks, addr);
+  if (cpuState->history) historyWrite(cpuState, addr);
   if (cpuState->in32Bit) {
     cpuState->wroteMem = addr != stdInOutAddr32;
-    cpuState->memory32[addr] = value;
+    memWrite32(cpuState, addr, value);
   } else {
     cpuState->wroteMem = addr != stdInOutAddr16;
     cpuState->memory16[addr] = value;
@@ -151,155 +180,26 @@ void writeMemory(cpu *cpuState, uint16_t addr, uint32_t value) {
 }
 
 
-const char *redStr = "\033[31m";  // PC, register memory or modified
-const char *yellowStr = "\033[33m";  // PC incremented and current memory address
-const char *blueStr1 = "\033[34m"; // First read source register or memory addr
-const char *blueStr2 = "\033[94m"; // Second read source register
-const char *whiteStr = "\033[97m"; // Default
-
-const char *getPCColour(cpu *cpuState) {
-  
-  if (cpuState->halted) {
-    return whiteStr;
-  }
-  
-  if (cpuState->pcModified) {
-    return redStr;
-  }
-  
-  if (cpuState->oldPC != cpuState->pc) {
-    return yellowStr;
-  }
-  
-  return whiteStr;
-}
-
-const char *getRegColour(cpu *cpuState, uint8_t reg) {
-  if ((cpuState->wroteReg && cpuState->lastWriteReg == reg)) {
-    return redStr;
-  }
-  
-  if ((cpuState->readReg1 && cpuState->lastReadReg1 == reg)) {
-    return blueStr1;
-  }
-  
-  if ((cpuState->readReg2 && cpuState->lastReadReg2 == reg)) {
-    return blueStr2;
-  }
-  
-  return whiteStr;
-}
-
-const char *getMemColour(cpu *cpuState, uint16_t addr) {
-  if (addr == cpuState->pc) {
-    return yellowStr;
-  }
-  
-  if (cpuState->readMem && addr == cpuState->lastReadAddr) {
-    return blueStr1;
-  }
-  
-  if (cpuState->wroteMem && addr == cpuState->lastWriteAddr) {
-    return redStr;
-  }
-  
-  return whiteStr;
-}
-
-
-void printMemRange(cpu *cpuState, uint16_t addr) {
-  uint16_t startAddr = addr - windowSize;
-  uint16_t endAddr = addr + windowSize;
-  
-  if (addr < windowSize) {
-    startAddr = 0;
-    endAddr = 2 * windowSize;
-  }
-  
-  // Hide stdInOutAddr == 255, won't work for any other value 
-  if (!cpuState->in32Bit && addr > 254 - windowSize) {
-    startAddr = 254 - 2 * windowSize; 
-    endAddr = 254;
-  }
-  
-  char *fLabelStr1 = "     %sM[%04" PRIX16 "]%s";
-  char *fLabelStr2 = ",   %sM[%04" PRIX16 "]%s";
-  uint32_t memSize = MEM_SIZE_32;
-  if (!cpuState->in32Bit) {
-    fLabelStr1 = "    %sM[%02" PRIX8 "]%s";
-    fLabelStr2 = ", %sM[%02" PRIX8 "]%s";
-    memSize = MEM_SIZE_16;
-  }
-  
-  printf(fLabelStr1, getMemColour(cpuState, startAddr), startAddr, whiteStr);
-  for (uint16_t i = startAddr + 1; i <= endAddr && i < memSize; ++i) {
-    printf(fLabelStr2, getMemColour(cpuState, i), i, whiteStr);
-  }
-  
-  if (cpuState->in32Bit) {
-    printf("\n    %s%08" PRIX32 "%s", getMemColour(cpuState, startAddr), cpuState->memory32[startAddr], whiteStr);
-  } else {
-    printf("\n     %s%04" PRIX16 "%s", getMemColour(cpuState, startAddr), cpuState->memory16[startAddr], whiteStr);
-  }
-  for (uint16_t i = startAddr + 1; i <= endAddr && i < memSize; ++i) {
-    if (cpuState->in32Bit) {
-      printf(",  %s%08" PRIX32 "%s", getMemColour(cpuState, i), cpuState->memory32[i], whiteStr);
-    } else {
-      printf(",  %s%04" PRIX16 "%s", getMemColour(cpuState, i), cpuState->memory16[i], whiteStr);
-    }
-  }
-  
-  putchar('\n');
-}
-
-void printCpuState(cpu *cpuState) {
-  if (!debug) return;
- 
-  if (cpuState->halted) {
-    printf("%sCpu has halted%s\n", redStr, whiteStr);
-    return;
-  }
-  
-  char *fLabelStr1 = "      %sPC%s";
-  char *fLabelStr2 = ",    %sR[%02" PRIX8 "]%s";
-  char *fValueStr1 = "\n    %s%04" PRIX16 "%s";
-  char *fValueStr2 = ", %s%08" PRIX32 "%s";
-  if (!cpuState->in32Bit) {
-    fLabelStr1 = "    %sPC%s";
-    fLabelStr2 = ", %sR[%" PRIX8 "]%s";
-    fValueStr1 = "\n    %s%02" PRIX8 "%s";
-    fValueStr2 = ", %s%04" PRIX16 "%s";
-  }
-  
-  puts("Cpu state:\n  Registers:");
-  printf(fLabelStr1, getPCColour(cpuState), whiteStr);
-  for (uint8_t i = 0; i < REG_COUNT; ++i) {
-    printf(fLabelStr2, getRegColour(cpuState, i), i, whiteStr);
-  }
-
-  printf(fValueStr1, getPCColour(cpuState), cpuState->pc, whiteStr);
-  for (uint8_t i = 0; i < REG_COUNT; ++i) {
-    printf(fValueStr2, getRegColour(cpuState, i), cpuState->registers[i], whiteStr);
-  }
-
-  puts("\n\n  Memory near PC:");
-  printMemRange(cpuState, cpuState->pc);
-
-  if (cpuState->readMem) {
-    puts("\n  Memory near last read:");
-    printMemRange(cpuState, cpuState->lastReadAddr);
-  }
-
-  if (cpuState->wroteMem) {
-    puts("\n  Memory near last write:");
-    printMemRange(cpuState, cpuState->lastWriteAddr);
-  }
-  
-  putchar('\n');
+// Defaults for the settings initCpuState leaves alone
+void initCpuConfig(cpu *cpuState) {
+  cpuState->step = false;
+  cpuState->debug = true;
+  cpuState->quiet = false;
+  cpuState->io = NULL;
+  cpuState->cycleLimit = UINT64_MAX;
+  cpuState->trace = NULL;
+  cpuState->profile = NULL;
+  cpuState->breaks = NULL;
+  cpuState->history = NULL;
+  // Not a setting but it has to start out NULL once so initCpuState knows there is nothing to release
+  cpuState->pages = NULL;
+  cpuState->pageCount = 0;
 }
 
 void initCpuState(cpu *cpuState) {
   cpuState->halted = cpuState->pcModified = false;
+  cpuState->stop = STOP_NONE;
+  cpuState->cycles = 0;
   
   cpuState->readReg1 = cpuState->readReg2 = cpuState->wroteReg = false;
   cpuState->lastReadReg1 = cpuState->lastReadReg2 = cpuState->lastWriteReg = 0;
@@ -309,9 +209,7 @@ void initCpuState(cpu *cpuState) {
   
   cpuState->readMem = cpuState->wroteMem = false;
   cpuState->lastReadAddr = cpuState->lastWriteAddr = 0;
-  for (uint32_t i = 0; i < MEM_SIZE_32; ++i) {
-    cpuState->memory32[i] = 0;
-  }
+  resetCpuMemory(cpuState);
 }
 
 void initCpuState16(cpu *cpuState) {
@@ -321,51 +219,179 @@ void initCpuState16(cpu *cpuState) {
   initCpuState(cpuState);
 }
 
-void endCycle(cpu *cpuState) {
+void endCycle(cpu *cpuState, uint32_t inst) {
+  // A jump already moved pc on, writePC kept where it was in oldPC
+  uint16_t pc = cpuState->pcModified ? cpuState->oldPC : cpuState->pc;
+  ++cpuState->cycles;
   writePC(cpuState, cpuState->pc + 1, true);
   writeRegister(cpuState, 0, 0);
+  // Replayed cycles were traced and profiled the first time they ran
+  bool replayed = cpuState->history && !historyEnd(cpuState);
+  if (cpuState->trace && !replayed) traceCycle(cpuState, pc, inst);
+  if (cpuState->profile && !replayed) profileCycle(cpuState, pc, inst);
   printCpuState(cpuState)  ;
   
   cpuState->pcModified = false;
   cpuState->readReg1 = cpuState->readReg2 = cpuState->wroteReg = false;
   cpuState->readMem = cpuState->wroteMem = false;
   
-  if (step) {
+  if (cpuState->step) {
     getchar();
   }
+  // Watchpoints and conditions stop the cpu once the instruction that hit them has finished
+  if (cpuState->breaks && cpuState->breaks->hit) cpuState->stop = STOP_BREAK;
+}
+
+// Consumes breaks->resume, returning whether the run should step over a breakpoint at the pc it starts on
+static bool takeResume(cpuBreaks *breaks) {
+  if (!breaks) return false;
+  bool resumed = breaks->resume;
+  breaks->resume = false;
+  breaks->hit = BREAK_NONE;
+  return resumed;
 }
 
+// The 32 bit reference interpreter. Instructions are op:4 rd:4 rs:4 rt:4 addr:16 and do what their 16 bit
+// counterparts do over the 64K word address space. 0FFF switches back to 16 bit mode and returns, the same word
+// switches 16 bit mode over to 32 bit and pc carries on from the next address in the new mode.
 void runCpu32(cpu *cpuState) {
   if (!cpuState->in32Bit) return;
-  
-  while (!cpuState->halted) {
-    uint32_t inst = cpuState->memory32[cpuState->pc];
-    
-    switch(inst >> 12) {
+
+  cpuBreaks *breaks = cpuState->breaks;
+  uint64_t start = cpuState->cycles;
+  bool resumed = takeResume(breaks);
+
+  while (cpuState->in32Bit && !cpuState->halted && cpuState->stop == STOP_NONE) {
+    if (cpuState->cycles >= cpuState->cycleLimit) {
+      cpuState->stop = STOP_CYCLE_LIMIT;
+      return;
+    }
+    if (breaks && BREAK_BIT(breaks->code, cpuState->pc) && !(resumed && cpuState->cycles == start)) {
+      breaks->hit = BREAK_CODE;
+      breaks->hitAddr = cpuState->pc;
+      cpuState->stop = STOP_BREAK;
+      return;
+    }
+    if (cpuState->history) historyBegin(cpuState);
+
+    uint32_t inst = memRead32(cpuState, cpuState->pc);
+    uint8_t rd = (inst >> 24) & 0xF;
+    uint8_t rs = (inst >> 20) & 0xF;
+    uint8_t rt = (inst >> 16) & 0xF;
+    uint16_t addr = inst & 0xFFFF;
+    uint32_t r1, r2, mem;
+
+    switch (inst >> 28) {
       case 0x0:
-        cpuState->in32Bit = inst == 0x0FFF;
-        runCpu32(cpuState);
-        cpuState->halted = !cpuState->in32Bit;
+        cpuState->in32Bit = inst != 0x0FFF;
+        cpuState->halted = cpuState->in32Bit;
+        break;
+      case 0x1:
+        r1 = readRegister(cpuState, rs, false);
+        r2 = readRegister(cpuState, rt, true);
+        writeRegister(cpuState, rd, r1 + r2);
+        break;
+      case 0x2:
+        r1 = readRegister(cpuState, rs, false);
+        r2 = readRegister(cpuState, rt, true);
+        writeRegister(cpuState, rd, r1 - r2);
+        break;
+      case 0x3:
+        r1 = readRegister(cpuState, rs, false);
+        r2 = readRegister(cpuState, rt, true);
+        writeRegister(cpuState, rd, r1 & r2);
+        break;
+      case 0x4:
+        r1 = readRegister(cpuState, rs, false);
+        r2 = readRegister(cpuState, rt, true);
+        writeRegister(cpuState, rd, r1 ^ r2);
+        break;
+      case 0x5:
+        r1 = readRegister(cpuState, rs, false);
+        r2 = readRegister(cpuState, rt, true);
+        writeRegister(cpuState, rd, r1 << (r2 & 31));
+        break;
+      case 0x6:
+        r1 = readRegister(cpuState, rs, false);
+        r2 = readRegister(cpuState, rt, true);
+        writeRegister(cpuState, rd, r1 >> (r2 & 31));
+        break;
+      case 0x7:
+        writeRegister(cpuState, rd, addr);
+        break;
+      case 0x8:
+        mem = readMemory(cpuState, addr);
+        // Leave the instruction unfinished if there was no input for it
+        if (cpuState->stop) return;
+        writeRegister(cpuState, rd, mem);
+        break;
+      case 0x9:
+        r1 = readRegister(cpuState, rd, false);
+        writeMemory(cpuState, addr, r1);
+        break;
+      case 0xA:
+        r1 = readRegister(cpuState, rt, false);
+        mem = readMemory(cpuState, r1);
+        if (cpuState->stop) return;
+        writeRegister(cpuState, rd, mem);
+        break;
+      case 0xB:
+        r1 = readRegister(cpuState, rd, false);
+        r2 = readRegister(cpuState, rt, true);
+        writeMemory(cpuState, r2, r1);
+        break;
+      case 0xC:
+        r1 = readRegister(cpuState, rd, false);
+        if (r1 == 0) writePC(cpuState, addr, false);
+        break;
+      case 0xD:
+        r1 = readRegister(cpuState, rd, false);
+        if (r1 > 0) writePC(cpuState, addr, false);
+        break;
+      case 0xE:
+        r1 = readRegister(cpuState, rd, false);
+        writePC(cpuState, r1, false);
+        break;
+      case 0xF:
+        writeRegister(cpuState, rd, (uint16_t)(cpuState->pc + 1));
+        writePC(cpuState, addr, false);
         break;
-      default:
-        puts("Invalid opcode");
-        exit(1);
     }
-    
-    endCycle(cpuState);
+
+    endCycle(cpuState, inst);
   }
 }
 
+// The reference interpreter, it runs whichever mode the cpu is in and hands 32 bit stretches to runCpu32
 void runCpu16(cpu *cpuState) {
-  if (cpuState->in32Bit) return;
+  cpuBreaks *breaks = cpuState->breaks;
+  uint64_t start = cpuState->cycles;
+  bool resumed = takeResume(breaks);
   
-  while (!cpuState->halted) {
+  while (!cpuState->halted && cpuState->stop == STOP_NONE) {
+    if (cpuState->in32Bit) {
+      // Only the cycle the run started on steps over a breakpoint
+      if (breaks) breaks->resume = resumed && cpuState->cycles == start;
+      runCpu32(cpuState);
+      continue;
+    }
+    if (cpuState->cycles >= cpuState->cycleLimit) {
+      cpuState->stop = STOP_CYCLE_LIMIT;
+      return;
+    }
+    if (breaks && BREAK_BIT(breaks->code, cpuState->pc) && !(resumed && cpuState->cycles == start)) {
+      breaks->hit = BREAK_CODE;
+      breaks->hitAddr = cpuState->pc;
+      cpuState->stop = STOP_BREAK;
+      return;
+    }
+    if (cpuState->history) historyBegin(cpuState);
+
     uint16_t inst = cpuState->memory16[cpuState->pc];
     
     switch(inst >> 12) {
       case 0x0:
         cpuState->in32Bit = inst == 0x0FFF;
-        runCpu32(cpuState);
         cpuState->halted = !cpuState->in32Bit;
         break;
       case 0x1:
@@ -391,18 +417,20 @@ void runCpu16(cpu *cpuState) {
       case 0x5:
         r1 = readRegister(cpuState, (inst >> 4) & 0xF, false);
         r2 = readRegister(cpuState, inst & 0xF, true);
-        writeRegister(cpuState, (inst >> 8) & 0xF, r1 << r2);
+        writeRegister(cpuState, (inst >> 8) & 0xF, r1 << (r2 & 31));
         break;
       case 0x6:
         r1 = readRegister(cpuState, (inst >> 4) & 0xF, false);
         r2 = readRegister(cpuState, inst & 0xF, true);
-        writeRegister(cpuState, (inst >> 8) & 0xF, r1 >> r2);
+        writeRegister(cpuState, (inst >> 8) & 0xF, r1 >> (r2 & 31));
         break;
       case 0x7:
         writeRegister(cpuState, (inst >> 8) & 0xF, inst & 0xFF);
         break;
       case 0x8:
         uint32_t mem = readMemory(cpuState, inst & 0xFF);
+        // Leave the instruction unfinished if there was no input for it
+        if (cpuState->stop) return;
         writeRegister(cpuState, (inst >> 8) & 0xF, mem);
         break;
       case 0x9:
@@ -412,6 +440,7 @@ void runCpu16(cpu *cpuState) {
       case 0xA:
         r1 = readRegister(cpuState, inst & 0xF, false);
         mem = readMemory(cpuState, r1);
+        if (cpuState->stop) return;
         writeRegister(cpuState, (inst >> 8) & 0xF, mem);
         break;
       case 0xB:
@@ -436,7 +465,7 @@ void runCpu16(cpu *cpuState) {
         writePC(cpuState, r1, false);
         break;
       case 0xF:
-        writeRegister(cpuState, (inst >> 8) & 0xF, cpuState->pc + 1);
+        writeRegister(cpuState, (inst >> 8) & 0xF, (cpuState->pc + 1) & ADDR_MASK_16);
         writePC(cpuState, inst & 0xFF, false);
         break;
       default:
@@ -444,16 +473,645 @@ void runCpu16(cpu *cpuState) {
         exit(1);
     }
     
-    endCycle(cpuState);
+    endCycle(cpuState, inst);
   }
 }
 
 
-// From https://github.com/archiecobbs/libnbcompat/blob/4700b02/fgetln.c
-char *fgetln(FILE *fp, size_t *len) {
-  static char *buf = NULL;
-  static size_t bufsiz = 0;
-  static size_t buflen = 0;
+// Same as runCpu16 but with all access tracking, printing and stepping left out so that
+// headless runs are bound by the emulated work rather than the terminal
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+// Opcodes writing to rd, as a mask
+#define REG_WRITERS_16 (uint16_t)0x85FE
+
+// The switch loop behind runCpu16Headless, runCpu16Profiled and runCpu16Debug, inlined into each so the plain one
+// has no trace of the counting or breakpoint checks left in it
+static ALWAYS_INLINE void runHeadless16(cpu *cpuState, cpuProfile *profile, cpuBreaks *breaks) {
+  if (cpuState->in32Bit) return;
+
+  // A run resumed from a breakpoint runs the instruction there rather than stopping on it again
+  bool resumed = takeResume(breaks);
+
+  uint32_t *registers = cpuState->registers;
+  uint16_t *memory = cpuState->memory16;
+  uint16_t pc = cpuState->pc;
+  uint64_t cycles = 0;
+  uint64_t budget = cpuState->cycles < cpuState->cycleLimit ? cpuState->cycleLimit - cpuState->cycles : 0;
+
+  while (!cpuState->stop) {
+    if (cycles == budget) {
+      cpuState->stop = STOP_CYCLE_LIMIT;
+      break;
+    }
+    if (breaks && BREAK_BIT(breaks->code, pc) && (cycles || !resumed)) {
+      breaks->hit = BREAK_CODE;
+      breaks->hitAddr = pc;
+      cpuState->stop = STOP_BREAK;
+      break;
+    }
+
+    uint16_t inst = memory[pc];
+    uint8_t rd = (inst >> 8) & 0xF;
+    uint8_t rs = (inst >> 4) & 0xF;
+    uint8_t rt = inst & 0xF;
+    uint8_t addr = inst & 0xFF;
+    uint16_t nextPC = (pc + 1) & ADDR_MASK_16;
+    ++cycles;
+
+    switch(inst >> 12) {
+      case 0x0:
+        if (profile) {
+          ++profile->hits[pc];
+          ++profile->opcodes[0];
+          ++profile->node->cycles;
+        }
+        // The caller carries on in 32 bit mode from the next address
+        cpuState->in32Bit = inst == 0x0FFF;
+        cpuState->halted = !cpuState->in32Bit;
+        cpuState->pc = cpuState->oldPC = cpuState->halted ? pc : pc + 1;
+        cpuState->cycles += cycles;
+        registers[0] = 0;
+        return;
+      case 0x1:
+        registers[rd] = registers[rs] + registers[rt];
+        break;
+      case 0x2:
+        registers[rd] = registers[rs] - registers[rt];
+        break;
+      case 0x3:
+        registers[rd] = registers[rs] & registers[rt];
+        break;
+      case 0x4:
+        registers[rd] = registers[rs] ^ registers[rt];
+        break;
+      case 0x5:
+        registers[rd] = registers[rs] << (registers[rt] & 31);
+        break;
+      case 0x6:
+        registers[rd] = registers[rs] >> (registers[rt] & 31);
+        break;
+      case 0x7:
+        registers[rd] = addr;
+        break;
+      case 0xA:
+        addr = registers[rt];
+        // fall through
+      case 0x8:
+        if (addr == stdInOutAddr16 && !handleStdin(cpuState, addr)) {
+          cpuState->stop = STOP_NO_INPUT;
+          --cycles;
+          continue;
+        }
+        registers[rd] = memory[addr];
+        if (profile) ++profile->reads[addr];
+        if (breaks && BREAK_BIT(breaks->reads, addr)) {
+          breaks->hit = BREAK_READ;
+          breaks->hitAddr = addr;
+        }
+        break;
+      case 0xB:
+        addr = registers[rt];
+        // fall through
+      case 0x9:
+        memory[addr] = registers[rd];
+        if (profile) ++profile->writes[addr];
+        if (breaks && BREAK_BIT(breaks->writes, addr)) {
+          breaks->hit = BREAK_WRITE;
+          breaks->hitAddr = addr;
+        }
+        if (addr == stdInOutAddr16) handleStdout(cpuState, addr);
+        break;
+      case 0xC:
+        if (registers[rd] == 0) nextPC = addr;
+        if (profile) {
+          ++profile->branches[pc];
+          profile->taken[pc] += registers[rd] == 0;
+        }
+        break;
+      case 0xD:
+        if (registers[rd] > 0) nextPC = addr;
+        if (profile) {
+          ++profile->branches[pc];
+          profile->taken[pc] += registers[rd] > 0;
+        }
+        break;
+      case 0xE:
+        nextPC = registers[rd] & ADDR_MASK_16;
+        break;
+      case 0xF:
+        registers[rd] = nextPC;
+        nextPC = addr;
+        break;
+    }
+
+    // Counted once the instruction has finished so a read left waiting for input isn't counted twice, the
+    // subroutine a jsr or jmp is charged to is the one it was run from
+    if (profile) {
+      ++profile->hits[pc];
+      ++profile->opcodes[inst >> 12];
+      ++profile->node->cycles;
+      if (inst >> 12 == 0xE) profileReturn(profile);
+      if (inst >> 12 == 0xF) profileCall(profile, addr);
+    }
+    if (breaks) {
+      if (rd && breaks->regMask >> rd & 1 && REG_WRITERS_16 >> (inst >> 12) & 1) {
+        checkConditions(breaks, rd, registers[rd]);
+      }
+      if (breaks->hit) cpuState->stop = STOP_BREAK;
+    }
+    registers[0] = 0;
+    pc = nextPC;
+  }
+
+  cpuState->pc = pc;
+  cpuState->cycles += cycles;
+}
+
+// Word reads and writes in 32 bit mode with page 0 kept inline, the rest of memory goes through the page table
+static ALWAYS_INLINE uint32_t load32(cpu *cpuState, uint16_t addr) {
+  return addr < PAGE_WORDS_32 ? cpuState->memory32[addr] : memRead32(cpuState, addr);
+}
+
+// Returns false if the write was lost for want of a page, memWord32 has stopped the cpu
+static ALWAYS_INLINE bool store32(cpu *cpuState, uint16_t addr, uint32_t word) {
+  if (addr < PAGE_WORDS_32) {
+    cpuState->memory32[addr] = word;
+    return true;
+  }
+  memWrite32(cpuState, addr, word);
+  return cpuState->stop != STOP_OUT_OF_MEMORY;
+}
+
+// The 32 bit counterpart of runHeadless16, returning once the program switches back to 16 bit mode. The profile
+// only covers the 16 bit address space so 32 bit stretches aren't counted, same as the reference interpreter.
+static ALWAYS_INLINE void runHeadless32(cpu *cpuState, cpuBreaks *breaks) {
+  if (!cpuState->in32Bit) return;
+
+  bool resumed = takeResume(breaks);
+  uint32_t *registers = cpuState->registers;
+  uint16_t pc = cpuState->pc;
+  uint64_t cycles = 0;
+  uint64_t budget = cpuState->cycles < cpuState->cycleLimit ? cpuState->cycleLimit - cpuState->cycles : 0;
+
+  while (!cpuState->stop) {
+    if (cycles == budget) {
+      cpuState->stop = STOP_CYCLE_LIMIT;
+      break;
+    }
+    if (breaks && BREAK_BIT(breaks->code, pc) && (cycles || !resumed)) {
+      breaks->hit = BREAK_CODE;
+      breaks->hitAddr = pc;
+      cpuState->stop = STOP_BREAK;
+      break;
+    }
+
+    uint32_t inst = load32(cpuState, pc);
+    uint8_t rd = (inst >> 24) & 0xF;
+    uint8_t rs = (inst >> 20) & 0xF;
+    uint8_t rt = (inst >> 16) & 0xF;
+    uint16_t addr = inst & 0xFFFF;
+    uint16_t nextPC = pc + 1;
+    ++cycles;
+
+    switch (inst >> 28) {
+      case 0x0:
+        cpuState->in32Bit = inst != 0x0FFF;
+        cpuState->halted = cpuState->in32Bit;
+        cpuState->pc = cpuState->oldPC = cpuState->halted ? pc : nextPC & ADDR_MASK_16;
+        cpuState->cycles += cycles;
+        registers[0] = 0;
+        return;
+      case 0x1:
+        registers[rd] = registers[rs] + registers[rt];
+        break;
+      case 0x2:
+        registers[rd] = registers[rs] - registers[rt];
+        break;
+      case 0x3:
+        registers[rd] = registers[rs] & registers[rt];
+        break;
+      case 0x4:
+        registers[rd] = registers[rs] ^ registers[rt];
+        break;
+      case 0x5:
+        registers[rd] = registers[rs] << (registers[rt] & 31);
+        break;
+      case 0x6:
+        registers[rd] = registers[rs] >> (registers[rt] & 31);
+        break;
+      case 0x7:
+        registers[rd] = addr;
+        break;
+      case 0xA:
+        addr = registers[rt];
+        // fall through
+      case 0x8:
+        if (addr == stdInOutAddr32 && !handleStdin(cpuState, addr)) {
+          cpuState->stop = STOP_NO_INPUT;
+          --cycles;
+          continue;
+        }
+        registers[rd] = load32(cpuState, addr);
+        if (breaks && BREAK_BIT(breaks->reads, addr)) {
+          breaks->hit = BREAK_READ;
+          breaks->hitAddr = addr;
+        }
+        break;
+      case 0xB:
+        addr = registers[rt];
+        // fall through
+      case 0x9:
+        store32(cpuState, addr, registers[rd]);
+        if (breaks && BREAK_BIT(breaks->writes, addr)) {
+          breaks->hit = BREAK_WRITE;
+          breaks->hitAddr = addr;
+        }
+        if (addr == stdInOutAddr32) handleStdout(cpuState, addr);
+        break;
+      case 0xC:
+        if (registers[rd] == 0) nextPC = addr;
+        break;
+      case 0xD:
+        if (registers[rd] > 0) nextPC = addr;
+        break;
+      case 0xE:
+        nextPC = registers[rd];
+        break;
+      case 0xF:
+        registers[rd] = nextPC;
+        nextPC = addr;
+        break;
+    }
+
+    if (breaks) {
+      if (rd && breaks->regMask >> rd & 1 && REG_WRITERS_16 >> (inst >> 28) & 1) {
+        checkConditions(breaks, rd, registers[rd]);
+      }
+      if (breaks->hit) cpuState->stop = STOP_BREAK;
+    }
+    registers[0] = 0;
+    pc = nextPC;
+  }
+
+  cpuState->pc = pc;
+  cpuState->cycles += cycles;
+}
+
+// Alternates between the two loops as the program switches modes, each switch is a return and a call
+static ALWAYS_INLINE void runHeadless(cpu *cpuState, cpuProfile *profile, cpuBreaks *breaks) {
+  while (!cpuState->halted && !cpuState->stop) {
+    if (cpuState->in32Bit) {
+      runHeadless32(cpuState, breaks);
+    } else {
+      runHeadless16(cpuState, profile, breaks);
+    }
+  }
+}
+
+void runCpu16Headless(cpu *cpuState) {
+  runHeadless(cpuState, NULL, NULL);
+}
+
+// runCpu16Headless counting everything cpuState->profile tracks as it goes
+void runCpu16Profiled(cpu *cpuState) {
+  runHeadless(cpuState, cpuState->profile, NULL);
+}
+
+// runCpu16Headless stopping with STOP_BREAK at anything in cpuState->breaks
+void runCpu16Debug(cpu *cpuState) {
+  runHeadless(cpuState, NULL, cpuState->breaks);
+}
+
+void decodeOp16(decodedOp16 *op, uint16_t inst, const void *const *handlers) {
+  uint8_t opcode = inst >> 12;
+  op->rd = (inst >> 8) & 0xF;
+  op->rs = (inst >> 4) & 0xF;
+  op->rt = inst & 0xF;
+  op->imm = inst & 0xFF;
+
+  if (opcode == 0x8 && op->imm == stdInOutAddr16) {
+    opcode = OP16_LOD_IO;
+  } else if (opcode == 0x9 && op->imm == stdInOutAddr16) {
+    opcode = OP16_STR_IO;
+  }
+  op->handler = handlers[opcode];
+}
+
+#ifdef __GNUC__
+// Predecodes all of memory16 and then runs it with computed goto dispatch, any write to memory
+// redecodes that address so self modifying programs still see their changes
+static void runThreaded16(cpu *cpuState) {
+  if (cpuState->in32Bit) return;
+
+  static const void *const handlers[OP16_HANDLER_COUNT] = {
+    &&opHlt, &&opAdd, &&opSub, &&opAnd, &&opXor, &&opAsl, &&opAsr, &&opLda,
+    &&opLod, &&opStr, &&opLdi, &&opSti, &&opBrz, &&opBrp, &&opJmp, &&opJsr,
+    &&opLodIO, &&opStrIO
+  };
+
+  uint32_t *registers = cpuState->registers;
+  uint16_t *memory = cpuState->memory16;
+  uint64_t cycles = 0;
+  uint64_t budget = cpuState->cycles < cpuState->cycleLimit ? cpuState->cycleLimit - cpuState->cycles : 0;
+  decodedOp16 ops[MEM_SIZE_16];
+  decodedOp16 *op;
+  uint8_t pc = cpuState->pc;
+  uint8_t addr;
+
+  for (uint32_t i = 0; i < MEM_SIZE_16; ++i) {
+    decodeOp16(ops + i, memory[i], handlers);
+  }
+
+#define DISPATCH() do { if (cycles == budget) goto cycleLimit; op = ops + pc; ++cycles; goto *op->handler; } while (0)
+#define NEXT() do { registers[0] = 0; ++pc; DISPATCH(); } while (0)
+#define JUMP(newPC) do { registers[0] = 0; pc = (newPC); DISPATCH(); } while (0)
+#define REDECODE(addr) decodeOp16(ops + (addr), memory[addr], handlers)
+
+  DISPATCH();
+
+opHlt:
+  // 0FFF leaves the caller to carry on in 32 bit mode from the next address
+  cpuState->in32Bit = memory[pc] == 0x0FFF;
+  cpuState->halted = !cpuState->in32Bit;
+  cpuState->pc = cpuState->oldPC = cpuState->halted ? pc : pc + 1;
+  cpuState->cycles += cycles;
+  registers[0] = 0;
+  return;
+opAdd:
+  registers[op->rd] = registers[op->rs] + registers[op->rt];
+  NEXT();
+opSub:
+  registers[op->rd] = registers[op->rs] - registers[op->rt];
+  NEXT();
+opAnd:
+  registers[op->rd] = registers[op->rs] & registers[op->rt];
+  NEXT();
+opXor:
+  registers[op->rd] = registers[op->rs] ^ registers[op->rt];
+  NEXT();
+opAsl:
+  registers[op->rd] = registers[op->rs] << (registers[op->rt] & 31);
+  NEXT();
+opAsr:
+  registers[op->rd] = registers[op->rs] >> (registers[op->rt] & 31);
+  NEXT();
+opLda:
+  registers[op->rd] = op->imm;
+  NEXT();
+opLod:
+  registers[op->rd] = memory[op->imm];
+  NEXT();
+opLodIO:
+  // Redecode only once op is no longer needed as the port may be the instruction being run
+  if (!handleStdin(cpuState, stdInOutAddr16)) goto noInput;
+  registers[op->rd] = memory[stdInOutAddr16];
+  REDECODE(stdInOutAddr16);
+  NEXT();
+opStr:
+  memory[op->imm] = registers[op->rd];
+  REDECODE(op->imm);
+  NEXT();
+opStrIO:
+  memory[stdInOutAddr16] = registers[op->rd];
+  REDECODE(stdInOutAddr16);
+  handleStdout(cpuState, stdInOutAddr16);
+  NEXT();
+opLdi:
+  addr = registers[op->rt];
+  if (addr == stdInOutAddr16) {
+    if (!handleStdin(cpuState, addr)) goto noInput;
+    registers[op->rd] = memory[addr];
+    REDECODE(addr);
+    NEXT();
+  }
+  registers[op->rd] = memory[addr];
+  NEXT();
+opSti:
+  addr = registers[op->rt];
+  memory[addr] = registers[op->rd];
+  REDECODE(addr);
+  if (addr == stdInOutAddr16) handleStdout(cpuState, addr);
+  NEXT();
+opBrz:
+  if (registers[op->rd] == 0) JUMP(op->imm);
+  NEXT();
+opBrp:
+  if (registers[op->rd] > 0) JUMP(op->imm);
+  NEXT();
+opJmp:
+  JUMP(registers[op->rd]);
+opJsr:
+  registers[op->rd] = (uint8_t)(pc + 1);
+  JUMP(op->imm);
+
+noInput:
+  // Leave pc on the read so it is retried once more input is available
+  cpuState->stop = STOP_NO_INPUT;
+  --cycles;
+  goto stopped;
+cycleLimit:
+  cpuState->stop = STOP_CYCLE_LIMIT;
+stopped:
+  cpuState->pc = pc;
+  cpuState->cycles += cycles;
+  return;
+
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+#undef REDECODE
+}
+
+static void decodeOp32(decodedOp32 *op, uint32_t inst, const void *const *handlers) {
+  uint8_t opcode = inst >> 28;
+  op->rd = (inst >> 24) & 0xF;
+  op->rs = (inst >> 20) & 0xF;
+  op->rt = (inst >> 16) & 0xF;
+  op->imm = inst & 0xFFFF;
+
+  if (inst == 0x0FFF) {
+    opcode = OP32_MODE;
+  } else if (opcode == 0x8 && op->imm == stdInOutAddr32) {
+    opcode = OP32_LOD_IO;
+  } else if (opcode == 0x9 && op->imm == stdInOutAddr32) {
+    opcode = OP32_STR_IO;
+  }
+  op->handler = handlers[opcode];
+}
+
+// runThreaded16 for 32 bit mode, returning once the program switches back. code holds the decoded words between
+// calls, it's allocated on first use and the caller frees it. Only page 0 can change in 16 bit mode so that's all
+// that has to be decoded again on each call.
+void runCpu32Threaded(cpu *cpuState, decodedOp32 **code) {
+  if (!cpuState->in32Bit) return;
+
+  static const void *const handlers[OP32_HANDLER_COUNT] = {
+    &&opHlt, &&opAdd, &&opSub, &&opAnd, &&opXor, &&opAsl, &&opAsr, &&opLda,
+    &&opLod, &&opStr, &&opLdi, &&opSti, &&opBrz, &&opBrp, &&opJmp, &&opJsr,
+    &&opLodIO, &&opStrIO, &&opMode
+  };
+
+  uint32_t *registers = cpuState->registers;
+  uint64_t cycles = 0;
+  uint64_t budget = cpuState->cycles < cpuState->cycleLimit ? cpuState->cycleLimit - cpuState->cycles : 0;
+  uint16_t pc = cpuState->pc;
+  uint16_t addr;
+  decodedOp32 *op;
+
+  decodedOp32 *ops = *code;
+  if (!ops) {
+    if (!(ops = *code = malloc(MEM_SIZE_32 * sizeof(decodedOp32)))) {
+      cpuState->stop = STOP_OUT_OF_MEMORY;
+      return;
+    }
+    for (uint32_t i = 0; i < MEM_SIZE_32; ++i) ops[i].handler = &&opDecode;
+  } else {
+    for (uint32_t i = 0; i < PAGE_WORDS_32; ++i) ops[i].handler = &&opDecode;
+  }
+
+#define DISPATCH() do { if (cycles == budget) goto cycleLimit; op = ops + pc; ++cycles; goto *op->handler; } while (0)
+#define NEXT() do { registers[0] = 0; ++pc; DISPATCH(); } while (0)
+#define JUMP(newPC) do { registers[0] = 0; pc = (newPC); DISPATCH(); } while (0)
+#define INVALIDATE(addr) (ops[addr].handler = &&opDecode)
+
+  DISPATCH();
+
+opDecode:
+  decodeOp32(op, load32(cpuState, pc), handlers);
+  goto *op->handler;
+opHlt:
+  cpuState->halted = true;
+  cpuState->pc = cpuState->oldPC = pc;
+  cpuState->cycles += cycles;
+  registers[0] = 0;
+  return;
+opMode:
+  cpuState->in32Bit = false;
+  cpuState->pc = cpuState->oldPC = (pc + 1) & ADDR_MASK_16;
+  cpuState->cycles += cycles;
+  registers[0] = 0;
+  return;
+opAdd:
+  registers[op->rd] = registers[op->rs] + registers[op->rt];
+  NEXT();
+opSub:
+  registers[op->rd] = registers[op->rs] - registers[op->rt];
+  NEXT();
+opAnd:
+  registers[op->rd] = registers[op->rs] & registers[op->rt];
+  NEXT();
+opXor:
+  registers[op->rd] = registers[op->rs] ^ registers[op->rt];
+  NEXT();
+opAsl:
+  registers[op->rd] = registers[op->rs] << (registers[op->rt] & 31);
+  NEXT();
+opAsr:
+  registers[op->rd] = registers[op->rs] >> (registers[op->rt] & 31);
+  NEXT();
+opLda:
+  registers[op->rd] = op->imm;
+  NEXT();
+opLod:
+  registers[op->rd] = load32(cpuState, op->imm);
+  NEXT();
+opLodIO:
+  if (!handleStdin(cpuState, stdInOutAddr32)) goto noInput;
+  registers[op->rd] = load32(cpuState, stdInOutAddr32);
+  INVALIDATE(stdInOutAddr32);
+  NEXT();
+opStr:
+  if (!store32(cpuState, op->imm, registers[op->rd])) goto outOfMemory;
+  INVALIDATE(op->imm);
+  NEXT();
+opStrIO:
+  if (!store32(cpuState, stdInOutAddr32, registers[op->rd])) goto outOfMemory;
+  INVALIDATE(stdInOutAddr32);
+  handleStdout(cpuState, stdInOutAddr32);
+  NEXT();
+opLdi:
+  addr = registers[op->rt];
+  if (addr == stdInOutAddr32) {
+    if (!handleStdin(cpuState, addr)) goto noInput;
+    INVALIDATE(addr);
+  }
+  registers[op->rd] = load32(cpuState, addr);
+  NEXT();
+opSti:
+  addr = registers[op->rt];
+  if (!store32(cpuState, addr, registers[op->rd])) goto outOfMemory;
+  INVALIDATE(addr);
+  if (addr == stdInOutAddr32) handleStdout(cpuState, addr);
+  NEXT();
+opBrz:
+  if (registers[op->rd] == 0) JUMP(op->imm);
+  NEXT();
+opBrp:
+  if (registers[op->rd] > 0) JUMP(op->imm);
+  NEXT();
+opJmp:
+  JUMP(registers[op->rd]);
+opJsr:
+  registers[op->rd] = (uint16_t)(pc + 1);
+  JUMP(op->imm);
+
+noInput:
+  cpuState->stop = STOP_NO_INPUT;
+  --cycles;
+  goto stopped;
+outOfMemory:
+  // Ends after the store the same as the other engines, which only look at stop between instructions
+  registers[0] = 0;
+  ++pc;
+  goto stopped;
+cycleLimit:
+  cpuState->stop = STOP_CYCLE_LIMIT;
+stopped:
+  cpuState->pc = pc;
+  cpuState->cycles += cycles;
+  return;
+
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+#undef INVALIDATE
+}
+
+void runCpu16Threaded(cpu *cpuState) {
+  decodedOp32 *code = NULL;
+  while (!cpuState->halted && !cpuState->stop) {
+    if (cpuState->in32Bit) {
+      runCpu32Threaded(cpuState, &code);
+    } else {
+      runThreaded16(cpuState);
+    }
+  }
+  free(code);
+}
+#else
+void runCpu16Threaded(cpu *cpuState) {
+  runCpu16Headless(cpuState);
+}
+
+void runCpu32Threaded(cpu *cpuState, decodedOp32 **code) {
+  (void)code;
+  runHeadless32(cpuState, NULL);
+}
+#endif
+
+
+// From https://github.com/archiecobbs/libnbcompat/blob/4700b02/fgetln.c, renamed as BSD and macOS declare fgetln in
+// stdio.h with a different signature
+// Takes the buffer from the caller rather than keeping it static so files can be loaded from several threads
+char *readLine(FILE *fp, size_t *len, char **bufp, size_t *bufsizp) {
+  char *buf = *bufp;
+  size_t bufsiz = *bufsizp;
+  size_t buflen = 0;
   int c;
 
   if (buf == NULL) {
@@ -463,9 +1121,9 @@ char *fgetln(FILE *fp, size_t *len) {
     }
   }
 
-  buflen = 0;
   while ((c = fgetc(fp)) != EOF) {
-    if (buflen >= bufsiz) {
+    // Always leaves room for the caller to terminate the line
+    if (buflen + 1 >= bufsiz) {
       size_t nbufsiz = bufsiz + BUFSIZ;
       char *nbuf = realloc(buf, nbufsiz);
 
@@ -473,7 +1131,8 @@ char *fgetln(FILE *fp, size_t *len) {
         int oerrno = errno;
         free(buf);
         errno = oerrno;
-        buf = NULL;
+        *bufp = NULL;
+        *bufsizp = 0;
         return NULL;
       }
 
@@ -485,12 +1144,13 @@ char *fgetln(FILE *fp, size_t *len) {
       break;
     }
   }
+  *bufp = buf;
+  *bufsizp = bufsiz;
   *len = buflen;
   return buflen == 0 ? NULL : buf;
 }
 
-void processLine16(char *line, cpu *cpuState) {
-  static bool inComment = false;
+bool processLine16(char *line, cpu *cpuState, bool *inComment, bool echo) {
   char *rest;
   
   // Trim spaces from beginning and end of line
@@ -500,89 +1160,80 @@ void processLine16(char *line, cpu *cpuState) {
   line[len] = 0;
   
   // Handle end of multi line comments
-  if (inComment && line[0] == '*' && strcmp(line + len - 2, "*/") == 0) {
-    inComment = false;
-    putchar('\n');
-    return;
+  if (*inComment && line[0] == '*' && strcmp(line + len - 2, "*/") == 0) {
+    *inComment = false;
+    if (echo) putchar('\n');
+    return true;
   }
   
   // Handle start and body of multi line comments
-  if ((inComment && line[0] == '*') || strncmp(line, "/*", 2) == 0) {
-    inComment = true;
-    putchar('\n');
-    return;
+  if ((*inComment && line[0] == '*') || strncmp(line, "/*", 2) == 0) {
+    *inComment = true;
+    if (echo) putchar('\n');
+    return true;
   }
   
-  if (inComment) {
-    puts("\nInvalid line in multi line comment");
-    exit(1);
+  if (*inComment) {
+    if (!cpuState->quiet) puts("\nInvalid line in multi line comment");
+    return false;
   }
   
   // Handle whitespace only lines, program and function declarations, and single line comments
   if (!strlen(line) || strncmp(line, "program", 7) == 0 || 
       strncmp(line, "function", 8) == 0 || strncmp(line, "//", 2) == 0) {
-    putchar('\n');
-    return;
+    if (echo) putchar('\n');
+    return true;
   }
 
   uint32_t address = strtoul(line, &rest, 16);
   if (errno == ERANGE || address >= MEM_SIZE_32 || (line + 2) > rest) {
-    puts("\nInvalid memory address");
-    exit(1);
+    if (!cpuState->quiet) puts("\nInvalid memory address");
+    return false;
   }
 
   line = rest + 1;
   uint32_t data = strtoul(line, &rest, 16);
   if (errno == ERANGE || (data > memMaxValue16 || (line + 4) > rest)) {
-    puts("\nInvalid memory value");
-    exit(1);
+    if (!cpuState->quiet) puts("\nInvalid memory value");
+    return false;
   }
 
-  printf(", %02lX -> %04X\n", address, data);
-  cpuState->memory16[address] = data;
+  if (echo) printf(", %02lX -> %04X\n", address, data);
+  memWrite16(cpuState, address, data);
+  return true;
 }
 
-void processFile16(cpu *cpuState, char *filePath) {
+// Loads a .xtoy16 image into cpuState, echo prints each line as it is parsed like the interactive modes expect
+bool processFile16(cpu *cpuState, char *filePath, bool echo) {
   FILE *fp;
   char *line = NULL;
+  char *buf = NULL;
+  size_t bufsiz = 0;
   size_t lineLen;
+  bool inComment = false;
+  bool ok = true;
 
   if (!(fp = fopen(filePath, "r"))) {
-    puts("Path is invalid");
-    exit(1);
+    if (!cpuState->quiet) puts("Path is invalid");
+    return false;
   }
 
   initCpuState16(cpuState);
 
-  while ((line = fgetln(fp, &lineLen))) {
-    line[lineLen - 1] = '\0';
-    printf("input: \"%s\"", line);
-    processLine16(line, cpuState);
-  }
-
-
-  if (ferror(fp) || !feof(fp)) {
-    puts("File reading error");
-    exit(1);
+  while (ok && (line = readLine(fp, &lineLen, &buf, &bufsiz))) {
+    line[line[lineLen - 1] == '\n' ? lineLen - 1 : lineLen] = '\0';
+    if (echo) printf("input: \"%s\"", line);
+    ok = processLine16(line, cpuState, &inComment, echo);
   }
 
-  putchar('\n');
-}
-
-int main(int argc, char **argv) {
-  cpu cpuState;
-
-  if (argc != 2) {
-    puts("No path given");
-    return 1;
+  if (ok && (ferror(fp) || !feof(fp))) {
+    if (!cpuState->quiet) puts("File reading error");
+    ok = false;
   }
 
-  processFile16(&cpuState, argv[1]);
-
-  printCpuState(&cpuState);
-  putchar('\n');
-
-  runCpu16(&cpuState);
-
-  return 0;
+  free(buf);
+  fclose(fp);
+  if (ok) internPages(cpuState);
+  if (ok && echo) putchar('\n');
+  return ok;
 }
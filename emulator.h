@@ -0,0 +1,286 @@
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include <inttypes.h> // UINT8_MAX, uint8_t, UINT16_MAX, uint16_t, uint32_t, uint64_t
+#include <stdatomic.h> // atomic_uint
+#include <stdbool.h>  // bool
+#include <stdio.h>    // FILE, size_t
+
+#define REG_COUNT   (uint8_t)16
+#define MEM_SIZE_16 (uint32_t)(UINT8_MAX + 1)
+#define MEM_SIZE_32 (uint32_t)(UINT16_MAX + 1)
+#define ADDR_MASK_16 (uint16_t)(MEM_SIZE_16 - 1)
+
+// Memory is split into pages the size of the whole 16 bit address space
+#define PAGE_WORDS_32 (uint32_t)(MEM_SIZE_16 / 2)
+#define PAGE_COUNT    (uint32_t)(MEM_SIZE_32 / PAGE_WORDS_32)
+
+extern uint16_t stdInOutAddr16;
+extern uint16_t stdInOutAddr32;
+
+// Why a run returned without the cpu halting
+typedef enum {
+  STOP_NONE,
+  STOP_CYCLE_LIMIT,   // cycles reached cycleLimit
+  STOP_NO_INPUT,      // A read of the I/O port had no input, pc is left on that instruction
+  STOP_BREAK,         // Something in breaks was hit, see breaks->hit
+  STOP_HISTORY_START, // Running backwards reached the oldest cycle in the history
+  STOP_OUT_OF_MEMORY  // A page to write to couldn't be allocated, the write was lost and the run ended after it
+} stopReason;
+
+// Backend for the memory mapped stdin/stdout word, a NULL io in cpu means the console. wide is set for 32 bit words.
+typedef struct ioPort {
+  // Returns false if there is no input left
+  bool (*read)(struct ioPort *port, uint32_t *word, bool wide);
+  void (*write)(struct ioPort *port, uint32_t word, bool wide);
+  // Flushes and frees the port, NULL for ports that don't need it
+  void (*close)(struct ioPort *port);
+} ioPort;
+
+// Spills traceRecords to a file from its own thread, see trace.c
+typedef struct traceWriter traceWriter;
+
+// A subroutine as reached through one particular chain of calls
+typedef struct profileNode {
+  uint8_t            entry;
+  uint64_t           cycles; // Spent in the subroutine itself rather than the ones it calls
+  struct profileNode *parent, *child, *sibling;
+} profileNode;
+
+// Counts gathered by --profile over the 16 bit address space, see profile.c
+typedef struct {
+  uint64_t    hits[MEM_SIZE_16];
+  uint64_t    branches[MEM_SIZE_16], taken[MEM_SIZE_16];
+  uint64_t    reads[MEM_SIZE_16], writes[MEM_SIZE_16];
+  uint64_t    opcodes[16];
+  // Call tree built from jsr and jmp, node is the subroutine the cpu is in now
+  profileNode *root, *node;
+  uint32_t    depth;
+} cpuProfile;
+
+// Undo log and checkpoints for running backwards, see history.c
+typedef struct cpuHistory cpuHistory;
+
+// Words of one bit per address in cpuBreaks' bitmaps
+#define BREAK_WORDS      (uint32_t)(MEM_SIZE_32 / 64)
+#define BREAK_CONDITIONS (uint8_t)16
+#define BREAK_BIT(bits, addr) ((bits)[(addr) >> 6] >> ((addr) & 63) & 1)
+
+// What stopped a run with STOP_BREAK
+typedef enum {
+  BREAK_NONE,
+  BREAK_CODE,    // pc reached a breakpoint, the instruction there hasn't run yet
+  BREAK_READ,    // The instruction just run read a watched address
+  BREAK_WRITE,   // or wrote to one
+  BREAK_REGISTER // or left a register meeting one of the conditions
+} breakKind;
+
+typedef enum {
+  COND_EQ,
+  COND_NE,
+  COND_LT,
+  COND_GT
+} conditionOp;
+
+typedef struct {
+  uint8_t     reg;
+  conditionOp op;
+  uint32_t    value;
+} regCondition;
+
+// Breakpoints and watchpoints by address and conditions on registers, see debug.c. Addresses are bitmaps and the
+// registers with conditions a mask so each check is a single bit test.
+typedef struct {
+  uint64_t     code[BREAK_WORDS];
+  uint64_t     reads[BREAK_WORDS], writes[BREAK_WORDS];
+  uint16_t     regMask;
+  uint8_t      conditionCount;
+  regCondition conditions[BREAK_CONDITIONS];
+  // Set by whoever resumes the cpu so a run starting on a breakpoint runs it rather than stopping again
+  bool         resume;
+  breakKind    hit;
+  uint16_t     hitAddr; // Or the index of the condition for BREAK_REGISTER
+} cpuBreaks;
+
+// Memory past page 0, shared copy on write between forked cpus. Interned pages are also shared between every cpu
+// that loaded the same words and stay read only for as long as they're interned.
+typedef struct memPage {
+  atomic_uint    refs;
+  bool           interned;
+  uint32_t       hash;
+  struct memPage *next;
+  uint32_t       words[PAGE_WORDS_32];
+} memPage;
+
+typedef struct {
+  // Per instance settings, kept across initCpuState. quiet stops the loaders printing why they rejected an image.
+  bool       step, debug, quiet;
+  ioPort     *io;
+  uint64_t   cycleLimit;
+  // Only the reference interpreter records cycles
+  traceWriter *trace;
+  // Counted by the reference interpreter and runCpu16Profiled
+  cpuProfile  *profile;
+  // Checked by the reference interpreter and runCpu16Debug
+  cpuBreaks   *breaks;
+  // Only the reference interpreter records cycles for running backwards
+  cpuHistory  *history;
+
+  bool       halted;
+  bool       in32Bit;
+  stopReason stop;
+  uint64_t   cycles;
+  
+  bool     pcModified;
+  uint16_t oldPC, pc;
+  
+  bool     readReg1, readReg2, wroteReg;
+  uint8_t  lastReadReg1, lastReadReg2, lastWriteReg;
+  uint32_t registers[REG_COUNT];
+  
+  bool     readMem, wroteMem;
+  uint16_t lastReadAddr, lastWriteAddr;
+  // Page 0, all of memory in 16 bit mode. 32 bit mode goes through memRead32/memWord32 for the rest.
+  union {
+    uint16_t memory16[MEM_SIZE_16];
+    uint32_t memory32[PAGE_WORDS_32];
+  };
+  // Grows to cover the highest page written, pages past pageCount and NULL pages read as zero
+  memPage  **pages;
+  uint16_t pageCount;
+} cpu;
+
+void initCpuConfig(cpu *cpuState);
+void initCpuState16(cpu *cpuState);
+bool processLine16(char *line, cpu *cpuState, bool *inComment, bool echo);
+bool processFile16(cpu *cpuState, char *filePath, bool echo);
+// fgetln with the buffer kept by the caller in *bufp and *bufsizp, NULL at the end of the file or if it can't grow.
+// The line isn't NUL terminated but there's room after it for one, it ends with its newline if it had one.
+char *readLine(FILE *fp, size_t *len, char **bufp, size_t *bufsizp);
+
+bool readConsole(uint32_t *word, bool wide);
+void writeConsole(uint32_t word, bool wide);
+bool handleStdin(cpu *cpuState, uint16_t nextReadAddr);
+void handleStdout(cpu *cpuState, uint16_t lastWriteAddr);
+
+// Every engine runs whichever mode the cpu is in and follows the program across mode switches, the runCpu32 ones
+// return to their caller at a switch back to 16 bit mode instead
+void runCpu32(cpu *cpuState);
+void runCpu16(cpu *cpuState);
+void runCpu16Headless(cpu *cpuState);
+void runCpu16Threaded(cpu *cpuState);
+// Lazily decoded 32 bit code, kept by the caller of runCpu32Threaded between calls and freed once it's done
+typedef struct decodedOp32 decodedOp32;
+void runCpu32Threaded(cpu *cpuState, decodedOp32 **code);
+void runCpu16Profiled(cpu *cpuState);
+void runCpu16Debug(cpu *cpuState);
+
+// memory.c
+uint32_t memRead32(cpu *cpuState, uint32_t addr);
+uint32_t *memWord32(cpu *cpuState, uint32_t addr);
+void memWrite32(cpu *cpuState, uint32_t addr, uint32_t word);
+void memWrite16(cpu *cpuState, uint32_t addr, uint16_t word);
+void memCopy32(cpu *cpuState, uint32_t addr, const void *words, uint32_t count);
+void memCopy16(cpu *cpuState, uint32_t addr, const void *words, uint32_t count);
+void resetCpuMemory(cpu *cpuState);
+void freeCpuMemory(cpu *cpuState);
+void internPages(cpu *cpuState);
+bool forkCpu(cpu *child, cpu *parent);
+
+// image.c
+bool loadImageData(cpu *cpuState, const char *data, size_t size);
+bool loadImage(cpu *cpuState, char *filePath, bool echo);
+
+// print.c
+bool startLiveView(uint32_t fps);
+void flushLiveView(void);
+void printCpuState(cpu *cpuState);
+
+// trace.c
+traceWriter *openTrace(char *path, cpu *cpuState);
+void traceCycle(cpu *cpuState, uint16_t pc, uint32_t inst);
+bool closeTrace(traceWriter *trace);
+
+// profile.c
+cpuProfile *newProfile(void);
+void resetProfile(cpuProfile *profile);
+void freeProfile(cpuProfile *profile);
+void profileCall(cpuProfile *profile, uint8_t target);
+void profileReturn(cpuProfile *profile);
+void profileCycle(cpu *cpuState, uint16_t pc, uint32_t inst);
+void mergeProfile(cpuProfile *into, cpuProfile *from);
+void writeProfileReport(FILE *out, cpuProfile *profile, const uint16_t *memory, const char *name);
+void writeFoldedStacks(FILE *out, cpuProfile *profile, const char *rootName);
+
+// debug.c
+cpuBreaks *newBreaks(void);
+void setBreakpoint(cpuBreaks *breaks, uint16_t addr, bool on);
+void setWatchpoint(cpuBreaks *breaks, uint16_t addr, bool read, bool write, bool on);
+bool parseCondition(const char *text, regCondition *condition);
+bool addCondition(cpuBreaks *breaks, regCondition condition);
+bool removeCondition(cpuBreaks *breaks, regCondition condition);
+bool checkConditions(cpuBreaks *breaks, uint8_t reg, uint32_t value);
+void breakOnRead(cpuBreaks *breaks, uint16_t addr);
+void breakOnWrite(cpuBreaks *breaks, uint16_t addr);
+void describeBreak(cpuBreaks *breaks, char *buf, size_t size);
+
+// history.c
+cpuHistory *newHistory(size_t bytes);
+void freeHistory(cpuHistory *history);
+void resetHistory(cpu *cpuState);
+bool historyReplaying(cpu *cpuState);
+uint64_t historyStart(cpu *cpuState);
+void historyBegin(cpu *cpuState);
+void historyRegister(cpu *cpuState, uint8_t reg);
+void historyRead(cpu *cpuState, uint16_t addr);
+void historyWrite(cpu *cpuState, uint16_t addr);
+bool replayInput(cpu *cpuState, uint32_t *word);
+void historyInput(cpu *cpuState, uint16_t addr, uint32_t word);
+bool historyEnd(cpu *cpuState);
+bool stepBack(cpu *cpuState);
+void runBackwards(cpu *cpuState, uint64_t count);
+bool seekHistory(cpu *cpuState, uint64_t cycle);
+bool findLastWrite(cpu *cpuState, uint16_t addr, uint64_t before, uint64_t *cycle, uint16_t *pc);
+
+// gdb.c
+bool serveGdb(cpu *cpuState, char *address, bool *detached);
+
+// io.c
+ioPort *openStreamIo(int inFd, int outFd, bool binary);
+ioPort *openLogIo(ioPort *inner, int logFd, bool replay);
+void closeIo(ioPort *port);
+
+// batch.c
+int runBatch(char *manifestPath, char *resultsPath, uint32_t threadCount, uint64_t cycleLimit, bool lockstep,
+             char *profilePath, char *foldedPath);
+
+// server.c
+int serveJobs(char *socketPath, uint32_t threadCount, uint64_t cycleLimit);
+
+// sessions.c
+int serveSessions(char *socketPath, uint32_t threadCount, uint64_t cycleLimit);
+
+// multicore.c
+#define MAX_CORES (uint32_t)64
+
+typedef struct {
+  uint32_t coreCount;
+  // Instructions each core runs per turn unless free running
+  uint32_t quantum;
+  bool     freeRunning;
+  // Addresses the race detector takes for synchronisation rather than data, as the core accessing them addresses them
+  uint64_t sync[BREAK_WORDS];
+} coreConfig;
+
+int runCores(cpu *cpuState, coreConfig *config);
+
+// lockstep.c
+void runCpu16Lockstep(cpu **cpus, uint32_t count);
+
+// jit.c
+void runCpu16Jit(cpu *cpuState);
+
+// aot.c
+bool emitAot16(cpu *cpuState, FILE *out, const char *source);
+
+#endif
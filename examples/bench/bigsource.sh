@@ -0,0 +1,33 @@
+#!/bin/sh
+# Writes a large xasm source for timing the front ends, e.g. xasm --frontend direct --bench 20 big.xasm. It only
+# has to parse, at COUNT blocks it is far past what fits in memory. With assemble it writes COUNT labels and
+# comments around as many forward branches as fit in memory instead, for timing the assembler end to end.
+# Usage: bigsource.sh [COUNT] [assemble] > big.xasm
+count=${1:-100000}
+if [ "$2" = assemble ]; then
+  awk -v count="$count" 'BEGIN {
+    print "; Generated by bigsource.sh"
+    for (i = 0; i < count; ++i) {
+      printf "block%d:\n", i
+      print "; Comments are kept out of the statements"
+      # The branches and the hlt fill memory from 10 to FE, the most the assembler takes
+      if (i < 238) printf "    brp r1 block%d\n", count - 1 - i
+    }
+    print "    hlt"
+  }'
+  exit
+fi
+awk -v count="$count" 'BEGIN {
+  print "; Generated by bigsource.sh"
+  for (i = 0; i < count; ++i) {
+    printf "block%d:\n", i
+    print "    lod r1 20"
+    print "    lda r2,01"
+    print "  sub r1, r1,\tr2"
+    printf "    brp r1 block%d\n", i
+    print "    add r3 r1 r2"
+    print ".WORD 0400"
+    print "; Comments are kept out of the statements"
+    print "    jmp rF"
+  }
+}'
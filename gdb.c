@@ -0,0 +1,592 @@
+#include <errno.h>      // EINTR, errno
+#include <inttypes.h>   // PRIu64, PRIX32, uint8_t, uint16_t, uint32_t, uint64_t
+#include <netinet/in.h> // htonl, htons, INADDR_LOOPBACK, sockaddr_in
+#include <poll.h>       // poll, pollfd, POLLIN
+#include <stdbool.h>    // bool, false, true
+#include <stdio.h>      // fprintf, puts, snprintf, stderr
+#include <stdlib.h>     // calloc, free, strtoul
+#include <string.h>     // memcpy, strcmp, strcpy, strlen, strncmp
+#include <sys/socket.h> // accept, AF_INET, AF_UNIX, bind, listen, MSG_NOSIGNAL, send, setsockopt, socket, SOCK_STREAM, SOL_SOCKET, SO_REUSEADDR
+#include <sys/un.h>     // sockaddr_un
+#include <unistd.h>     // close, read, ssize_t, unlink
+
+#include "emulator.h"
+
+// GDB remote serial protocol stub. Registers are r0-rF then pc, each 32 bits. Memory is byte addressed with each
+// word little endian, 2 bytes to a word in 16 bit mode and 4 in 32 bit mode, so word addresses are byte addresses
+// halved or quartered. Register conditions are set with "monitor break-if r3==0010" and "monitor delete-if ...".
+// With --history the cpu can also be run backwards with reverse-step and reverse-continue, and "monitor last-write
+// ADDR" says which cycle last stored to a word address.
+
+// Largest packet taken or sent, not counting the framing
+#define GDB_PACKET_SIZE (size_t)4096
+// Cycles run between checks for the debugger interrupting a continue
+#define GDB_SLICE (uint64_t)1048576
+
+typedef struct {
+  int     fd;
+  bool    noAck;
+  size_t  inPos, inLen;
+  uint8_t inBuf[GDB_PACKET_SIZE];
+  char    packet[GDB_PACKET_SIZE + 1];
+  char    reply[GDB_PACKET_SIZE + 1];
+} gdbConnection;
+
+static const char hexChars[] = "0123456789abcdef";
+
+static const char targetXml[] =
+  "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\"><target version=\"1.0\">"
+  "<feature name=\"org.xtoy.toy\">"
+  "<reg name=\"r0\" bitsize=\"32\" regnum=\"0\"/><reg name=\"r1\" bitsize=\"32\"/><reg name=\"r2\" bitsize=\"32\"/>"
+  "<reg name=\"r3\" bitsize=\"32\"/><reg name=\"r4\" bitsize=\"32\"/><reg name=\"r5\" bitsize=\"32\"/>"
+  "<reg name=\"r6\" bitsize=\"32\"/><reg name=\"r7\" bitsize=\"32\"/><reg name=\"r8\" bitsize=\"32\"/>"
+  "<reg name=\"r9\" bitsize=\"32\"/><reg name=\"rA\" bitsize=\"32\"/><reg name=\"rB\" bitsize=\"32\"/>"
+  "<reg name=\"rC\" bitsize=\"32\"/><reg name=\"rD\" bitsize=\"32\"/><reg name=\"rE\" bitsize=\"32\"/>"
+  "<reg name=\"rF\" bitsize=\"32\"/><reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
+  "</feature></target>";
+
+
+static bool sendAll(int fd, const char *buf, size_t len) {
+  while (len) {
+    ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return false;
+    buf += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+static int nextByte(gdbConnection *conn) {
+  if (conn->inPos == conn->inLen) {
+    ssize_t got;
+    while ((got = read(conn->fd, conn->inBuf, GDB_PACKET_SIZE)) < 0 && errno == EINTR);
+    if (got <= 0) return -1;
+    conn->inPos = 0;
+    conn->inLen = got;
+  }
+  return conn->inBuf[conn->inPos++];
+}
+
+static int hexDigit(int c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+// Waits for the next packet and acknowledges it, returns false once the debugger has gone
+static bool receivePacket(gdbConnection *conn) {
+  while (true) {
+    int c;
+    while ((c = nextByte(conn)) >= 0 && c != '$');
+    if (c < 0) return false;
+
+    size_t len = 0;
+    uint8_t sum = 0;
+    while ((c = nextByte(conn)) >= 0 && c != '#') {
+      sum += c;
+      if (len < GDB_PACKET_SIZE) conn->packet[len] = c;
+      ++len;
+    }
+    int high = nextByte(conn), low = nextByte(conn);
+    if (c < 0 || high < 0 || low < 0) return false;
+
+    bool ok = len <= GDB_PACKET_SIZE && hexDigit(high) >= 0 && hexDigit(low) >= 0 &&
+              (hexDigit(high) << 4 | hexDigit(low)) == sum;
+    if (!conn->noAck && !sendAll(conn->fd, ok ? "+" : "-", 1)) return false;
+    if (ok) {
+      conn->packet[len] = '\0';
+      return true;
+    }
+  }
+}
+
+static bool sendPacket(gdbConnection *conn, const char *data) {
+  char frame[GDB_PACKET_SIZE + 4];
+  size_t len = strlen(data);
+  uint8_t sum = 0;
+  frame[0] = '$';
+  for (size_t i = 0; i < len; ++i) sum += frame[i + 1] = data[i];
+  frame[len + 1] = '#';
+  frame[len + 2] = hexChars[sum >> 4];
+  frame[len + 3] = hexChars[sum & 0xF];
+
+  while (true) {
+    if (!sendAll(conn->fd, frame, len + 4)) return false;
+    if (conn->noAck) return true;
+    int c;
+    while ((c = nextByte(conn)) >= 0 && c != '+' && c != '-');
+    if (c != '-') return c == '+';
+  }
+}
+
+static char *putHex(char *out, uint32_t value, uint8_t bytes) {
+  for (uint8_t i = 0; i < bytes; ++i, value >>= 8) {
+    *out++ = hexChars[value >> 4 & 0xF];
+    *out++ = hexChars[value & 0xF];
+  }
+  *out = '\0';
+  return out;
+}
+
+// Little endian like putHex, returns false if there aren't bytes * 2 hex digits
+static bool getHex(const char **in, uint32_t *value, uint8_t bytes) {
+  *value = 0;
+  for (uint8_t i = 0; i < bytes; ++i) {
+    int high = hexDigit((*in)[0]), low = high < 0 ? -1 : hexDigit((*in)[1]);
+    if (low < 0) return false;
+    *value |= (uint32_t)(high << 4 | low) << (i * 8);
+    *in += 2;
+  }
+  return true;
+}
+
+static uint8_t wordBytes(cpu *cpuState) {
+  return cpuState->in32Bit ? 4 : 2;
+}
+
+static uint32_t wordCount(cpu *cpuState) {
+  return cpuState->in32Bit ? MEM_SIZE_32 : MEM_SIZE_16;
+}
+
+static uint32_t readWord(cpu *cpuState, uint32_t addr) {
+  return cpuState->in32Bit ? memRead32(cpuState, addr) : cpuState->memory16[addr];
+}
+
+static void writeWord(cpu *cpuState, uint32_t addr, uint32_t word) {
+  if (cpuState->in32Bit) {
+    memWrite32(cpuState, addr, word);
+  } else {
+    cpuState->memory16[addr] = word;
+  }
+}
+
+static bool readRegister(cpu *cpuState, uint32_t reg, uint32_t *value) {
+  if (reg > REG_COUNT) return false;
+  *value = reg == REG_COUNT ? cpuState->pc : cpuState->registers[reg];
+  return true;
+}
+
+static bool writeRegister(cpu *cpuState, uint32_t reg, uint32_t value) {
+  if (reg > REG_COUNT) return false;
+  if (reg == REG_COUNT) {
+    cpuState->pc = cpuState->oldPC = cpuState->in32Bit ? value : value & ADDR_MASK_16;
+  } else if (reg) {
+    cpuState->registers[reg] = value;
+  }
+  return true;
+}
+
+// Parses the "ADDR,LENGTH" at the start of args into a range of words, returns false if any of it is outside memory
+static bool parseRange(cpu *cpuState, const char *args, const char **rest, uint32_t *addr, uint32_t *len) {
+  char *end;
+  *addr = strtoul(args, &end, 16);
+  if (*end != ',') return false;
+  *len = strtoul(end + 1, &end, 16);
+  *rest = end;
+  return *addr / wordBytes(cpuState) < wordCount(cpuState) &&
+         *len <= wordCount(cpuState) * wordBytes(cpuState) - *addr;
+}
+
+static void readMemoryPacket(cpu *cpuState, const char *args, char *reply) {
+  uint32_t addr, len;
+  const char *rest;
+  if (!parseRange(cpuState, args, &rest, &addr, &len)) {
+    strcpy(reply, "E01");
+    return;
+  }
+  if (len > GDB_PACKET_SIZE / 2) len = GDB_PACKET_SIZE / 2;
+
+  uint8_t bytes = wordBytes(cpuState);
+  for (uint32_t i = addr; i < addr + len; ++i) {
+    reply = putHex(reply, readWord(cpuState, i / bytes) >> (i % bytes * 8), 1);
+  }
+}
+
+static void writeMemoryPacket(cpu *cpuState, const char *args, char *reply) {
+  uint32_t addr, len;
+  const char *data;
+  if (!parseRange(cpuState, args, &data, &addr, &len) || *data++ != ':' || strlen(data) != len * 2) {
+    strcpy(reply, "E01");
+    return;
+  }
+
+  uint8_t bytes = wordBytes(cpuState);
+  for (uint32_t i = addr; i < addr + len; ++i) {
+    uint32_t byte;
+    getHex(&data, &byte, 1);
+    uint32_t shift = i % bytes * 8;
+    writeWord(cpuState, i / bytes, (readWord(cpuState, i / bytes) & ~(0xFFu << shift)) | byte << shift);
+  }
+  // Words on a page that couldn't be allocated were lost
+  if (cpuState->stop == STOP_OUT_OF_MEMORY) {
+    cpuState->stop = STOP_NONE;
+    strcpy(reply, "E01");
+    return;
+  }
+  strcpy(reply, "OK");
+}
+
+// Z and z, the length of a watchpoint is in bytes and every word it touches is watched
+static void breakpointPacket(cpu *cpuState, const char *packet, char *reply) {
+  uint32_t type = packet[1] - '0', addr, len;
+  const char *rest;
+  if (packet[2] != ',' || type > 4 || !parseRange(cpuState, packet + 3, &rest, &addr, &len)) {
+    strcpy(reply, type > 4 ? "" : "E01");
+    return;
+  }
+
+  cpuBreaks *breaks = cpuState->breaks;
+  bool on = packet[0] == 'Z';
+  uint8_t bytes = wordBytes(cpuState);
+  if (type <= 1) {
+    setBreakpoint(breaks, addr / bytes, on);
+  } else {
+    uint32_t last = len ? (addr + len - 1) / bytes : addr / bytes;
+    for (uint32_t word = addr / bytes; word <= last; ++word) {
+      setWatchpoint(breaks, word, type != 2, type != 3, on);
+    }
+  }
+  strcpy(reply, "OK");
+}
+
+// "monitor" commands, the reply is the hex of whatever they print
+static void monitorPacket(cpu *cpuState, const char *hex, char *reply) {
+  char command[GDB_PACKET_SIZE / 2 + 1];
+  size_t len = 0;
+  uint32_t c;
+  while (len < sizeof(command) - 1 && getHex(&hex, &c, 1)) command[len++] = c;
+  command[len] = '\0';
+
+  char output[128];
+  regCondition condition;
+  if (strncmp(command, "break-if ", 9) == 0 && parseCondition(command + 9, &condition)) {
+    snprintf(output, sizeof(output), addCondition(cpuState->breaks, condition) ? "Condition set\n" :
+      "Too many conditions\n");
+  } else if (strncmp(command, "delete-if ", 10) == 0 && parseCondition(command + 10, &condition)) {
+    snprintf(output, sizeof(output), removeCondition(cpuState->breaks, condition) ? "Condition deleted\n" :
+      "No such condition\n");
+  } else if (strcmp(command, "cycles") == 0) {
+    snprintf(output, sizeof(output), "%" PRIu64 " cycles\n", cpuState->cycles);
+  } else if (strncmp(command, "last-write ", 11) == 0) {
+    uint16_t addr = strtoul(command + 11, NULL, 16);
+    uint64_t cycle;
+    uint16_t pc;
+    if (!cpuState->history) {
+      snprintf(output, sizeof(output), "No history, start with --history\n");
+    } else if (findLastWrite(cpuState, addr, cpuState->cycles, &cycle, &pc)) {
+      snprintf(output, sizeof(output), "M[%02" PRIX16 "] last written at cycle %" PRIu64 " by pc %02" PRIX16 "\n",
+        addr, cycle, pc);
+    } else {
+      snprintf(output, sizeof(output), "M[%02" PRIX16 "] not written since cycle %" PRIu64 "\n", addr,
+        historyStart(cpuState));
+    }
+  } else {
+    snprintf(output, sizeof(output), "Commands are break-if rN==HEX, delete-if rN==HEX, cycles and last-write ADDR, "
+      "conditions can also use != < and >\n");
+  }
+
+  for (char *out = output; *out; ++out) reply = putHex(reply, *out, 1);
+}
+
+static void featuresPacket(const char *args, char *reply) {
+  char *end;
+  if (strncmp(args, "target.xml:", 11)) {
+    strcpy(reply, "E00");
+    return;
+  }
+  size_t offset = strtoul(args + 11, &end, 16);
+  size_t len = *end == ',' ? strtoul(end + 1, NULL, 16) : 0;
+  size_t size = sizeof(targetXml) - 1;
+  if (offset > size) offset = size;
+  if (len > size - offset) len = size - offset;
+  if (len > GDB_PACKET_SIZE - 1) len = GDB_PACKET_SIZE - 1;
+
+  reply[0] = offset + len < size ? 'm' : 'l';
+  memcpy(reply + 1, targetXml + offset, len);
+  reply[len + 1] = '\0';
+}
+
+// Looks for the debugger's interrupt byte without waiting, returns false if it has gone
+static bool checkInterrupt(gdbConnection *conn, bool *interrupted) {
+  if (conn->inPos == conn->inLen) {
+    struct pollfd fds = {conn->fd, POLLIN, 0};
+    if (poll(&fds, 1, 0) <= 0) return true;
+  }
+  int c = nextByte(conn);
+  if (c < 0) return false;
+  *interrupted = c == 0x03;
+  return true;
+}
+
+// Continues or steps until something stops the cpu, a continue runs in slices so the debugger can interrupt it
+static bool resumeCpu(gdbConnection *conn, cpu *cpuState, bool step, bool *interrupted) {
+  uint64_t cycleLimit = cpuState->cycleLimit;
+  *interrupted = false;
+  cpuState->stop = STOP_NONE;
+  cpuState->breaks->resume = true;
+
+  while (!cpuState->halted && cpuState->cycles < cycleLimit) {
+    uint64_t slice = step ? 1 : GDB_SLICE;
+    cpuState->cycleLimit = cycleLimit - cpuState->cycles > slice ? cpuState->cycles + slice : cycleLimit;
+    // Only the reference interpreter traces, profiles and records history
+    if (cpuState->trace || cpuState->profile || cpuState->history) {
+      runCpu16(cpuState);
+    } else {
+      runCpu16Debug(cpuState);
+    }
+    if (cpuState->stop != STOP_CYCLE_LIMIT || step) break;
+
+    cpuState->stop = STOP_NONE;
+    if (!checkInterrupt(conn, interrupted)) {
+      cpuState->cycleLimit = cycleLimit;
+      return false;
+    }
+    if (*interrupted) break;
+  }
+
+  cpuState->cycleLimit = cycleLimit;
+  return true;
+}
+
+// The same for running backwards through the history
+static bool reverseCpu(gdbConnection *conn, cpu *cpuState, bool step, bool *interrupted) {
+  *interrupted = false;
+  do {
+    runBackwards(cpuState, step ? 1 : GDB_SLICE);
+    if (cpuState->stop != STOP_CYCLE_LIMIT || step) break;
+    if (!checkInterrupt(conn, interrupted)) return false;
+  } while (!*interrupted);
+  return true;
+}
+
+// A halt with history isn't the end, the debugger can still go back from it
+static void stopReply(cpu *cpuState, bool interrupted, char *reply) {
+  cpuBreaks *breaks = cpuState->breaks;
+  if (cpuState->halted && !cpuState->history) {
+    strcpy(reply, "W00");
+  } else if (interrupted) {
+    strcpy(reply, "T02");
+  } else if (cpuState->stop == STOP_HISTORY_START) {
+    strcpy(reply, "T05replaylog:begin;");
+  } else if (cpuState->stop == STOP_BREAK && breaks->hit == BREAK_CODE) {
+    strcpy(reply, "T05swbreak:;");
+  } else if (cpuState->stop == STOP_BREAK && (breaks->hit == BREAK_READ || breaks->hit == BREAK_WRITE)) {
+    uint16_t addr = breaks->hitAddr;
+    const char *kind = BREAK_BIT(breaks->reads, addr) && BREAK_BIT(breaks->writes, addr) ? "awatch" :
+                       breaks->hit == BREAK_READ ? "rwatch" : "watch";
+    snprintf(reply, GDB_PACKET_SIZE, "T05%s:%" PRIX32 ";", kind, (uint32_t)addr * wordBytes(cpuState));
+  } else {
+    strcpy(reply, "T05");
+  }
+}
+
+// Says why the cpu stopped when the stop reply can't, as console output
+static bool sendStopNote(gdbConnection *conn, cpu *cpuState) {
+  char note[128];
+  if (cpuState->stop == STOP_BREAK && cpuState->breaks->hit == BREAK_REGISTER) {
+    describeBreak(cpuState->breaks, note, sizeof(note));
+  } else if (cpuState->stop == STOP_NO_INPUT) {
+    strcpy(note, "No input left");
+  } else if (cpuState->halted && cpuState->history) {
+    strcpy(note, "Cpu has halted");
+  } else if (cpuState->stop == STOP_CYCLE_LIMIT && cpuState->cycles >= cpuState->cycleLimit) {
+    strcpy(note, "Stopped at the cycle limit");
+  } else {
+    return true;
+  }
+
+  char *out = conn->reply;
+  *out++ = 'O';
+  for (char *c = note; *c; ++c) out = putHex(out, *c, 1);
+  putHex(out, '\n', 1);
+  return sendPacket(conn, conn->reply);
+}
+
+static int listenOn(char *address, bool *isUnix) {
+  char *end;
+  unsigned long port = strtoul(address, &end, 10);
+  int fd;
+  *isUnix = !*address || *end || port > UINT16_MAX;
+
+  if (*isUnix) {
+    struct sockaddr_un addr = {0};
+    if (strlen(address) >= sizeof(addr.sun_path)) return -1;
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, address, strlen(address));
+    unlink(address);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 1)) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  // Only local debuggers, there's no authentication
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int reuse = 1;
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 1)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Handles one packet, returns false once the session is over
+static bool handlePacket(gdbConnection *conn, cpu *cpuState, bool *killed) {
+  const char *packet = conn->packet;
+  char *reply = conn->reply;
+  uint32_t value;
+  reply[0] = '\0';
+
+  switch (packet[0]) {
+    case '?':
+      stopReply(cpuState, false, reply);
+      break;
+    case 'g':
+      for (uint32_t i = 0; i <= REG_COUNT; ++i) {
+        readRegister(cpuState, i, &value);
+        reply = putHex(reply, value, 4);
+      }
+      break;
+    case 'G': {
+      const char *in = packet + 1;
+      for (uint32_t i = 0; i <= REG_COUNT && getHex(&in, &value, 4); ++i) writeRegister(cpuState, i, value);
+      if (cpuState->history) resetHistory(cpuState);
+      strcpy(reply, "OK");
+      break;
+    }
+    case 'p':
+      if (readRegister(cpuState, strtoul(packet + 1, NULL, 16), &value)) {
+        putHex(reply, value, 4);
+      } else {
+        strcpy(reply, "E01");
+      }
+      break;
+    case 'P': {
+      char *end;
+      uint32_t reg = strtoul(packet + 1, &end, 16);
+      const char *in = end + 1;
+      bool ok = *end == '=' && getHex(&in, &value, 4) && writeRegister(cpuState, reg, value);
+      if (ok && cpuState->history) resetHistory(cpuState);
+      strcpy(reply, ok ? "OK" : "E01");
+      break;
+    }
+    case 'm':
+      readMemoryPacket(cpuState, packet + 1, reply);
+      break;
+    case 'M':
+      writeMemoryPacket(cpuState, packet + 1, reply);
+      // Cycles before the change can't be undone or replayed onto it
+      if (cpuState->history) resetHistory(cpuState);
+      break;
+    case 'c':
+    case 's': {
+      bool interrupted;
+      if (packet[1]) writeRegister(cpuState, REG_COUNT, strtoul(packet + 1, NULL, 16));
+      if (!resumeCpu(conn, cpuState, packet[0] == 's', &interrupted) || !sendStopNote(conn, cpuState)) return false;
+      stopReply(cpuState, interrupted, reply);
+      break;
+    }
+    case 'b': {
+      bool interrupted;
+      if (!cpuState->history || (packet[1] != 's' && packet[1] != 'c')) {
+        strcpy(reply, "E01");
+        break;
+      }
+      if (!reverseCpu(conn, cpuState, packet[1] == 's', &interrupted) || !sendStopNote(conn, cpuState)) return false;
+      stopReply(cpuState, interrupted, reply);
+      break;
+    }
+    case 'Z':
+    case 'z':
+      breakpointPacket(cpuState, packet, reply);
+      break;
+    case 'H':
+      strcpy(reply, "OK");
+      break;
+    case 'D':
+      sendPacket(conn, "OK");
+      return false;
+    case 'k':
+      *killed = true;
+      return false;
+    case 'q':
+      if (strncmp(packet, "qSupported", 10) == 0) {
+        snprintf(reply, GDB_PACKET_SIZE, "PacketSize=%zX;QStartNoAckMode+;swbreak+;qXfer:features:read+%s",
+          GDB_PACKET_SIZE, cpuState->history ? ";ReverseStep+;ReverseContinue+" : "");
+      } else if (strcmp(packet, "qAttached") == 0) {
+        strcpy(reply, "1");
+      } else if (strcmp(packet, "qC") == 0) {
+        strcpy(reply, "QC1");
+      } else if (strcmp(packet, "qfThreadInfo") == 0) {
+        strcpy(reply, "m1");
+      } else if (strcmp(packet, "qsThreadInfo") == 0) {
+        strcpy(reply, "l");
+      } else if (strncmp(packet, "qRcmd,", 6) == 0) {
+        monitorPacket(cpuState, packet + 6, reply);
+      } else if (strncmp(packet, "qXfer:features:read:", 20) == 0) {
+        featuresPacket(packet + 20, reply);
+      }
+      break;
+    case 'Q':
+      if (strcmp(packet, "QStartNoAckMode") == 0) {
+        conn->noAck = sendPacket(conn, "OK");
+        return conn->noAck;
+      }
+      break;
+  }
+
+  return sendPacket(conn, conn->reply);
+}
+
+// Serves the debugger on address, a TCP port on localhost or otherwise the path of a UNIX socket, until it detaches
+// or kills the cpu. A debugger going away without either counts as detaching, the cpu is left wherever it stopped.
+bool serveGdb(cpu *cpuState, char *address, bool *detached) {
+  bool isUnix;
+  int listener = listenOn(address, &isUnix);
+  if (listener < 0) {
+    puts("Could not listen for GDB");
+    return false;
+  }
+
+  fprintf(stderr, "Waiting for GDB on %s\n", address);
+  int fd;
+  while ((fd = accept(listener, NULL, NULL)) < 0 && errno == EINTR);
+  close(listener);
+  if (isUnix) unlink(address);
+  if (fd < 0) {
+    puts("Could not accept GDB");
+    return false;
+  }
+
+  gdbConnection *conn = calloc(1, sizeof(gdbConnection));
+  if (!conn) {
+    puts("Out of memory");
+    close(fd);
+    return false;
+  }
+  conn->fd = fd;
+  if (!cpuState->breaks && !(cpuState->breaks = newBreaks())) {
+    puts("Out of memory");
+    close(fd);
+    free(conn);
+    return false;
+  }
+
+  bool killed = false;
+  while (receivePacket(conn) && handlePacket(conn, cpuState, &killed));
+  *detached = !killed;
+
+  cpuState->stop = STOP_NONE;
+  close(fd);
+  free(conn);
+  return true;
+}
@@ -0,0 +1,410 @@
+#include <stdbool.h> // bool, false, true
+#include <stdint.h>  // int32_t, uint8_t, uint16_t, uint32_t, UINT32_MAX, uint64_t
+#include <stdlib.h>  // calloc, free, malloc
+
+#include "emulator.h"
+
+// Every cycle the reference interpreter runs leaves a record of what it overwrote, so the cpu can be stepped
+// backwards by putting the old values back. Records live in a ring sized from the memory given to the history, the
+// oldest are dropped as new ones arrive. Full checkpoints are forked off every so often so any cycle still in the
+// ring can be reached by running forwards from one of them instead of undoing everything after it.
+// Running forwards over cycles that are already recorded replays them, port reads take the recorded input and port
+// writes are left out as they already happened.
+
+// Checkpoint slots, checkpointInterval spreads them over twice the ring so the oldest cycles always have one
+#define HISTORY_CHECKPOINTS (uint32_t)32
+// Quarters of the memory given to the history that go to the ring, the rest is for pages held by checkpoints
+#define HISTORY_RING_QUARTERS (size_t)3
+
+enum {
+  HISTORY_READ   = 1 << 0, // memAddr was read
+  HISTORY_WRITE  = 1 << 1, // memAddr was stored to, memOld is what it held
+  HISTORY_INPUT  = 1 << 2, // memAddr was the port and took input, memNew is the word read
+  HISTORY_MODE   = 1 << 3  // The cycle switched between 16 and 32 bit mode
+};
+
+// 32 bytes a cycle. Stores also link to the store to the same address before them, see findLastWrite.
+typedef struct {
+  uint32_t regOld;
+  uint32_t memOld, memNew;
+  // Cycles back to the previous store to memAddr and to one further back for searching, 0 for none
+  uint32_t prevDelta, jumpDelta;
+  uint32_t depth; // Stores to memAddr before this one
+  uint16_t pc;
+  uint16_t memAddr;
+  uint8_t  reg;   // 0 if no register was written
+  uint8_t  flags;
+} historyRecord;
+
+struct cpuHistory {
+  historyRecord *records;
+  uint64_t      capacity;
+  // Recorded cycles are [oldest, end), anything the cpu runs before end is a replay
+  uint64_t      oldest, end;
+  historyRecord current;
+  bool          inCycle;
+  bool          wasIn32Bit;
+  // One more than the cycle of the latest store to each address as of end, 0 for none
+  uint64_t      lastWrite[MEM_SIZE_32];
+  cpu           checkpoints[HISTORY_CHECKPOINTS];
+  uint64_t      checkpointCycles[HISTORY_CHECKPOINTS];
+  uint32_t      checkpointCount, nextCheckpoint;
+  uint64_t      checkpointInterval;
+  // The cycle the next checkpoint is taken at, kept apart from the checkpoints as they can all have been dropped
+  uint64_t      checkpointDue;
+  // What the pages the checkpoints hold may take, the oldest checkpoints are dropped to stay under it
+  size_t        pageBytes;
+};
+
+
+// bytes covers everything including the checkpoints and every page they hold, counting pages they still share with
+// the cpu since it may write to them at any time. Returns NULL if that isn't enough for any history or it can't be
+// allocated.
+cpuHistory *newHistory(size_t bytes) {
+  if (bytes <= sizeof(cpuHistory) || (bytes - sizeof(cpuHistory)) / 4 * HISTORY_RING_QUARTERS
+      < 1024 * sizeof(historyRecord)) {
+    return NULL;
+  }
+  cpuHistory *history = calloc(1, sizeof(cpuHistory));
+  if (!history) return NULL;
+
+  history->capacity = (bytes - sizeof(cpuHistory)) / 4 * HISTORY_RING_QUARTERS / sizeof(historyRecord);
+  history->pageBytes = bytes - sizeof(cpuHistory) - history->capacity * sizeof(historyRecord);
+  if (!(history->records = malloc(history->capacity * sizeof(historyRecord)))) {
+    free(history);
+    return NULL;
+  }
+  history->checkpointInterval = history->capacity * 2 / HISTORY_CHECKPOINTS;
+  return history;
+}
+
+// Checkpoints are taken round the slots, the nth oldest is in this one
+static uint32_t checkpointSlot(cpuHistory *history, uint32_t n) {
+  return (history->nextCheckpoint + HISTORY_CHECKPOINTS - history->checkpointCount + n) % HISTORY_CHECKPOINTS;
+}
+
+static void dropCheckpoints(cpuHistory *history) {
+  for (uint32_t i = 0; i < history->checkpointCount; ++i) {
+    freeCpuMemory(history->checkpoints + checkpointSlot(history, i));
+  }
+  history->checkpointCount = history->nextCheckpoint = 0;
+}
+
+void freeHistory(cpuHistory *history) {
+  if (!history) return;
+  dropCheckpoints(history);
+  free(history->records);
+  free(history);
+}
+
+// Forgets everything before the cpu's current cycle, needed whenever its state is changed from outside a cycle
+void resetHistory(cpu *cpuState) {
+  cpuHistory *history = cpuState->history;
+  history->oldest = history->end = history->checkpointDue = cpuState->cycles;
+  history->inCycle = false;
+  for (uint32_t i = 0; i < MEM_SIZE_32; ++i) history->lastWrite[i] = 0;
+  dropCheckpoints(history);
+}
+
+bool historyReplaying(cpu *cpuState) {
+  return cpuState->cycles < cpuState->history->end;
+}
+
+uint64_t historyStart(cpu *cpuState) {
+  return cpuState->history->oldest;
+}
+
+static historyRecord *recordAt(cpuHistory *history, uint64_t cycle) {
+  return history->records + cycle % history->capacity;
+}
+
+// Bytes of pages and page tables the checkpoints hold. A page shared by several checkpoints is only counted once,
+// which only needs comparing against the next newer one as the cpu never goes back to a page it has copied away from.
+static size_t checkpointPageBytes(cpuHistory *history) {
+  size_t bytes = 0;
+  for (uint32_t i = 0; i < history->checkpointCount; ++i) {
+    cpu *checkpoint = history->checkpoints + checkpointSlot(history, i);
+    cpu *newer = i + 1 < history->checkpointCount ? history->checkpoints + checkpointSlot(history, i + 1) : NULL;
+    bytes += checkpoint->pageCount * sizeof(memPage *);
+    for (uint32_t page = 1; page < checkpoint->pageCount; ++page) {
+      memPage *held = checkpoint->pages[page];
+      if (held && !(newer && page < newer->pageCount && newer->pages[page] == held)) bytes += sizeof(memPage);
+    }
+  }
+  return bytes;
+}
+
+static void takeCheckpoint(cpu *cpuState) {
+  cpuHistory *history = cpuState->history;
+  uint32_t slot = history->nextCheckpoint;
+  history->checkpointDue = cpuState->cycles + history->checkpointInterval;
+  if (history->checkpointCount == HISTORY_CHECKPOINTS) {
+    freeCpuMemory(history->checkpoints + slot);
+    --history->checkpointCount;
+  }
+  // Without one the cycles since the last are only further to go back to
+  if (!forkCpu(history->checkpoints + slot, cpuState)) return;
+  ++history->checkpointCount;
+  history->checkpointCycles[slot] = cpuState->cycles;
+  history->nextCheckpoint = (slot + 1) % HISTORY_CHECKPOINTS;
+
+  // Older cycles can still be reached by undoing from a newer checkpoint or the cpu, just more slowly
+  while (history->checkpointCount && checkpointPageBytes(history) > history->pageBytes) {
+    freeCpuMemory(history->checkpoints + checkpointSlot(history, 0));
+    --history->checkpointCount;
+  }
+}
+
+// Called before each cycle, the record is only written to the ring once the cycle finishes so one left waiting for
+// input doesn't replace the oldest record
+void historyBegin(cpu *cpuState) {
+  cpuHistory *history = cpuState->history;
+  if (historyReplaying(cpuState)) {
+    history->inCycle = false;
+    return;
+  }
+
+  // Something else ran the cpu on since the last recorded cycle
+  if (cpuState->cycles != history->end) resetHistory(cpuState);
+  history->inCycle = true;
+  if (cpuState->cycles >= history->checkpointDue) takeCheckpoint(cpuState);
+
+  history->current = (historyRecord){0};
+  history->current.pc = cpuState->pc;
+  history->wasIn32Bit = cpuState->in32Bit;
+}
+
+void historyRegister(cpu *cpuState, uint8_t reg) {
+  cpuHistory *history = cpuState->history;
+  if (!history->inCycle || history->current.reg) return;
+  history->current.reg = reg;
+  history->current.regOld = cpuState->registers[reg];
+}
+
+void historyRead(cpu *cpuState, uint16_t addr) {
+  cpuHistory *history = cpuState->history;
+  if (!history->inCycle) return;
+  history->current.flags |= HISTORY_READ;
+  history->current.memAddr = addr;
+}
+
+void historyWrite(cpu *cpuState, uint16_t addr) {
+  cpuHistory *history = cpuState->history;
+  if (!history->inCycle) return;
+  history->current.flags |= HISTORY_WRITE;
+  history->current.memAddr = addr;
+  history->current.memOld = cpuState->in32Bit ? memRead32(cpuState, addr) : cpuState->memory16[addr];
+}
+
+// Gives the input a replayed port read took the first time round, returns false if the cycle isn't a replay
+bool replayInput(cpu *cpuState, uint32_t *word) {
+  cpuHistory *history = cpuState->history;
+  if (!historyReplaying(cpuState)) return false;
+  *word = recordAt(history, cpuState->cycles)->memNew;
+  return true;
+}
+
+void historyInput(cpu *cpuState, uint16_t addr, uint32_t word) {
+  cpuHistory *history = cpuState->history;
+  if (!history->inCycle) return;
+  history->current.flags |= HISTORY_INPUT;
+  history->current.memAddr = addr;
+  history->current.memOld = cpuState->in32Bit ? memRead32(cpuState, addr) : cpuState->memory16[addr];
+  history->current.memNew = word;
+}
+
+static bool recorded(cpuHistory *history, uint64_t cycle) {
+  return cycle >= history->oldest && cycle < history->end;
+}
+
+// Links a store into the list of stores to its address. Each store also gets a jump pointer further back, chosen
+// the way Myers' skew binary lists do it, so finding the last store before any cycle takes logarithmic time.
+static void linkWrite(cpuHistory *history, historyRecord *record, uint64_t cycle) {
+  uint64_t prev = history->lastWrite[record->memAddr];
+  history->lastWrite[record->memAddr] = cycle + 1;
+  record->prevDelta = record->jumpDelta = record->depth = 0;
+  if (!prev || !recorded(history, --prev) || cycle - prev > UINT32_MAX) return;
+
+  historyRecord *parent = recordAt(history, prev);
+  record->prevDelta = cycle - prev;
+  record->depth = parent->depth + 1;
+  record->jumpDelta = record->prevDelta;
+  if (!parent->jumpDelta) return;
+
+  uint64_t jump = prev - parent->jumpDelta;
+  if (!recorded(history, jump)) return;
+  historyRecord *jumpRecord = recordAt(history, jump);
+  if (!jumpRecord->jumpDelta || !recorded(history, jump - jumpRecord->jumpDelta)) return;
+  historyRecord *jumpJump = recordAt(history, jump - jumpRecord->jumpDelta);
+  if (parent->depth - jumpRecord->depth == jumpRecord->depth - jumpJump->depth &&
+      cycle - (jump - jumpRecord->jumpDelta) <= UINT32_MAX) {
+    record->jumpDelta = cycle - (jump - jumpRecord->jumpDelta);
+  }
+}
+
+// Called once the cycle has finished and been counted, returns false if it was a replay
+bool historyEnd(cpu *cpuState) {
+  cpuHistory *history = cpuState->history;
+  if (!history->inCycle) return false;
+  history->inCycle = false;
+
+  uint64_t cycle = cpuState->cycles - 1;
+  historyRecord *record = recordAt(history, cycle);
+  *record = history->current;
+  if (cpuState->in32Bit != history->wasIn32Bit) record->flags |= HISTORY_MODE;
+
+  history->end = cpuState->cycles;
+  if (history->end - history->oldest > history->capacity) history->oldest = history->end - history->capacity;
+  if (record->flags & HISTORY_WRITE) linkWrite(history, record, cycle);
+  return true;
+}
+
+// Puts back everything the last cycle changed, returns false at the oldest recorded cycle or with STOP_OUT_OF_MEMORY
+bool stepBack(cpu *cpuState) {
+  cpuHistory *history = cpuState->history;
+  if (cpuState->cycles <= history->oldest || cpuState->cycles > history->end) return false;
+
+  uint64_t cycle = cpuState->cycles - 1;
+  historyRecord *record = recordAt(history, cycle);
+  if (record->flags & HISTORY_MODE) cpuState->in32Bit = !cpuState->in32Bit;
+  if (record->flags & (HISTORY_WRITE | HISTORY_INPUT)) {
+    if (cpuState->in32Bit) {
+      memWrite32(cpuState, record->memAddr, record->memOld);
+      // Left on the cycle with the stop memWrite32 gave it, the page to put the word back on couldn't be allocated
+      if (cpuState->stop == STOP_OUT_OF_MEMORY) {
+        if (record->flags & HISTORY_MODE) cpuState->in32Bit = !cpuState->in32Bit;
+        return false;
+      }
+    } else {
+      cpuState->memory16[record->memAddr] = record->memOld;
+    }
+  }
+  if (record->reg) cpuState->registers[record->reg] = record->regOld;
+
+  cpuState->pc = cpuState->oldPC = record->pc;
+  cpuState->cycles = cycle;
+  cpuState->halted = false;
+  cpuState->stop = STOP_NONE;
+  cpuState->pcModified = false;
+  cpuState->readReg1 = cpuState->readReg2 = cpuState->wroteReg = false;
+  cpuState->readMem = cpuState->wroteMem = false;
+  return true;
+}
+
+// Whether undoing the record just stepped back over means stopping, the cpu is left before that cycle ran
+static bool reverseBreak(cpu *cpuState, historyRecord *record) {
+  cpuBreaks *breaks = cpuState->breaks;
+  if (BREAK_BIT(breaks->code, cpuState->pc)) {
+    breaks->hit = BREAK_CODE;
+    breaks->hitAddr = cpuState->pc;
+  } else if (record->flags & (HISTORY_READ | HISTORY_INPUT) && BREAK_BIT(breaks->reads, record->memAddr)) {
+    breaks->hit = BREAK_READ;
+    breaks->hitAddr = record->memAddr;
+  } else if (record->flags & HISTORY_WRITE && BREAK_BIT(breaks->writes, record->memAddr)) {
+    breaks->hit = BREAK_WRITE;
+    breaks->hitAddr = record->memAddr;
+  } else if (record->reg && breaks->regMask >> record->reg & 1) {
+    checkConditions(breaks, record->reg, cpuState->registers[record->reg]);
+  }
+  return breaks->hit != BREAK_NONE;
+}
+
+// Steps back up to count cycles, stopping early at anything in breaks. The stop is STOP_BREAK for those,
+// STOP_HISTORY_START at the oldest recorded cycle and STOP_CYCLE_LIMIT once count cycles have been undone, or
+// STOP_OUT_OF_MEMORY from stepBack.
+void runBackwards(cpu *cpuState, uint64_t count) {
+  cpuHistory *history = cpuState->history;
+  cpuBreaks *breaks = cpuState->breaks;
+  if (breaks) breaks->hit = BREAK_NONE;
+  cpuState->stop = STOP_NONE;
+
+  for (uint64_t i = 0; i < count; ++i) {
+    if (!stepBack(cpuState)) {
+      if (cpuState->stop != STOP_OUT_OF_MEMORY) cpuState->stop = STOP_HISTORY_START;
+      return;
+    }
+    if (breaks && reverseBreak(cpuState, recordAt(history, cpuState->cycles))) {
+      cpuState->stop = STOP_BREAK;
+      return;
+    }
+  }
+  cpuState->stop = STOP_CYCLE_LIMIT;
+}
+
+// Copies what settings has that initCpuConfig sets up into cpuState
+static void keepSettings(cpu *cpuState, cpu *settings) {
+  cpuState->step = settings->step;
+  cpuState->debug = settings->debug;
+  cpuState->io = settings->io;
+  cpuState->cycleLimit = settings->cycleLimit;
+  cpuState->trace = settings->trace;
+  cpuState->profile = settings->profile;
+  cpuState->breaks = settings->breaks;
+  cpuState->history = settings->history;
+}
+
+// Moves the cpu to any recorded cycle, by undoing cycles or by replaying them from the cpu or a checkpoint, whichever
+// is fewer. Returns false for cycles outside the history, or with STOP_OUT_OF_MEMORY if a page ran out on the way.
+bool seekHistory(cpu *cpuState, uint64_t cycle) {
+  cpuHistory *history = cpuState->history;
+  if (cycle < history->oldest || cycle > history->end) return false;
+
+  int32_t best = -1;
+  for (uint32_t n = 0; n < history->checkpointCount; ++n) {
+    uint32_t i = checkpointSlot(history, n);
+    uint64_t at = history->checkpointCycles[i];
+    if (at >= history->oldest && at <= cycle && (best < 0 || at > history->checkpointCycles[best])) best = i;
+  }
+  uint64_t replayFrom = best >= 0 ? history->checkpointCycles[best] : 0;
+
+  if (cpuState->cycles >= cycle && (best < 0 || cpuState->cycles - cycle <= cycle - replayFrom)) {
+    while (cpuState->cycles > cycle) {
+      if (!stepBack(cpuState)) return false;
+    }
+    cpuState->stop = STOP_NONE;
+    return true;
+  }
+
+  if (best >= 0 && (cpuState->cycles > cycle || cpuState->cycles < replayFrom)) {
+    cpu fork;
+    if (!forkCpu(&fork, history->checkpoints + best)) {
+      cpuState->stop = STOP_OUT_OF_MEMORY;
+      return false;
+    }
+    keepSettings(&fork, cpuState);
+    freeCpuMemory(cpuState);
+    *cpuState = fork;
+  }
+
+  // Nothing on the way is worth stopping or printing for
+  cpu settings = *cpuState;
+  cpuState->step = cpuState->debug = false;
+  cpuState->breaks = NULL;
+  cpuState->cycleLimit = cycle;
+  cpuState->stop = STOP_NONE;
+  runCpu16(cpuState);
+  keepSettings(cpuState, &settings);
+  if (cpuState->stop == STOP_OUT_OF_MEMORY) return false;
+  cpuState->stop = STOP_NONE;
+  return cpuState->cycles == cycle;
+}
+
+// Finds the last store to addr before the cycle before, giving its cycle and pc. Returns false if there was none
+// since the oldest recorded cycle.
+bool findLastWrite(cpu *cpuState, uint16_t addr, uint64_t before, uint64_t *cycle, uint16_t *pc) {
+  cpuHistory *history = cpuState->history;
+  uint64_t at = history->lastWrite[addr];
+  if (!at || !recorded(history, --at)) return false;
+
+  while (at >= before) {
+    historyRecord *record = recordAt(history, at);
+    if (!record->prevDelta) return false;
+    uint64_t jump = at - record->jumpDelta;
+    at = jump >= before && recorded(history, jump) ? jump : at - record->prevDelta;
+    if (!recorded(history, at)) return false;
+  }
+
+  *cycle = at;
+  *pc = recordAt(history, at)->pc;
+  return true;
+}
@@ -0,0 +1,178 @@
+#include <ctype.h>    // isspace
+#include <fcntl.h>    // open, O_RDONLY
+#include <stdbool.h>  // bool, false, true
+#include <stdint.h>   // uint16_t, uint32_t
+#include <stdio.h>    // puts
+#include <stdlib.h>   // free, realloc
+#include <string.h>   // memchr, memcmp, memcpy
+#include <sys/mman.h> // MAP_FAILED, MAP_PRIVATE, mmap, munmap, PROT_READ
+#include <sys/stat.h> // fstat, S_ISREG, stat
+#include <unistd.h>   // close
+
+#include "emulator.h"
+#include "image.h"
+
+static bool loadBinary(cpu *cpuState, const char *data, size_t size) {
+  imageHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (header.version != IMAGE_VERSION || (header.wordBits != 16 && header.wordBits != 32)) {
+    if (!cpuState->quiet) puts("Unsupported image version");
+    return false;
+  }
+
+  initCpuState16(cpuState);
+
+  size_t wordBytes = header.wordBits / 8;
+  size_t offset = sizeof(header);
+  for (uint32_t i = 0; i < header.segmentCount; ++i) {
+    imageSegment segment;
+    if (size - offset < sizeof(segment)) {
+      if (!cpuState->quiet) puts("Image is truncated");
+      return false;
+    }
+    memcpy(&segment, data + offset, sizeof(segment));
+    offset += sizeof(segment);
+
+    if (segment.address >= MEM_SIZE_32 || segment.wordCount > MEM_SIZE_32 - segment.address) {
+      if (!cpuState->quiet) puts("Invalid segment address");
+      return false;
+    }
+    if ((size - offset) / wordBytes < segment.wordCount) {
+      if (!cpuState->quiet) puts("Image is truncated");
+      return false;
+    }
+
+    if (header.wordBits == 16) {
+      memCopy16(cpuState, segment.address, data + offset, segment.wordCount);
+    } else {
+      memCopy32(cpuState, segment.address, data + offset, segment.wordCount);
+    }
+    offset += segment.wordCount * wordBytes;
+  }
+
+  internPages(cpuState);
+  return true;
+}
+
+static int hexDigit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+// Reads up to 8 hex digits, more than that or a 0x prefix are left to strtoul
+static bool parseHex(const char **text, const char *end, uint32_t *value, uint32_t *digits) {
+  int digit;
+  *value = *digits = 0;
+  while (*text < end && (digit = hexDigit(**text)) >= 0) {
+    if (++*digits > 8) return false;
+    *value = *value << 4 | digit;
+    ++*text;
+  }
+  return *text == end || (**text != 'x' && **text != 'X');
+}
+
+// Handles the usual "AA: DDDD" line without copying it or going through strtoul, returns false for anything else
+// so processLine16 can deal with it and report any errors
+static bool parseWord16(cpu *cpuState, const char *line, const char *end) {
+  uint32_t address, data, digits;
+
+  while (line < end && isspace((unsigned char)*line)) ++line;
+  if (!parseHex(&line, end, &address, &digits) || digits < 2 || address >= MEM_SIZE_32) return false;
+  if (line == end || !*line) return false;
+
+  // strtoul counts skipped whitespace towards the 4 characters a value needs
+  const char *start = ++line;
+  while (line < end && isspace((unsigned char)*line)) ++line;
+  if (!parseHex(&line, end, &data, &digits) || !digits || line - start < 4 || data > UINT16_MAX) return false;
+
+  memWrite16(cpuState, address, data);
+  return true;
+}
+
+// processFile16 without the echo, working straight from the mapped file
+static bool loadText16(cpu *cpuState, const char *text, size_t size) {
+  const char *end = text + size;
+  char *line = NULL;
+  size_t lineSize = 0;
+  bool inComment = false;
+  bool ok = true;
+
+  initCpuState16(cpuState);
+
+  while (ok && text < end) {
+    const char *newline = memchr(text, '\n', end - text);
+    const char *next = newline ? newline + 1 : end;
+    size_t len = (newline ? newline : end) - text;
+
+    if (inComment || !parseWord16(cpuState, text, text + len)) {
+      if (len + 1 > lineSize) {
+        char *grown = realloc(line, len + 1);
+        if (!grown) {
+          if (!cpuState->quiet) puts("Out of memory");
+          ok = false;
+          break;
+        }
+        line = grown;
+        lineSize = len + 1;
+      }
+      memcpy(line, text, len);
+      line[len] = '\0';
+      ok = processLine16(line, cpuState, &inComment, false);
+    }
+    text = next;
+  }
+
+  free(line);
+  if (ok) internPages(cpuState);
+  return ok;
+}
+
+// Turns a load that lost words to a page that couldn't be allocated into a failed one
+static bool loadedAll(cpu *cpuState, bool loaded) {
+  if (!loaded || cpuState->stop != STOP_OUT_OF_MEMORY) return loaded;
+  if (!cpuState->quiet) puts("Out of memory");
+  return false;
+}
+
+// Loads either a binary image or a .xtoy16 text image from memory, telling them apart by the magic
+bool loadImageData(cpu *cpuState, const char *data, size_t size) {
+  if (size >= sizeof(imageHeader) && !memcmp(data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC))) {
+    return loadedAll(cpuState, loadBinary(cpuState, data, size));
+  }
+  return loadedAll(cpuState, loadText16(cpuState, data, size));
+}
+
+// loadImageData for a file. Regular files are mapped rather than read, anything that can't be mapped and text images
+// loaded with echo go through processFile16.
+bool loadImage(cpu *cpuState, char *filePath, bool echo) {
+  int fd = open(filePath, O_RDONLY);
+  if (fd < 0) {
+    if (!cpuState->quiet) puts("Path is invalid");
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) || !S_ISREG(info.st_mode)) {
+    close(fd);
+    return loadedAll(cpuState, processFile16(cpuState, filePath, echo));
+  }
+
+  size_t size = info.st_size;
+  if (!size) {
+    close(fd);
+    initCpuState16(cpuState);
+    return true;
+  }
+
+  const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return loadedAll(cpuState, processFile16(cpuState, filePath, echo));
+
+  bool binary = size >= sizeof(imageHeader) && !memcmp(data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+  bool ok = binary || !echo ? loadImageData(cpuState, data, size) :
+                              loadedAll(cpuState, processFile16(cpuState, filePath, echo));
+  munmap((void *)data, size);
+  return ok;
+}
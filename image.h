@@ -0,0 +1,25 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h> // uint16_t, uint32_t
+
+// Binary .xtoyb images, written by xasm and loaded by the emulator. An imageHeader is followed by segmentCount
+// segments, each an imageSegment and then wordCount words. Everything is little endian with words laid out the way
+// memory16/memory32 hold them so a segment can be copied straight into memory.
+#define IMAGE_MAGIC   "XTOYIMG"
+#define IMAGE_VERSION (uint16_t)1
+
+typedef struct {
+  char     magic[8];
+  uint16_t version;
+  uint16_t wordBits; // 16 or 32
+  uint32_t segmentCount;
+} imageHeader;
+
+// Both counted in words of the image's word size
+typedef struct {
+  uint32_t address;
+  uint32_t wordCount;
+} imageSegment;
+
+#endif
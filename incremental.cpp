@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "xasm.h"
+
+
+// Versions kept of each input, enough to undo a few saves without parsing anything
+static const std::size_t HistoryLength = 4;
+
+// 64 bit FNV-1a
+static uint64_t ContentHash(std::string_view text) {
+  uint64_t hash = 0xCBF29CE484222325;
+  for (unsigned char c : text) {
+    hash = (hash ^ c) * 0x100000001B3;
+  }
+  return hash;
+}
+
+// Including a last line without a newline
+static uint32_t CountLines(std::string_view text) {
+  return std::count(text.begin(), text.end(), '\n') + (!text.empty() && text.back() != '\n');
+}
+
+// Points the statement's tokens at the same text in to, which starts shift bytes further on than it did in from
+static Statement MoveStatement(Statement statement, std::string_view from, std::string_view to, std::size_t shift,
+    uint32_t lineShift) {
+  auto move = [&](SourceToken &token) {
+    token.text = to.substr(token.text.data() - from.data() + shift, token.text.size());
+    token.line += lineShift;
+  };
+
+  move(statement.name);
+  for (std::size_t i = 0; i < std::min(statement.argumentCount, statement.arguments.size()); ++i) {
+    move(statement.arguments[i].token);
+  }
+  return statement;
+}
+
+
+IncrementalBuild::IncrementalBuild(ParseFunction parse, const std::vector<std::string> &paths)
+  : parse(parse), histories(paths.size()) {
+  for (const std::string &path : paths) {
+    objects.push_back({path, Assembly{}});
+  }
+}
+
+// A line never parses differently for the lines around it, so the changed lines can be parsed as a source of their
+// own and put between the statements base had before and after them. Those can only be moved over when they point
+// into base's text, which the ANTLR front end only manages for ASCII sources.
+bool IncrementalBuild::Parse(const Version *base, Version &version) {
+  std::string_view text = version.text;
+  std::vector<Diagnostic> &diagnostics = version.object.diagnostics;
+  if (!base || !base->parsed.strings.empty()) {
+    parsedLines += CountLines(text);
+    return parse(text, version.parsed, diagnostics);
+  }
+
+  // From the start of the line the texts first differ on to past the end of the line they last differ on
+  std::string_view baseText = base->text;
+  std::size_t prefix = std::mismatch(text.begin(), text.end(), baseText.begin(), baseText.end()).first - text.begin();
+  std::size_t start = prefix == 0 ? 0 : text.rfind('\n', prefix - 1) + 1;
+  std::size_t suffix = 0, suffixLimit = std::min(text.size(), baseText.size()) - start;
+  while (suffix < suffixLimit && text[text.size() - 1 - suffix] == baseText[baseText.size() - 1 - suffix]) {
+    ++suffix;
+  }
+  std::size_t end = text.find('\n', text.size() - suffix);
+  end = end == std::string_view::npos ? text.size() : end + 1;
+  std::size_t shift = text.size() - baseText.size();
+
+  std::string_view changed = text.substr(start, end - start);
+  uint32_t startLine = CountLines(text.substr(0, start));
+  uint32_t changedLines = CountLines(changed), baseChangedLines = CountLines(baseText.substr(start, end - shift - start));
+  parsedLines += changedLines;
+
+  ParsedSource middle;
+  bool ok = parse(changed, middle, diagnostics);
+  for (Diagnostic &diagnostic : diagnostics) {
+    if (diagnostic.line) {
+      diagnostic.line += startLine;
+    }
+  }
+  if (!ok) {
+    return false;
+  }
+
+  std::vector<Statement> &statements = version.parsed.statements;
+  statements.reserve(base->parsed.statements.size() + middle.statements.size());
+  auto baseIter = base->parsed.statements.begin(), baseEnd = base->parsed.statements.end();
+  for (; baseIter != baseEnd && baseIter->name.line <= startLine; ++baseIter) {
+    statements.push_back(MoveStatement(*baseIter, baseText, text, 0, 0));
+  }
+  for (Statement &statement : middle.statements) {
+    statement.name.line += startLine;
+    for (SourceArgument &argument : statement.arguments) {
+      argument.token.line += startLine;
+    }
+    statements.push_back(statement);
+  }
+  for (; baseIter != baseEnd; ++baseIter) {
+    if (baseIter->name.line > startLine + baseChangedLines) {
+      statements.push_back(MoveStatement(*baseIter, baseText, text, shift, changedLines - baseChangedLines));
+    }
+  }
+  version.parsed.strings = std::move(middle.strings);
+  return true;
+}
+
+bool IncrementalBuild::Build(Assembly &program) {
+  changedInputs = parsedLines = 0;
+  bool ok = true;
+  for (std::size_t i = 0; i < objects.size(); ++i) {
+    auto &[name, object] = objects[i];
+    std::vector<std::unique_ptr<Version>> &history = histories[i];
+
+    std::ifstream file(name, std::ios::binary);
+    if (!file) {
+      object = Assembly{};
+      object.diagnostics.push_back({0, 0, "", "Cannot open"});
+      ok = false;
+      continue;
+    }
+    std::stringstream data;
+    data << file.rdbuf();
+    std::string text = data.str();
+    uint64_t hash = ContentHash(text);
+
+    auto found = std::find_if(history.begin(), history.end(), [&](const std::unique_ptr<Version> &version) {
+      return version->hash == hash && version->text == text;
+    });
+    if (found == history.end()) {
+      auto version = std::make_unique<Version>();
+      version->hash = hash;
+      version->text = std::move(text);
+      std::string_view content = version->text;
+      if (content.substr(0, sizeof(ObjectMagic)) == std::string_view(ObjectMagic, sizeof(ObjectMagic))) {
+        version->ok = ReadObject(content, version->object);
+      } else {
+        auto base = std::find_if(history.rbegin(), history.rend(), [](const std::unique_ptr<Version> &version) {
+          return version->parsedOk;
+        });
+        version->parsedOk = Parse(base == history.rend() ? nullptr : base->get(), *version);
+        version->ok = version->parsedOk && AssembleObject(version->parsed, version->object);
+      }
+
+      if (history.size() == HistoryLength) {
+        history.erase(history.begin());
+      }
+      history.push_back(std::move(version));
+      ++changedInputs;
+    } else if (found != history.end() - 1) {
+      std::rotate(found, found + 1, history.end());
+      ++changedInputs;
+    }
+
+    object = history.back()->object;
+    ok = history.back()->ok && ok;
+  }
+
+  if (!ok) {
+    program = Assembly{};
+    return false;
+  }
+  return Link(objects, program);
+}
@@ -0,0 +1,230 @@
+#include <errno.h>   // EINTR, errno
+#include <stdbool.h> // bool, false, true
+#include <stdint.h>  // uint8_t, uint32_t
+#include <stdio.h>   // fflush, stdout
+#include <stdlib.h>  // calloc, free
+#include <unistd.h>  // close, read, ssize_t, write
+
+#include "emulator.h"
+
+// Bytes buffered each way, the port only makes a syscall when one of these fills or runs dry
+#define IO_BUFFER_SIZE (size_t)65536
+
+// Words read from and written to a pair of file descriptors. Text is whitespace separated hex words like the console
+// takes without the prompts, written one per line. Binary is little endian words, 2 bytes each in 16 bit mode and
+// 4 in 32 bit mode.
+typedef struct {
+  ioPort  port;
+  int     inFd, outFd;
+  bool    binary;
+  bool    inEnd;
+  size_t  inPos, inLen;
+  size_t  outLen;
+  uint8_t inBuf[IO_BUFFER_SIZE];
+  uint8_t outBuf[IO_BUFFER_SIZE];
+} streamIo;
+
+// Records every word read from inner to a log, or replays a log in place of reading anything. The log is 4 byte
+// little endian words whatever the mode so a replay sees exactly what the recorded run did. A NULL inner is the
+// console.
+typedef struct {
+  ioPort  port;
+  ioPort  *inner;
+  int     logFd;
+  bool    replay;
+  bool    logEnd;
+  size_t  logPos, logLen;
+  uint8_t logBuf[IO_BUFFER_SIZE];
+} logIo;
+
+
+static bool writeAll(int fd, const uint8_t *buf, size_t len) {
+  while (len) {
+    ssize_t written = write(fd, buf, len);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+    buf += written;
+    len -= written;
+  }
+  return true;
+}
+
+// Refills buf once it has been used up, keeping any bytes between pos and len. Returns false at the end of the file.
+static bool fillBuffer(int fd, uint8_t *buf, size_t *pos, size_t *len, bool *end) {
+  if (*end) return false;
+  size_t kept = *len - *pos;
+  for (size_t i = 0; i < kept; ++i) buf[i] = buf[*pos + i];
+  *pos = 0;
+  *len = kept;
+
+  ssize_t got;
+  while ((got = read(fd, buf + *len, IO_BUFFER_SIZE - *len)) < 0 && errno == EINTR);
+  if (got <= 0) {
+    *end = true;
+    return false;
+  }
+  *len += got;
+  return true;
+}
+
+static void flushStream(streamIo *io) {
+  // Anything the debugger printed has to come out before the words written after it
+  fflush(stdout);
+  writeAll(io->outFd, io->outBuf, io->outLen);
+  io->outLen = 0;
+}
+
+static int hexDigit(uint8_t c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+static bool isSpace(uint8_t c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static int nextByte(streamIo *io) {
+  if (io->inPos == io->inLen) {
+    // Whatever is waiting for this input may need to see the output so far first
+    if (io->outLen) flushStream(io);
+    if (!fillBuffer(io->inFd, io->inBuf, &io->inPos, &io->inLen, &io->inEnd)) return -1;
+  }
+  return io->inBuf[io->inPos];
+}
+
+// Takes up to 4 or 8 hex digits like the console's scanf, anything else up to the next whitespace is skipped
+static bool readText(streamIo *io, uint32_t *word, bool wide) {
+  uint8_t maxDigits = wide ? 8 : 4;
+  int c;
+  while (true) {
+    while ((c = nextByte(io)) >= 0 && isSpace(c)) ++io->inPos;
+    if (c < 0) return false;
+
+    uint8_t digits = 0;
+    int digit;
+    *word = 0;
+    while (digits < maxDigits && (c = nextByte(io)) >= 0 && (digit = hexDigit(c)) >= 0) {
+      *word = *word << 4 | digit;
+      ++digits;
+      ++io->inPos;
+    }
+    if (digits) return true;
+
+    while ((c = nextByte(io)) >= 0 && !isSpace(c)) ++io->inPos;
+  }
+}
+
+static bool readBinary(streamIo *io, uint32_t *word, bool wide) {
+  size_t size = wide ? 4 : 2;
+  if (io->inLen - io->inPos < size) {
+    if (io->outLen) flushStream(io);
+    while (io->inLen - io->inPos < size) {
+      if (!fillBuffer(io->inFd, io->inBuf, &io->inPos, &io->inLen, &io->inEnd)) return false;
+    }
+  }
+
+  *word = 0;
+  for (size_t i = 0; i < size; ++i) *word |= (uint32_t)io->inBuf[io->inPos + i] << (i * 8);
+  io->inPos += size;
+  return true;
+}
+
+static bool streamRead(ioPort *port, uint32_t *word, bool wide) {
+  streamIo *io = (streamIo *)port;
+  return io->binary ? readBinary(io, word, wide) : readText(io, word, wide);
+}
+
+static void streamWrite(ioPort *port, uint32_t word, bool wide) {
+  static const char hexChars[] = "0123456789ABCDEF";
+  streamIo *io = (streamIo *)port;
+  if (IO_BUFFER_SIZE - io->outLen < 9) flushStream(io);
+
+  uint8_t *out = io->outBuf + io->outLen;
+  if (io->binary) {
+    size_t size = wide ? 4 : 2;
+    for (size_t i = 0; i < size; ++i) out[i] = word >> (i * 8);
+    io->outLen += size;
+  } else {
+    size_t digits = wide ? 8 : 4;
+    for (size_t i = 0; i < digits; ++i) out[i] = hexChars[(word >> ((digits - 1 - i) * 4)) & 0xF];
+    out[digits] = '\n';
+    io->outLen += digits + 1;
+  }
+}
+
+static void streamClose(ioPort *port) {
+  flushStream((streamIo *)port);
+  free(port);
+}
+
+ioPort *openStreamIo(int inFd, int outFd, bool binary) {
+  streamIo *io = calloc(1, sizeof(streamIo));
+  if (!io) return NULL;
+  io->port = (ioPort){streamRead, streamWrite, streamClose};
+  io->inFd = inFd;
+  io->outFd = outFd;
+  io->binary = binary;
+  return &io->port;
+}
+
+
+static void flushLog(logIo *io) {
+  writeAll(io->logFd, io->logBuf, io->logLen);
+  io->logLen = 0;
+}
+
+static bool logRead(ioPort *port, uint32_t *word, bool wide) {
+  logIo *io = (logIo *)port;
+
+  if (io->replay) {
+    while (io->logLen - io->logPos < 4) {
+      if (!fillBuffer(io->logFd, io->logBuf, &io->logPos, &io->logLen, &io->logEnd)) return false;
+    }
+    uint8_t *in = io->logBuf + io->logPos;
+    *word = in[0] | in[1] << 8 | in[2] << 16 | (uint32_t)in[3] << 24;
+    io->logPos += 4;
+    return true;
+  }
+
+  if (!(io->inner ? io->inner->read(io->inner, word, wide) : readConsole(word, wide))) return false;
+  if (IO_BUFFER_SIZE - io->logLen < 4) flushLog(io);
+  uint8_t *out = io->logBuf + io->logLen;
+  for (size_t i = 0; i < 4; ++i) out[i] = *word >> (i * 8);
+  io->logLen += 4;
+  // Someone typing at the console can't be expected to stop cleanly, keep the log current for them
+  if (!io->inner) flushLog(io);
+  return true;
+}
+
+static void logWrite(ioPort *port, uint32_t word, bool wide) {
+  logIo *io = (logIo *)port;
+  if (io->inner) {
+    io->inner->write(io->inner, word, wide);
+  } else {
+    writeConsole(word, wide);
+  }
+}
+
+static void logClose(ioPort *port) {
+  logIo *io = (logIo *)port;
+  if (!io->replay) flushLog(io);
+  closeIo(io->inner);
+  free(io);
+}
+
+// Takes ownership of inner, which only ever sees writes when replaying
+ioPort *openLogIo(ioPort *inner, int logFd, bool replay) {
+  logIo *io = calloc(1, sizeof(logIo));
+  if (!io) return NULL;
+  io->port = (ioPort){logRead, logWrite, logClose};
+  io->inner = inner;
+  io->logFd = logFd;
+  io->replay = replay;
+  return &io->port;
+}
+
+void closeIo(ioPort *port) {
+  if (port && port->close) port->close(port);
+}
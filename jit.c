@@ -0,0 +1,602 @@
+#include <stddef.h>   // offsetof, size_t
+#include <stdlib.h>   // free, malloc
+#include <string.h>   // memcpy, memset
+
+#include "emulator.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h> // mmap, munmap, MAP_ANONYMOUS, MAP_FAILED, MAP_PRIVATE, PROT_EXEC, PROT_READ, PROT_WRITE
+
+#define JIT_CODE_SIZE  (size_t)(1 << 20)
+#define JIT_THRESHOLD  (uint32_t)16
+#define JIT_MAX_BLOCK  (uint8_t)64
+// Worst case bytes emitted for the cycle limit check at the start of a block, 41 bytes
+#define JIT_MAX_PROLOGUE_BYTES (size_t)64
+// Worst case bytes emitted for one instruction plus the exit that ends a block after it, sti takes 91 and the exit 17.
+// Space is checked before every instruction so a block never runs off the end of the code region.
+#define JIT_MAX_INST_BYTES (size_t)128
+#define JIT_THUNK_SIZE (size_t)10
+
+// Native code returns the next pc in bits 0-7, what the dispatcher should do in bits 8-15 and the
+// written address for JIT_EXIT_INVALIDATE in bits 16-23
+enum {
+  JIT_EXIT_DISPATCH,   // Continue at pc, nothing compiled there
+  JIT_EXIT_INTERPRET,  // Instruction at pc touches the I/O port or the block would pass cycleLimit, interpret it once
+  JIT_EXIT_INVALIDATE  // A store hit translated code, throw away the blocks covering it and continue at pc
+};
+
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// TOY registers r1-rC live in host registers while in native code, r0 and rD-rF stay in cpuState->registers
+// rax and rcx are scratch, rdi holds cpuState
+static const int8_t pinnedRegs[REG_COUNT] = {
+  -1, RDX, RBX, RSI, RBP, R8, R9, R10, R11, R12, R13, R14, R15, -1, -1, -1
+};
+
+typedef uint32_t (*jitEntry)(cpu *cpuState, const void *code);
+
+typedef struct {
+  // Start of the mmap region, the block table and code map live at the start so code can reach them rip relative
+  uint8_t     *code;
+  const void **blockTable;
+  uint8_t     *codeMap;
+  uint8_t     *thunks;
+  uint8_t     *entry, *exit;
+  uint8_t     *blocksStart, *free, *end;
+
+  uint8_t      blockLength[MEM_SIZE_16];
+  bool         uncompilable[MEM_SIZE_16];
+  uint32_t     counters[MEM_SIZE_16];
+} jitState;
+
+
+static void emit8(uint8_t **p, uint8_t value) {
+  *(*p)++ = value;
+}
+
+static void emit32(uint8_t **p, uint32_t value) {
+  memcpy(*p, &value, sizeof(value));
+  *p += sizeof(value);
+}
+
+// disp32 for a rip relative operand, trailing is the number of instruction bytes after the displacement
+static void emitRipDisp(uint8_t **p, const void *target, size_t trailing) {
+  emit32(p, (uint32_t)((const uint8_t *)target - (*p + 4 + trailing)));
+}
+
+static void emitRel32(uint8_t **p, const void *target) {
+  emitRipDisp(p, target, 0);
+}
+
+// Emits a one byte opcode with a ModRM whose reg field is reg (a host register or opcode extension) and whose
+// r/m field is host, or TOY register toyReg's slot in cpuState->registers if host is negative
+static void emitRM(uint8_t **p, uint8_t opcode, uint8_t reg, int8_t host, uint8_t toyReg) {
+  uint8_t rex = 0x40 | (reg >= 8 ? 0x4 : 0) | (host >= 8 ? 0x1 : 0);
+
+  if (rex != 0x40) emit8(p, rex);
+  emit8(p, opcode);
+  if (host >= 0) {
+    emit8(p, 0xC0 | (reg & 7) << 3 | (host & 7));
+  } else {
+    emit8(p, 0x80 | (reg & 7) << 3 | RDI);
+    emit32(p, offsetof(cpu, registers) + 4 * toyReg);
+  }
+}
+
+// Same as emitRM with r/m being wherever TOY register toyReg currently lives
+static void emitToyRM(uint8_t **p, uint8_t opcode, uint8_t reg, uint8_t toyReg) {
+  emitRM(p, opcode, reg, pinnedRegs[toyReg], toyReg);
+}
+
+// add qword [rdi + cycles], count
+static void emitAddCycles(uint8_t **p, uint8_t count) {
+  if (!count) return;
+  emit8(p, 0x48);
+  emit8(p, 0x81);
+  emit8(p, 0x87);
+  emit32(p, offsetof(cpu, cycles));
+  emit32(p, count);
+}
+
+static void emitExit(jitState *jit, uint8_t **p, uint8_t count, uint32_t exitCode) {
+  emitAddCycles(p, count);
+  emit8(p, 0xB8); // mov eax, imm32
+  emit32(p, exitCode);
+  emit8(p, 0xE9); // jmp exit
+  emitRel32(p, jit->exit);
+}
+
+// jmp qword [rip + blockTable + 8 * pc]
+static void emitChain(jitState *jit, uint8_t **p, uint8_t pc) {
+  emit8(p, 0xFF);
+  emit8(p, 0x25);
+  emitRipDisp(p, jit->blockTable + pc, 0);
+}
+
+// Short forward jcc around a side exit, returns where to patch the displacement
+static uint8_t *emitJccShort(uint8_t **p, uint8_t opcode) {
+  emit8(p, opcode);
+  emit8(p, 0);
+  return *p - 1;
+}
+
+static void patchJccShort(uint8_t **p, uint8_t *disp) {
+  *disp = (uint8_t)(*p - (disp + 1));
+}
+
+// Loads TOY register rt masked to an address into ecx and side exits to the interpreter if it's the I/O port
+static void emitIndirectAddr(jitState *jit, uint8_t **p, uint8_t rt, uint8_t pc, uint8_t count) {
+  emitToyRM(p, 0x8B, RCX, rt); // mov ecx, rt
+  emit8(p, 0x0F);              // movzx ecx, cl
+  emit8(p, 0xB6);
+  emit8(p, 0xC9);
+  emit8(p, 0x81);              // cmp ecx, imm32
+  emit8(p, 0xF9);
+  emit32(p, stdInOutAddr16);
+  uint8_t *skip = emitJccShort(p, 0x75); // jne
+  emitExit(jit, p, count, JIT_EXIT_INTERPRET << 8 | pc);
+  patchJccShort(p, skip);
+}
+
+
+static void jitFlush(jitState *jit) {
+  for (uint32_t i = 0; i < MEM_SIZE_16; ++i) {
+    jit->blockTable[i] = jit->thunks + i * JIT_THUNK_SIZE;
+    jit->blockLength[i] = 0;
+    jit->counters[i] = 0;
+  }
+  memset(jit->codeMap, 0, MEM_SIZE_16);
+  jit->free = jit->blocksStart;
+}
+
+static jitState *jitCreate(void) {
+  jitState *jit = malloc(sizeof(jitState));
+  if (!jit) return NULL;
+
+  jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->code == MAP_FAILED) {
+    free(jit);
+    return NULL;
+  }
+  jit->end = jit->code + JIT_CODE_SIZE;
+
+  jit->blockTable = (const void **)jit->code;
+  jit->codeMap = (uint8_t *)(jit->blockTable + MEM_SIZE_16);
+  jit->thunks = jit->codeMap + MEM_SIZE_16;
+  uint8_t *p = jit->thunks + MEM_SIZE_16 * JIT_THUNK_SIZE;
+
+  // uint32_t entry(cpu *cpuState, const void *code)
+  jit->entry = p;
+  emit8(&p, 0x53);             // push rbx
+  emit8(&p, 0x55);             // push rbp
+  emit8(&p, 0x41); emit8(&p, 0x54); // push r12
+  emit8(&p, 0x41); emit8(&p, 0x55); // push r13
+  emit8(&p, 0x41); emit8(&p, 0x56); // push r14
+  emit8(&p, 0x41); emit8(&p, 0x57); // push r15
+  emit8(&p, 0x48); emit8(&p, 0x89); emit8(&p, 0xF0); // mov rax, rsi
+  for (uint8_t i = 0; i < REG_COUNT; ++i) {
+    if (pinnedRegs[i] >= 0) emitRM(&p, 0x8B, pinnedRegs[i], -1, i);
+  }
+  emit8(&p, 0xFF); emit8(&p, 0xE0); // jmp rax
+
+  // Every exit lands here with the exit code in eax
+  jit->exit = p;
+  for (uint8_t i = 0; i < REG_COUNT; ++i) {
+    if (pinnedRegs[i] >= 0) emitRM(&p, 0x89, pinnedRegs[i], -1, i);
+  }
+  emit8(&p, 0x41); emit8(&p, 0x5F); // pop r15
+  emit8(&p, 0x41); emit8(&p, 0x5E); // pop r14
+  emit8(&p, 0x41); emit8(&p, 0x5D); // pop r13
+  emit8(&p, 0x41); emit8(&p, 0x5C); // pop r12
+  emit8(&p, 0x5D);             // pop rbp
+  emit8(&p, 0x5B);             // pop rbx
+  emit8(&p, 0xC3);             // ret
+
+  // Uncompiled addresses in the block table point to a thunk that hands pc back to the dispatcher
+  for (uint32_t i = 0; i < MEM_SIZE_16; ++i) {
+    uint8_t *thunk = jit->thunks + i * JIT_THUNK_SIZE;
+    emit8(&thunk, 0xB8); // mov eax, pc
+    emit32(&thunk, JIT_EXIT_DISPATCH << 8 | i);
+    emit8(&thunk, 0xE9); // jmp exit
+    emitRel32(&thunk, jit->exit);
+  }
+
+  jit->blocksStart = p;
+  memset(jit->uncompilable, 0, sizeof(jit->uncompilable));
+  jitFlush(jit);
+  return jit;
+}
+
+static void jitDestroy(jitState *jit) {
+  munmap(jit->code, JIT_CODE_SIZE);
+  free(jit);
+}
+
+// Drops every block that covers addr, blocks only reach each other through blockTable so nothing else needs unlinking
+static void jitInvalidate(jitState *jit, uint8_t addr) {
+  for (uint32_t start = 0; start < MEM_SIZE_16; ++start) {
+    uint8_t length = jit->blockLength[start];
+    if (!length || addr < start || addr >= start + length) continue;
+
+    jit->blockTable[start] = jit->thunks + start * JIT_THUNK_SIZE;
+    jit->blockLength[start] = 0;
+    jit->counters[start] = 0;
+    for (uint32_t i = start; i < start + length; ++i) {
+      --jit->codeMap[i];
+    }
+  }
+}
+
+// Translates the basic block at startPC, stopping at the first brz/brp/jmp/jsr/hlt or before anything that
+// has to go through the I/O handlers. Returns false if not even the first instruction can be translated.
+static bool jitCompile(jitState *jit, cpu *cpuState, uint8_t startPC) {
+  if ((size_t)(jit->end - jit->free) < JIT_MAX_PROLOGUE_BYTES + JIT_MAX_INST_BYTES) {
+    jitFlush(jit);
+  }
+
+  uint16_t *memory = cpuState->memory16;
+  uint8_t *start = jit->free;
+  uint8_t *p = start;
+  uint8_t pc = startPC;
+  uint8_t count = 0;
+  bool ended = false;
+
+  // Blocks only count their cycles on the way out so check up front that the whole block fits under cycleLimit
+  emit8(&p, 0x48); // mov rax, [rdi + cycles]
+  emit8(&p, 0x8B);
+  emit8(&p, 0x87);
+  emit32(&p, offsetof(cpu, cycles));
+  emit8(&p, 0x48); // add rax, count
+  emit8(&p, 0x83);
+  emit8(&p, 0xC0);
+  emit8(&p, 0);
+  uint8_t *length = p - 1;
+  emit8(&p, 0x48); // cmp rax, [rdi + cycleLimit]
+  emit8(&p, 0x3B);
+  emit8(&p, 0x87);
+  emit32(&p, offsetof(cpu, cycleLimit));
+  uint8_t *fits = emitJccShort(&p, 0x76); // jbe
+  emitExit(jit, &p, 0, JIT_EXIT_INTERPRET << 8 | startPC);
+  patchJccShort(&p, fits);
+
+  while (!ended) {
+    uint16_t inst = memory[pc];
+    uint8_t opcode = inst >> 12;
+    uint8_t rd = (inst >> 8) & 0xF;
+    uint8_t rs = (inst >> 4) & 0xF;
+    uint8_t rt = inst & 0xF;
+    uint8_t addr = inst & 0xFF;
+    uint8_t nextPC = pc + 1;
+    uint8_t *skip;
+
+    // hlt, the mode switch and constant I/O addresses are left to the interpreter, and a block that has used up the
+    // code region carries on in a new one after the flush
+    if (opcode == 0x0 || ((opcode == 0x8 || opcode == 0x9) && addr == stdInOutAddr16)
+        || (size_t)(jit->end - p) < JIT_MAX_INST_BYTES) {
+      if (!count) break;
+      emitAddCycles(&p, count);
+      emitChain(jit, &p, pc);
+      break;
+    }
+
+    switch (opcode) {
+      case 0x1:
+      case 0x2:
+      case 0x3:
+      case 0x4: {
+        static const uint8_t aluOpcodes[] = {0, 0x03, 0x2B, 0x23, 0x33}; // add, sub, and, xor eax, r/m32
+        if (!rd) break;
+        emitToyRM(&p, 0x8B, RAX, rs);
+        emitToyRM(&p, aluOpcodes[opcode], RAX, rt);
+        emitToyRM(&p, 0x89, RAX, rd);
+        break;
+      }
+      case 0x5:
+      case 0x6:
+        if (!rd) break;
+        emitToyRM(&p, 0x8B, RCX, rt);
+        emitToyRM(&p, 0x8B, RAX, rs);
+        emit8(&p, 0xD3); // shl/shr eax, cl, only uses the low 5 bits of cl like the interpreters
+        emit8(&p, opcode == 0x5 ? 0xE0 : 0xE8);
+        emitToyRM(&p, 0x89, RAX, rd);
+        break;
+      case 0x7:
+        if (!rd) break;
+        emitToyRM(&p, 0xC7, 0, rd); // mov r/m32, imm32
+        emit32(&p, addr);
+        break;
+      case 0x8:
+        if (!rd) break;
+        emit8(&p, 0x0F); // movzx eax, word [rdi + memory16 + 2 * addr]
+        emit8(&p, 0xB7);
+        emit8(&p, 0x87);
+        emit32(&p, offsetof(cpu, memory16) + 2 * addr);
+        emitToyRM(&p, 0x89, RAX, rd);
+        break;
+      case 0x9:
+        emitToyRM(&p, 0x8B, RAX, rd);
+        emit8(&p, 0x66); // mov word [rdi + memory16 + 2 * addr], ax
+        emit8(&p, 0x89);
+        emit8(&p, 0x87);
+        emit32(&p, offsetof(cpu, memory16) + 2 * addr);
+        emit8(&p, 0x80); // cmp byte [rip + codeMap + addr], 0
+        emit8(&p, 0x3D);
+        emitRipDisp(&p, jit->codeMap + addr, 1);
+        emit8(&p, 0x00);
+        skip = emitJccShort(&p, 0x74); // je
+        emitExit(jit, &p, count + 1, addr << 16 | JIT_EXIT_INVALIDATE << 8 | nextPC);
+        patchJccShort(&p, skip);
+        break;
+      case 0xA:
+        emitIndirectAddr(jit, &p, rt, pc, count);
+        if (!rd) break;
+        emit8(&p, 0x0F); // movzx eax, word [rdi + rcx * 2 + memory16]
+        emit8(&p, 0xB7);
+        emit8(&p, 0x84);
+        emit8(&p, 0x4F);
+        emit32(&p, offsetof(cpu, memory16));
+        emitToyRM(&p, 0x89, RAX, rd);
+        break;
+      case 0xB:
+        emitIndirectAddr(jit, &p, rt, pc, count);
+        emitToyRM(&p, 0x8B, RAX, rd);
+        emit8(&p, 0x66); // mov word [rdi + rcx * 2 + memory16], ax
+        emit8(&p, 0x89);
+        emit8(&p, 0x84);
+        emit8(&p, 0x4F);
+        emit32(&p, offsetof(cpu, memory16));
+        emit8(&p, 0x48); // lea rax, [rip + codeMap]
+        emit8(&p, 0x8D);
+        emit8(&p, 0x05);
+        emitRipDisp(&p, jit->codeMap, 0);
+        emit8(&p, 0x80); // cmp byte [rax + rcx], 0
+        emit8(&p, 0x3C);
+        emit8(&p, 0x08);
+        emit8(&p, 0x00);
+        skip = emitJccShort(&p, 0x74); // je
+        emitAddCycles(&p, count + 1);
+        emit8(&p, 0x89); // mov eax, ecx
+        emit8(&p, 0xC8);
+        emit8(&p, 0xC1); // shl eax, 16
+        emit8(&p, 0xE0);
+        emit8(&p, 0x10);
+        emit8(&p, 0x0D); // or eax, imm32
+        emit32(&p, JIT_EXIT_INVALIDATE << 8 | nextPC);
+        emit8(&p, 0xE9); // jmp exit
+        emitRel32(&p, jit->exit);
+        patchJccShort(&p, skip);
+        break;
+      case 0xC:
+      case 0xD:
+        emitAddCycles(&p, count + 1);
+        if (rd) {
+          emitToyRM(&p, 0x83, 7, rd); // cmp r/m32, 0
+          emit8(&p, 0x00);
+          emit8(&p, opcode == 0xC ? 0x74 : 0x75); // je/jne over the fallthrough
+          emit8(&p, 6);
+          emitChain(jit, &p, nextPC);
+        } else if (opcode == 0xD) {
+          // r0 is never positive
+          emitChain(jit, &p, nextPC);
+        }
+        if (rd || opcode == 0xC) emitChain(jit, &p, addr);
+        ended = true;
+        break;
+      case 0xE:
+        emitAddCycles(&p, count + 1);
+        emitToyRM(&p, 0x8B, RAX, rd);
+        emit8(&p, 0x0F); // movzx eax, al
+        emit8(&p, 0xB6);
+        emit8(&p, 0xC0);
+        emit8(&p, 0x48); // lea rcx, [rip + blockTable]
+        emit8(&p, 0x8D);
+        emit8(&p, 0x0D);
+        emitRipDisp(&p, jit->blockTable, 0);
+        emit8(&p, 0xFF); // jmp [rcx + rax * 8]
+        emit8(&p, 0x24);
+        emit8(&p, 0xC1);
+        ended = true;
+        break;
+      case 0xF:
+        emitAddCycles(&p, count + 1);
+        if (rd) {
+          emitToyRM(&p, 0xC7, 0, rd);
+          emit32(&p, nextPC);
+        }
+        emitChain(jit, &p, addr);
+        ended = true;
+        break;
+    }
+
+    ++count;
+    if (!ended && (pc == ADDR_MASK_16 || count == JIT_MAX_BLOCK)) {
+      // Don't let blocks wrap around memory
+      emitAddCycles(&p, count);
+      emitChain(jit, &p, nextPC);
+      ended = true;
+    }
+    pc = nextPC;
+  }
+
+  if (!count) {
+    jit->uncompilable[startPC] = true;
+    return false;
+  }
+
+  *length = count;
+  jit->free = p;
+  jit->blockTable[startPC] = start;
+  jit->blockLength[startPC] = count;
+  for (uint32_t i = startPC; i < (uint32_t)startPC + count; ++i) {
+    ++jit->codeMap[i];
+  }
+  return true;
+}
+
+
+// Cold tier, executes a single instruction and returns the next pc
+static uint8_t jitInterpret(jitState *jit, cpu *cpuState, uint8_t pc) {
+  uint32_t *registers = cpuState->registers;
+  uint16_t *memory = cpuState->memory16;
+  uint16_t inst = memory[pc];
+  uint8_t rd = (inst >> 8) & 0xF;
+  uint8_t rs = (inst >> 4) & 0xF;
+  uint8_t rt = inst & 0xF;
+  uint8_t addr = inst & 0xFF;
+  uint8_t nextPC = pc + 1;
+
+  if (cpuState->cycles >= cpuState->cycleLimit) {
+    cpuState->stop = STOP_CYCLE_LIMIT;
+    return pc;
+  }
+
+  ++cpuState->cycles;
+  switch(inst >> 12) {
+    case 0x0:
+      // runCpu16Jit carries on in 32 bit mode from the next address
+      cpuState->in32Bit = inst == 0x0FFF;
+      cpuState->halted = !cpuState->in32Bit;
+      cpuState->pc = cpuState->oldPC = cpuState->halted ? pc : pc + 1;
+      registers[0] = 0;
+      return pc;
+    case 0x1:
+      registers[rd] = registers[rs] + registers[rt];
+      break;
+    case 0x2:
+      registers[rd] = registers[rs] - registers[rt];
+      break;
+    case 0x3:
+      registers[rd] = registers[rs] & registers[rt];
+      break;
+    case 0x4:
+      registers[rd] = registers[rs] ^ registers[rt];
+      break;
+    case 0x5:
+      registers[rd] = registers[rs] << (registers[rt] & 31);
+      break;
+    case 0x6:
+      registers[rd] = registers[rs] >> (registers[rt] & 31);
+      break;
+    case 0x7:
+      registers[rd] = addr;
+      break;
+    case 0xA:
+      addr = registers[rt];
+      // fall through
+    case 0x8:
+      if (addr == stdInOutAddr16) {
+        if (!handleStdin(cpuState, addr)) {
+          // Leave pc on the read so it is retried once more input is available
+          cpuState->stop = STOP_NO_INPUT;
+          --cpuState->cycles;
+          return pc;
+        }
+        if (jit->codeMap[addr]) jitInvalidate(jit, addr);
+      }
+      registers[rd] = memory[addr];
+      break;
+    case 0xB:
+      addr = registers[rt];
+      // fall through
+    case 0x9:
+      memory[addr] = registers[rd];
+      if (jit->codeMap[addr]) jitInvalidate(jit, addr);
+      if (addr == stdInOutAddr16) handleStdout(cpuState, addr);
+      break;
+    case 0xC:
+      if (registers[rd] == 0) nextPC = addr;
+      break;
+    case 0xD:
+      if (registers[rd] > 0) nextPC = addr;
+      break;
+    case 0xE:
+      nextPC = registers[rd];
+      break;
+    case 0xF:
+      registers[rd] = nextPC;
+      nextPC = addr;
+      break;
+  }
+
+  registers[0] = 0;
+  return nextPC;
+}
+
+// Tiered execution: basic blocks are interpreted and counted at their first instruction, once a block has run
+// JIT_THRESHOLD times it's translated to x86-64 and compiled blocks chain into each other through blockTable.
+// Returns when the program switches to 32 bit mode.
+static void runJit16(jitState *jit, cpu *cpuState) {
+  uint8_t pc = cpuState->pc;
+  while (!cpuState->halted && !cpuState->in32Bit && !cpuState->stop) {
+    if (jit->blockLength[pc]) {
+      uint32_t exitCode = ((jitEntry)jit->entry)(cpuState, jit->blockTable[pc]);
+      pc = exitCode & 0xFF;
+      switch ((exitCode >> 8) & 0xFF) {
+        case JIT_EXIT_DISPATCH:
+          break;
+        case JIT_EXIT_INTERPRET:
+          pc = jitInterpret(jit, cpuState, pc);
+          continue;
+        case JIT_EXIT_INVALIDATE:
+          jitInvalidate(jit, exitCode >> 16);
+          continue;
+      }
+      if (jit->blockLength[pc]) continue;
+    }
+
+    if (!jit->uncompilable[pc] && ++jit->counters[pc] >= JIT_THRESHOLD && jitCompile(jit, cpuState, pc)) {
+      continue;
+    }
+
+    // Interpret up to the end of the basic block, or a single instruction if the block can't be compiled
+    // so that whatever follows it gets counted on its own
+    bool single = jit->uncompilable[pc];
+    while (!cpuState->halted && !cpuState->stop) {
+      uint8_t opcode = cpuState->memory16[pc] >> 12;
+      pc = jitInterpret(jit, cpuState, pc);
+      if (single || opcode == 0x0 || opcode >= 0xC || jit->blockLength[pc]) break;
+    }
+  }
+
+  if (!cpuState->halted && !cpuState->in32Bit) cpuState->pc = pc;
+}
+
+// 32 bit stretches run on the threaded interpreter, compiled blocks covering anything they stored to are dropped
+// once the program is back in 16 bit mode
+void runCpu16Jit(cpu *cpuState) {
+  jitState *jit = jitCreate();
+  if (!jit) {
+    runCpu16Threaded(cpuState);
+    return;
+  }
+
+  decodedOp32 *code32 = NULL;
+  uint16_t before[MEM_SIZE_16];
+  while (!cpuState->halted && !cpuState->stop) {
+    if (!cpuState->in32Bit) {
+      runJit16(jit, cpuState);
+      continue;
+    }
+
+    memcpy(before, cpuState->memory16, sizeof(before));
+    runCpu32Threaded(cpuState, &code32);
+    for (uint32_t i = 0; i < MEM_SIZE_16; ++i) {
+      if (cpuState->memory16[i] != before[i] && jit->codeMap[i]) jitInvalidate(jit, i);
+    }
+  }
+
+  free(code32);
+  jitDestroy(jit);
+}
+
+#else
+
+void runCpu16Jit(cpu *cpuState) {
+  runCpu16Threaded(cpuState);
+}
+
+#endif
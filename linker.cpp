@@ -0,0 +1,243 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "image.h"
+#include "xasm.h"
+
+
+static void AppendEntry(std::string &out, std::size_t address, std::string_view name) {
+  ObjectEntry entry{static_cast<uint16_t>(address), static_cast<uint16_t>(name.size())};
+  out.append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+  out.append(name);
+}
+
+std::string ObjectData(const Assembly &object) {
+  // The segments are the binary image's without its header
+  std::string image = BinaryImage(object.image);
+  imageHeader header;
+  std::memcpy(&header, image.data(), sizeof(header));
+
+  ObjectHeader objectHeader{};
+  std::memcpy(objectHeader.magic, ObjectMagic, sizeof(objectHeader.magic));
+  objectHeader.version = ObjectVersion;
+  objectHeader.wordBits = header.wordBits;
+  objectHeader.segmentCount = header.segmentCount;
+  objectHeader.symbolCount = object.symbols.size();
+  objectHeader.relocationCount = object.relocations.size();
+
+  std::string out(reinterpret_cast<const char *>(&objectHeader), sizeof(objectHeader));
+  out.append(image, sizeof(header));
+  for (const Symbol &symbol : object.symbols) {
+    AppendEntry(out, symbol.address, symbol.name);
+  }
+  for (const Relocation &relocation : object.relocations) {
+    AppendEntry(out, relocation.address, relocation.symbol);
+  }
+  return out;
+}
+
+// Takes size bytes off the front of data, failing if there aren't that many
+static bool Take(std::string_view &data, void *out, std::size_t size) {
+  if (data.size() < size) {
+    return false;
+  }
+  std::memcpy(out, data.data(), size);
+  data.remove_prefix(size);
+  return true;
+}
+
+static bool TakeEntry(std::string_view &data, std::size_t &address, std::string &name) {
+  ObjectEntry entry;
+  if (!Take(data, &entry, sizeof(entry)) || data.size() < entry.nameLength) {
+    return false;
+  }
+  address = entry.address;
+  name.assign(data.substr(0, entry.nameLength));
+  data.remove_prefix(entry.nameLength);
+  return true;
+}
+
+bool ReadObject(std::string_view data, Assembly &object) {
+  object = Assembly{};
+
+  ObjectHeader header;
+  if (!Take(data, &header, sizeof(header)) || std::memcmp(header.magic, ObjectMagic, sizeof(header.magic)) != 0) {
+    object.diagnostics.push_back({0, 0, "", "Not an object file"});
+    return false;
+  }
+  if (header.version != ObjectVersion || header.wordBits != 16) {
+    object.diagnostics.push_back({0, 0, "", "Unsupported object version " + std::to_string(header.version)});
+    return false;
+  }
+
+  bool whole = true;
+  for (uint32_t i = 0; i < header.segmentCount && whole; ++i) {
+    imageSegment segment;
+    whole = Take(data, &segment, sizeof(segment)) && segment.address <= MemorySize
+      && segment.wordCount <= MemorySize - segment.address
+      && Take(data, &object.image.words[segment.address], segment.wordCount * sizeof(uint16_t));
+    if (whole) {
+      std::fill_n(object.image.used.begin() + segment.address, segment.wordCount, true);
+    }
+  }
+  // Every entry takes at least its ObjectEntry, so a count past what's left is corrupt rather than worth allocating
+  whole = whole && header.symbolCount <= data.size() / sizeof(ObjectEntry);
+  if (whole) {
+    object.symbols.resize(header.symbolCount);
+  }
+  for (Symbol &symbol : object.symbols) {
+    whole = whole && TakeEntry(data, symbol.address, symbol.name);
+  }
+  whole = whole && header.relocationCount <= data.size() / sizeof(ObjectEntry);
+  if (whole) {
+    object.relocations.resize(header.relocationCount);
+  }
+  for (Relocation &relocation : object.relocations) {
+    whole = whole && TakeEntry(data, relocation.address, relocation.symbol) && relocation.address < MemorySize;
+  }
+
+  if (!whole) {
+    object.diagnostics.push_back({0, 0, "", "Truncated or corrupt object file"});
+    return false;
+  }
+  return true;
+}
+
+
+// Workers take the next source until there are none left, the front ends and the assembler share nothing between
+// calls so nothing is locked
+bool AssembleObjects(const std::vector<std::string_view> &sources, ParseFunction parse, std::vector<Assembly> &objects,
+    unsigned jobs) {
+  objects.assign(sources.size(), Assembly{});
+  std::vector<char> assembled(sources.size());
+  std::atomic<std::size_t> next{0};
+
+  auto worker = [&]() {
+    for (std::size_t i; (i = next++) < sources.size();) {
+      ParsedSource parsed;
+      std::vector<Diagnostic> diagnostics;
+      if (!parse(sources[i], parsed, diagnostics)) {
+        objects[i].diagnostics = std::move(diagnostics);
+        continue;
+      }
+      assembled[i] = AssembleObject(parsed, objects[i]);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < std::min<std::size_t>(jobs, sources.size()); ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  return std::all_of(assembled.begin(), assembled.end(), [](char ok) { return ok; });
+}
+
+
+struct LinkedSymbol {
+  std::size_t address;
+  std::size_t object;
+  // Another object that defines the same label, only an error if something imports it
+  std::size_t duplicate = 0;
+  bool ambiguous = false;
+};
+
+static void LinkError(Assembly &program, std::string_view symbol, const std::string &message) {
+  program.diagnostics.push_back({0, 0, std::string(symbol), message});
+}
+
+bool Link(const std::vector<std::pair<std::string, Assembly>> &objects, Assembly &program) {
+  program = Assembly{};
+  Image &memory = program.image;
+  std::unordered_map<std::string_view, LinkedSymbol> symbols;
+
+  // Each object moves up by the space the ones before it took, which runs from 10 to past its last word
+  std::vector<std::size_t> deltas;
+  std::size_t base = 0x10;
+  for (std::size_t objectIdx = 0; objectIdx < objects.size(); ++objectIdx) {
+    const auto &[name, object] = objects[objectIdx];
+    std::size_t delta = base - 0x10;
+    deltas.push_back(delta);
+
+    // Objects can't use .ORG, so anything but one run of words from 10 couldn't have been moved as a whole
+    std::size_t end = 0x10;
+    for (std::size_t i = 0; i < MemorySize; ++i) {
+      if (!object.image.used[i]) {
+        continue;
+      }
+      if (i != end) {
+        LinkError(program, "", name + " has words outside one run from 10 and can't be moved");
+        return false;
+      }
+      end = i + 1;
+
+      std::size_t address = i + delta;
+      if (address >= MemorySize || memory.used[address]) {
+        LinkError(program, "", name + " doesn't fit in memory after the objects before it");
+        return false;
+      }
+      memory.used[address] = true;
+      memory.words[address] = object.image.words[i];
+      memory.lines[address] = object.image.lines[i];
+    }
+    base += end - 0x10;
+
+    // References within an object are already resolved, so objects can share label names as long as no other
+    // object imports one of them
+    for (const Symbol &symbol : object.symbols) {
+      auto [symbolIter, added] = symbols.emplace(symbol.name, LinkedSymbol{symbol.address + delta, objectIdx});
+      if (!added && !symbolIter->second.ambiguous) {
+        symbolIter->second.ambiguous = true;
+        symbolIter->second.duplicate = objectIdx;
+      }
+      program.symbols.push_back({symbol.name, symbol.address + delta});
+    }
+  }
+
+  for (std::size_t objectIdx = 0; objectIdx < objects.size(); ++objectIdx) {
+    const auto &[name, object] = objects[objectIdx];
+    for (const Relocation &relocation : object.relocations) {
+      if (!object.image.used[relocation.address]) {
+        LinkError(program, relocation.symbol, "Relocation of an empty address in " + name);
+        continue;
+      }
+
+      uint16_t &word = memory.words[relocation.address + deltas[objectIdx]];
+      std::size_t target;
+      if (relocation.symbol.empty()) {
+        target = (word & 0xFF) + deltas[objectIdx];
+      } else {
+        auto symbolIter = symbols.find(relocation.symbol);
+        if (symbolIter == symbols.end()) {
+          LinkError(program, relocation.symbol, "Cannot reference undefined label in " + name);
+          continue;
+        }
+        if (symbolIter->second.ambiguous) {
+          LinkError(program, relocation.symbol, "Cannot reference label in " + name + ", it is defined in both "
+            + objects[symbolIter->second.object].first + " and " + objects[symbolIter->second.duplicate].first);
+          continue;
+        }
+        target = symbolIter->second.address;
+      }
+
+      if (target >= MemorySize) {
+        LinkError(program, relocation.symbol, "Label moved past the end of memory in " + name);
+        continue;
+      }
+      word = (word & 0xFF00) | target;
+    }
+  }
+
+  return program.diagnostics.empty();
+}
@@ -0,0 +1,512 @@
+#include <inttypes.h> // UINT32_MAX, uint16_t, uint32_t, uint64_t, uintptr_t
+#include <stdbool.h>  // bool, false, true
+#include <stdlib.h>   // aligned_alloc, calloc, free, malloc
+#include <string.h>   // memcpy
+
+#include "emulator.h"
+
+#ifdef __GNUC__
+
+// Lanes per group, one AVX2 register of 32 bit registers or two SSE ones
+#define LOCKSTEP_WIDTH (uint32_t)8
+// Instructions each group issues before the scheduler moves on and checks how well the groups are converged
+#define LOCKSTEP_SLICE (uint32_t)4096
+
+// Kernels are written with vector extensions and cloned for AVX2 with a plain x86-64 (SSE2) fallback,
+// the loader picks the clone once at startup
+#if defined(__x86_64__) && defined(__linux__) && !defined(__clang__)
+#define LOCKSTEP_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define LOCKSTEP_KERNEL
+#endif
+
+// One element per lane of a group
+typedef uint16_t lanesU16 __attribute__((vector_size(2 * LOCKSTEP_WIDTH)));
+typedef int16_t  lanesI16 __attribute__((vector_size(2 * LOCKSTEP_WIDTH)));
+typedef uint32_t lanesU32 __attribute__((vector_size(4 * LOCKSTEP_WIDTH)));
+typedef int32_t  lanesI32 __attribute__((vector_size(4 * LOCKSTEP_WIDTH)));
+
+typedef enum {
+  LANE_RUNNING,
+  LANE_HALT,        // Reached opcode 0, finished off when unpacking
+  LANE_CYCLE_LIMIT,
+  LANE_NO_INPUT,
+  LANE_UNUSED       // Padding, a halted cpu or one in 32 bit mode
+} laneState;
+
+// Structure of arrays copy of laneCount 16 bit cpus, everything is indexed [field * laneCount + lane] so each
+// group of LOCKSTEP_WIDTH lanes has its registers and memory words next to each other
+typedef struct {
+  uint32_t laneCount;
+  uint32_t *registers;
+  uint16_t *memory;
+  uint32_t *pc;
+  uint32_t *state;
+  uint64_t *cycles;
+  uint64_t *cycleLimit;
+  cpu      **cpus;
+} lockstepCpus;
+
+
+static void *allocLanes(uint32_t laneCount, size_t perLane) {
+  // aligned_alloc wants the size to be a multiple of the alignment
+  size_t size = (laneCount * perLane + 63) & ~(size_t)63;
+  return aligned_alloc(64, size);
+}
+
+static bool packLanes(lockstepCpus *m, cpu **cpus, uint32_t count) {
+  uint32_t n = (count + LOCKSTEP_WIDTH - 1) / LOCKSTEP_WIDTH * LOCKSTEP_WIDTH;
+  m->laneCount = n;
+  m->registers = allocLanes(n, REG_COUNT * sizeof(uint32_t));
+  m->memory = allocLanes(n, MEM_SIZE_16 * sizeof(uint16_t));
+  m->pc = allocLanes(n, sizeof(uint32_t));
+  m->state = allocLanes(n, sizeof(uint32_t));
+  m->cycles = allocLanes(n, sizeof(uint64_t));
+  m->cycleLimit = allocLanes(n, sizeof(uint64_t));
+  m->cpus = malloc(n * sizeof(cpu *));
+  if (!m->registers || !m->memory || !m->pc || !m->state || !m->cycles || !m->cycleLimit || !m->cpus) return false;
+
+  for (uint32_t lane = 0; lane < n; ++lane) {
+    cpu *cpuState = lane < count ? cpus[lane] : NULL;
+    bool runnable = cpuState && !cpuState->halted && !cpuState->in32Bit;
+    m->cpus[lane] = cpuState;
+    m->state[lane] = runnable ? LANE_RUNNING : LANE_UNUSED;
+    m->pc[lane] = runnable ? cpuState->pc & ADDR_MASK_16 : 0;
+    m->cycles[lane] = runnable ? cpuState->cycles : 0;
+    m->cycleLimit[lane] = runnable ? cpuState->cycleLimit : 0;
+    for (uint32_t r = 0; r < REG_COUNT; ++r) {
+      m->registers[r * n + lane] = runnable ? cpuState->registers[r] : 0;
+    }
+    for (uint32_t addr = 0; addr < MEM_SIZE_16; ++addr) {
+      m->memory[addr * n + lane] = runnable ? cpuState->memory16[addr] : 0;
+    }
+    if (runnable) cpuState->stop = STOP_NONE;
+  }
+  return true;
+}
+
+static void unpackLanes(lockstepCpus *m) {
+  uint32_t n = m->laneCount;
+  for (uint32_t lane = 0; lane < n; ++lane) {
+    cpu *cpuState = m->cpus[lane];
+    if (m->state[lane] == LANE_UNUSED) continue;
+
+    cpuState->pc = cpuState->oldPC = m->pc[lane];
+    cpuState->cycles = m->cycles[lane];
+    for (uint32_t r = 0; r < REG_COUNT; ++r) {
+      cpuState->registers[r] = m->registers[r * n + lane];
+    }
+    for (uint32_t addr = 0; addr < MEM_SIZE_16; ++addr) {
+      cpuState->memory16[addr] = m->memory[addr * n + lane];
+    }
+
+    switch (m->state[lane]) {
+      case LANE_HALT:
+        // A lane switching to 32 bit mode leaves the group and finishes on the threaded interpreter
+        cpuState->in32Bit = cpuState->memory16[cpuState->pc] == 0x0FFF;
+        cpuState->halted = !cpuState->in32Bit;
+        cpuState->registers[0] = 0;
+        if (cpuState->in32Bit) {
+          cpuState->pc = cpuState->oldPC = cpuState->pc + 1;
+          runCpu16Threaded(cpuState);
+        }
+        break;
+      case LANE_CYCLE_LIMIT:
+        cpuState->stop = STOP_CYCLE_LIMIT;
+        break;
+      case LANE_NO_INPUT:
+        cpuState->stop = STOP_NO_INPUT;
+        break;
+    }
+  }
+}
+
+static void freeLanes(lockstepCpus *m) {
+  free(m->registers);
+  free(m->memory);
+  free(m->pc);
+  free(m->state);
+  free(m->cycles);
+  free(m->cycleLimit);
+  free(m->cpus);
+}
+
+// Sorts running lanes by pc so lanes that are at the same place end up in the same group and finished lanes
+// collect in groups at the end that are skipped entirely. Returns false if nothing could be allocated.
+static bool regroupLanes(lockstepCpus *m) {
+  uint32_t n = m->laneCount;
+  uint32_t *order = malloc(n * sizeof(uint32_t));
+  uint32_t *counts = calloc(MEM_SIZE_16 + 1, sizeof(uint32_t));
+  lockstepCpus sorted = *m;
+  sorted.registers = allocLanes(n, REG_COUNT * sizeof(uint32_t));
+  sorted.memory = allocLanes(n, MEM_SIZE_16 * sizeof(uint16_t));
+  if (!order || !counts || !sorted.registers || !sorted.memory) {
+    free(order);
+    free(counts);
+    free(sorted.registers);
+    free(sorted.memory);
+    return false;
+  }
+
+  // Counting sort on pc with everything that isn't running as one extra bucket at the end
+  for (uint32_t lane = 0; lane < n; ++lane) {
+    ++counts[m->state[lane] == LANE_RUNNING ? m->pc[lane] : MEM_SIZE_16];
+  }
+  for (uint32_t i = 0, total = 0; i <= MEM_SIZE_16; ++i) {
+    uint32_t bucket = counts[i];
+    counts[i] = total;
+    total += bucket;
+  }
+  for (uint32_t lane = 0; lane < n; ++lane) {
+    order[counts[m->state[lane] == LANE_RUNNING ? m->pc[lane] : MEM_SIZE_16]++] = lane;
+  }
+
+  // pc, state, cycles and the cpu pointers are small enough to shuffle in place through a scratch copy
+  uint64_t *scratch = (uint64_t *)sorted.registers;
+  for (uint32_t i = 0; i < n; ++i) scratch[i] = m->cycles[order[i]];
+  memcpy(m->cycles, scratch, n * sizeof(uint64_t));
+  for (uint32_t i = 0; i < n; ++i) scratch[i] = m->cycleLimit[order[i]];
+  memcpy(m->cycleLimit, scratch, n * sizeof(uint64_t));
+  for (uint32_t i = 0; i < n; ++i) scratch[i] = (uint64_t)(uintptr_t)m->cpus[order[i]];
+  for (uint32_t i = 0; i < n; ++i) m->cpus[i] = (cpu *)(uintptr_t)scratch[i];
+  for (uint32_t i = 0; i < n; ++i) scratch[i] = (uint64_t)m->pc[order[i]] << 32 | m->state[order[i]];
+  for (uint32_t i = 0; i < n; ++i) {
+    m->pc[i] = scratch[i] >> 32;
+    m->state[i] = (uint32_t)scratch[i];
+  }
+
+  for (uint32_t r = 0; r < REG_COUNT; ++r) {
+    for (uint32_t i = 0; i < n; ++i) sorted.registers[r * n + i] = m->registers[r * n + order[i]];
+  }
+  for (uint32_t addr = 0; addr < MEM_SIZE_16; ++addr) {
+    for (uint32_t i = 0; i < n; ++i) sorted.memory[addr * n + i] = m->memory[addr * n + order[i]];
+  }
+
+  free(m->registers);
+  free(m->memory);
+  m->registers = sorted.registers;
+  m->memory = sorted.memory;
+  free(order);
+  free(counts);
+  return true;
+}
+
+
+// Runs inst on a single lane, used for hlt, ldi/sti and anything that touches the I/O port
+static void stepLane(lockstepCpus *m, uint32_t lane, uint16_t inst) {
+  uint32_t n = m->laneCount;
+  uint32_t *registers = m->registers + lane;
+  uint16_t *memory = m->memory + lane;
+  cpu *cpuState = m->cpus[lane];
+  uint8_t rd = (inst >> 8) & 0xF;
+  uint8_t rs = (inst >> 4) & 0xF;
+  uint8_t rt = inst & 0xF;
+  uint8_t addr = inst & 0xFF;
+  uint8_t nextPC = m->pc[lane] + 1;
+
+  switch (inst >> 12) {
+    case 0x0:
+      m->state[lane] = LANE_HALT;
+      ++m->cycles[lane];
+      return;
+    case 0x1:
+      registers[rd * n] = registers[rs * n] + registers[rt * n];
+      break;
+    case 0x2:
+      registers[rd * n] = registers[rs * n] - registers[rt * n];
+      break;
+    case 0x3:
+      registers[rd * n] = registers[rs * n] & registers[rt * n];
+      break;
+    case 0x4:
+      registers[rd * n] = registers[rs * n] ^ registers[rt * n];
+      break;
+    case 0x5:
+      registers[rd * n] = registers[rs * n] << (registers[rt * n] & 31);
+      break;
+    case 0x6:
+      registers[rd * n] = registers[rs * n] >> (registers[rt * n] & 31);
+      break;
+    case 0x7:
+      registers[rd * n] = addr;
+      break;
+    case 0xA:
+      addr = registers[rt * n];
+      // fall through
+    case 0x8:
+      if (addr == stdInOutAddr16) {
+        if (!handleStdin(cpuState, addr)) {
+          m->state[lane] = LANE_NO_INPUT;
+          return;
+        }
+        memory[addr * n] = cpuState->memory16[addr];
+      }
+      registers[rd * n] = memory[addr * n];
+      break;
+    case 0xB:
+      addr = registers[rt * n];
+      // fall through
+    case 0x9:
+      memory[addr * n] = registers[rd * n];
+      if (addr == stdInOutAddr16) {
+        cpuState->memory16[addr] = memory[addr * n];
+        handleStdout(cpuState, addr);
+      }
+      break;
+    case 0xC:
+      if (registers[rd * n] == 0) nextPC = addr;
+      break;
+    case 0xD:
+      if (registers[rd * n] > 0) nextPC = addr;
+      break;
+    case 0xE:
+      nextPC = registers[rd * n];
+      break;
+    case 0xF:
+      registers[rd * n] = nextPC;
+      nextPC = addr;
+      break;
+  }
+
+  registers[0] = 0;
+  m->pc[lane] = nextPC;
+  ++m->cycles[lane];
+}
+
+// A macro rather than a function so no vector ever crosses a call, that has a different ABI in the AVX2 clone
+#define BLEND32(mask, value, old) (((value) & (lanesU32)(mask)) | ((old) & ~(lanesU32)(mask)))
+
+// True if every lane of mask is set, a macro for the same reason as BLEND32
+#define ALL_LANES(mask, result) do { \
+  result = true; \
+  for (uint32_t l = 0; l < LOCKSTEP_WIDTH; ++l) result &= (mask)[l] != 0; \
+} while (0)
+
+// Issues up to steps instructions for the group starting at lane base. Each step runs the instruction at the lowest
+// pc of any running lane on every lane that is at that pc and has the same word there, the rest wait to reconverge.
+// Branches become a per lane select of the next pc so lanes only split up when they actually go different ways.
+// While every running lane is at the same pc that pc is tracked as a scalar so finding the next instruction doesn't
+// have to wait on the vector of pcs. Returns how many lane instructions were run so the scheduler can tell how
+// converged the group is.
+LOCKSTEP_KERNEL
+static uint64_t stepGroup(lockstepCpus *m, uint32_t base, uint32_t steps, uint32_t *issued) {
+  uint32_t n = m->laneCount;
+  uint32_t *pc = m->pc + base;
+  uint32_t *state = m->state + base;
+  uint64_t *cycles = m->cycles + base;
+  uint64_t *cycleLimit = m->cycleLimit + base;
+  uint64_t executed = 0;
+  uint32_t step = 0;
+
+  // Each step adds at most one cycle to a lane, so no lane can reach its limit within the smallest budget and the
+  // limits only need looking at in between runs of that many steps. Cycles are counted per run in 32 bits.
+  lanesU32 counts = {0};
+  uint32_t budget = 0;
+
+  lanesU32 pcs, states;
+  lanesI32 running;
+  memcpy(&pcs, pc, sizeof(pcs));
+  uint32_t leader = 0, first = 0;
+  bool converged = false;
+
+  while (step < steps) {
+    if (!budget) {
+      budget = steps - step;
+      for (uint32_t l = 0; l < LOCKSTEP_WIDTH; ++l) {
+        cycles[l] += counts[l];
+        executed += counts[l];
+        if (state[l] != LANE_RUNNING) continue;
+        if (cycles[l] >= cycleLimit[l]) {
+          state[l] = LANE_CYCLE_LIMIT;
+          converged = false;
+        } else if (cycleLimit[l] - cycles[l] < budget) {
+          budget = cycleLimit[l] - cycles[l];
+        }
+      }
+      counts = (lanesU32){0};
+      memcpy(&states, state, sizeof(states));
+      running = states == LANE_RUNNING;
+    }
+
+    if (!converged) {
+      // Horizontal min of the running lanes' pcs
+      lanesU32 candidates = BLEND32(running, pcs, (lanesU32){0} + UINT32_MAX);
+      lanesU32 swapped = __builtin_shuffle(candidates, (lanesU32){4, 5, 6, 7, 0, 1, 2, 3});
+      candidates = BLEND32(swapped < candidates, swapped, candidates);
+      swapped = __builtin_shuffle(candidates, (lanesU32){2, 3, 0, 1, 6, 7, 4, 5});
+      candidates = BLEND32(swapped < candidates, swapped, candidates);
+      swapped = __builtin_shuffle(candidates, (lanesU32){1, 0, 3, 2, 5, 4, 7, 6});
+      candidates = BLEND32(swapped < candidates, swapped, candidates);
+      leader = candidates[0];
+      if (leader == UINT32_MAX) break;
+
+      lanesI32 atLeader = running & (pcs == leader);
+      for (first = 0; !atLeader[first]; ++first);
+    }
+
+    ++step;
+    --budget;
+    uint16_t *row = m->memory + leader * n + base;
+    uint16_t inst = row[first];
+    lanesU16 words;
+    memcpy(&words, row, sizeof(words));
+    lanesI32 mask = running & (pcs == leader) & (__builtin_convertvector(words, lanesU32) == inst);
+
+    uint8_t opcode = inst >> 12;
+    uint8_t rd = (inst >> 8) & 0xF;
+    uint8_t addr = inst & 0xFF;
+    bool port = (opcode == 0x8 || opcode == 0x9) && addr == stdInOutAddr16;
+
+    // hlt, the I/O port and ldi/sti that would need a gather/scatter go one lane at a time
+    if (opcode == 0x0 || opcode == 0xA || opcode == 0xB || port) {
+      // stepLane adds to cycles directly, that still only uses up one step of the lane's budget
+      memcpy(pc, &pcs, sizeof(pcs));
+      for (uint32_t l = 0; l < LOCKSTEP_WIDTH; ++l) {
+        if (!mask[l]) continue;
+        stepLane(m, base + l, inst);
+        ++executed;
+      }
+      memcpy(&pcs, pc, sizeof(pcs));
+      memcpy(&states, state, sizeof(states));
+      running = states == LANE_RUNNING;
+      converged = false;
+      continue;
+    }
+
+    uint32_t *dest = m->registers + rd * n + base;
+    lanesU32 s, t, old;
+    memcpy(&s, m->registers + ((inst >> 4) & 0xF) * n + base, sizeof(s));
+    memcpy(&t, m->registers + (inst & 0xF) * n + base, sizeof(t));
+    memcpy(&old, dest, sizeof(old));
+    lanesU32 value = old;
+    // Every lane in mask is at leader so they all share the fall through pc
+    uint32_t next = (leader + 1) & ADDR_MASK_16;
+    lanesU32 nextPC = (lanesU32){0} + next;
+    bool writesRd = rd != 0, uniform = true;
+
+    switch (opcode) {
+      case 0x1:
+        value = s + t;
+        break;
+      case 0x2:
+        value = s - t;
+        break;
+      case 0x3:
+        value = s & t;
+        break;
+      case 0x4:
+        value = s ^ t;
+        break;
+      case 0x5:
+        value = s << (t & 31);
+        break;
+      case 0x6:
+        value = s >> (t & 31);
+        break;
+      case 0x7:
+        value = (lanesU32){0} + addr;
+        break;
+      case 0x8: {
+        lanesU16 words;
+        memcpy(&words, m->memory + addr * n + base, sizeof(words));
+        value = __builtin_convertvector(words, lanesU32);
+        break;
+      }
+      case 0x9: {
+        uint16_t *target = m->memory + addr * n + base;
+        lanesU16 words;
+        lanesI16 mask16 = __builtin_convertvector(mask, lanesI16);
+        memcpy(&words, target, sizeof(words));
+        words = (__builtin_convertvector(old, lanesU16) & (lanesU16)mask16) | (words & ~(lanesU16)mask16);
+        memcpy(target, &words, sizeof(words));
+        writesRd = false;
+        break;
+      }
+      case 0xC:
+      case 0xD:
+      case 0xE:
+        if (opcode == 0xC) {
+          nextPC = BLEND32(old == 0, (lanesU32){0} + addr, nextPC);
+        } else if (opcode == 0xD) {
+          nextPC = BLEND32(old > 0, (lanesU32){0} + addr, nextPC);
+        } else {
+          nextPC = old & ADDR_MASK_16;
+        }
+        next = nextPC[first];
+        ALL_LANES(~mask | (nextPC == next), uniform);
+        writesRd = false;
+        break;
+      case 0xF:
+        value = nextPC;
+        next = addr;
+        nextPC = (lanesU32){0} + next;
+        break;
+    }
+
+    // Writes to r0 are thrown away at the end of every instruction anyway
+    if (writesRd) {
+      value = BLEND32(mask, value, old);
+      memcpy(dest, &value, sizeof(value));
+    }
+
+    pcs = BLEND32(mask, nextPC, pcs);
+    counts -= (lanesU32)mask;
+
+    bool everyLane;
+    ALL_LANES(mask == running, everyLane);
+    converged = everyLane && uniform;
+    leader = next;
+  }
+
+  memcpy(pc, &pcs, sizeof(pcs));
+  for (uint32_t l = 0; l < LOCKSTEP_WIDTH; ++l) {
+    cycles[l] += counts[l];
+    executed += counts[l];
+  }
+  *issued += step;
+  return executed;
+}
+
+// Runs count 16 bit cpus together, results are the same as running each of them through runCpu16Headless though
+// lanes sharing the console will interleave their I/O. Lanes that stop converging are regrouped by pc so the groups
+// stay as full as possible.
+void runCpu16Lockstep(cpu **cpus, uint32_t count) {
+  lockstepCpus m = {0};
+  if (!count) return;
+  // Cpus already in 32 bit mode can't join a group, they run on the threaded interpreter like lanes that switch do
+  for (uint32_t i = 0; i < count; ++i) {
+    cpu *cpuState = cpus[i];
+    if (!cpuState || cpuState->halted || !cpuState->in32Bit) continue;
+    cpuState->stop = STOP_NONE;
+    runCpu16Threaded(cpuState);
+  }
+  if (!packLanes(&m, cpus, count)) {
+    freeLanes(&m);
+    for (uint32_t i = 0; i < count; ++i) runCpu16Threaded(cpus[i]);
+    return;
+  }
+
+  uint32_t groupCount = m.laneCount / LOCKSTEP_WIDTH;
+  while (true) {
+    uint64_t executed = 0;
+    uint32_t issued = 0;
+    for (uint32_t group = 0; group < groupCount; ++group) {
+      executed += stepGroup(&m, group * LOCKSTEP_WIDTH, LOCKSTEP_SLICE, &issued);
+    }
+    if (!issued) break;
+
+    // Less than half full on average, worth paying for a shuffle
+    if (groupCount > 1 && executed * 2 < (uint64_t)issued * LOCKSTEP_WIDTH) regroupLanes(&m);
+  }
+
+  unpackLanes(&m);
+  freeLanes(&m);
+}
+
+#else
+
+void runCpu16Lockstep(cpu **cpus, uint32_t count) {
+  for (uint32_t i = 0; i < count; ++i) runCpu16Threaded(cpus[i]);
+}
+
+#endif
@@ -1,374 +1,330 @@
+#include <algorithm>
 #include <array>
+#include <cerrno>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <map>
 #include <optional>
-
-#include "antlr4-runtime.h"
-#include "asmxtoyLexer.h"
-#include "asmxtoyParser.h"
-#include "asmxtoyBaseListener.h"
-
-using namespace antlr4;
-
-
-enum OperandType {
-  End,
-  Zero,
-  Register,
-  Address
-};
-
-static std::array<OperandType, 3> OperandFormatRRR = {Register, Register, Register};
-static std::array<OperandType, 3> OperandFormatR_R = {Register, Zero, Register};
-static std::array<OperandType, 3> OperandFormatRA  = {Register, Address,  End};
-
-// TODO: Remove registerCount and just use non End operands?
-struct Instruction {
-  std::size_t registerCount;
-
-  uint_fast8_t opcode;
-  std::array<OperandType, 3> operandTypes;
-};
-
-static std::unordered_map<std::string, struct Instruction> Instructions{{
-  {"hlt", {0, 0x0, {Zero, Zero, Zero}}},
-  {"add", {3, 0x1, OperandFormatRRR}},
-  {"sub", {3, 0x2, OperandFormatRRR}},
-  {"and", {3, 0x3, OperandFormatRRR}},
-  {"xor", {3, 0x4, OperandFormatRRR}},
-  {"asl", {3, 0x5, OperandFormatRRR}},
-  {"asr", {3, 0x6, OperandFormatRRR}},
-  {"lda", {2, 0x7, OperandFormatRA}},
-  {"lod", {2, 0x8, OperandFormatRA}},
-  {"str", {2, 0x9, OperandFormatRA}},
-  {"ldi", {2, 0xA, OperandFormatR_R}},
-  {"sti", {2, 0xB, OperandFormatR_R}},
-  {"brz", {2, 0xC, OperandFormatRA}},
-  {"brp", {2, 0xD, OperandFormatRA}},
-  {"jmp", {1, 0xE, {Register, Zero, Zero}}},
-  {"jsr", {2, 0xF, OperandFormatRA}}
-}};
-
-
-enum DirectiveName {
-  ORG,
-  WORD
-};
-
-struct Directive {
-  enum DirectiveName name;
-  uint_fast8_t argumentLength;
-};
-
-static std::unordered_map<std::string, struct Directive> Directives({
-  {"ORG", {DirectiveName::ORG, 2}},
-  {"WORD", {DirectiveName::WORD, 4}}
-});
-
-
-static std::size_t MemoryLocation = 0x10;
-static const std::size_t MemorySize = UINT8_MAX + 1;
-static std::array<bool, MemorySize> MemoryUsed = {false};
-static std::array<std::string, MemorySize> Memory;
-
-static std::unordered_map<std::string, std::size_t> Labels;
-
-
-static void SetMemoryLocation(std::string word, Token *token) {
-  MemoryUsed[MemoryLocation] = true;
-  Memory[MemoryLocation] = word;
-  ++MemoryLocation;
-  if (MemoryUsed[MemoryLocation]) {
-    std::cerr << "Memory address hit an existing adddress which is not allowed" << std::endl;
-    std::cerr << token->toString() << std::endl;
-    throw std::exception();
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "xasm.h"
+
+
+// Maps the source read only, it stays mapped until exit. An empty file is an empty view as it can't be mapped.
+static bool MapSource(const char *path, std::string_view &source) {
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0) {
+    std::cerr << "Cannot open " << path << std::endl;
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
   }
-}
-
-
-// Error checking and label finding
-class XToyPreListener : public asmxtoyBaseListener {
-public:
-  void exitInstruction(asmxtoyParser::InstructionContext *) override;
-  void exitDirective(asmxtoyParser::DirectiveContext *) override;
-  void exitLabel(asmxtoyParser::LabelContext *) override;
-};
-
-class XToyOutputListener : public asmxtoyBaseListener {
-public:
-  void exitInstruction(asmxtoyParser::InstructionContext *) override;
-  void exitDirective(asmxtoyParser::DirectiveContext *) override;
-};
-
 
-void XToyPreListener::exitInstruction(asmxtoyParser::InstructionContext *instructionCtx) {
-  Token *mnemonicToken = instructionCtx->MNEMONIC()->getSymbol();
-  std::string mnemonic = mnemonicToken->getText();
-
-  auto instructionIter = Instructions.find(mnemonic);
-  if (instructionIter == Instructions.end()) {
-    std::cerr << "Found invalid instruction " << mnemonic << std::endl;
-    std::cerr << mnemonicToken->toString() << std::endl;
-    throw std::exception();
+  void *data = nullptr;
+  if (info.st_size != 0) {
+    data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
   }
-
-  struct Instruction instruction = instructionIter->second;
-  std::size_t argumentCount = instructionCtx->argument().size();
-  if (instruction.registerCount != argumentCount) {
-    std::cerr << "Instruction " << mnemonic << " has incorrect argument count " << argumentCount
-      << ", expected " << instruction.registerCount << std::endl;
-    std::cerr << mnemonicToken->toString() << std::endl;
-    throw std::exception();
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "Cannot map " << path << std::endl;
+    return false;
   }
 
-#ifndef NDEBUG
-  std::cout << "Found instruction " << mnemonic << " with " << argumentCount << " arguments" << std::endl;
-#endif
-
-  std::size_t argumentIdx = 0;
-  for (enum OperandType operandType : instruction.operandTypes) {
-    asmxtoyParser::ArgumentContext *const &argumentCtx = instructionCtx->argument(argumentIdx);
-    tree::TerminalNode *argumentNode = nullptr;
-
-    switch (operandType) {
-      case End:
-      case Zero:
-        break;
-      case Register: {
-        // TODO: Report error
-        if (!argumentCtx) {
-          throw std::exception();
-        }
+  source = std::string_view(static_cast<const char *>(data), info.st_size);
+  return true;
+}
 
-        argumentNode = argumentCtx->REGISTER();
-        if (!argumentNode) {
-          std::cerr << "Instruction " << mnemonic << " has incorrect argument at position "
-            << argumentIdx << ", expected register" << std::endl;
-          std::cerr << mnemonicToken->toString() << std::endl;
-          throw std::exception();
-        }
+// Parses the source benchPasses times and reports the front end's throughput instead of assembling
+static int Bench(const char *name, ParseFunction parse, std::string_view source, std::size_t benchPasses) {
+  std::size_t statementCount = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < benchPasses; ++i) {
+    ParsedSource parsed;
+    std::vector<Diagnostic> diagnostics;
+    if (!parse(source, parsed, diagnostics)) {
+      std::cerr << diagnostics.front() << std::endl;
+      return EXIT_FAILURE;
+    }
+    statementCount = parsed.statements.size();
+  }
+  std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
 
-#ifndef NDEBUG
-        std::cout << "  Register: ";
-#endif
-        break;
-      }
-      case Address:
-        // TODO: Report error
-        if (!argumentCtx) {
-          throw std::exception();
-        }
+  std::cerr << name << ": " << benchPasses << " passes over " << source.size() << " bytes with "
+    << statementCount << " statements in " << seconds.count() << "s, "
+    << source.size() * benchPasses / seconds.count() / 1e6 << " MB/s, "
+    << statementCount * benchPasses / seconds.count() / 1e6 << " M statements/s" << std::endl;
+  return EXIT_SUCCESS;
+}
 
-        argumentNode = argumentCtx->HALFWORD();
-        if (argumentNode) {
-          std::string address = argumentNode->getSymbol()->getText();
-          if (address.length() != 2) {
-            std::cerr << "Instruction " << mnemonic << " has incorrect argument at position "
-              << argumentIdx << ", expected 2 digit memory address" << std::endl;
-            std::cerr << mnemonicToken->toString() << std::endl;
-            throw std::exception();
-          }
-        }
+static bool WriteFile(const char *path, const std::string &data) {
+  std::ofstream out(path, std::ios::binary);
+  if (!out) {
+    std::cerr << "Cannot open " << path << " for writing" << std::endl;
+    return false;
+  }
+  out << data;
+  return static_cast<bool>(out);
+}
 
-        if (argumentNode) {
-#ifndef NDEBUG
-          std::cout << "   Address: ";
-#endif
-        } else{
-          argumentNode = argumentCtx->LABEL();
-#ifndef NDEBUG
-          std::cout << "     Label: ";
-#endif
-        }
+static void PrintDiagnostics(const char *name, const std::vector<Diagnostic> &diagnostics) {
+  for (const Diagnostic &diagnostic : diagnostics) {
+    std::cerr << name << ": " << diagnostic << std::endl;
+  }
+}
 
-        if (!argumentNode) {
-          std::cerr << "Instruction " << mnemonic << " has incorrect argument at position "
-            << argumentIdx << ", expected memory address or label" << std::endl;
-          std::cerr << mnemonicToken->toString() << std::endl;
-          throw std::exception();
-        }
-        break;
+// Assembles the sources among the inputs into objects across jobs threads, reads the objects among them as they are
+// and links them all in the order given
+static int LinkInputs(ParseFunction parse, unsigned jobs, const char *imagePath, int inputCount, char **inputPaths) {
+  std::vector<std::pair<std::string, Assembly>> objects(inputCount);
+  std::vector<std::string_view> sources;
+  std::vector<std::size_t> sourceObjects;
+  bool ok = true;
+  for (int i = 0; i < inputCount; ++i) {
+    auto &[name, object] = objects[i];
+    name = inputPaths[i];
+
+    std::string_view data;
+    if (!MapSource(inputPaths[i], data)) {
+      return EXIT_FAILURE;
     }
-
-    if (argumentNode) {
-#ifndef NDEBUG
-      std::cout << argumentNode->getSymbol()->getText() << std::endl;
-#endif
-      ++argumentIdx;
+    if (data.substr(0, sizeof(ObjectMagic)) == std::string_view(ObjectMagic, sizeof(ObjectMagic))) {
+      ok = ReadObject(data, object) && ok;
+    } else {
+      sources.push_back(data);
+      sourceObjects.push_back(i);
     }
   }
 
-  ++MemoryLocation;
-  if (MemoryLocation >= MemorySize) {
-    std::cerr << "Memory address has exceeded max size" << std::endl;
-    std::cerr << mnemonicToken->toString() << std::endl;
-    throw std::exception();
+  std::vector<Assembly> assembled;
+  ok = AssembleObjects(sources, parse, assembled, jobs) && ok;
+  for (std::size_t i = 0; i < sources.size(); ++i) {
+    objects[sourceObjects[i]].second = std::move(assembled[i]);
   }
-}
-
-void XToyPreListener::exitDirective(asmxtoyParser::DirectiveContext *directiveCtx) {
-  Token *directiveToken = directiveCtx->DIRECTIVE()->getSymbol();
-  Token *argumentToken = directiveCtx->WORD()->getSymbol();
-  std::string directive = directiveToken->getText();
-  std::string argument = argumentToken->getText();
-
-  directive.erase(0, 1);
-
-#ifndef NDEBUG
-  std::cout << "Found directive " << directive << " with argument "
-    << argument << std::endl;
-#endif
-
-  if (Directives.count(directive) != 1) {
-    std::cerr << "directive " << directive << " does not exist" << std::endl;
-    std::cerr << directiveToken->toString() << std::endl;
-    throw std::exception();
+  for (const auto &[name, object] : objects) {
+    PrintDiagnostics(name.c_str(), object.diagnostics);
   }
-
-  struct Directive directiveInfo = Directives[directive];
-  if (argument.length() != directiveInfo.argumentLength) {
-    std::cerr << "directive " << directive << " expects an argument of length "
-      << +directiveInfo.argumentLength << " but one of length " << argument.length()
-      << " given" << std::endl;
-    std::cerr << argumentToken->toString() << std::endl;
-    throw std::exception();
+  if (!ok) {
+    return EXIT_FAILURE;
   }
 
-  // TODO: Ensure argument is a hex int
-
-  switch (directiveInfo.name) {
-    case DirectiveName::ORG: {
-      std::size_t newMemoryLocation = std::stoi(argument, nullptr, 16);
-      if (MemoryUsed[newMemoryLocation]) {
-        std::cerr << "ORG directive with an existing adddress is not allowed" << std::endl;
-        std::cerr << argumentToken->toString() << std::endl;
-        throw std::exception();
-      }
-
-      MemoryLocation = newMemoryLocation;
-      }
-      break;
-    case DirectiveName::WORD:
-      ++MemoryLocation;
-      break;
+  Assembly program;
+  if (!Link(objects, program)) {
+    PrintDiagnostics(imagePath, program.diagnostics);
+    return EXIT_FAILURE;
   }
 
+  std::cout << std::endl << "Output:" << std::endl;
+  PrintWords(program.image, std::cout);
+  return WriteFile(imagePath, BinaryImage(program.image)) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-void XToyPreListener::exitLabel(asmxtoyParser::LabelContext *labelCtx) {
-  Token *labelToken = labelCtx->LABEL()->getSymbol();
-  std::string label = labelToken->getText();
+// How long to wait for more of a save after an input changes, editors can write a file in a few steps
+static const int SettleMilliseconds = 2;
 
-#ifndef NDEBUG
-  std::cout << std::setfill('0') << std::setw(2) << std::uppercase << std::hex
-    << "Found label " << label << " with address " << MemoryLocation << std::endl;
-#endif
-
-  if (Labels.count(label) == 1) {
-    std::cerr << "Cannot redefine label" << std::endl;
-    std::cerr << labelToken->toString() << std::endl;
-    throw std::exception();
+// Builds the image again if any input changed or the last build failed, reporting how long it took
+static bool RebuildImage(IncrementalBuild &build, const char *imagePath, bool lastOk) {
+  auto start = std::chrono::steady_clock::now();
+  Assembly program;
+  bool ok = build.Build(program);
+  if (lastOk && build.changedInputs == 0) {
+    return ok;
   }
+  ok = ok && WriteFile(imagePath, BinaryImage(program.image));
+  std::chrono::duration<double, std::milli> milliseconds = std::chrono::steady_clock::now() - start;
 
-  Labels[label] = MemoryLocation;
+  for (const auto &[name, object] : build.Objects()) {
+    PrintDiagnostics(name.c_str(), object.diagnostics);
+  }
+  PrintDiagnostics(imagePath, program.diagnostics);
+  std::cerr << imagePath << ": " << (ok ? "built" : "failed") << " in " << milliseconds.count() << "ms, "
+    << build.changedInputs << " inputs changed, " << build.parsedLines << " lines parsed" << std::endl;
+  return ok;
 }
 
+// Links the inputs like --link and then stays resident, linking them again every time one is saved. The inputs'
+// directories are watched rather than the inputs so saves that rename a new file over an input are seen too.
+static int WatchInputs(ParseFunction parse, const char *imagePath, int inputCount, char **inputPaths) {
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0) {
+    std::cerr << "Cannot watch the inputs" << std::endl;
+    return EXIT_FAILURE;
+  }
 
-void XToyOutputListener::exitInstruction(asmxtoyParser::InstructionContext *instructionCtx) {
-  Token *mnemonicToken = instructionCtx->MNEMONIC()->getSymbol();
-  std::string mnemonic = mnemonicToken->getText();
-  struct Instruction instruction = Instructions.find(mnemonic)->second;
-
-  std::stringstream word;
-  word << std::uppercase << std::hex << +instruction.opcode;
-
-  std::size_t argumentIdx = 0;
-  for (enum OperandType operandType : instruction.operandTypes) {
-    asmxtoyParser::ArgumentContext *const &argumentCtx = instructionCtx->argument(argumentIdx);
+  // The watch of each input's directory and the input's name in it
+  std::vector<std::pair<int, std::string>> watches;
+  for (int i = 0; i < inputCount; ++i) {
+    std::string_view path = inputPaths[i];
+    std::size_t slash = path.rfind('/');
+    std::string directory = slash == std::string_view::npos ? "." : std::string(path.substr(0, slash ? slash : 1));
+    int wd = inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0) {
+      std::cerr << "Cannot watch " << directory << std::endl;
+      close(fd);
+      return EXIT_FAILURE;
+    }
+    watches.push_back({wd, std::string(path.substr(slash + 1))});
+  }
 
-    switch (operandType) {
-      case End:
-        break;
-      case Zero:
-        word << "0";
-        break;
-      case Register: {
-        std::string registerStr = argumentCtx->REGISTER()->getSymbol()->getText();
-        word << std::uppercase << std::hex << registerStr.back();
-        ++argumentIdx;
+  IncrementalBuild build(parse, std::vector<std::string>(inputPaths, inputPaths + inputCount));
+  bool ok = RebuildImage(build, imagePath, false);
+  alignas(inotify_event) char buffer[4096];
+  for (;;) {
+    // Blocks until an input changes and then until no more events come for SettleMilliseconds
+    bool changed = false;
+    for (;;) {
+      pollfd pollFd{fd, POLLIN, 0};
+      int ready = poll(&pollFd, 1, changed ? SettleMilliseconds : -1);
+      if (ready == 0) {
         break;
       }
-      case Address:
-        tree::TerminalNode *addressNode = argumentCtx->HALFWORD();
-        if (addressNode) {
-          word << addressNode->getSymbol()->getText();
-        } else {
-          std::string labelStr = argumentCtx->LABEL()->getSymbol()->getText();
-
-          if (Labels.count(labelStr) == 0) {
-            std::cerr << "Cannot reference undefined label" << std::endl;
-            std::cerr << mnemonicToken->toString() << std::endl;
-            throw std::exception();
-          }
-
-          word << Labels[labelStr];
-        }
+      if (ready < 0 && errno == EINTR) {
+        continue;
+      }
 
-        ++argumentIdx;
-        break;
+      ssize_t length = ready < 0 ? -1 : read(fd, buffer, sizeof(buffer));
+      if (length <= 0) {
+        std::cerr << "Cannot read changes to the inputs" << std::endl;
+        close(fd);
+        return EXIT_FAILURE;
+      }
+      for (char *eventStart = buffer; eventStart < buffer + length; ) {
+        const inotify_event *event = reinterpret_cast<const inotify_event *>(eventStart);
+        for (const auto &[wd, name] : watches) {
+          changed = changed || (event->wd == wd && event->len && name == event->name);
+        }
+        eventStart += sizeof(inotify_event) + event->len;
+      }
     }
-  }
 
-  SetMemoryLocation(word.str(), mnemonicToken);
+    ok = RebuildImage(build, imagePath, ok);
+  }
 }
 
-void XToyOutputListener::exitDirective(asmxtoyParser::DirectiveContext *directiveCtx) {
-  std::string directive = directiveCtx->DIRECTIVE()->getSymbol()->getText();
-  Token *argumentToken = directiveCtx->WORD()->getSymbol();
-  std::string argument = argumentToken->getText();
-
-  directive.erase(0, 1);
-  struct Directive directiveInfo = Directives[directive];
-
-  switch (directiveInfo.name) {
-    case DirectiveName::ORG:
-      MemoryLocation = std::stoi(argument, nullptr, 16);
-      break;
-    case DirectiveName::WORD:
-      SetMemoryLocation(argument, argumentToken);
-      break;
+// Usage: xasm [--frontend antlr|direct] [--bench passes] [--listing] [source] [binary image], the source defaults
+// to test.xasm. The direct front end is the hand written one in scanner.cpp. --listing prints the source next to
+// what it assembled to in place of the plain addr: word lines.
+//        xasm [--frontend antlr|direct] --object source object
+//        xasm [--frontend antlr|direct] [--jobs threads] --link image input...
+// --object assembles a source into a relocatable object. --link links sources and objects into one image in the
+// order given, assembling the sources in parallel. Every label is exported and labels a source uses without
+// defining are imported, two inputs defining the same label is only an error if another one imports it. Sources
+// linked this way can't use .ORG.
+//        xasm [--frontend antlr|direct] --watch image input...
+// --watch links like --link and then again every time an input is saved until interrupted. Each input stays parsed
+// and assembled in between, so only the lines that changed are parsed again and only the inputs that changed are
+// assembled again.
+int main(int argc, char *argv[]) {
+  const char *frontend = "antlr";
+  ParseFunction parse = ParseAntlr;
+  std::size_t benchPasses = 0;
+  bool listing = false, object = false, link = false, watch = false;
+  unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+
+  int argi = 1;
+  for (; argi < argc && std::strncmp(argv[argi], "--", 2) == 0; ++argi) {
+    if (std::strcmp(argv[argi], "--frontend") == 0 && argi + 1 < argc) {
+      frontend = argv[++argi];
+      if (std::strcmp(frontend, "antlr") == 0) {
+        parse = ParseAntlr;
+      } else if (std::strcmp(frontend, "direct") == 0) {
+        parse = ParseDirect;
+      } else {
+        std::cerr << "Unknown front end " << frontend << ", expected antlr or direct" << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (std::strcmp(argv[argi], "--bench") == 0 && argi + 1 < argc) {
+      benchPasses = std::strtoull(argv[++argi], nullptr, 10);
+    } else if (std::strcmp(argv[argi], "--listing") == 0) {
+      listing = true;
+    } else if (std::strcmp(argv[argi], "--object") == 0) {
+      object = true;
+    } else if (std::strcmp(argv[argi], "--link") == 0) {
+      link = true;
+    } else if (std::strcmp(argv[argi], "--watch") == 0) {
+      watch = true;
+    } else if (std::strcmp(argv[argi], "--jobs") == 0 && argi + 1 < argc) {
+      jobs = std::max(1ul, std::strtoul(argv[++argi], nullptr, 10));
+    } else {
+      std::cerr << "Unknown option " << argv[argi] << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (watch) {
+    if (argc - argi < 2) {
+      std::cerr << "--watch needs an image and at least one input" << std::endl;
+      return EXIT_FAILURE;
+    }
+    return WatchInputs(parse, argv[argi], argc - argi - 1, argv + argi + 1);
+  }
+  if (link) {
+    if (argc - argi < 2) {
+      std::cerr << "--link needs an image and at least one input" << std::endl;
+      return EXIT_FAILURE;
+    }
+    return LinkInputs(parse, jobs, argv[argi], argc - argi - 1, argv + argi + 1);
+  }
+  if (object && argc - argi != 2) {
+    std::cerr << "--object needs a source and an object" << std::endl;
+    return EXIT_FAILURE;
   }
-}
 
+  std::string_view source;
+  if (!MapSource(argi < argc ? argv[argi] : "test.xasm", source)) {
+    return EXIT_FAILURE;
+  }
 
-int main(void) {
-  std::ifstream code("test.xasm");
-  ANTLRInputStream input(code);
-  asmxtoyLexer lexer(&input);
-  CommonTokenStream tokens(&lexer);
-  asmxtoyParser parser(&tokens);
+  if (benchPasses) {
+    return Bench(frontend, parse, source, benchPasses);
+  }
 
-  tree::ParseTree* tree = parser.file();
+  // The debug build describes every statement as it is assembled
+  std::ostream *debug = nullptr;
+#ifndef NDEBUG
+  debug = &std::cout;
+#endif
 
-  XToyPreListener preListener;
-  XToyOutputListener outputListener;
-  try {
-    tree::ParseTreeWalker::DEFAULT.walk(&preListener, tree);
-    MemoryLocation = 0x10;
-    tree::ParseTreeWalker::DEFAULT.walk(&outputListener, tree);
-  } catch (const std::exception &) {
+  ParsedSource parsed;
+  Assembly assembly;
+  if (!parse(source, parsed, assembly.diagnostics)
+      || !(object ? AssembleObject(parsed, assembly, debug) : Assemble(parsed, assembly, debug))) {
+    for (const Diagnostic &diagnostic : assembly.diagnostics) {
+      std::cerr << diagnostic << std::endl;
+    }
     return EXIT_FAILURE;
   }
 
-  std::cout << std::endl << "Output:" << std::endl;
-  for (std::size_t i = 0; i < MemorySize; ++i) {
-    if (MemoryUsed[i]) {
-      std::cout << std::setfill('0') << std::setw(2) << std::uppercase << std::hex
-        << i << ": " << Memory[i] << std::endl;
-    }
+  if (object) {
+    return WriteFile(argv[argi + 1], ObjectData(assembly)) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (listing) {
+    std::cout << std::endl << "Listing:" << std::endl;
+    PrintListing(assembly.image, source, std::cout);
+  } else {
+    std::cout << std::endl << "Output:" << std::endl;
+    PrintWords(assembly.image, std::cout);
+  }
+
+  if (argi + 1 < argc && !WriteFile(argv[argi + 1], BinaryImage(assembly.image))) {
+    return EXIT_FAILURE;
   }
 
   return EXIT_SUCCESS;
@@ -0,0 +1,217 @@
+#include <pthread.h>   // PTHREAD_MUTEX_INITIALIZER, pthread_mutex_lock, pthread_mutex_t, pthread_mutex_unlock
+#include <stdatomic.h> // atomic_fetch_add_explicit, atomic_fetch_sub_explicit, atomic_init, atomic_load_explicit, memory_order_acq_rel, memory_order_acquire, memory_order_relaxed
+#include <stdbool.h>   // bool, false, true
+#include <stdlib.h>    // free, malloc, realloc
+#include <string.h>    // memcmp, memcpy, memset
+
+#include "emulator.h"
+
+// Everything past page 0 lives in refcounted pages that forks share until one of them writes, pages that were
+// never written are NULL and read as zero. Page 0 is the memory16/memory32 array inside cpu itself so the 16 bit
+// engines always see a flat private array, forking just copies it along with the rest of the struct.
+// Loaded pages are interned so cpus that loaded the same image share one copy of it the same way forks do, the
+// table holds a reference of its own and drops the page once it's the only one left.
+
+// Power of two
+#define INTERN_BUCKETS (uint32_t)4096
+
+static memPage *internTable[INTERN_BUCKETS];
+static pthread_mutex_t internLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void releasePage(memPage *page) {
+  if (!page) return;
+  if (!page->interned) {
+    if (atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1) free(page);
+    return;
+  }
+
+  // Lookups take references under the lock so the count can't go back up once only the table holds it
+  pthread_mutex_lock(&internLock);
+  if (atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 2) {
+    memPage **link = internTable + page->hash % INTERN_BUCKETS;
+    while (*link != page) link = &(*link)->next;
+    *link = page->next;
+    free(page);
+  }
+  pthread_mutex_unlock(&internLock);
+}
+
+static memPage *newPage(const memPage *contents) {
+  memPage *page = malloc(sizeof(memPage));
+  if (!page) return NULL;
+  atomic_init(&page->refs, 1);
+  page->interned = false;
+  if (contents) {
+    memcpy(page->words, contents->words, sizeof(page->words));
+  } else {
+    memset(page->words, 0, sizeof(page->words));
+  }
+  return page;
+}
+
+uint32_t memRead32(cpu *cpuState, uint32_t addr) {
+  uint32_t pageIndex = addr / PAGE_WORDS_32;
+  if (!pageIndex) return cpuState->memory32[addr];
+  memPage *page = pageIndex < cpuState->pageCount ? cpuState->pages[pageIndex] : NULL;
+  return page ? page->words[addr % PAGE_WORDS_32] : 0;
+}
+
+// Doubles the page table until it covers pageIndex
+static bool growPages(cpu *cpuState, uint32_t pageIndex) {
+  uint32_t count = cpuState->pageCount ? cpuState->pageCount : 4;
+  while (count <= pageIndex) count *= 2;
+  memPage **pages = realloc(cpuState->pages, count * sizeof(memPage *));
+  if (!pages) return false;
+  memset(pages + cpuState->pageCount, 0, (count - cpuState->pageCount) * sizeof(memPage *));
+  cpuState->pages = pages;
+  cpuState->pageCount = count;
+  return true;
+}
+
+// Returns the word at addr ready to be written, giving the cpu its own copy of the page first if it's shared. When
+// the page can't be allocated the cpu is stopped with STOP_OUT_OF_MEMORY and the word returned is a scratch one, so
+// the write is lost rather than ending the process.
+uint32_t *memWord32(cpu *cpuState, uint32_t addr) {
+  // A page so the bulk copies can fill a whole run of it, per thread as cpus run on several
+  static _Thread_local uint32_t scratch[PAGE_WORDS_32];
+
+  uint32_t pageIndex = addr / PAGE_WORDS_32;
+  if (!pageIndex) return cpuState->memory32 + addr;
+
+  if (pageIndex >= cpuState->pageCount && !growPages(cpuState, pageIndex)) {
+    cpuState->stop = STOP_OUT_OF_MEMORY;
+    return scratch + addr % PAGE_WORDS_32;
+  }
+  memPage **slot = cpuState->pages + pageIndex;
+  if (!*slot || atomic_load_explicit(&(*slot)->refs, memory_order_acquire) > 1) {
+    memPage *shared = *slot;
+    memPage *page = newPage(shared);
+    if (!page) {
+      cpuState->stop = STOP_OUT_OF_MEMORY;
+      return scratch + addr % PAGE_WORDS_32;
+    }
+    *slot = page;
+    releasePage(shared);
+  }
+  return (*slot)->words + addr % PAGE_WORDS_32;
+}
+
+void memWrite32(cpu *cpuState, uint32_t addr, uint32_t word) {
+  *memWord32(cpuState, addr) = word;
+}
+
+// 16 bit words laid over the same memory the way memory16 overlays memory32, used by the loader which can place
+// words past the 16 bit address space
+void memWrite16(cpu *cpuState, uint32_t addr, uint16_t word) {
+  if (addr < MEM_SIZE_16) {
+    cpuState->memory16[addr] = word;
+    return;
+  }
+  uint32_t *pair = memWord32(cpuState, addr / 2);
+  ((uint16_t *)pair)[addr % 2] = word;
+}
+
+// Bulk memWrite32 for loaders, words doesn't have to be aligned
+void memCopy32(cpu *cpuState, uint32_t addr, const void *words, uint32_t count) {
+  const char *src = words;
+  while (count) {
+    uint32_t run = PAGE_WORDS_32 - addr % PAGE_WORDS_32;
+    if (run > count) run = count;
+    memcpy(memWord32(cpuState, addr), src, run * sizeof(uint32_t));
+    addr += run;
+    src += run * sizeof(uint32_t);
+    count -= run;
+  }
+}
+
+// Bulk memWrite16, a page holds MEM_SIZE_16 16 bit words
+void memCopy16(cpu *cpuState, uint32_t addr, const void *words, uint32_t count) {
+  const char *src = words;
+  while (count) {
+    uint32_t run = MEM_SIZE_16 - addr % MEM_SIZE_16;
+    if (run > count) run = count;
+    memcpy((uint16_t *)memWord32(cpuState, addr / 2) + addr % 2, src, run * sizeof(uint16_t));
+    addr += run;
+    src += run * sizeof(uint16_t);
+    count -= run;
+  }
+}
+
+void resetCpuMemory(cpu *cpuState) {
+  memset(cpuState->memory32, 0, sizeof(cpuState->memory32));
+  for (uint32_t i = 1; i < cpuState->pageCount; ++i) {
+    releasePage(cpuState->pages[i]);
+    cpuState->pages[i] = NULL;
+  }
+}
+
+void freeCpuMemory(cpu *cpuState) {
+  resetCpuMemory(cpuState);
+  free(cpuState->pages);
+  cpuState->pages = NULL;
+  cpuState->pageCount = 0;
+}
+
+static uint32_t hashPage(const memPage *page) {
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < PAGE_WORDS_32; ++i) hash = (hash ^ page->words[i]) * 16777619u;
+  return hash;
+}
+
+// Swaps every private page past page 0 for the interned copy of its words, interning it if there isn't one yet.
+// Pages left all zero are dropped since a NULL page reads the same. Meant to run once an image has been loaded,
+// after that the cpu only gets its own copy of a page when it writes to it.
+void internPages(cpu *cpuState) {
+  static const uint32_t zeroWords[PAGE_WORDS_32];
+
+  for (uint32_t i = 1; i < cpuState->pageCount; ++i) {
+    memPage *page = cpuState->pages[i];
+    if (!page || page->interned || atomic_load_explicit(&page->refs, memory_order_acquire) > 1) continue;
+
+    if (!memcmp(page->words, zeroWords, sizeof(zeroWords))) {
+      releasePage(page);
+      cpuState->pages[i] = NULL;
+      continue;
+    }
+
+    uint32_t hash = hashPage(page);
+    pthread_mutex_lock(&internLock);
+    memPage *found = internTable[hash % INTERN_BUCKETS];
+    while (found && (found->hash != hash || memcmp(found->words, page->words, sizeof(page->words)))) {
+      found = found->next;
+    }
+    if (found) {
+      atomic_fetch_add_explicit(&found->refs, 1, memory_order_relaxed);
+    } else {
+      page->interned = true;
+      page->hash = hash;
+      page->next = internTable[hash % INTERN_BUCKETS];
+      internTable[hash % INTERN_BUCKETS] = page;
+      atomic_fetch_add_explicit(&page->refs, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&internLock);
+
+    if (found) {
+      releasePage(page);
+      cpuState->pages[i] = found;
+    }
+  }
+}
+
+// Makes child a copy of parent as it is right now, memory past page 0 is shared until either of them writes to it.
+// Several children can be forked from the same parent at once as long as the parent isn't running. Returns false,
+// leaving child alone, if its page table can't be allocated.
+bool forkCpu(cpu *child, cpu *parent) {
+  memPage **pages = NULL;
+  if (parent->pageCount) {
+    if (!(pages = malloc(parent->pageCount * sizeof(memPage *)))) return false;
+    for (uint32_t i = 0; i < parent->pageCount; ++i) {
+      pages[i] = parent->pages[i];
+      if (pages[i]) atomic_fetch_add_explicit(&pages[i]->refs, 1, memory_order_relaxed);
+    }
+  }
+
+  *child = *parent;
+  child->pages = pages;
+  return true;
+}
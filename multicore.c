@@ -0,0 +1,432 @@
+#include <inttypes.h> // PRIu32, PRIu64, PRIX16, uint16_t, uint32_t, uint64_t
+#include <pthread.h>  // pthread_create, pthread_join, pthread_mutex_destroy, pthread_mutex_init, pthread_mutex_lock, pthread_mutex_t, pthread_mutex_unlock, pthread_t
+#include <stdbool.h>  // bool, false, true
+#include <stdio.h>    // fprintf, printf, puts, stderr
+#include <stdlib.h>   // calloc, free
+#include <time.h>     // clock_gettime, CLOCK_MONOTONIC, timespec
+
+#include "emulator.h"
+
+// Several cores running one image against the memory of the cpu it was loaded into. Each core is a cpu of its own
+// for the registers, pc, mode and access tracking but its memory is never touched, every load, store and fetch goes
+// to the shared cpu instead. Cores start where the image does with their number in R[1] so the program can tell
+// them apart, and share the one I/O port.
+//
+// The deterministic mode runs the cores on the calling thread, each in turn for quantum instructions, so a program
+// and its input always interleave the same way. That's also where the race detector runs. Free running gives every
+// core a host thread of its own. Memory is then sequentially consistent: every fetch, load and store is a single
+// atomic access of the whole word and all cores see them in one order that keeps each core's own program order, the
+// same guarantee every round robin interleaving gives. TOY has no read-modify-write so that's what locks like
+// Peterson's rely on. I/O is serialised, a word read from the port goes straight to the core that read it and the
+// word written is what's output even if another core stores to the port address in between.
+
+// The race detector tracks memory as 16 bit words so 16 and 32 bit accesses to the same place meet
+#define RACE_UNITS (uint32_t)(MEM_SIZE_32 * 2)
+// Units whose history is allocated together, the first time one of them is accessed
+#define RACE_CHUNK (uint32_t)256
+
+// The last time a core accessed a unit, clock 0 when it never has. For synchronisation addresses the clock of each
+// read slot is instead the vector clock released to whoever reads the address next.
+typedef struct {
+  uint32_t clock;
+  uint16_t pc;
+  uint8_t  core;
+} raceAccess;
+
+typedef struct {
+  cpu             *memory;
+  uint32_t        *pageWords[PAGE_COUNT];
+  cpu             *cores;
+  uint32_t        coreCount;
+  bool            freeRunning;
+  pthread_mutex_t ioLock;
+
+  // Happens before race detection, DJIT+ style. Every core has a vector clock, a store to a synchronisation address
+  // releases it and a load from one acquires whatever was released there. A load or store of anything else races
+  // with an earlier access by another core to the same unit, at least one of them a store, unless the vector clock
+  // of the core shows it already acquired that access.
+  bool            detect;
+  const uint64_t  *sync;
+  uint32_t        *clocks; // coreCount by coreCount, row per core
+  // Per unit the last store then the last load by each core
+  raceAccess      *races[RACE_UNITS / RACE_CHUNK];
+  uint64_t        reported[RACE_UNITS / 64];
+  uint64_t        raceCount;
+  // The detector couldn't allocate a chunk of history, every core was stopped
+  bool            outOfMemory;
+} multicore;
+
+typedef struct {
+  multicore *m;
+  uint32_t  index;
+  bool      started;
+} coreThread;
+
+static uint16_t load16(multicore *m, uint16_t addr) {
+  uint16_t *word = m->memory->memory16 + addr;
+  return m->freeRunning ? __atomic_load_n(word, __ATOMIC_SEQ_CST) : *word;
+}
+
+static void store16(multicore *m, uint16_t addr, uint16_t value) {
+  uint16_t *word = m->memory->memory16 + addr;
+  if (m->freeRunning) {
+    __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+  } else {
+    *word = value;
+  }
+}
+
+static uint32_t load32(multicore *m, uint16_t addr) {
+  uint32_t *word = m->pageWords[addr / PAGE_WORDS_32] + addr % PAGE_WORDS_32;
+  return m->freeRunning ? __atomic_load_n(word, __ATOMIC_SEQ_CST) : *word;
+}
+
+static void store32(multicore *m, uint16_t addr, uint32_t value) {
+  uint32_t *word = m->pageWords[addr / PAGE_WORDS_32] + addr % PAGE_WORDS_32;
+  if (m->freeRunning) {
+    __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+  } else {
+    *word = value;
+  }
+}
+
+// Loads the word at addr into value, returning false if it's the I/O port and there's no input left
+static bool coreLoad(multicore *m, cpu *core, uint16_t addr, uint32_t *value) {
+  bool wide = core->in32Bit;
+  if (addr == (wide ? stdInOutAddr32 : stdInOutAddr16)) {
+    uint32_t word;
+    pthread_mutex_lock(&m->ioLock);
+    bool read = m->memory->io ? m->memory->io->read(m->memory->io, &word, wide) : readConsole(&word, wide);
+    pthread_mutex_unlock(&m->ioLock);
+    if (!read) {
+      core->stop = STOP_NO_INPUT;
+      return false;
+    }
+    if (wide) {
+      store32(m, addr, word);
+    } else {
+      store16(m, addr, word);
+    }
+    *value = wide ? word : (uint16_t)word;
+  } else {
+    *value = wide ? load32(m, addr) : load16(m, addr);
+  }
+  core->readMem = true;
+  core->lastReadAddr = addr;
+  return true;
+}
+
+static void coreStore(multicore *m, cpu *core, uint16_t addr, uint32_t value) {
+  bool wide = core->in32Bit;
+  bool port = addr == (wide ? stdInOutAddr32 : stdInOutAddr16);
+  core->wroteMem = !port;
+  core->lastWriteAddr = addr;
+  if (wide) {
+    store32(m, addr, value);
+  } else {
+    store16(m, addr, value);
+  }
+  if (!port) return;
+
+  value = wide ? value : (uint16_t)value;
+  pthread_mutex_lock(&m->ioLock);
+  if (m->memory->io) {
+    m->memory->io->write(m->memory->io, value, wide);
+  } else {
+    writeConsole(value, wide);
+  }
+  pthread_mutex_unlock(&m->ioLock);
+}
+
+// The load and store slots of unit, allocating them along with the rest of its chunk the first time. If that fails
+// every core is stopped, the detector only runs on the calling thread so none of them is mid instruction, and NULL
+// is returned.
+static raceAccess *raceSlots(multicore *m, uint32_t unit) {
+  raceAccess **chunk = m->races + unit / RACE_CHUNK;
+  if (!*chunk && !(*chunk = calloc(RACE_CHUNK * (m->coreCount + 1), sizeof(raceAccess)))) {
+    m->outOfMemory = true;
+    for (uint32_t i = 0; i < m->coreCount; ++i) {
+      if (!m->cores[i].halted && m->cores[i].stop == STOP_NONE) m->cores[i].stop = STOP_OUT_OF_MEMORY;
+    }
+    return NULL;
+  }
+  return *chunk + unit % RACE_CHUNK * (m->coreCount + 1);
+}
+
+// Reports the first race found on each unit
+static void reportRace(multicore *m, uint32_t unit, uint16_t addr, raceAccess *earlier, bool earlierStore,
+                       uint32_t index, bool store, uint16_t pc) {
+  if (BREAK_BIT(m->reported, unit)) return;
+  m->reported[unit >> 6] |= (uint64_t)1 << (unit & 63);
+  ++m->raceCount;
+  fprintf(stderr, "Race on M[%02" PRIX16 "] between core %u %s at pc %02" PRIX16 " and core %" PRIu32 " %s at pc %02"
+    PRIX16 "\n", addr, earlier->core, earlierStore ? "storing" : "loading", earlier->pc, index,
+    store ? "storing" : "loading", pc);
+}
+
+static void checkAccess(multicore *m, uint32_t index, uint16_t addr, bool store, uint16_t pc) {
+  cpu *core = m->cores + index;
+  uint32_t count = m->coreCount;
+  uint32_t *clock = m->clocks + index * count;
+  uint32_t unit = core->in32Bit ? addr * 2u : addr;
+  uint32_t units = core->in32Bit ? 2 : 1;
+
+  if (BREAK_BIT(m->sync, addr)) {
+    for (uint32_t u = unit; u < unit + units; ++u) {
+      raceAccess *released = raceSlots(m, u);
+      if (!released++) return;
+      for (uint32_t i = 0; i < count; ++i) {
+        if (store && clock[i] > released[i].clock) released[i].clock = clock[i];
+        if (!store && released[i].clock > clock[i]) clock[i] = released[i].clock;
+      }
+    }
+    // Whatever this core does next isn't covered by the release
+    if (store) ++clock[index];
+    return;
+  }
+
+  for (uint32_t u = unit; u < unit + units; ++u) {
+    raceAccess *slots = raceSlots(m, u);
+    if (!slots) return;
+    raceAccess *lastStore = slots;
+    if (lastStore->clock && lastStore->core != index && lastStore->clock > clock[lastStore->core]) {
+      reportRace(m, u, addr, lastStore, true, index, store, pc);
+    }
+    if (store) {
+      for (uint32_t i = 0; i < count; ++i) {
+        if (i != index && slots[1 + i].clock > clock[i]) reportRace(m, u, addr, slots + 1 + i, false, index, true, pc);
+      }
+      *lastStore = (raceAccess){clock[index], pc, index};
+    } else {
+      slots[1 + index] = (raceAccess){clock[index], pc, index};
+    }
+  }
+}
+
+// Runs one instruction on the core, the same way the reference interpreter does in whichever mode the core is in
+static void stepCore(multicore *m, uint32_t index) {
+  cpu *core = m->cores + index;
+  if (core->cycles >= core->cycleLimit) {
+    core->stop = STOP_CYCLE_LIMIT;
+    return;
+  }
+
+  uint32_t *r = core->registers;
+  uint16_t pc = core->pc, next;
+  core->readMem = core->wroteMem = false;
+
+  if (core->in32Bit) {
+    uint32_t inst = load32(m, pc);
+    uint8_t rd = (inst >> 24) & 0xF;
+    uint8_t rs = (inst >> 20) & 0xF;
+    uint8_t rt = (inst >> 16) & 0xF;
+    uint16_t addr = inst & 0xFFFF;
+    next = pc + 1;
+
+    switch (inst >> 28) {
+      case 0x0:
+        if (inst != 0x0FFF) {
+          core->halted = true;
+          ++core->cycles;
+          return;
+        }
+        core->in32Bit = false;
+        next &= ADDR_MASK_16;
+        break;
+      case 0x1: r[rd] = r[rs] + r[rt]; break;
+      case 0x2: r[rd] = r[rs] - r[rt]; break;
+      case 0x3: r[rd] = r[rs] & r[rt]; break;
+      case 0x4: r[rd] = r[rs] ^ r[rt]; break;
+      case 0x5: r[rd] = r[rs] << (r[rt] & 31); break;
+      case 0x6: r[rd] = r[rs] >> (r[rt] & 31); break;
+      case 0x7: r[rd] = addr; break;
+      case 0x8:
+        // Leave the instruction unfinished if there was no input for it
+        if (!coreLoad(m, core, addr, r + rd)) return;
+        break;
+      case 0x9: coreStore(m, core, addr, r[rd]); break;
+      case 0xA:
+        if (!coreLoad(m, core, r[rt], r + rd)) return;
+        break;
+      case 0xB: coreStore(m, core, r[rt], r[rd]); break;
+      case 0xC: if (r[rd] == 0) next = addr; break;
+      case 0xD: if (r[rd] > 0) next = addr; break;
+      case 0xE: next = r[rd]; break;
+      case 0xF:
+        r[rd] = (uint16_t)(pc + 1);
+        next = addr;
+        break;
+    }
+  } else {
+    uint16_t inst = load16(m, pc);
+    uint8_t rd = (inst >> 8) & 0xF;
+    uint8_t rs = (inst >> 4) & 0xF;
+    uint8_t rt = inst & 0xF;
+    uint8_t addr = inst & 0xFF;
+    next = (pc + 1) & ADDR_MASK_16;
+
+    switch (inst >> 12) {
+      case 0x0:
+        if (inst != 0x0FFF) {
+          core->halted = true;
+          ++core->cycles;
+          return;
+        }
+        core->in32Bit = true;
+        next = pc + 1;
+        break;
+      case 0x1: r[rd] = r[rs] + r[rt]; break;
+      case 0x2: r[rd] = r[rs] - r[rt]; break;
+      case 0x3: r[rd] = r[rs] & r[rt]; break;
+      case 0x4: r[rd] = r[rs] ^ r[rt]; break;
+      case 0x5: r[rd] = r[rs] << (r[rt] & 31); break;
+      case 0x6: r[rd] = r[rs] >> (r[rt] & 31); break;
+      case 0x7: r[rd] = addr; break;
+      case 0x8:
+        if (!coreLoad(m, core, addr, r + rd)) return;
+        break;
+      case 0x9: coreStore(m, core, addr, r[rd]); break;
+      case 0xA:
+        if (!coreLoad(m, core, r[rt] & ADDR_MASK_16, r + rd)) return;
+        break;
+      case 0xB: coreStore(m, core, r[rt] & ADDR_MASK_16, r[rd]); break;
+      case 0xC: if (r[rd] == 0) next = addr; break;
+      case 0xD: if (r[rd] > 0) next = addr; break;
+      case 0xE: next = r[rd] & ADDR_MASK_16; break;
+      case 0xF:
+        r[rd] = (pc + 1) & ADDR_MASK_16;
+        next = addr;
+        break;
+    }
+  }
+
+  r[0] = 0;
+  core->oldPC = pc;
+  core->pc = next;
+  ++core->cycles;
+
+  if (!m->detect) return;
+  // The I/O port is a device rather than memory the cores share
+  uint16_t port = core->in32Bit ? stdInOutAddr32 : stdInOutAddr16;
+  if (core->readMem && core->lastReadAddr != port) checkAccess(m, index, core->lastReadAddr, false, pc);
+  if (core->wroteMem) checkAccess(m, index, core->lastWriteAddr, true, pc);
+}
+
+static bool coreRunning(cpu *core) {
+  return !core->halted && core->stop == STOP_NONE;
+}
+
+static void *coreThreadMain(void *arg) {
+  coreThread *thread = arg;
+  cpu *core = thread->m->cores + thread->index;
+  while (coreRunning(core)) stepCore(thread->m, thread->index);
+  return NULL;
+}
+
+// Runs every core that isn't on a thread of its own in turn until they've all stopped
+static void runRoundRobin(multicore *m, coreThread *threads, uint32_t quantum) {
+  bool running = true;
+  while (running) {
+    running = false;
+    for (uint32_t i = 0; i < m->coreCount; ++i) {
+      cpu *core = m->cores + i;
+      if (threads[i].started) continue;
+      for (uint32_t n = 0; n < quantum && coreRunning(core); ++n) stepCore(m, i);
+      running |= coreRunning(core);
+    }
+  }
+}
+
+// Frees what runCores allocated, any of it may be NULL
+static void freeCores(multicore *m, cpu *cores, coreThread *threads, pthread_t *handles) {
+  if (m) {
+    pthread_mutex_destroy(&m->ioLock);
+    for (uint32_t i = 0; i < RACE_UNITS / RACE_CHUNK; ++i) free(m->races[i]);
+    free(m->clocks);
+  }
+  free(handles);
+  free(threads);
+  free(cores);
+  free(m);
+}
+
+// Runs config->coreCount cores from the image loaded into cpuState until every one of them has halted or stopped,
+// reporting how each finished. Returns 1 if the race detector found anything or memory ran out.
+int runCores(cpu *cpuState, coreConfig *config) {
+  uint32_t count = config->coreCount;
+  if (count < 1 || count > MAX_CORES) {
+    printf("Between 1 and %" PRIu32 " cores can be run\n", MAX_CORES);
+    return 1;
+  }
+
+  multicore *m = calloc(1, sizeof(multicore));
+  cpu *cores = calloc(count, sizeof(cpu));
+  coreThread *threads = calloc(count, sizeof(coreThread));
+  pthread_t *handles = calloc(count, sizeof(pthread_t));
+  if (m) pthread_mutex_init(&m->ioLock, NULL);
+  if (!m || !cores || !threads || !handles) {
+    puts("Out of memory");
+    freeCores(m, cores, threads, handles);
+    return 1;
+  }
+
+  // Give the shared cpu every page up front so no core ever has to grow or copy one under another
+  m->memory = cpuState;
+  m->pageWords[0] = cpuState->memory32;
+  for (uint32_t i = 1; i < PAGE_COUNT; ++i) m->pageWords[i] = memWord32(cpuState, i * PAGE_WORDS_32);
+  m->cores = cores;
+  m->coreCount = count;
+  m->freeRunning = config->freeRunning;
+  m->detect = !config->freeRunning;
+  m->sync = config->sync;
+  if (m->detect) m->clocks = calloc((size_t)count * count, sizeof(uint32_t));
+  if (cpuState->stop == STOP_OUT_OF_MEMORY || (m->detect && !m->clocks)) {
+    puts("Out of memory");
+    freeCores(m, cores, threads, handles);
+    return 1;
+  }
+
+  for (uint32_t i = 0; i < count; ++i) {
+    cores[i] = *cpuState;
+    cores[i].pages = NULL;
+    cores[i].pageCount = 0;
+    cores[i].registers[1] = i;
+    threads[i] = (coreThread){m, i, false};
+    if (m->detect) m->clocks[i * count + i] = 1;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // A core whose thread fails to start is run by the calling thread alongside any others that failed
+  if (m->freeRunning) {
+    for (uint32_t i = 0; i < count; ++i) {
+      threads[i].started = !pthread_create(handles + i, NULL, coreThreadMain, threads + i);
+    }
+  }
+  runRoundRobin(m, threads, m->freeRunning ? 1 : config->quantum ? config->quantum : 1);
+  for (uint32_t i = 0; i < count; ++i) {
+    if (threads[i].started) pthread_join(handles[i], NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  uint64_t cycles = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    cpu *core = cores + i;
+    cycles += core->cycles;
+    fprintf(stderr, "Core %" PRIu32 " %s at pc %02" PRIX16 " after %" PRIu64 " instructions\n", i,
+      core->halted ? "halted" : core->stop == STOP_NO_INPUT ? "ran out of input" :
+      core->stop == STOP_OUT_OF_MEMORY ? "ran out of memory" : "stopped at the cycle limit",
+      core->pc, core->cycles);
+  }
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "Executed %" PRIu64 " instructions on %" PRIu32 " cores in %.6fs (%.0f instructions/s)\n",
+    cycles, count, seconds, seconds > 0 ? cycles / seconds : 0);
+  if (m->detect) fprintf(stderr, "Found %" PRIu64 " races\n", m->raceCount);
+  if (m->outOfMemory) puts("Out of memory");
+
+  int status = m->raceCount || m->outOfMemory ? 1 : 0;
+  freeCores(m, cores, threads, handles);
+  return status;
+}
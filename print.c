@@ -0,0 +1,357 @@
+#include <inttypes.h>  // PRIX8, PRIX16, PRIX32, uint8_t, uint16_t, uint32_t, uint64_t
+#include <stdarg.h>    // va_end, va_list, va_start
+#include <stdbool.h>   // bool, false, true
+#include <stdio.h>     // fflush, fputs, fwrite, printf, snprintf, stdout, vsnprintf
+#include <stdlib.h>    // atexit
+#include <string.h>    // memcpy, strlen
+#include <sys/ioctl.h> // ioctl, TIOCGWINSZ, winsize
+#include <time.h>      // clock_gettime, CLOCK_MONOTONIC, timespec
+#include <unistd.h>    // isatty, STDOUT_FILENO
+
+#include "emulator.h"
+
+// The debugger's view of a cpu, shared with xtrace which renders traced cycles the same way. A view is laid out
+// into a screen of cells and then written out in one go, normally below the last one. The live view started by
+// --fps instead keeps the panel at the top of the terminal, redrawing only the cells that changed at most fps times
+// a second, while console I/O scrolls underneath it.
+
+// Enough for the 32 bit view with both memory windows open
+#define SCREEN_ROWS (uint8_t)17
+#define SCREEN_COLS (uint8_t)176
+// Worst case of a cursor move and colour change in front of every cell
+#define SCREEN_OUT_SIZE (size_t)(SCREEN_ROWS * SCREEN_COLS * 24)
+
+typedef struct {
+  char       ch;
+  const char *colour;
+} screenCell;
+
+typedef struct {
+  screenCell cells[SCREEN_ROWS][SCREEN_COLS];
+  uint8_t    rowLen[SCREEN_ROWS];
+  uint8_t    row, col;
+} screen;
+
+static uint8_t windowSize = 6;
+
+const char *redStr = "\033[31m";  // PC, register memory or modified
+const char *yellowStr = "\033[33m";  // PC incremented and current memory address
+const char *blueStr1 = "\033[34m"; // First read source register or memory addr
+const char *blueStr2 = "\033[94m"; // Second read source register
+const char *whiteStr = "\033[97m"; // Default
+
+static screen view, shown;
+static char out[SCREEN_OUT_SIZE];
+// 0 unless the live view is on, then how much of the panel the terminal can show
+static uint32_t liveFps;
+static uint16_t liveCols;
+static uint64_t lastFrame;
+// The cpu of a view skipped for being too soon after the last frame
+static cpu *pendingCpu;
+
+const char *getPCColour(cpu *cpuState) {
+  
+  if (cpuState->halted) {
+    return whiteStr;
+  }
+  
+  if (cpuState->pcModified) {
+    return redStr;
+  }
+  
+  if (cpuState->oldPC != cpuState->pc) {
+    return yellowStr;
+  }
+  
+  return whiteStr;
+}
+
+const char *getRegColour(cpu *cpuState, uint8_t reg) {
+  if ((cpuState->wroteReg && cpuState->lastWriteReg == reg)) {
+    return redStr;
+  }
+  
+  if ((cpuState->readReg1 && cpuState->lastReadReg1 == reg)) {
+    return blueStr1;
+  }
+  
+  if ((cpuState->readReg2 && cpuState->lastReadReg2 == reg)) {
+    return blueStr2;
+  }
+  
+  return whiteStr;
+}
+
+const char *getMemColour(cpu *cpuState, uint16_t addr) {
+  if (addr == cpuState->pc) {
+    return yellowStr;
+  }
+  
+  if (cpuState->readMem && addr == cpuState->lastReadAddr) {
+    return blueStr1;
+  }
+  
+  if (cpuState->wroteMem && addr == cpuState->lastWriteAddr) {
+    return redStr;
+  }
+  
+  return whiteStr;
+}
+
+
+static void clearScreen(screen *s) {
+  for (uint8_t row = 0; row < SCREEN_ROWS; ++row) {
+    for (uint8_t col = 0; col < SCREEN_COLS; ++col) s->cells[row][col] = (screenCell){' ', whiteStr};
+    s->rowLen[row] = 0;
+  }
+  s->row = s->col = 0;
+}
+
+// printf into the screen at its cursor, anything past the edges is dropped
+static void put(screen *s, const char *colour, const char *fmt, ...) {
+  char text[SCREEN_COLS + 1];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(text, sizeof(text), fmt, args);
+  va_end(args);
+
+  for (char *c = text; *c; ++c) {
+    if (*c == '\n') {
+      ++s->row;
+      s->col = 0;
+      continue;
+    }
+    if (s->row < SCREEN_ROWS && s->col < SCREEN_COLS) {
+      s->cells[s->row][s->col] = (screenCell){*c, colour};
+      s->rowLen[s->row] = s->col + 1;
+    }
+    ++s->col;
+  }
+}
+
+static size_t append(size_t len, const char *text) {
+  size_t textLen = strlen(text);
+  memcpy(out + len, text, textLen);
+  return len + textLen;
+}
+
+static void printMemRange(screen *s, cpu *cpuState, uint16_t addr) {
+  uint16_t startAddr = addr - windowSize;
+  uint16_t endAddr = addr + windowSize;
+
+  if (addr < windowSize) {
+    startAddr = 0;
+    endAddr = 2 * windowSize;
+  }
+
+  // Hide stdInOutAddr == 255, won't work for any other value
+  if (!cpuState->in32Bit && addr > 254 - windowSize) {
+    startAddr = 254 - 2 * windowSize;
+    endAddr = 254;
+  }
+
+  char *fLabelStr1 = "     ";
+  char *fLabelStr2 = ",   ";
+  char *fLabelStr = "M[%04" PRIX16 "]";
+  uint32_t memSize = MEM_SIZE_32;
+  if (!cpuState->in32Bit) {
+    fLabelStr1 = "    ";
+    fLabelStr2 = ", ";
+    fLabelStr = "M[%02" PRIX8 "]";
+    memSize = MEM_SIZE_16;
+  }
+
+  put(s, whiteStr, fLabelStr1);
+  put(s, getMemColour(cpuState, startAddr), fLabelStr, startAddr);
+  for (uint16_t i = startAddr + 1; i <= endAddr && i < memSize; ++i) {
+    put(s, whiteStr, fLabelStr2);
+    put(s, getMemColour(cpuState, i), fLabelStr, i);
+  }
+
+  if (cpuState->in32Bit) {
+    put(s, whiteStr, "\n    ");
+    put(s, getMemColour(cpuState, startAddr), "%08" PRIX32, memRead32(cpuState, startAddr));
+  } else {
+    put(s, whiteStr, "\n     ");
+    put(s, getMemColour(cpuState, startAddr), "%04" PRIX16, cpuState->memory16[startAddr]);
+  }
+  for (uint16_t i = startAddr + 1; i <= endAddr && i < memSize; ++i) {
+    put(s, whiteStr, ",  ");
+    if (cpuState->in32Bit) {
+      put(s, getMemColour(cpuState, i), "%08" PRIX32, memRead32(cpuState, i));
+    } else {
+      put(s, getMemColour(cpuState, i), "%04" PRIX16, cpuState->memory16[i]);
+    }
+  }
+
+  put(s, whiteStr, "\n");
+}
+
+// Lays the view out, the header says the cpu halted in place of the usual one
+static void layoutCpuState(screen *s, cpu *cpuState) {
+  char *fLabelStr1 = "      ";
+  char *fLabelStr2 = ",    ";
+  char *fLabelStr = "R[%02" PRIX8 "]";
+  char *fValueStr1 = "%04" PRIX16;
+  char *fValueStr2 = "%08" PRIX32;
+  if (!cpuState->in32Bit) {
+    fLabelStr1 = "    ";
+    fLabelStr2 = ", ";
+    fLabelStr = "R[%" PRIX8 "]";
+    fValueStr1 = "%02" PRIX8;
+    fValueStr2 = "%04" PRIX16;
+  }
+
+  clearScreen(s);
+  if (cpuState->halted) {
+    put(s, redStr, "Cpu has halted\n");
+  } else {
+    put(s, whiteStr, "Cpu state:\n");
+  }
+  put(s, whiteStr, "  Registers:\n");
+  put(s, whiteStr, fLabelStr1);
+  put(s, getPCColour(cpuState), "PC");
+  for (uint8_t i = 0; i < REG_COUNT; ++i) {
+    put(s, whiteStr, fLabelStr2);
+    put(s, getRegColour(cpuState, i), fLabelStr, i);
+  }
+
+  put(s, whiteStr, "\n    ");
+  put(s, getPCColour(cpuState), fValueStr1, cpuState->pc);
+  for (uint8_t i = 0; i < REG_COUNT; ++i) {
+    put(s, whiteStr, ", ");
+    put(s, getRegColour(cpuState, i), fValueStr2, cpuState->registers[i]);
+  }
+
+  put(s, whiteStr, "\n\n  Memory near PC:\n");
+  printMemRange(s, cpuState, cpuState->pc);
+
+  if (cpuState->readMem) {
+    put(s, whiteStr, "\n  Memory near last read:\n");
+    printMemRange(s, cpuState, cpuState->lastReadAddr);
+  }
+
+  if (cpuState->wroteMem) {
+    put(s, whiteStr, "\n  Memory near last write:\n");
+    printMemRange(s, cpuState, cpuState->lastWriteAddr);
+  }
+
+  put(s, whiteStr, "\n");
+}
+
+// Writes the rows laid out so far below whatever was printed last
+static void writeScreen(screen *s) {
+  size_t len = 0;
+  const char *colour = NULL;
+  for (uint8_t row = 0; row < s->row && row < SCREEN_ROWS; ++row) {
+    for (uint8_t col = 0; col < s->rowLen[row]; ++col) {
+      screenCell *cell = &s->cells[row][col];
+      if (cell->colour != colour) len = append(len, colour = cell->colour);
+      out[len++] = cell->ch;
+    }
+    if (colour != whiteStr) len = append(len, colour = whiteStr);
+    out[len++] = '\n';
+  }
+  fwrite(out, 1, len, stdout);
+}
+
+// Redraws the cells of the live view that differ from what's on the terminal, leaving the cursor where console I/O
+// had it
+static void drawScreen(screen *s) {
+  char move[16];
+  size_t len = append(0, "\0337");
+  const char *colour = NULL;
+  for (uint8_t row = 0; row < SCREEN_ROWS; ++row) {
+    int16_t cursor = -1;
+    for (uint8_t col = 0; col < liveCols; ++col) {
+      screenCell *cell = &s->cells[row][col];
+      screenCell *old = &shown.cells[row][col];
+      if (cell->ch == old->ch && cell->colour == old->colour) continue;
+
+      if (cursor != col) {
+        snprintf(move, sizeof(move), "\033[%u;%uH", row + 1u, col + 1u);
+        len = append(len, move);
+      }
+      if (cell->colour != colour) len = append(len, colour = cell->colour);
+      out[len++] = cell->ch;
+      cursor = col + 1;
+      *old = *cell;
+    }
+  }
+  len = append(len, whiteStr);
+  len = append(len, "\0338");
+
+  fwrite(out, 1, len, stdout);
+  fflush(stdout);
+}
+
+static uint64_t monotonicNs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void endLiveView(void) {
+  fflush(stdout);
+  // Give the whole terminal back to scrolling and carry on below the panel
+  fputs("\033[r", stdout);
+  printf("\033[%u;1H%s", SCREEN_ROWS + 1u, whiteStr);
+  fflush(stdout);
+}
+
+// Switches printCpuState over to the live view. Returns false if stdout isn't a terminal with room for the panel
+// and some lines of console I/O under it.
+bool startLiveView(uint32_t fps) {
+  struct winsize size;
+  if (!fps || !isatty(STDOUT_FILENO) || ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) || size.ws_row < SCREEN_ROWS + 4) {
+    return false;
+  }
+
+  liveFps = fps;
+  liveCols = size.ws_col < SCREEN_COLS ? size.ws_col : SCREEN_COLS;
+  // Nothing matches a NUL cell so the first frame draws the whole panel
+  for (uint8_t row = 0; row < SCREEN_ROWS; ++row) {
+    for (uint8_t col = 0; col < SCREEN_COLS; ++col) shown.cells[row][col] = (screenCell){'\0', NULL};
+  }
+  printf("\033[2J\033[%u;%ur\033[%u;1H", SCREEN_ROWS + 1u, (unsigned)size.ws_row, SCREEN_ROWS + 1u);
+  fflush(stdout);
+  atexit(endLiveView);
+  return true;
+}
+
+// Draws a view skipped by the frame rate limit, for when the cpu is about to wait on the user
+void flushLiveView(void) {
+  if (!pendingCpu) return;
+  layoutCpuState(&view, pendingCpu);
+  drawScreen(&view);
+  pendingCpu = NULL;
+  lastFrame = monotonicNs();
+}
+
+void printCpuState(cpu *cpuState) {
+  if (!cpuState->debug) return;
+
+  if (liveFps) {
+    // Stops and single steps are always drawn, otherwise only once the next frame is due
+    uint64_t now = monotonicNs();
+    bool due = now - lastFrame >= 1000000000 / liveFps;
+    if (!due && !cpuState->halted && !cpuState->step && cpuState->stop == STOP_NONE) {
+      pendingCpu = cpuState;
+      return;
+    }
+    layoutCpuState(&view, cpuState);
+    drawScreen(&view);
+    pendingCpu = NULL;
+    lastFrame = now;
+    return;
+  }
+
+  if (cpuState->halted) {
+    clearScreen(&view);
+    put(&view, redStr, "Cpu has halted");
+    put(&view, whiteStr, "\n");
+  } else {
+    layoutCpuState(&view, cpuState);
+  }
+  writeScreen(&view);
+}
@@ -0,0 +1,240 @@
+#include <inttypes.h> // PRIu64, PRIX8, PRIX16, uint8_t, uint16_t, uint32_t, uint64_t
+#include <stdbool.h>  // bool, false, true
+#include <stdio.h>    // FILE, fprintf, fputs, puts, snprintf
+#include <stdlib.h>   // calloc, exit, free, malloc, qsort
+#include <string.h>   // memset, strlen
+
+#include "emulator.h"
+
+// Calls nested deeper than this are counted against the deepest subroutine so runaway recursion can't grow the
+// call tree without bound
+#define PROFILE_MAX_DEPTH (uint32_t)256
+// Rows in each of the report's top N tables
+#define PROFILE_TOP       (uint32_t)16
+
+static const char *mnemonics[16] = {
+  "hlt", "add", "sub", "and", "xor", "asl", "asr", "lda", "lod", "str", "ldi", "sti", "brz", "brp", "jmp", "jsr"
+};
+
+typedef struct {
+  uint16_t start, end;
+  uint64_t iterations, cycles;
+} profileLoop;
+
+
+static void outOfMemory(void) {
+  puts("Out of memory");
+  exit(1);
+}
+
+static profileNode *newNode(profileNode *parent, uint8_t entry) {
+  profileNode *node = calloc(1, sizeof(profileNode));
+  if (!node) outOfMemory();
+  node->entry = entry;
+  node->parent = parent;
+  return node;
+}
+
+static void freeNodes(profileNode *node) {
+  while (node) {
+    profileNode *sibling = node->sibling;
+    freeNodes(node->child);
+    free(node);
+    node = sibling;
+  }
+}
+
+static profileNode *childNode(profileNode *parent, uint8_t entry) {
+  for (profileNode *child = parent->child; child; child = child->sibling) {
+    if (child->entry == entry) return child;
+  }
+  profileNode *child = newNode(parent, entry);
+  child->sibling = parent->child;
+  parent->child = child;
+  return child;
+}
+
+cpuProfile *newProfile(void) {
+  cpuProfile *profile = calloc(1, sizeof(cpuProfile));
+  if (!profile) outOfMemory();
+  profile->root = profile->node = newNode(NULL, 0);
+  return profile;
+}
+
+void resetProfile(cpuProfile *profile) {
+  profileNode *root = profile->root;
+  freeNodes(root->child);
+  memset(profile, 0, sizeof(cpuProfile));
+  memset(root, 0, sizeof(profileNode));
+  profile->root = profile->node = root;
+}
+
+void freeProfile(cpuProfile *profile) {
+  if (!profile) return;
+  freeNodes(profile->root);
+  free(profile);
+}
+
+void profileCall(cpuProfile *profile, uint8_t target) {
+  if (++profile->depth <= PROFILE_MAX_DEPTH) profile->node = childNode(profile->node, target);
+}
+
+// A jmp with nothing to return from is just a jump
+void profileReturn(cpuProfile *profile) {
+  if (!profile->depth) return;
+  if (profile->depth-- <= PROFILE_MAX_DEPTH) profile->node = profile->node->parent;
+}
+
+// Counts the cycle the reference interpreter just ran from its tracking fields
+void profileCycle(cpu *cpuState, uint16_t pc, uint32_t inst) {
+  cpuProfile *profile = cpuState->profile;
+  if (cpuState->in32Bit) return;
+
+  uint8_t opcode = inst >> 12;
+  ++profile->hits[pc];
+  ++profile->opcodes[opcode];
+  ++profile->node->cycles;
+
+  if (cpuState->readMem) ++profile->reads[cpuState->lastReadAddr];
+  if (opcode == 0x9 || opcode == 0xB) ++profile->writes[cpuState->lastWriteAddr];
+  if (opcode == 0xC || opcode == 0xD) {
+    ++profile->branches[pc];
+    if (cpuState->pcModified) ++profile->taken[pc];
+  }
+  if (opcode == 0xE) profileReturn(profile);
+  if (opcode == 0xF) profileCall(profile, inst & 0xFF);
+}
+
+static void mergeNodes(profileNode *into, profileNode *from) {
+  into->cycles += from->cycles;
+  for (profileNode *child = from->child; child; child = child->sibling) {
+    mergeNodes(childNode(into, child->entry), child);
+  }
+}
+
+// Adds from's counts into into, the call stack into is in is left alone
+void mergeProfile(cpuProfile *into, cpuProfile *from) {
+  for (uint32_t i = 0; i < MEM_SIZE_16; ++i) {
+    into->hits[i] += from->hits[i];
+    into->branches[i] += from->branches[i];
+    into->taken[i] += from->taken[i];
+    into->reads[i] += from->reads[i];
+    into->writes[i] += from->writes[i];
+  }
+  for (uint8_t i = 0; i < 16; ++i) into->opcodes[i] += from->opcodes[i];
+  mergeNodes(into->root, from->root);
+}
+
+
+static const uint64_t *sortCounts;
+
+static int compareAddrs(const void *a, const void *b) {
+  uint64_t x = sortCounts[*(const uint16_t *)a], y = sortCounts[*(const uint16_t *)b];
+  if (x != y) return x < y ? 1 : -1;
+  return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+static int compareLoops(const void *a, const void *b) {
+  uint64_t x = ((const profileLoop *)a)->cycles, y = ((const profileLoop *)b)->cycles;
+  return (x < y) - (x > y);
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+  return whole ? 100.0 * part / whole : 0;
+}
+
+// The PROFILE_TOP busiest addresses by counts, only the reporting thread ever sorts so sortCounts can be static
+static void writeTopAddrs(FILE *out, const char *title, const uint64_t *counts, uint64_t total,
+                          const uint16_t *memory, bool showInst) {
+  uint16_t addrs[MEM_SIZE_16];
+  for (uint16_t i = 0; i < MEM_SIZE_16; ++i) addrs[i] = i;
+  sortCounts = counts;
+  qsort(addrs, MEM_SIZE_16, sizeof(uint16_t), compareAddrs);
+
+  fprintf(out, "\n%s\n", title);
+  for (uint32_t i = 0; i < PROFILE_TOP && counts[addrs[i]]; ++i) {
+    uint16_t addr = addrs[i];
+    fprintf(out, "  %02" PRIX16, addr);
+    if (showInst) fprintf(out, "  %04" PRIX16 " %s", memory[addr], mnemonics[memory[addr] >> 12]);
+    fprintf(out, "  %12" PRIu64 "  %5.1f%%\n", counts[addr], percent(counts[addr], total));
+  }
+}
+
+// Everything a branch jumps back over is a loop, its cost is every cycle spent at the addresses it covers
+static void writeLoops(FILE *out, cpuProfile *profile, const uint16_t *memory, uint64_t total) {
+  profileLoop loops[MEM_SIZE_16];
+  uint32_t loopCount = 0;
+  for (uint16_t pc = 0; pc < MEM_SIZE_16; ++pc) {
+    uint16_t target = memory[pc] & 0xFF;
+    if (!profile->taken[pc] || target > pc) continue;
+
+    profileLoop *loop = loops + loopCount++;
+    loop->start = target;
+    loop->end = pc;
+    loop->iterations = profile->taken[pc];
+    loop->cycles = 0;
+    for (uint16_t i = target; i <= pc; ++i) loop->cycles += profile->hits[i];
+  }
+  qsort(loops, loopCount, sizeof(profileLoop), compareLoops);
+
+  fputs("\nHot loops\n", out);
+  for (uint32_t i = 0; i < PROFILE_TOP && i < loopCount; ++i) {
+    profileLoop *loop = loops + i;
+    fprintf(out, "  %02" PRIX16 "-%02" PRIX16 "  %12" PRIu64 " iterations  %12" PRIu64 " cycles  %5.1f%%\n",
+      loop->start, loop->end, loop->iterations, loop->cycles, percent(loop->cycles, total));
+  }
+}
+
+// memory is what the image looks like now, used to name the instruction at each address
+void writeProfileReport(FILE *out, cpuProfile *profile, const uint16_t *memory, const char *name) {
+  uint64_t total = 0;
+  for (uint8_t i = 0; i < 16; ++i) total += profile->opcodes[i];
+  fprintf(out, "Profile of %s, %" PRIu64 " instructions\n", name, total);
+
+  fputs("\nInstruction mix\n", out);
+  for (uint8_t i = 0; i < 16; ++i) {
+    if (!profile->opcodes[i]) continue;
+    fprintf(out, "  %s  %12" PRIu64 "  %5.1f%%\n", mnemonics[i], profile->opcodes[i],
+      percent(profile->opcodes[i], total));
+  }
+
+  writeTopAddrs(out, "Hot instructions", profile->hits, total, memory, true);
+  writeLoops(out, profile, memory, total);
+
+  fputs("\nBranches\n", out);
+  for (uint16_t pc = 0; pc < MEM_SIZE_16; ++pc) {
+    uint64_t branches = profile->branches[pc];
+    if (!branches) continue;
+    fprintf(out, "  %02" PRIX16 "  %04" PRIX16 " %s  %12" PRIu64 " taken  %12" PRIu64 " not taken  %5.1f%%\n", pc,
+      memory[pc], mnemonics[memory[pc] >> 12], profile->taken[pc], branches - profile->taken[pc],
+      percent(profile->taken[pc], branches));
+  }
+
+  uint64_t reads = 0, writes = 0;
+  for (uint16_t i = 0; i < MEM_SIZE_16; ++i) {
+    reads += profile->reads[i];
+    writes += profile->writes[i];
+  }
+  writeTopAddrs(out, "Memory reads", profile->reads, reads, memory, false);
+  writeTopAddrs(out, "Memory writes", profile->writes, writes, memory, false);
+}
+
+static void writeNodeStacks(FILE *out, profileNode *node, char *path, size_t len) {
+  if (node->parent) len += snprintf(path + len, 8, ";sub_%02" PRIX8, node->entry);
+  if (node->cycles) fprintf(out, "%.*s %" PRIu64 "\n", (int)len, path, node->cycles);
+  for (profileNode *child = node->child; child; child = child->sibling) writeNodeStacks(out, child, path, len);
+}
+
+// One line per call stack with the cycles spent at its top, the format flamegraph.pl and friends take. The stacks
+// start at main, below rootName if it isn't NULL.
+void writeFoldedStacks(FILE *out, cpuProfile *profile, const char *rootName) {
+  size_t rootLen = rootName ? strlen(rootName) + 1 : 0;
+  char *path = malloc(rootLen + sizeof("main") + PROFILE_MAX_DEPTH * 8);
+  if (!path) outOfMemory();
+
+  size_t len = 0;
+  if (rootName) len = snprintf(path, rootLen + 1, "%s;", rootName);
+  len += snprintf(path + len, sizeof("main"), "main");
+  writeNodeStacks(out, profile->root, path, len);
+  free(path);
+}
@@ -0,0 +1,273 @@
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "xasm.h"
+
+
+// The token types of asmxtoy.g4 in the order its lexer rules are listed, which breaks ties between equally long matches
+enum class TokenType {
+  Mnemonic,
+  Directive,
+  Comma,
+  Colon,
+  Register,
+  HalfWord,
+  Word,
+  Label,
+  Comment,
+  Whitespace,
+  Eol,
+  End,
+  Invalid
+};
+
+static bool IsHexDigit(char c) {
+  return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F');
+}
+
+static bool EndsLabel(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == ':' || c == ',';
+}
+
+// Splits the source into tokens the way the generated lexer does, taking the longest match and on a tie the rule
+// listed first. Every rule but COMMENT matches a prefix of what LABEL would so only those two need measuring.
+class Scanner {
+public:
+  explicit Scanner(std::string_view source) : source(source) {
+    Next();
+  }
+
+  void Next() {
+    // Only EOL can hold a newline, ANTLR doesn't count \r as one
+    position += token.text.size();
+    if (type == TokenType::Eol && token.text[0] == '\n') {
+      ++line;
+      column = 0;
+    } else {
+      column += token.text.size();
+    }
+
+    token.line = line;
+    token.column = column;
+    if (position == source.size()) {
+      type = TokenType::End;
+      token.text = {};
+      return;
+    }
+
+    const char *start = source.data() + position;
+    std::size_t remaining = source.size() - position;
+    std::size_t length = 1;
+    switch (start[0]) {
+      case ' ':
+      case '\t':
+        while (length < remaining && (start[length] == ' ' || start[length] == '\t')) {
+          ++length;
+        }
+        type = TokenType::Whitespace;
+        break;
+      case '\n':
+      case '\r':
+        type = TokenType::Eol;
+        break;
+      case ',':
+        type = TokenType::Comma;
+        break;
+      case ':':
+        type = TokenType::Colon;
+        break;
+      case '0': case '1': case '2': case '3': case '4':
+      case '5': case '6': case '7': case '8': case '9':
+        // LABEL can't start with a digit
+        if (remaining >= 4 && IsHexDigit(start[1]) && IsHexDigit(start[2]) && IsHexDigit(start[3])) {
+          length = 4;
+          type = TokenType::Word;
+        } else if (remaining >= 2 && IsHexDigit(start[1])) {
+          length = 2;
+          type = TokenType::HalfWord;
+        } else {
+          type = TokenType::Invalid;
+        }
+        break;
+      default: {
+        while (length < remaining && !EndsLabel(start[length])) {
+          ++length;
+        }
+        std::string_view text(start, length);
+
+        if (start[0] == ';') {
+          std::size_t commentLength = length;
+          while (commentLength < remaining && start[commentLength] != '\n' && start[commentLength] != '\r') {
+            ++commentLength;
+          }
+          if (commentLength > length) {
+            length = commentLength;
+            type = TokenType::Comment;
+            break;
+          }
+        }
+
+        if (length == 3 && Instructions.Find(text)) {
+          type = TokenType::Mnemonic;
+        } else if (start[0] == '.' && Directives.Find(text.substr(1))) {
+          type = TokenType::Directive;
+        } else if (length == 2 && start[0] == 'r' && IsHexDigit(start[1])) {
+          type = TokenType::Register;
+        } else if (length == 2 && IsHexDigit(start[0]) && IsHexDigit(start[1])) {
+          type = TokenType::HalfWord;
+        } else if (length == 4 && IsHexDigit(start[0]) && IsHexDigit(start[1]) && IsHexDigit(start[2])
+            && IsHexDigit(start[3])) {
+          type = TokenType::Word;
+        } else {
+          type = TokenType::Label;
+        }
+        break;
+      }
+    }
+
+    token.text = std::string_view(start, type == TokenType::Invalid ? 1 : length);
+  }
+
+  TokenType type = TokenType::End;
+  SourceToken token{};
+
+private:
+  std::string_view source;
+  std::size_t position = 0;
+  uint32_t line = 1, column = 0;
+};
+
+
+static bool SyntaxError(const Scanner &scanner, std::vector<Diagnostic> &diagnostics) {
+  const char *message = "Unexpected input";
+  std::string_view text = scanner.token.text;
+  if (scanner.type == TokenType::Invalid) {
+    message = "Token recognition error";
+  } else if (scanner.type == TokenType::Eol) {
+    message = "Unexpected end of line";
+    text = {};
+  } else if (scanner.type == TokenType::End) {
+    message = "Unexpected end of file";
+  }
+  diagnostics.push_back({scanner.token.line, scanner.token.column, std::string(text), message});
+  return false;
+}
+
+static bool IsArgument(TokenType type) {
+  return type == TokenType::Register || type == TokenType::HalfWord || type == TokenType::Label;
+}
+
+static ArgumentKind ArgumentKindOf(TokenType type) {
+  switch (type) {
+    case TokenType::Register:
+      return ArgumentKind::Register;
+    case TokenType::HalfWord:
+      return ArgumentKind::HalfWord;
+    default:
+      return ArgumentKind::Label;
+  }
+}
+
+// Recognises file: (line? EOL)* line? EOF one line at a time. WS tokens never follow each other so the only choice
+// the grammar leaves is whether WS after an instruction starts another argument or ends the line, which the token
+// after it decides.
+bool ParseDirect(std::string_view source, ParsedSource &parsed, std::vector<Diagnostic> &diagnostics) {
+  Scanner scanner(source);
+  // A guess from typical line lengths so large sources rarely have to regrow the statements
+  parsed.statements.reserve(parsed.statements.size() + source.size() / 16);
+
+  while (scanner.type != TokenType::End) {
+    if (scanner.type == TokenType::Whitespace) {
+      scanner.Next();
+    }
+
+    Statement statement{};
+    statement.name = scanner.token;
+    switch (scanner.type) {
+      case TokenType::Eol:
+      case TokenType::End:
+        break;
+
+      case TokenType::Mnemonic:
+        statement.kind = StatementKind::Instruction;
+        scanner.Next();
+        for (;;) {
+          bool separated = false;
+          if (scanner.type == TokenType::Whitespace) {
+            scanner.Next();
+            separated = true;
+          }
+          if (scanner.type == TokenType::Comma) {
+            scanner.Next();
+            if (scanner.type == TokenType::Whitespace) {
+              scanner.Next();
+            }
+            separated = true;
+          } else if (separated && !IsArgument(scanner.type)) {
+            break;
+          }
+          if (!separated) {
+            break;
+          }
+
+          if (!IsArgument(scanner.type)) {
+            return SyntaxError(scanner, diagnostics);
+          }
+          if (statement.argumentCount < statement.arguments.size()) {
+            statement.arguments[statement.argumentCount] = {ArgumentKindOf(scanner.type), scanner.token};
+          }
+          ++statement.argumentCount;
+          scanner.Next();
+        }
+        parsed.statements.push_back(statement);
+        break;
+
+      case TokenType::Directive:
+        statement.kind = StatementKind::Directive;
+        scanner.Next();
+        if (scanner.type != TokenType::Whitespace) {
+          return SyntaxError(scanner, diagnostics);
+        }
+        scanner.Next();
+        if (scanner.type != TokenType::Word) {
+          return SyntaxError(scanner, diagnostics);
+        }
+        statement.argumentCount = 1;
+        statement.arguments[0] = {ArgumentKind::Word, scanner.token};
+        scanner.Next();
+        parsed.statements.push_back(statement);
+        break;
+
+      case TokenType::Label:
+        statement.kind = StatementKind::Label;
+        scanner.Next();
+        if (scanner.type != TokenType::Colon) {
+          return SyntaxError(scanner, diagnostics);
+        }
+        scanner.Next();
+        parsed.statements.push_back(statement);
+        break;
+
+      case TokenType::Comment:
+        scanner.Next();
+        break;
+
+      default:
+        return SyntaxError(scanner, diagnostics);
+    }
+
+    if (scanner.type == TokenType::Whitespace) {
+      scanner.Next();
+    }
+    if (scanner.type == TokenType::Eol) {
+      scanner.Next();
+    } else if (scanner.type != TokenType::End) {
+      return SyntaxError(scanner, diagnostics);
+    }
+  }
+
+  return true;
+}
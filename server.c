@@ -0,0 +1,423 @@
+#include <errno.h>      // EINTR, errno
+#include <inttypes.h>   // PRIu32, PRIu64, UINT64_MAX, uint32_t, uint64_t
+#include <pthread.h>    // pthread_cond_init, pthread_cond_signal, pthread_cond_t, pthread_cond_wait, pthread_create, pthread_detach, pthread_mutex_init, pthread_mutex_lock, pthread_mutex_t, pthread_mutex_unlock, pthread_t
+#include <signal.h>     // sig_atomic_t, sigaction, sigemptyset, SIGINT, SIGTERM
+#include <stdatomic.h>  // atomic_fetch_add_explicit, atomic_load_explicit, atomic_uint_fast64_t, memory_order_relaxed
+#include <stdbool.h>    // bool, false, true
+#include <stdio.h>      // fprintf, puts, stderr
+#include <stdlib.h>     // calloc, free, malloc, realloc
+#include <string.h>     // memcmp, memcpy, strlen
+#include <sys/epoll.h>  // epoll_create1, epoll_ctl, epoll_event, epoll_wait, EPOLL_CTL_ADD, EPOLL_CTL_DEL, EPOLLIN, EPOLLONESHOT
+#include <sys/socket.h> // accept, AF_UNIX, bind, listen, MSG_NOSIGNAL, send, socket, SOCK_STREAM, SOMAXCONN
+#include <sys/un.h>     // sockaddr_un
+#include <time.h>       // clock_gettime, CLOCK_MONOTONIC, timespec
+#include <unistd.h>     // close, read, ssize_t, sysconf, unlink, _SC_NPROCESSORS_ONLN
+
+#include "emulator.h"
+#include "image.h"
+#include "server.h"
+
+// Connections accepted but not yet taken by a worker
+#define SERVE_BACKLOG (uint32_t)256
+// Loaded images kept to fork jobs from, picked by hash so a new image only pushes out the one in its slot
+#define SERVE_IMAGE_SLOTS (uint32_t)64
+// Output words a worker holds before sending them as a frame
+#define SERVE_OUTPUT_WORDS (uint32_t)4096
+#define SERVE_FRAME_WORDS (uint32_t)(sizeof(serveFrame) / sizeof(uint32_t))
+// Bytes read from a connection at a time, enough for several small jobs sent back to back
+#define SERVE_READ_SIZE (size_t)65536
+// Connections the accept loop takes from epoll at a time
+#define SERVE_EVENTS (uint32_t)64
+
+// Held by its slot and by workers comparing against it or forking from it, freed with the last reference
+typedef struct {
+  uint32_t refs; // Under imageLock
+  uint32_t hash;
+  bool     loaded;
+  size_t   size;
+  char     *data;
+  cpu      cpuState;
+} serveImage;
+
+// Everything the workers share. The accept loop queues connections with a job to run, a worker serves one until it
+// has no more jobs waiting and then hands it back to the loop to wait on.
+typedef struct {
+  pthread_mutex_t      lock;
+  pthread_cond_t       queued, taken;
+  int                  fds[SERVE_BACKLOG];
+  uint32_t             head, count;
+  uint64_t             cycleLimit;
+  int                  epollFd;
+  pthread_mutex_t      imageLock;
+  serveImage           *images[SERVE_IMAGE_SLOTS]; // NULL for an empty slot
+  atomic_uint_fast64_t jobs, cycles;
+} serveState;
+
+// One of the pool, its cpu is set up once and reused for every job it runs
+typedef struct {
+  ioPort         port;
+  serveState     *server;
+  int            fd;
+  bool           failed; // The client stopped taking replies
+  cpu            cpuState;
+  const uint32_t *input;
+  uint32_t       inputPos, inputCount;
+  char           *image;
+  uint32_t       *inputWords;
+  size_t         imageCap, inputCap;
+  size_t         readPos, readLen;
+  uint8_t        readBuf[SERVE_READ_SIZE];
+  // An output frame, its words from SERVE_FRAME_WORDS on and room after them for the result frame
+  uint32_t       outCount;
+  uint32_t       out[SERVE_FRAME_WORDS + SERVE_OUTPUT_WORDS + (sizeof(serveFrame) + sizeof(serveResult)) / sizeof(uint32_t)];
+} serveWorker;
+
+static volatile sig_atomic_t stopping;
+
+
+static void stopServing(int signal) {
+  (void)signal;
+  stopping = true;
+}
+
+static bool sendAll(int fd, const void *buf, size_t len) {
+  const char *bytes = buf;
+  while (len) {
+    ssize_t sent = send(fd, bytes, len, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return false;
+    bytes += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+// Reads len bytes through the worker's buffer, returns false if the connection ends first
+static bool readBytes(serveWorker *worker, void *buf, size_t len) {
+  char *dest = buf;
+  while (len) {
+    if (worker->readPos == worker->readLen) {
+      ssize_t got;
+      while ((got = read(worker->fd, worker->readBuf, SERVE_READ_SIZE)) < 0 && errno == EINTR);
+      if (got <= 0) return false;
+      worker->readPos = 0;
+      worker->readLen = got;
+    }
+    size_t run = worker->readLen - worker->readPos;
+    if (run > len) run = len;
+    memcpy(dest, worker->readBuf + worker->readPos, run);
+    worker->readPos += run;
+    dest += run;
+    len -= run;
+  }
+  return true;
+}
+
+static bool growBuffer(void **buf, size_t *cap, size_t size) {
+  if (size <= *cap) return true;
+  void *grown = realloc(*buf, size);
+  if (!grown) return false;
+  *buf = grown;
+  *cap = size;
+  return true;
+}
+
+static bool serveRead(ioPort *port, uint32_t *word, bool wide) {
+  (void)wide;
+  serveWorker *worker = (serveWorker *)port;
+  if (worker->inputPos == worker->inputCount) return false;
+  *word = worker->input[worker->inputPos++];
+  return true;
+}
+
+static void flushOutput(serveWorker *worker) {
+  serveFrame frame = {SERVE_OUTPUT, worker->outCount};
+  memcpy(worker->out, &frame, sizeof(frame));
+  size_t len = sizeof(frame) + worker->outCount * sizeof(uint32_t);
+  if (!worker->failed && !sendAll(worker->fd, worker->out, len)) worker->failed = true;
+  worker->outCount = 0;
+}
+
+static void serveWrite(ioPort *port, uint32_t word, bool wide) {
+  (void)wide;
+  serveWorker *worker = (serveWorker *)port;
+  worker->out[SERVE_FRAME_WORDS + worker->outCount++] = word;
+  if (worker->outCount == SERVE_OUTPUT_WORDS) flushOutput(worker);
+}
+
+void fillResult(serveResult *result, cpu *cpuState, uint32_t status) {
+  *result = (serveResult){0};
+  result->status = status;
+  if (status == SERVE_RAN) {
+    result->stop = cpuState->stop;
+    result->cycles = cpuState->cycles;
+    result->pc = cpuState->pc;
+    result->halted = cpuState->halted;
+    result->in32Bit = cpuState->in32Bit;
+    memcpy(result->registers, cpuState->registers, sizeof(result->registers));
+  }
+}
+
+// Sends whatever output is left together with the result in one go
+static bool sendResult(serveWorker *worker, uint32_t status) {
+  serveResult result;
+  fillResult(&result, &worker->cpuState, status);
+
+  serveFrame frame = {SERVE_OUTPUT, worker->outCount};
+  memcpy(worker->out, &frame, sizeof(frame));
+  char *end = (char *)(worker->out + SERVE_FRAME_WORDS + worker->outCount);
+  frame = (serveFrame){SERVE_RESULT, 1};
+  memcpy(end, &frame, sizeof(frame));
+  memcpy(end + sizeof(frame), &result, sizeof(result));
+
+  const char *start = worker->outCount ? (char *)worker->out : end;
+  size_t len = end + sizeof(frame) + sizeof(result) - start;
+  worker->outCount = 0;
+  return !worker->failed && sendAll(worker->fd, start, len);
+}
+
+static uint32_t hashBytes(const char *data, size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; ++i) hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+  return hash;
+}
+
+static void releaseImage(serveState *server, serveImage *image) {
+  pthread_mutex_lock(&server->imageLock);
+  bool last = !--image->refs;
+  pthread_mutex_unlock(&server->imageLock);
+  if (!last) return;
+  free(image->data);
+  freeCpuMemory(&image->cpuState);
+  free(image);
+}
+
+// Makes the worker's cpu a fork of the image it was sent, loading it into the image's slot first if it isn't already
+// there. Returns false if the image was rejected.
+static bool forkImage(serveWorker *worker, size_t size) {
+  serveState *server = worker->server;
+  uint32_t hash = hashBytes(worker->image, size);
+  serveImage **slot = server->images + hash % SERVE_IMAGE_SLOTS;
+  freeCpuMemory(&worker->cpuState);
+
+  // Images run up to SERVE_MAX_IMAGE so only the hash and size are checked under the lock, the reference keeps the
+  // image from being freed while the rest is compared
+  pthread_mutex_lock(&server->imageLock);
+  serveImage *cached = *slot && (*slot)->hash == hash && (*slot)->size == size ? *slot : NULL;
+  if (cached) ++cached->refs;
+  pthread_mutex_unlock(&server->imageLock);
+  if (cached) {
+    bool same = !memcmp(cached->data, worker->image, size);
+    bool loaded = same && cached->loaded && forkCpu(&worker->cpuState, &cached->cpuState);
+    releaseImage(server, cached);
+    if (same) return loaded;
+  }
+
+  // Parsed outside the lock so a big image doesn't hold up workers running other ones
+  cpu image;
+  initCpuConfig(&image);
+  image.debug = false;
+  image.quiet = true;
+  bool loaded = loadImageData(&image, worker->image, size);
+  serveImage *kept = malloc(sizeof(serveImage));
+  char *data = malloc(size ? size : 1);
+  if (!kept || !data) {
+    // Run it without keeping it
+    free(kept);
+    free(data);
+    loaded = loaded && forkCpu(&worker->cpuState, &image);
+    freeCpuMemory(&image);
+    return loaded;
+  }
+  memcpy(data, worker->image, size);
+  *kept = (serveImage){1, hash, loaded, size, data, image};
+  // Nothing else can see it yet, and once it's in the slot it's only ever forked from
+  loaded = loaded && forkCpu(&worker->cpuState, &kept->cpuState);
+
+  pthread_mutex_lock(&server->imageLock);
+  serveImage *replaced = *slot;
+  *slot = kept;
+  pthread_mutex_unlock(&server->imageLock);
+  if (replaced) releaseImage(server, replaced);
+  return loaded;
+}
+
+// Reads and runs one job, returns false once the connection is done with
+static bool serveJob(serveWorker *worker) {
+  serveRequest request;
+  if (!readBytes(worker, &request, sizeof(request))) return false;
+  if (request.imageSize > SERVE_MAX_IMAGE || request.inputCount > SERVE_MAX_INPUT) {
+    sendResult(worker, SERVE_TOO_LARGE);
+    return false;
+  }
+
+  size_t size = request.imageSize;
+  if (!growBuffer((void **)&worker->image, &worker->imageCap, size) ||
+      !growBuffer((void **)&worker->inputWords, &worker->inputCap, request.inputCount * sizeof(uint32_t))) {
+    sendResult(worker, SERVE_TOO_LARGE);
+    return false;
+  }
+  if (!readBytes(worker, worker->image, size)) return false;
+  if (!readBytes(worker, worker->inputWords, request.inputCount * sizeof(uint32_t))) return false;
+
+  if (!forkImage(worker, size)) return sendResult(worker, SERVE_BAD_IMAGE);
+
+  cpu *cpuState = &worker->cpuState;
+  worker->input = worker->inputWords;
+  worker->inputPos = 0;
+  worker->inputCount = request.inputCount;
+  worker->failed = false;
+  cpuState->io = &worker->port;
+  uint64_t limit = worker->server->cycleLimit;
+  cpuState->cycleLimit = request.cycleLimit && request.cycleLimit < limit ? request.cycleLimit : limit;
+  runCpu16Threaded(cpuState);
+
+  atomic_fetch_add_explicit(&worker->server->jobs, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&worker->server->cycles, cpuState->cycles, memory_order_relaxed);
+  return sendResult(worker, SERVE_RAN);
+}
+
+static void *serveWorkerMain(void *arg) {
+  serveWorker *worker = arg;
+  serveState *server = worker->server;
+  for (;;) {
+    pthread_mutex_lock(&server->lock);
+    while (!server->count) pthread_cond_wait(&server->queued, &server->lock);
+    worker->fd = server->fds[server->head];
+    server->head = (server->head + 1) % SERVE_BACKLOG;
+    --server->count;
+    pthread_cond_signal(&server->taken);
+    pthread_mutex_unlock(&server->lock);
+
+    // Jobs already read ahead are run before the connection is handed back, anything after them is still unread
+    worker->readPos = worker->readLen = 0;
+    bool open;
+    while ((open = serveJob(worker)) && worker->readPos < worker->readLen);
+
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.fd = worker->fd;
+    if (!open || epoll_ctl(server->epollFd, EPOLL_CTL_ADD, worker->fd, &event)) close(worker->fd);
+  }
+  return NULL;
+}
+
+int listenUnix(char *path) {
+  struct sockaddr_un addr = {0};
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path, strlen(path));
+  unlink(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, SOMAXCONN)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Serves jobs on a UNIX socket at socketPath, see server.h, until interrupted. threadCount workers each keep a cpu
+// ready to run the next job, 0 means one per online core. Loaded images are kept and every job on one is a copy on
+// write fork of it, so a job only costs its own instructions and the copy of page 0. A connection only holds a worker
+// while it has a job in progress, between jobs this thread waits on it along with the listener. Jobs past the worker
+// count wait for one. Jobs served per second are reported once the server stops.
+int serveJobs(char *socketPath, uint32_t threadCount, uint64_t cycleLimit) {
+  serveState *server = calloc(1, sizeof(serveState));
+  if (!server) {
+    puts("Out of memory");
+    return 1;
+  }
+  pthread_mutex_init(&server->lock, NULL);
+  pthread_mutex_init(&server->imageLock, NULL);
+  pthread_cond_init(&server->queued, NULL);
+  pthread_cond_init(&server->taken, NULL);
+  server->cycleLimit = cycleLimit;
+
+  int listener = listenUnix(socketPath);
+  if (listener < 0 || (server->epollFd = epoll_create1(0)) < 0) {
+    puts("Could not listen for jobs");
+    return 1;
+  }
+  struct epoll_event event = {0};
+  event.events = EPOLLIN;
+  event.data.fd = listener;
+  epoll_ctl(server->epollFd, EPOLL_CTL_ADD, listener, &event);
+
+  if (!threadCount) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = cores > 0 ? cores : 1;
+  }
+  uint32_t started = 0;
+  for (uint32_t i = 0; i < threadCount; ++i) {
+    serveWorker *worker = calloc(1, sizeof(serveWorker));
+    if (!worker) break;
+    worker->port = (ioPort){serveRead, serveWrite, NULL};
+    worker->server = server;
+    initCpuConfig(&worker->cpuState);
+    worker->cpuState.debug = false;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serveWorkerMain, worker)) {
+      free(worker);
+      break;
+    }
+    pthread_detach(thread);
+    ++started;
+  }
+  if (!started) {
+    puts("Could not start any workers");
+    close(listener);
+    unlink(socketPath);
+    return 1;
+  }
+
+  // Without SA_RESTART so epoll_wait returns when the server is told to stop
+  struct sigaction action = {0};
+  action.sa_handler = stopServing;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  fprintf(stderr, "Serving jobs on %s with %" PRIu32 " workers\n", socketPath, started);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Connections, new or handed back by a worker, go to the workers once they have something to read. A connection
+  // closing counts as that so its worker can see it end.
+  struct epoll_event events[SERVE_EVENTS];
+  while (!stopping) {
+    int count = epoll_wait(server->epollFd, events, SERVE_EVENTS, -1);
+    for (int i = 0; i < count; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == listener) {
+        if ((fd = accept(listener, NULL, NULL)) < 0) continue;
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.fd = fd;
+        if (epoll_ctl(server->epollFd, EPOLL_CTL_ADD, fd, &event)) close(fd);
+        continue;
+      }
+      epoll_ctl(server->epollFd, EPOLL_CTL_DEL, fd, NULL);
+
+      pthread_mutex_lock(&server->lock);
+      while (server->count == SERVE_BACKLOG) pthread_cond_wait(&server->taken, &server->lock);
+      server->fds[(server->head + server->count) % SERVE_BACKLOG] = fd;
+      ++server->count;
+      pthread_cond_signal(&server->queued);
+      pthread_mutex_unlock(&server->lock);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  close(listener);
+  unlink(socketPath);
+
+  // Workers are left to the process exit, jobs in progress are dropped
+  uint64_t jobs = atomic_load_explicit(&server->jobs, memory_order_relaxed);
+  uint64_t cycles = atomic_load_explicit(&server->cycles, memory_order_relaxed);
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "Served %" PRIu64 " jobs, %" PRIu64 " instructions in %.6fs (%.0f jobs/s)\n",
+    jobs, cycles, seconds, seconds > 0 ? jobs / seconds : 0);
+  return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "emulator.h"
+
+// The job protocol spoken over the socket given to --serve. A connection sends any number of jobs one after the
+// other, each a serveRequest followed by imageSize bytes of a .xtoyb or .xtoy16 image and then inputCount 4 byte
+// input words. The reply to each is any number of SERVE_OUTPUT frames holding the words written to the I/O port,
+// sent as they fill, then a SERVE_RESULT frame. Everything is little endian.
+// With --sessions a connection carries one job whose input doesn't have to be there up front. inputCount is ignored,
+// every word sent after the image is input whenever it arrives and shutting down the sending side ends the input.
+// The reply is the same and the connection is closed once it's sent.
+#define SERVE_MAX_IMAGE (uint32_t)(16 << 20)
+#define SERVE_MAX_INPUT (uint32_t)(16 << 20)
+
+typedef struct {
+  uint32_t imageSize;
+  uint32_t inputCount;
+  uint64_t cycleLimit; // 0 for no limit beyond the server's own --cycle-limit
+} serveRequest;
+
+enum {
+  SERVE_OUTPUT = 1, // Followed by count 4 byte words
+  SERVE_RESULT      // Followed by a serveResult, count is 1
+};
+
+typedef struct {
+  uint32_t kind;
+  uint32_t count;
+} serveFrame;
+
+enum {
+  SERVE_RAN,
+  SERVE_BAD_IMAGE, // Nothing ran, the connection carries on with the next job
+  SERVE_TOO_LARGE  // imageSize or inputCount is over the maximum, the server closes the connection
+};
+
+// The cpu once the job stopped, stop is a stopReason and STOP_NONE when the program halted
+typedef struct {
+  uint32_t status;
+  uint32_t stop;
+  uint64_t cycles;
+  uint16_t pc;
+  uint8_t  halted;
+  uint8_t  in32Bit;
+  uint32_t registers[REG_COUNT];
+  uint8_t  padding[4];
+} serveResult;
+
+// server.c, shared with sessions.c
+int listenUnix(char *path);
+void fillResult(serveResult *result, cpu *cpuState, uint32_t status);
+
+#endif
@@ -0,0 +1,490 @@
+#include <errno.h>      // EAGAIN, EINTR, errno, EWOULDBLOCK
+#include <fcntl.h>      // fcntl, F_GETFL, F_SETFL, O_NONBLOCK
+#include <inttypes.h>   // PRIu32, PRIu64, UINT64_MAX, uint8_t, uint32_t, uint64_t
+#include <pthread.h>    // pthread_cond_signal, pthread_cond_t, pthread_cond_wait, pthread_create, pthread_detach, pthread_mutex_lock, pthread_mutex_t, pthread_mutex_unlock, pthread_t, PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+#include <signal.h>     // sig_atomic_t, sigaction, sigemptyset, SIGINT, SIGTERM
+#include <stdbool.h>    // bool, false, true
+#include <stdio.h>      // fprintf, puts, stderr
+#include <stdlib.h>     // calloc, free, malloc, realloc
+#include <string.h>     // memcpy
+#include <sys/epoll.h>  // epoll_create1, epoll_ctl, epoll_event, epoll_wait, EPOLL_CTL_ADD, EPOLL_CTL_DEL, EPOLL_CTL_MOD, EPOLLIN, EPOLLOUT
+#include <sys/socket.h> // accept, MSG_NOSIGNAL, send, shutdown, SHUT_RDWR
+#include <time.h>       // clock_gettime, CLOCK_MONOTONIC, timespec
+#include <unistd.h>     // close, read, ssize_t, sysconf, unlink, _SC_NPROCESSORS_ONLN
+
+#include "emulator.h"
+#include "server.h"
+
+// Interactive jobs multiplexed over a few threads. A session is one connection and the cpu running its job. When the
+// program reads the I/O port with no input queued the engine stops on that instruction the way it does for any port
+// that runs dry, so the session is parked without holding a thread and the event loop queues it to run again once
+// more input arrives. Running it again carries on from the same instruction, so the program sees exactly what it
+// would reading a blocking port. Sessions that keep running are run in slices so a few long ones can't starve the
+// rest of a worker.
+
+// Instructions a session runs before going to the back of the run queue
+#define SESSION_SLICE (uint64_t)(1 << 20)
+// Input words queued before the event loop stops reading a session and output bytes queued before it stops running
+#define SESSION_MAX_PENDING (size_t)(1 << 20)
+#define SESSION_MAX_SEND    (size_t)(4 << 20)
+#define SESSION_EVENTS      (uint32_t)256
+#define SESSION_READ_SIZE   (size_t)65536
+
+typedef enum {
+  SESSION_READING,  // Waiting on the rest of the request and image
+  SESSION_QUEUED,   // In the run queue
+  SESSION_RUNNING,  // A worker has it
+  SESSION_WAITING,  // Parked until input arrives or the output drains
+  SESSION_DONE      // The result is queued, the connection closes once it's sent
+} sessionState;
+
+typedef struct session {
+  ioPort         port;
+  int            fd;
+  sessionState   state;
+  // Set once the client has shut down its side and nothing more will be added to pending
+  bool           inputClosed;
+  // Set when the connection fails while a worker has the session, whoever next takes it frees it
+  bool           dropped;
+  // Whether the connection is in the epoll set, see watch
+  bool           watched;
+  bool           loaded;
+  // Set by the worker when the output couldn't be kept
+  bool           failed;
+  serveRequest   request;
+  size_t         received;
+  char           *image;
+  // Input words the event loop has queued and the ones the cpu is reading, swapped when the cpu runs out
+  uint32_t       *pending, *input;
+  size_t         pendingCount, pendingCap, inputPos, inputCount, inputCap;
+  uint8_t        partial[sizeof(uint32_t)];
+  uint8_t        partialLen;
+  // Output the cpu wrote this slice, framed into send once it stops
+  uint32_t       *out;
+  size_t         outCount, outCap;
+  char           *send;
+  size_t         sendPos, sendLen, sendCap;
+  cpu            cpuState;
+  struct session *next;
+} session;
+
+// Guards every session field the event loop and workers both touch as well as the run queue
+static pthread_mutex_t sessionLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sessionQueued = PTHREAD_COND_INITIALIZER;
+static session *runHead, *runTail;
+static int epollFd;
+static uint64_t sessionCycleLimit;
+static uint64_t sessionCount, sessionCycles;
+static volatile sig_atomic_t stopping;
+
+
+static void stopServing(int signal) {
+  (void)signal;
+  stopping = true;
+}
+
+static bool growBuffer(void **buf, size_t *cap, size_t size) {
+  if (size <= *cap) return true;
+  size_t grown = *cap ? *cap : 64;
+  while (grown < size) grown *= 2;
+  void *data = realloc(*buf, grown);
+  if (!data) return false;
+  *buf = data;
+  *cap = grown;
+  return true;
+}
+
+static void enqueue(session *s) {
+  s->state = SESSION_QUEUED;
+  s->next = NULL;
+  if (runTail) {
+    runTail->next = s;
+  } else {
+    runHead = s;
+  }
+  runTail = s;
+  pthread_cond_signal(&sessionQueued);
+}
+
+// Points epoll at whatever the session needs next, reading unless the input is closed or backed up and writing while
+// there's something to send. A session failSession shut is read too, to find the end of it. Hangups are reported
+// whatever is asked for, so one waiting on neither is taken out of the set rather than have a client that has gone
+// wake the event loop over and over while a worker runs it.
+static void watch(session *s) {
+  struct epoll_event event = {0};
+  bool shut = s->state == SESSION_DONE && !s->sendLen;
+  bool reading = shut || (!s->inputClosed && s->state != SESSION_DONE && s->pendingCount < SESSION_MAX_PENDING);
+  event.events = (reading ? EPOLLIN : 0) | (s->sendPos < s->sendLen ? EPOLLOUT : 0);
+  event.data.ptr = s;
+  if (!event.events) {
+    if (s->watched) epoll_ctl(epollFd, EPOLL_CTL_DEL, s->fd, NULL);
+  } else {
+    epoll_ctl(epollFd, s->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, s->fd, &event);
+  }
+  s->watched = event.events != 0;
+}
+
+static void freeSession(session *s) {
+  close(s->fd);
+  freeCpuMemory(&s->cpuState);
+  free(s->image);
+  free(s->pending);
+  free(s->input);
+  free(s->out);
+  free(s->send);
+  free(s);
+}
+
+// Stops watching a connection that failed, freeing the session unless a worker has it or will
+static void dropSession(session *s) {
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, s->fd, NULL);
+  if (s->state == SESSION_RUNNING || s->state == SESSION_QUEUED) {
+    s->dropped = true;
+  } else {
+    freeSession(s);
+  }
+}
+
+static bool queueSend(session *s, const void *data, size_t len) {
+  if (!growBuffer((void **)&s->send, &s->sendCap, s->sendLen + len)) return false;
+  memcpy(s->send + s->sendLen, data, len);
+  s->sendLen += len;
+  return true;
+}
+
+// Frames the output the cpu wrote so far onto the send buffer
+static void queueOutput(session *s) {
+  if (!s->outCount) return;
+  serveFrame frame = {SERVE_OUTPUT, s->outCount};
+  if (!queueSend(s, &frame, sizeof(frame)) || !queueSend(s, s->out, s->outCount * sizeof(uint32_t))) s->failed = true;
+  s->outCount = 0;
+}
+
+static void queueResult(session *s, uint32_t status) {
+  serveResult result;
+  fillResult(&result, &s->cpuState, status);
+  serveFrame frame = {SERVE_RESULT, 1};
+  if (!queueSend(s, &frame, sizeof(frame)) || !queueSend(s, &result, sizeof(result))) s->failed = true;
+  s->state = SESSION_DONE;
+  ++sessionCount;
+  sessionCycles += s->cpuState.cycles;
+}
+
+static bool sessionRead(ioPort *port, uint32_t *word, bool wide) {
+  (void)wide;
+  session *s = (session *)port;
+  if (s->inputPos == s->inputCount) return false;
+  *word = s->input[s->inputPos++];
+  return true;
+}
+
+static void sessionWrite(ioPort *port, uint32_t word, bool wide) {
+  (void)wide;
+  session *s = (session *)port;
+  size_t size = (s->outCount + 1) * sizeof(uint32_t);
+  if (!growBuffer((void **)&s->out, &s->outCap, size)) {
+    // Losing output would change what the job did, so the session is ended once the slice is over
+    s->failed = true;
+    return;
+  }
+  s->out[s->outCount++] = word;
+}
+
+// Loads the image the client sent into the session's cpu, returns false if it was rejected
+static bool loadSession(session *s) {
+  cpu *cpuState = &s->cpuState;
+  initCpuConfig(cpuState);
+  cpuState->debug = false;
+  cpuState->quiet = true;
+  if (!loadImageData(cpuState, s->image, s->request.imageSize)) return false;
+  cpuState->io = &s->port;
+  uint64_t limit = s->request.cycleLimit;
+  cpuState->cycleLimit = limit && limit < sessionCycleLimit ? limit : sessionCycleLimit;
+  return true;
+}
+
+// Hands the input the event loop queued over to the cpu, called with the lock held
+static bool takeInput(session *s) {
+  if (!s->pendingCount) return true;
+  if (s->inputPos == s->inputCount) {
+    uint32_t *words = s->input;
+    size_t cap = s->inputCap;
+    s->input = s->pending;
+    s->inputCap = s->pendingCap;
+    s->inputCount = s->pendingCount;
+    s->pending = words;
+    s->pendingCap = cap;
+  } else {
+    size_t count = s->inputCount + s->pendingCount;
+    if (!growBuffer((void **)&s->input, &s->inputCap, count * sizeof(uint32_t))) return false;
+    memcpy(s->input + s->inputCount, s->pending, s->pendingCount * sizeof(uint32_t));
+    s->inputCount = count;
+  }
+  s->inputPos = 0;
+  s->pendingCount = 0;
+  return true;
+}
+
+// Ends a session whose output couldn't be kept. The connection is shut rather than closed so the event loop, which
+// may be looking at it right now, is what drops it.
+static void failSession(session *s) {
+  s->state = SESSION_DONE;
+  s->sendPos = s->sendLen = 0;
+  shutdown(s->fd, SHUT_RDWR);
+}
+
+// Runs a slice of the session and works out what it waits on next, called with the lock held and returns with it
+static void runSession(session *s) {
+  cpu *cpuState = &s->cpuState;
+  bool loaded = s->loaded;
+  bool took = takeInput(s);
+  pthread_mutex_unlock(&sessionLock);
+
+  uint64_t limit = 0;
+  if (!loaded && !(s->loaded = loadSession(s))) {
+    pthread_mutex_lock(&sessionLock);
+    queueResult(s, SERVE_BAD_IMAGE);
+    if (s->failed) failSession(s);
+    return;
+  }
+  if (took) {
+    limit = cpuState->cycleLimit;
+    if (limit - cpuState->cycles > SESSION_SLICE) cpuState->cycleLimit = cpuState->cycles + SESSION_SLICE;
+    cpuState->stop = STOP_NONE;
+    runCpu16Threaded(cpuState);
+    cpuState->cycleLimit = limit;
+  }
+
+  pthread_mutex_lock(&sessionLock);
+  // The connection failed while the cpu ran, the worker frees the session once this returns so it mustn't be queued
+  if (s->dropped) return;
+  queueOutput(s);
+  if (s->failed) {
+    s->state = SESSION_DONE;
+  } else if (!took) {
+    queueResult(s, SERVE_TOO_LARGE);
+  } else if (cpuState->halted || cpuState->stop == STOP_OUT_OF_MEMORY ||
+             (cpuState->stop == STOP_CYCLE_LIMIT && cpuState->cycles >= limit)) {
+    queueResult(s, SERVE_RAN);
+  } else if (cpuState->stop == STOP_NO_INPUT && !s->pendingCount) {
+    // No more input is coming so the program ran out, as it would have at the end of a blocking port
+    if (s->inputClosed) {
+      queueResult(s, SERVE_RAN);
+    } else {
+      s->state = SESSION_WAITING;
+    }
+  } else if (s->sendLen - s->sendPos > SESSION_MAX_SEND) {
+    s->state = SESSION_WAITING;
+  } else {
+    enqueue(s);
+  }
+  if (s->failed && s->state == SESSION_DONE) failSession(s);
+}
+
+static void *sessionWorkerMain(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&sessionLock);
+  for (;;) {
+    while (!runHead) pthread_cond_wait(&sessionQueued, &sessionLock);
+    session *s = runHead;
+    runHead = s->next;
+    if (!runHead) runTail = NULL;
+
+    if (s->dropped) {
+      freeSession(s);
+      continue;
+    }
+    s->state = SESSION_RUNNING;
+    runSession(s);
+    if (s->dropped) {
+      freeSession(s);
+    } else {
+      watch(s);
+    }
+  }
+  return NULL;
+}
+
+// Sorts bytes read from the client into the request, the image and input words, called with the lock held. Returns
+// false if the request is over the limits.
+static bool receive(session *s, const uint8_t *data, size_t len) {
+  while (len && s->state == SESSION_READING) {
+    size_t run;
+    if (s->received < sizeof(serveRequest)) {
+      run = sizeof(serveRequest) - s->received;
+      if (run > len) run = len;
+      memcpy((char *)&s->request + s->received, data, run);
+    } else {
+      size_t at = s->received - sizeof(serveRequest);
+      run = s->request.imageSize - at;
+      if (run > len) run = len;
+      memcpy(s->image + at, data, run);
+    }
+    s->received += run;
+    data += run;
+    len -= run;
+
+    if (s->received == sizeof(serveRequest)) {
+      if (s->request.imageSize > SERVE_MAX_IMAGE || !(s->image = malloc(s->request.imageSize ? s->request.imageSize : 1))) return false;
+    }
+    if (s->received == sizeof(serveRequest) + s->request.imageSize) enqueue(s);
+  }
+
+  if (!len) return true;
+  size_t words = (s->partialLen + len) / sizeof(uint32_t);
+  if (!growBuffer((void **)&s->pending, &s->pendingCap, (s->pendingCount + words) * sizeof(uint32_t))) return false;
+  while (len) {
+    size_t run = sizeof(uint32_t) - s->partialLen;
+    if (run > len) run = len;
+    memcpy(s->partial + s->partialLen, data, run);
+    s->partialLen += run;
+    data += run;
+    len -= run;
+    if (s->partialLen == sizeof(uint32_t)) {
+      memcpy(s->pending + s->pendingCount++, s->partial, sizeof(uint32_t));
+      s->partialLen = 0;
+    }
+  }
+  if (s->state == SESSION_WAITING && s->pendingCount) enqueue(s);
+  return true;
+}
+
+static void readSession(session *s) {
+  static uint8_t buf[SESSION_READ_SIZE];
+  ssize_t got;
+  while ((got = read(s->fd, buf, sizeof(buf))) < 0 && errno == EINTR);
+  if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+  pthread_mutex_lock(&sessionLock);
+  // A session that's done with nothing left to send was shut by its worker
+  bool finished = s->state == SESSION_READING || (s->state == SESSION_DONE && !s->sendLen);
+  if (got < 0 || (got == 0 && finished)) {
+    dropSession(s);
+  } else if (got == 0) {
+    s->inputClosed = true;
+    // Whatever it's waiting on, the program runs on to find the input has ended
+    if (s->state == SESSION_WAITING) enqueue(s);
+    watch(s);
+  } else if (!receive(s, buf, got)) {
+    dropSession(s);
+  } else {
+    watch(s);
+  }
+  pthread_mutex_unlock(&sessionLock);
+}
+
+static void writeSession(session *s) {
+  pthread_mutex_lock(&sessionLock);
+  ssize_t sent = send(s->fd, s->send + s->sendPos, s->sendLen - s->sendPos, MSG_NOSIGNAL);
+  if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    pthread_mutex_unlock(&sessionLock);
+    return;
+  }
+  if (sent < 0) {
+    dropSession(s);
+    pthread_mutex_unlock(&sessionLock);
+    return;
+  }
+
+  s->sendPos += sent;
+  if (s->sendPos == s->sendLen) s->sendPos = s->sendLen = 0;
+  if (s->state == SESSION_DONE && !s->sendLen) {
+    freeSession(s);
+  } else {
+    // A session held up by its own output can carry on once the client catches up
+    bool resume = s->state == SESSION_WAITING && s->sendLen - s->sendPos <= SESSION_MAX_SEND &&
+                  (s->pendingCount || s->inputClosed || s->cpuState.stop != STOP_NO_INPUT);
+    if (resume) enqueue(s);
+    watch(s);
+  }
+  pthread_mutex_unlock(&sessionLock);
+}
+
+// Serves interactive jobs on a UNIX socket at socketPath, see server.h, until interrupted. threadCount workers run
+// whichever sessions have something to do, 0 means one per online core, while this thread waits on every connection
+// at once and queues sessions as their input arrives.
+int serveSessions(char *socketPath, uint32_t threadCount, uint64_t cycleLimit) {
+  sessionCycleLimit = cycleLimit;
+  int listener = listenUnix(socketPath);
+  if (listener < 0 || (epollFd = epoll_create1(0)) < 0) {
+    puts("Could not listen for sessions");
+    return 1;
+  }
+  struct epoll_event event = {0};
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, listener, &event);
+
+  if (!threadCount) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = cores > 0 ? cores : 1;
+  }
+  uint32_t started = 0;
+  for (uint32_t i = 0; i < threadCount; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sessionWorkerMain, NULL)) break;
+    pthread_detach(thread);
+    ++started;
+  }
+  if (!started) {
+    puts("Could not start any workers");
+    close(listener);
+    unlink(socketPath);
+    return 1;
+  }
+
+  // Without SA_RESTART so epoll_wait returns when the server is told to stop
+  struct sigaction action = {0};
+  action.sa_handler = stopServing;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  fprintf(stderr, "Serving sessions on %s with %" PRIu32 " workers\n", socketPath, started);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  struct epoll_event events[SESSION_EVENTS];
+  while (!stopping) {
+    int count = epoll_wait(epollFd, events, SESSION_EVENTS, -1);
+    for (int i = 0; i < count; ++i) {
+      session *s = events[i].data.ptr;
+      if (!s) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) continue;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        if (!(s = calloc(1, sizeof(session)))) {
+          close(fd);
+          continue;
+        }
+        s->port = (ioPort){sessionRead, sessionWrite, NULL};
+        s->fd = fd;
+        s->state = SESSION_READING;
+        event.events = EPOLLIN;
+        event.data.ptr = s;
+        s->watched = true;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event)) freeSession(s);
+        continue;
+      }
+
+      if (events[i].events & EPOLLOUT) {
+        writeSession(s);
+      } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        readSession(s);
+      }
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  close(listener);
+  unlink(socketPath);
+
+  // Workers are left to the process exit, sessions in progress are dropped
+  pthread_mutex_lock(&sessionLock);
+  uint64_t count = sessionCount, cycles = sessionCycles;
+  pthread_mutex_unlock(&sessionLock);
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "Served %" PRIu64 " sessions, %" PRIu64 " instructions in %.6fs (%.0f sessions/s)\n",
+    count, cycles, seconds, seconds > 0 ? count / seconds : 0);
+  return 0;
+}
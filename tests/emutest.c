@@ -0,0 +1,323 @@
+#include <inttypes.h> // PRIX16, PRIX32, PRIu64, SCNx32, UINT64_MAX, uint32_t
+#include <stdbool.h>  // bool, false, true
+#include <stdio.h>    // FILE, fclose, fgets, fopen, fprintf, fread, puts, remove, size_t, snprintf, sscanf, stderr
+#include <stdlib.h>   // EXIT_FAILURE, EXIT_SUCCESS, free, malloc, mkdtemp, realloc, system
+#include <string.h>   // memcmp, memset, strcmp, strncmp
+#include <unistd.h>   // rmdir
+
+#include "emulator.h"
+#include "toyemu.h"
+
+// Engine parity checks run by make check, see usage below. Each image is run by the reference interpreter, then by
+// the headless, threaded, JIT and lockstep engines, libtoyemu and a compiled --aot program. Every one of them has
+// to end with the reference's registers, memory and output. Compiled programs only show their output, and images
+// that switch to 32 bit mode aren't compiled. tests/modes.xtoy16 reads the input and runs a stretch in 32 bit mode.
+
+// Fed to every run through the I/O port, the same words as hex lines for compiled programs
+static const uint32_t input[] = {0x0012, 0x0034, 0x0056, 0x0078};
+#define INPUT_COUNT (uint32_t)(sizeof(input) / sizeof(input[0]))
+
+// Programs writing more than this only have their first words compared, along with the count
+#define OUTPUT_WORDS (uint32_t)64
+
+// More lanes than a lockstep group holds so lanes get split across groups
+#define LOCKSTEP_LANES (uint32_t)11
+
+typedef struct {
+  ioPort   port;
+  uint32_t read;
+  uint32_t output[OUTPUT_WORDS];
+  uint32_t outputCount;
+} testPort;
+
+// A cpu and the port it reads and writes through, kept together so the port outlives the run
+typedef struct {
+  cpu      cpuState;
+  testPort io;
+} testRun;
+
+typedef struct {
+  const char *name;
+  void       (*run)(cpu *cpuState);
+} testEngine;
+
+static const testEngine engines[] = {
+  {"headless", runCpu16Headless},
+  {"threaded", runCpu16Threaded},
+  {"jit", runCpu16Jit}
+};
+
+static int failures = 0;
+
+
+static void fail(const char *path, const char *engine, const char *message) {
+  fprintf(stderr, "%s: %s %s\n", path, engine, message);
+  ++failures;
+}
+
+static bool testRead(ioPort *port, uint32_t *word, bool wide) {
+  (void)wide;
+  testPort *io = (testPort *)port;
+  if (io->read == INPUT_COUNT) return false;
+  *word = input[io->read++];
+  return true;
+}
+
+static void testWrite(ioPort *port, uint32_t word, bool wide) {
+  (void)wide;
+  testPort *io = (testPort *)port;
+  if (io->outputCount < OUTPUT_WORDS) io->output[io->outputCount] = word;
+  ++io->outputCount;
+}
+
+static bool startRun(testRun *run, const char *path) {
+  memset(run, 0, sizeof(testRun));
+  run->io.port.read = testRead;
+  run->io.port.write = testWrite;
+  initCpuConfig(&run->cpuState);
+  run->cpuState.debug = false;
+  run->cpuState.quiet = true;
+  run->cpuState.io = &run->io.port;
+  initCpuState16(&run->cpuState);
+  return loadImage(&run->cpuState, (char *)path, false);
+}
+
+static bool sameOutput(const testPort *a, const testPort *b) {
+  uint32_t stored = a->outputCount < OUTPUT_WORDS ? a->outputCount : OUTPUT_WORDS;
+  return a->outputCount == b->outputCount && !memcmp(a->output, b->output, stored * sizeof(uint32_t));
+}
+
+// Page 0 plus every page past it, which reads as zero where it was never written
+static bool sameMemory(cpu *a, cpu *b) {
+  for (uint32_t addr = 0; addr < MEM_SIZE_32; ++addr) {
+    if (memRead32(a, addr) != memRead32(b, addr)) return false;
+  }
+  return true;
+}
+
+static void compareRun(const char *path, const char *engine, testRun *expected, testRun *actual) {
+  cpu *a = &expected->cpuState, *b = &actual->cpuState;
+  char message[128];
+  if (a->halted != b->halted || a->in32Bit != b->in32Bit || a->stop != b->stop || a->pc != b->pc) {
+    snprintf(message, sizeof(message), "stops at pc %04" PRIX16 "%s, the reference at %04" PRIX16 "%s",
+      b->pc, b->halted ? " halted" : "", a->pc, a->halted ? " halted" : "");
+    fail(path, engine, message);
+  } else if (a->cycles != b->cycles) {
+    snprintf(message, sizeof(message), "runs %" PRIu64 " cycles, the reference %" PRIu64, b->cycles, a->cycles);
+    fail(path, engine, message);
+  } else if (memcmp(a->registers, b->registers, sizeof(a->registers))) {
+    fail(path, engine, "ends with different registers");
+  } else if (!sameMemory(a, b)) {
+    fail(path, engine, "ends with different memory");
+  } else if (!sameOutput(&actual->io, &expected->io)) {
+    fail(path, engine, "writes different output");
+  } else if (actual->io.read != expected->io.read) {
+    fail(path, engine, "reads a different amount of input");
+  }
+}
+
+static void checkEngines(const char *path, testRun *expected) {
+  for (uint32_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i) {
+    testRun run;
+    if (!startRun(&run, path)) {
+      fail(path, engines[i].name, "doesn't load");
+      continue;
+    }
+    engines[i].run(&run.cpuState);
+    compareRun(path, engines[i].name, expected, &run);
+    freeCpuMemory(&run.cpuState);
+  }
+}
+
+static void checkLockstep(const char *path, testRun *expected) {
+  testRun *runs = malloc(LOCKSTEP_LANES * sizeof(testRun));
+  cpu *lanes[LOCKSTEP_LANES];
+  if (!runs) {
+    fail(path, "lockstep", "Out of memory");
+    return;
+  }
+
+  uint32_t loaded = 0;
+  for (; loaded < LOCKSTEP_LANES; ++loaded) {
+    if (!startRun(runs + loaded, path)) break;
+    lanes[loaded] = &runs[loaded].cpuState;
+  }
+  if (loaded == LOCKSTEP_LANES) {
+    runCpu16Lockstep(lanes, LOCKSTEP_LANES);
+    for (uint32_t i = 0; i < LOCKSTEP_LANES; ++i) compareRun(path, "lockstep", expected, runs + i);
+  } else {
+    fail(path, "lockstep", "doesn't load");
+  }
+
+  for (uint32_t i = 0; i < loaded; ++i) freeCpuMemory(&runs[i].cpuState);
+  free(runs);
+}
+
+static bool readFile(const char *path, char **data, size_t *size) {
+  FILE *file = fopen(path, "rb");
+  if (!file) return false;
+  size_t capacity = 4096;
+  *size = 0;
+  *data = malloc(capacity);
+  while (*data) {
+    *size += fread(*data + *size, 1, capacity - *size, file);
+    if (*size < capacity) break;
+    char *grown = realloc(*data, capacity *= 2);
+    if (!grown) free(*data);
+    *data = grown;
+  }
+  fclose(file);
+  return *data != NULL;
+}
+
+static void checkLibrary(const char *path, testRun *expected) {
+  char *data;
+  size_t size;
+  toyMachine *machine;
+  if (!readFile(path, &data, &size)) {
+    fail(path, "libtoyemu", "Cannot open");
+    return;
+  }
+  if (toyCreate(&machine) != TOY_OK) {
+    fail(path, "libtoyemu", "Out of memory");
+    free(data);
+    return;
+  }
+
+  toyStatus status = toyLoadImage(machine, data, size);
+  free(data);
+  if (status == TOY_OK) status = toyWriteInput(machine, input, INPUT_COUNT);
+  if (status == TOY_OK) status = toyRun(machine, UINT64_MAX);
+  cpu *a = &expected->cpuState;
+  toyStatus wanted = a->halted ? TOY_HALTED : a->stop == STOP_NO_INPUT ? TOY_NEED_INPUT : TOY_CYCLE_LIMIT;
+  if (status != wanted) {
+    fail(path, "libtoyemu", "stops for a different reason");
+    toyDestroy(machine);
+    return;
+  }
+
+  toyState state;
+  toyGetState(machine, &state);
+  testPort io = {0};
+  uint32_t word;
+  while (toyReadOutput(machine, &word, 1)) testWrite(&io.port, word, false);
+  bool memoryMatches = true;
+  for (uint32_t addr = 0; addr < MEM_SIZE_32 && memoryMatches; ++addr) {
+    memoryMatches = toyReadMemory32(machine, addr, &word) == TOY_OK && word == memRead32(a, addr);
+  }
+
+  if (state.pc != a->pc || state.halted != a->halted || state.in32Bit != a->in32Bit || state.cycles != a->cycles) {
+    fail(path, "libtoyemu", "ends in a different state");
+  } else if (memcmp(state.registers, a->registers, sizeof(state.registers))) {
+    fail(path, "libtoyemu", "ends with different registers");
+  } else if (!memoryMatches) {
+    fail(path, "libtoyemu", "ends with different memory");
+  } else if (!sameOutput(&io, &expected->io)) {
+    fail(path, "libtoyemu", "writes different output");
+  }
+  toyDestroy(machine);
+}
+
+// Builds the program --aot writes with the compiler given and compares what it prints as output
+static void checkCompiled(const char *path, testRun *expected, const char *compiler) {
+  testRun run;
+  if (!startRun(&run, path)) {
+    fail(path, "aot", "doesn't load");
+    return;
+  }
+  bool switches = false;
+  for (uint32_t i = 0; i < MEM_SIZE_16; ++i) switches |= run.cpuState.memory16[i] == 0x0FFF;
+  if (switches) {
+    freeCpuMemory(&run.cpuState);
+    return;
+  }
+
+  char directory[] = "/tmp/emutestXXXXXX";
+  if (!mkdtemp(directory)) {
+    fail(path, "aot", "has nowhere to build");
+    freeCpuMemory(&run.cpuState);
+    return;
+  }
+  char source[64], program[64], inputPath[64], outputPath[64], command[512];
+  snprintf(source, sizeof(source), "%s/aot.c", directory);
+  snprintf(program, sizeof(program), "%s/aot", directory);
+  snprintf(inputPath, sizeof(inputPath), "%s/input", directory);
+  snprintf(outputPath, sizeof(outputPath), "%s/output", directory);
+
+  FILE *out = fopen(source, "w");
+  bool emitted = out && emitAot16(&run.cpuState, out, path);
+  if (out) fclose(out);
+  freeCpuMemory(&run.cpuState);
+  FILE *in = fopen(inputPath, "w");
+  if (in) {
+    for (uint32_t i = 0; i < INPUT_COUNT; ++i) fprintf(in, "%04" PRIX32 "\n", input[i]);
+    fclose(in);
+  }
+
+  snprintf(command, sizeof(command), "%s -O1 -o %s %s", compiler, program, source);
+  if (!emitted || !in) {
+    fail(path, "aot", "doesn't compile");
+  } else if (system(command)) {
+    fail(path, "aot", "program doesn't build");
+  } else {
+    snprintf(command, sizeof(command), "%s < %s > %s", program, inputPath, outputPath);
+    if (system(command)) {
+      fail(path, "aot", "program fails");
+    } else {
+      testPort io = {0};
+      FILE *printed = fopen(outputPath, "r");
+      char line[128];
+      while (printed && fgets(line, sizeof(line), printed)) {
+        uint32_t word;
+        if (strncmp(line, "output: ", 8) == 0 && sscanf(line + 8, "%" SCNx32, &word) == 1) {
+          testWrite(&io.port, word, false);
+        }
+      }
+      if (printed) fclose(printed);
+      if (!sameOutput(&io, &expected->io)) fail(path, "aot", "writes different output");
+    }
+  }
+
+  remove(source);
+  remove(program);
+  remove(inputPath);
+  remove(outputPath);
+  rmdir(directory);
+}
+
+// Usage: emutest [--cc COMPILER] IMAGE..., compiled programs are only checked when given a compiler
+int main(int argc, char **argv) {
+  const char *compiler = NULL;
+  int first = 1;
+  if (argc > 2 && strcmp(argv[1], "--cc") == 0) {
+    compiler = argv[2];
+    first = 3;
+  }
+  if (first == argc) {
+    puts("Usage: emutest [--cc COMPILER] IMAGE...");
+    return EXIT_FAILURE;
+  }
+
+  for (int i = first; i < argc; ++i) {
+    testRun expected;
+    if (!startRun(&expected, argv[i])) {
+      fail(argv[i], "reference", "doesn't load");
+      continue;
+    }
+    runCpu16(&expected.cpuState);
+    if (!expected.cpuState.halted) fail(argv[i], "reference", "doesn't halt");
+
+    checkEngines(argv[i], &expected);
+    checkLockstep(argv[i], &expected);
+    checkLibrary(argv[i], &expected);
+    if (compiler) checkCompiled(argv[i], &expected, compiler);
+    freeCpuMemory(&expected.cpuState);
+  }
+
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  puts("All checks passed");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,299 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "xasm.h"
+
+
+// Checks for xasm run by make check. The .xasm sources in the test directory with an .xtoy16 next to them were
+// assembled into it by the two pass assembler the single pass one replaced, in the format PrintWords writes.
+static const char *const ImageSources[] = {"calls", "countdown", "opcodes"};
+
+// Run through both front ends on top of the sources above. Some parse, some don't and some parse but don't assemble.
+static const char *const FrontEndSources[] = {
+  "",
+  "\n\n",
+  "hlt",
+  "  hlt  ; done\r\n",
+  "lda r1,15\n",
+  "lda r1 ,  15\n",
+  "lda\tr1\t, 15",
+  "add r1 r2 r3 r4\n",
+  "hlt ;\n",
+  ";\n",
+  "x:\nbrz r0 x\n",
+  "  l0op:  \nbrp r1 l0op",
+  "9lab:\n",
+  "hltx:\nhlt hltx\n",
+  "hlt hlt\n",
+  "r1:\n",
+  "rG:\n",
+  "jmp rG\n",
+  ".WORD 1234\n",
+  ".WORD 12\n",
+  ".WORD ABCD\n",
+  ".WORD 1234 ; data\n",
+  ".ORG 30\n",
+  ".ORG 0030\n",
+  ".BYTE 12\n",
+  "lda r1 ABCD\n",
+  "lda r1 1\n",
+  "str r2, FF, r3\n",
+  "a:b:\n",
+  "a b:\n",
+  "hlt\r\r\nhlt\n",
+  "\xC3\xA9:\nbrz r0 \xC3\xA9\n"
+};
+
+static int Failures = 0;
+
+static void Fail(const std::string &test, const std::string &message) {
+  std::cerr << test << ": " << message << std::endl;
+  ++Failures;
+}
+
+static bool ReadFile(const std::string &path, std::string &data) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  std::stringstream text;
+  text << file.rdbuf();
+  data = text.str();
+  return true;
+}
+
+static std::string Words(const Image &image) {
+  std::ostringstream out;
+  PrintWords(image, out);
+  return out.str();
+}
+
+static std::string Describe(const SourceToken &token) {
+  return "'" + std::string(token.text) + "' at " + std::to_string(token.line) + ":" + std::to_string(token.column);
+}
+
+static bool SameToken(const SourceToken &a, const SourceToken &b) {
+  return a.text == b.text && a.line == b.line && a.column == b.column;
+}
+
+// Both front ends have to accept the same sources and hand the assembler the same statements for them
+static void CheckFrontEnds(const std::string &name, std::string_view source) {
+  ParsedSource direct, antlr;
+  std::vector<Diagnostic> directDiagnostics, antlrDiagnostics;
+  bool directOk = ParseDirect(source, direct, directDiagnostics);
+  bool antlrOk = ParseAntlr(source, antlr, antlrDiagnostics);
+  if (directOk != antlrOk) {
+    std::ostringstream message;
+    message << "the direct front end " << (directOk ? "accepts" : "rejects") << " it, ANTLR "
+      << (antlrOk ? "accepts" : "rejects") << " it";
+    for (const Diagnostic &diagnostic : directOk ? antlrDiagnostics : directDiagnostics) {
+      message << ", " << diagnostic;
+    }
+    Fail(name, message.str());
+    return;
+  }
+  if (!directOk) {
+    return;
+  }
+
+  if (direct.statements.size() != antlr.statements.size()) {
+    Fail(name, std::to_string(direct.statements.size()) + " statements from the direct front end, "
+      + std::to_string(antlr.statements.size()) + " from ANTLR");
+    return;
+  }
+  for (std::size_t i = 0; i < direct.statements.size(); ++i) {
+    const Statement &a = direct.statements[i], &b = antlr.statements[i];
+    bool same = a.kind == b.kind && SameToken(a.name, b.name) && a.argumentCount == b.argumentCount;
+    for (std::size_t j = 0; same && j < std::min(a.argumentCount, a.arguments.size()); ++j) {
+      same = a.arguments[j].kind == b.arguments[j].kind && SameToken(a.arguments[j].token, b.arguments[j].token);
+    }
+    if (!same) {
+      Fail(name, "statement " + std::to_string(i) + " differs, " + Describe(a.name) + " from the direct front end, "
+        + Describe(b.name) + " from ANTLR");
+      return;
+    }
+  }
+}
+
+// The single pass assembler has to give the image the two pass one did, whichever front end parsed the source
+static void CheckImage(const std::string &name, std::string_view source, const std::string &expected) {
+  for (auto [frontend, parse] : {std::pair{"direct", ParseDirect}, std::pair{"antlr", ParseAntlr}}) {
+    ParsedSource parsed;
+    Assembly assembly;
+    if (!parse(source, parsed, assembly.diagnostics) || !Assemble(parsed, assembly)) {
+      std::ostringstream message;
+      message << "doesn't assemble with the " << frontend << " front end";
+      for (const Diagnostic &diagnostic : assembly.diagnostics) {
+        message << ", " << diagnostic;
+      }
+      Fail(name, message.str());
+    } else if (Words(assembly.image) != expected) {
+      Fail(name, std::string("the ") + frontend + " front end assembles it to\n" + Words(assembly.image));
+    }
+  }
+}
+
+static bool AssembleSource(const std::string &name, std::string_view source, Assembly &object) {
+  ParsedSource parsed;
+  if (!ParseDirect(source, parsed, object.diagnostics) || !AssembleObject(parsed, object)) {
+    Fail(name, "doesn't assemble as an object");
+    return false;
+  }
+  return true;
+}
+
+// Two objects can each define loop as long as nothing imports it, and going through .xtoyo doesn't change the link
+static void CheckSharedLabel(const std::string &directory) {
+  static const char *const expected =
+    "10: 7103\n11: FF14\n12: D111\n13: 0000\n"
+    "14: 7201\n15: 2112\n16: D115\n17: EF00\n";
+
+  std::vector<std::pair<std::string, Assembly>> objects;
+  for (const char *name : {"shared1.xasm", "shared2.xasm"}) {
+    std::string source;
+    objects.push_back({name, Assembly{}});
+    if (!ReadFile(directory + "/" + name, source)) {
+      Fail(name, "Cannot open");
+      return;
+    }
+    if (!AssembleSource(name, source, objects.back().second)) {
+      return;
+    }
+  }
+
+  Assembly program;
+  if (!Link(objects, program)) {
+    Fail("shared label", "doesn't link");
+    return;
+  }
+  if (Words(program.image) != expected) {
+    Fail("shared label", "links to\n" + Words(program.image));
+  }
+
+  std::vector<std::pair<std::string, Assembly>> readObjects;
+  for (const auto &[name, object] : objects) {
+    readObjects.push_back({name, Assembly{}});
+    if (!ReadObject(ObjectData(object), readObjects.back().second)) {
+      Fail(name, "doesn't read back from its object data");
+      return;
+    }
+  }
+  Assembly readProgram;
+  if (!Link(readObjects, readProgram) || Words(readProgram.image) != expected) {
+    Fail("shared label", "links differently from objects");
+  }
+
+  // Importing the label is ambiguous once both define it
+  Assembly importer;
+  program = Assembly{};
+  if (AssembleSource("importer", "jsr rF loop\n", importer)) {
+    objects.push_back({"importer", importer});
+    if (Link(objects, program)) {
+      Fail("shared label", "links an import of a label two objects define");
+    }
+  }
+}
+
+static void CheckCorruptObject(const std::string &name, std::string_view data) {
+  Assembly object;
+  if (ReadObject(data, object)) {
+    Fail(name, "reads as an object");
+  } else if (object.diagnostics.empty()) {
+    Fail(name, "fails without a diagnostic");
+  }
+}
+
+// Every prefix of a good object, counts past the end of the file and words the linker can't move
+static void CheckCorruptObjects(const std::string &directory) {
+  std::string source;
+  Assembly object;
+  if (!ReadFile(directory + "/shared1.xasm", source) || !AssembleSource("shared1.xasm", source, object)) {
+    return;
+  }
+  std::string data = ObjectData(object);
+
+  for (std::size_t size = 0; size < data.size(); ++size) {
+    CheckCorruptObject("object truncated to " + std::to_string(size) + " bytes", std::string_view(data).substr(0, size));
+  }
+
+  ObjectHeader header;
+  std::memcpy(&header, data.data(), sizeof(header));
+  auto withHeader = [&](ObjectHeader changed) {
+    std::string out = data;
+    std::memcpy(out.data(), &changed, sizeof(changed));
+    return out;
+  };
+  ObjectHeader changed = header;
+  changed.magic[0] = 'Y';
+  CheckCorruptObject("bad magic", withHeader(changed));
+  changed = header;
+  changed.version = ObjectVersion + 1;
+  CheckCorruptObject("later version", withHeader(changed));
+  changed = header;
+  changed.symbolCount = UINT32_MAX;
+  CheckCorruptObject("symbol count past the end", withHeader(changed));
+  changed = header;
+  changed.relocationCount = UINT32_MAX;
+  CheckCorruptObject("relocation count past the end", withHeader(changed));
+  changed = header;
+  changed.segmentCount = UINT32_MAX;
+  CheckCorruptObject("segment count past the end", withHeader(changed));
+
+  // The first segment's address moved so its words run past the end of memory
+  std::string overrun = data;
+  uint32_t address = MemorySize - 1;
+  std::memcpy(overrun.data() + sizeof(ObjectHeader), &address, sizeof(address));
+  CheckCorruptObject("segment past the end of memory", overrun);
+
+  // Reads fine but has a gap after its first word, so it isn't one run from 10
+  Assembly gap;
+  gap.image.words[0x10] = 0x7103;
+  gap.image.used[0x10] = true;
+  gap.image.words[0x20] = 0x0000;
+  gap.image.used[0x20] = true;
+  Assembly readGap, program;
+  if (!ReadObject(ObjectData(gap), readGap)) {
+    Fail("object with a gap", "doesn't read back from its object data");
+  } else if (Link({{"gap.xtoyo", readGap}}, program)) {
+    Fail("object with a gap", "links");
+  }
+}
+
+// Usage: xasmtest [directory], the directory holding the test sources defaults to tests
+int main(int argc, char *argv[]) {
+  std::string directory = argc > 1 ? argv[1] : "tests";
+
+  for (const char *name : ImageSources) {
+    std::string source, expected;
+    std::string path = directory + "/" + name;
+    if (!ReadFile(path + ".xasm", source) || !ReadFile(path + ".xtoy16", expected)) {
+      Fail(path, "Cannot open");
+      continue;
+    }
+    CheckFrontEnds(path + ".xasm", source);
+    CheckImage(path + ".xasm", source, expected);
+  }
+  for (std::size_t i = 0; i < std::size(FrontEndSources); ++i) {
+    CheckFrontEnds("source " + std::to_string(i), FrontEndSources[i]);
+  }
+
+  CheckSharedLabel(directory);
+  CheckCorruptObjects(directory);
+
+  if (Failures) {
+    std::cerr << Failures << " checks failed" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cout << "All checks passed" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,235 @@
+#include <stdbool.h> // bool, false, true
+#include <stdint.h>  // UINT64_MAX, uint16_t, uint32_t, uint64_t
+#include <stdlib.h>  // calloc, free, realloc
+#include <string.h>  // memcpy, memmove
+
+#include "emulator.h"
+#include "toyemu.h"
+
+// The cpu with its I/O port pointed at a pair of queues. Input is consumed from inHead, output is appended until
+// toyReadOutput takes it.
+struct toyMachine {
+  ioPort   port;
+  cpu      cpuState;
+  uint32_t *input;
+  size_t   inHead, inCount, inCapacity;
+  uint32_t *output;
+  size_t   outCount, outCapacity;
+  // Set when the output queue couldn't grow, the word written is lost
+  bool     outputLost;
+};
+
+static bool queueRead(ioPort *port, uint32_t *word, bool wide) {
+  (void)wide;
+  toyMachine *machine = (toyMachine *)port;
+  if (machine->inHead == machine->inCount) return false;
+  *word = machine->input[machine->inHead++];
+  return true;
+}
+
+static void queueWrite(ioPort *port, uint32_t word, bool wide) {
+  (void)wide;
+  toyMachine *machine = (toyMachine *)port;
+  if (machine->outCount == machine->outCapacity) {
+    size_t capacity = machine->outCapacity ? machine->outCapacity * 2 : 64;
+    uint32_t *output = realloc(machine->output, capacity * sizeof(uint32_t));
+    if (!output) {
+      machine->outputLost = true;
+      return;
+    }
+    machine->output = output;
+    machine->outCapacity = capacity;
+  }
+  machine->output[machine->outCount++] = word;
+}
+
+toyStatus toyCreate(toyMachine **machine) {
+  toyMachine *created = calloc(1, sizeof(toyMachine));
+  if (!created) return TOY_OUT_OF_MEMORY;
+
+  created->port.read = queueRead;
+  created->port.write = queueWrite;
+  cpu *cpuState = &created->cpuState;
+  initCpuConfig(cpuState);
+  cpuState->debug = false;
+  cpuState->quiet = true;
+  cpuState->io = &created->port;
+  initCpuState16(cpuState);
+
+  *machine = created;
+  return TOY_OK;
+}
+
+void toyDestroy(toyMachine *machine) {
+  if (!machine) return;
+  freeCpuMemory(&machine->cpuState);
+  free(machine->cpuState.breaks);
+  free(machine->input);
+  free(machine->output);
+  free(machine);
+}
+
+toyStatus toyLoadImage(toyMachine *machine, const void *data, size_t size) {
+  if (!data && size) return TOY_BAD_ARGUMENT;
+  machine->inHead = machine->inCount = 0;
+  machine->outCount = 0;
+  machine->outputLost = false;
+
+  if (!loadImageData(&machine->cpuState, data, size)) {
+    bool outOfMemory = machine->cpuState.stop == STOP_OUT_OF_MEMORY;
+    initCpuState16(&machine->cpuState);
+    return outOfMemory ? TOY_OUT_OF_MEMORY : TOY_BAD_IMAGE;
+  }
+  return TOY_OK;
+}
+
+toyStatus toyRun(toyMachine *machine, uint64_t maxCycles) {
+  cpu *cpuState = &machine->cpuState;
+  if (cpuState->halted) return TOY_HALTED;
+
+  // A breakpoint at pc is stepped over if it's what stopped the cpu or pc is an input that was waiting, a watchpoint
+  // stopped the cpu after the instruction that hit it so the one at pc hasn't been checked yet
+  cpuBreaks *breaks = cpuState->breaks;
+  if (breaks) {
+    breaks->resume = cpuState->stop == STOP_NO_INPUT ||
+                     (cpuState->stop == STOP_BREAK && breaks->hit == BREAK_CODE && breaks->hitAddr == cpuState->pc);
+  }
+  cpuState->stop = STOP_NONE;
+  cpuState->cycleLimit = maxCycles < UINT64_MAX - cpuState->cycles ? cpuState->cycles + maxCycles : UINT64_MAX;
+  if (breaks) {
+    runCpu16Debug(cpuState);
+  } else {
+    runCpu16Headless(cpuState);
+  }
+
+  if (machine->outputLost || cpuState->stop == STOP_OUT_OF_MEMORY) return TOY_OUT_OF_MEMORY;
+  if (cpuState->halted) return TOY_HALTED;
+  switch (cpuState->stop) {
+    case STOP_NO_INPUT:
+      return TOY_NEED_INPUT;
+    case STOP_BREAK:
+      return TOY_BREAK;
+    default:
+      return TOY_CYCLE_LIMIT;
+  }
+}
+
+toyStatus toyWriteInput(toyMachine *machine, const uint32_t *words, size_t count) {
+  // Reuse the space taken by words already read before growing
+  if (machine->inHead) {
+    memmove(machine->input, machine->input + machine->inHead, (machine->inCount - machine->inHead) * sizeof(uint32_t));
+    machine->inCount -= machine->inHead;
+    machine->inHead = 0;
+  }
+  if (count > machine->inCapacity - machine->inCount) {
+    size_t capacity = machine->inCapacity ? machine->inCapacity : 64;
+    while (capacity - machine->inCount < count) capacity *= 2;
+    uint32_t *input = realloc(machine->input, capacity * sizeof(uint32_t));
+    if (!input) return TOY_OUT_OF_MEMORY;
+    machine->input = input;
+    machine->inCapacity = capacity;
+  }
+  memcpy(machine->input + machine->inCount, words, count * sizeof(uint32_t));
+  machine->inCount += count;
+  return TOY_OK;
+}
+
+size_t toyReadOutput(toyMachine *machine, uint32_t *words, size_t max) {
+  size_t count = machine->outCount < max ? machine->outCount : max;
+  memcpy(words, machine->output, count * sizeof(uint32_t));
+  memmove(machine->output, machine->output + count, (machine->outCount - count) * sizeof(uint32_t));
+  machine->outCount -= count;
+  return count;
+}
+
+void toyGetState(toyMachine *machine, toyState *state) {
+  cpu *cpuState = &machine->cpuState;
+  state->pc = cpuState->pc;
+  state->halted = cpuState->halted;
+  state->in32Bit = cpuState->in32Bit;
+  state->cycles = cpuState->cycles;
+  memcpy(state->registers, cpuState->registers, sizeof(state->registers));
+
+  state->breakKind = TOY_BREAK_NONE;
+  state->breakAddr = 0;
+  if (cpuState->stop == STOP_BREAK) {
+    // Register conditions can't be set through the library so these are the only kinds hit
+    state->breakKind = cpuState->breaks->hit == BREAK_CODE ? TOY_BREAK_CODE :
+                       cpuState->breaks->hit == BREAK_READ ? TOY_BREAK_READ : TOY_BREAK_WRITE;
+    state->breakAddr = cpuState->breaks->hitAddr;
+  }
+}
+
+toyStatus toySetState(toyMachine *machine, const toyState *state) {
+  if (!state->in32Bit && state->pc >= MEM_SIZE_16) return TOY_BAD_ARGUMENT;
+
+  cpu *cpuState = &machine->cpuState;
+  cpuState->pc = cpuState->oldPC = state->pc;
+  cpuState->pcModified = false;
+  cpuState->halted = state->halted;
+  cpuState->in32Bit = state->in32Bit;
+  cpuState->cycles = state->cycles;
+  memcpy(cpuState->registers, state->registers, sizeof(cpuState->registers));
+  cpuState->registers[0] = 0;
+  cpuState->stop = STOP_NONE;
+  return TOY_OK;
+}
+
+// memWord32 stops the cpu when there's no page for a word, which for a write from outside a run mustn't replace the
+// stop the last run left
+static toyStatus writeMemory(cpu *cpuState, uint32_t addr, uint32_t word, bool wide) {
+  stopReason stop = cpuState->stop;
+  cpuState->stop = STOP_NONE;
+  if (wide) {
+    memWrite32(cpuState, addr, word);
+  } else {
+    memWrite16(cpuState, addr, word);
+  }
+  bool lost = cpuState->stop == STOP_OUT_OF_MEMORY;
+  cpuState->stop = stop;
+  return lost ? TOY_OUT_OF_MEMORY : TOY_OK;
+}
+
+toyStatus toyReadMemory16(toyMachine *machine, uint32_t addr, uint16_t *word) {
+  if (addr >= MEM_SIZE_32) return TOY_BAD_ARGUMENT;
+  // Halves laid out the way memWrite16 puts them
+  uint32_t pair = memRead32(&machine->cpuState, addr / 2);
+  memcpy(word, (uint16_t *)&pair + addr % 2, sizeof(uint16_t));
+  return TOY_OK;
+}
+
+toyStatus toyWriteMemory16(toyMachine *machine, uint32_t addr, uint16_t word) {
+  if (addr >= MEM_SIZE_32) return TOY_BAD_ARGUMENT;
+  return writeMemory(&machine->cpuState, addr, word, false);
+}
+
+toyStatus toyReadMemory32(toyMachine *machine, uint32_t addr, uint32_t *word) {
+  if (addr >= MEM_SIZE_32) return TOY_BAD_ARGUMENT;
+  *word = memRead32(&machine->cpuState, addr);
+  return TOY_OK;
+}
+
+toyStatus toyWriteMemory32(toyMachine *machine, uint32_t addr, uint32_t word) {
+  if (addr >= MEM_SIZE_32) return TOY_BAD_ARGUMENT;
+  return writeMemory(&machine->cpuState, addr, word, true);
+}
+
+static cpuBreaks *getBreaks(toyMachine *machine) {
+  cpu *cpuState = &machine->cpuState;
+  if (!cpuState->breaks) cpuState->breaks = newBreaks();
+  return cpuState->breaks;
+}
+
+toyStatus toySetBreakpoint(toyMachine *machine, uint16_t addr, bool on) {
+  cpuBreaks *breaks = getBreaks(machine);
+  if (!breaks) return TOY_OUT_OF_MEMORY;
+  setBreakpoint(breaks, addr, on);
+  return TOY_OK;
+}
+
+toyStatus toySetWatchpoint(toyMachine *machine, uint16_t addr, bool read, bool write, bool on) {
+  cpuBreaks *breaks = getBreaks(machine);
+  if (!breaks) return TOY_OUT_OF_MEMORY;
+  setWatchpoint(breaks, addr, read, write, on);
+  return TOY_OK;
+}
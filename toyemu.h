@@ -0,0 +1,78 @@
+#ifndef TOYEMU_H
+#define TOYEMU_H
+
+#include <stdbool.h> // bool
+#include <stddef.h>  // size_t
+#include <stdint.h>  // uint16_t, uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// libtoyemu, the emulator as a library for running programs in time slices from another process. Machines share
+// nothing but interned image pages so each can be driven from its own thread. Nothing is printed, the I/O port is
+// fed from and drained into queues on the machine. Running out of memory for the machine's pages partway through a
+// run loses the store that needed one and ends the run with TOY_OUT_OF_MEMORY.
+typedef struct toyMachine toyMachine;
+
+typedef enum {
+  TOY_OK,
+  TOY_HALTED,       // The program ran hlt
+  TOY_CYCLE_LIMIT,  // toyRun ran every cycle it was given
+  TOY_NEED_INPUT,   // The program read the I/O port with nothing queued, pc is left on that instruction
+  TOY_BREAK,        // A breakpoint or watchpoint was hit, see toyState for which
+  TOY_OUT_OF_MEMORY,
+  TOY_BAD_IMAGE,
+  TOY_BAD_ARGUMENT
+} toyStatus;
+
+typedef enum {
+  TOY_BREAK_NONE,
+  TOY_BREAK_CODE,  // pc reached a breakpoint, the instruction there hasn't run yet
+  TOY_BREAK_READ,  // The instruction just run read a watched address
+  TOY_BREAK_WRITE  // or wrote to one
+} toyBreakKind;
+
+// A copy of the cpu, toySetState takes everything back but the break
+typedef struct {
+  uint16_t     pc;
+  bool         halted, in32Bit;
+  uint64_t     cycles;
+  uint32_t     registers[16];
+  toyBreakKind breakKind; // Why the last run returned TOY_BREAK
+  uint16_t     breakAddr;
+} toyState;
+
+toyStatus toyCreate(toyMachine **machine);
+void toyDestroy(toyMachine *machine);
+
+// Resets the machine and loads a binary .xtoyb or text .xtoy16 image, dropping any queued input and output. A
+// rejected image leaves the machine reset.
+toyStatus toyLoadImage(toyMachine *machine, const void *data, size_t size);
+
+// Runs for up to maxCycles, returning why it stopped. Calling it again carries on from there, including past the
+// breakpoint it stopped on.
+toyStatus toyRun(toyMachine *machine, uint64_t maxCycles);
+
+// Words for the program to read from the I/O port and words it wrote there, 16 bit words in 16 bit mode
+toyStatus toyWriteInput(toyMachine *machine, const uint32_t *words, size_t count);
+size_t toyReadOutput(toyMachine *machine, uint32_t *words, size_t max);
+
+void toyGetState(toyMachine *machine, toyState *state);
+toyStatus toySetState(toyMachine *machine, const toyState *state);
+
+// Memory as 16 bit words, which the image and 16 bit mode address, or as the 32 bit words 32 bit mode addresses.
+// Addresses go up to 0xFFFF either way.
+toyStatus toyReadMemory16(toyMachine *machine, uint32_t addr, uint16_t *word);
+toyStatus toyWriteMemory16(toyMachine *machine, uint32_t addr, uint16_t word);
+toyStatus toyReadMemory32(toyMachine *machine, uint32_t addr, uint32_t *word);
+toyStatus toyWriteMemory32(toyMachine *machine, uint32_t addr, uint32_t word);
+
+toyStatus toySetBreakpoint(toyMachine *machine, uint16_t addr, bool on);
+toyStatus toySetWatchpoint(toyMachine *machine, uint16_t addr, bool read, bool write, bool on);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
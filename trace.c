@@ -0,0 +1,186 @@
+#include <errno.h>     // EINTR, errno
+#include <fcntl.h>     // open, O_CREAT, O_TRUNC, O_WRONLY
+#include <pthread.h>   // pthread_create, pthread_join, pthread_t
+#include <sched.h>     // sched_yield
+#include <stdatomic.h> // atomic_bool, atomic_init, atomic_load_explicit, atomic_store_explicit, atomic_uint_fast64_t, memory_order_acquire, memory_order_relaxed, memory_order_release
+#include <stdbool.h>   // bool, false, true
+#include <stdio.h>     // puts
+#include <stdlib.h>    // free, malloc
+#include <string.h>    // memcpy, memset
+#include <time.h>      // nanosleep, timespec
+#include <unistd.h>    // close, ssize_t, write
+
+#include "emulator.h"
+#include "trace.h"
+
+// Records held in memory waiting for the writer thread, a power of two
+#define TRACE_RING_RECORDS (uint64_t)65536
+
+// The cpu's thread is the only one moving head and the writer the only one moving tail, so recording a cycle is a
+// plain store and a release. The cpu only waits when the writer has fallen a whole ring behind.
+struct traceWriter {
+  traceRecord          *ring;
+  atomic_uint_fast64_t head, tail;
+  atomic_bool          closing;
+  bool                 failed;
+  int                  fd;
+  pthread_t            thread;
+};
+
+
+static bool writeAll(int fd, const void *buf, size_t len) {
+  const char *bytes = buf;
+  while (len) {
+    ssize_t written = write(fd, bytes, len);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+    bytes += written;
+    len -= written;
+  }
+  return true;
+}
+
+static void *traceWriterMain(void *arg) {
+  traceWriter *trace = arg;
+  const struct timespec idle = {0, 1000000};
+
+  while (true) {
+    // Checked before head so every record written before closing was set is seen
+    bool closing = atomic_load_explicit(&trace->closing, memory_order_acquire);
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+    if (head == tail) {
+      if (closing) return NULL;
+      nanosleep(&idle, NULL);
+      continue;
+    }
+
+    // Up to the end of the ring, anything wrapped around goes out on the next pass
+    uint64_t start = tail % TRACE_RING_RECORDS;
+    uint64_t count = head - tail;
+    if (count > TRACE_RING_RECORDS - start) count = TRACE_RING_RECORDS - start;
+    if (!trace->failed && !writeAll(trace->fd, trace->ring + start, count * sizeof(traceRecord))) {
+      trace->failed = true;
+    }
+    atomic_store_explicit(&trace->tail, tail + count, memory_order_release);
+  }
+}
+
+static bool writeHeader(int fd, cpu *cpuState) {
+  traceHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.pc = cpuState->pc;
+  header.in32Bit = cpuState->in32Bit;
+  header.cycles = cpuState->cycles;
+  memcpy(header.registers, cpuState->registers, sizeof(header.registers));
+  memcpy(header.memory32, cpuState->memory32, sizeof(header.memory32));
+  for (uint32_t i = 1; i < cpuState->pageCount; ++i) header.pageCount += cpuState->pages[i] != NULL;
+  if (!writeAll(fd, &header, sizeof(header))) return false;
+
+  for (uint32_t i = 1; i < cpuState->pageCount; ++i) {
+    if (!cpuState->pages[i]) continue;
+    tracePage page;
+    page.index = i;
+    memcpy(page.words, cpuState->pages[i]->words, sizeof(page.words));
+    if (!writeAll(fd, &page, sizeof(page))) return false;
+  }
+  return true;
+}
+
+// Starts tracing cpuState from its current state, the caller sets cpuState->trace to the result
+traceWriter *openTrace(char *path, cpu *cpuState) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    puts("Trace path is invalid");
+    return NULL;
+  }
+  if (!writeHeader(fd, cpuState)) {
+    puts("Trace writing error");
+    close(fd);
+    return NULL;
+  }
+
+  traceWriter *trace = malloc(sizeof(traceWriter));
+  traceRecord *ring = malloc(TRACE_RING_RECORDS * sizeof(traceRecord));
+  if (!trace || !ring) {
+    puts("Out of memory");
+    free(trace);
+    free(ring);
+    close(fd);
+    return NULL;
+  }
+
+  trace->ring = ring;
+  atomic_init(&trace->head, 0);
+  atomic_init(&trace->tail, 0);
+  atomic_init(&trace->closing, false);
+  trace->failed = false;
+  trace->fd = fd;
+  if (pthread_create(&trace->thread, NULL, traceWriterMain, trace)) {
+    puts("Could not start the trace writer");
+    free(ring);
+    free(trace);
+    close(fd);
+    return NULL;
+  }
+  return trace;
+}
+
+// Records the cycle that just ran the instruction inst at pc, the cpu's tracking fields must still describe it
+void traceCycle(cpu *cpuState, uint16_t pc, uint32_t inst) {
+  traceWriter *trace = cpuState->trace;
+  uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+  while (head - atomic_load_explicit(&trace->tail, memory_order_acquire) == TRACE_RING_RECORDS) sched_yield();
+
+  traceRecord *record = trace->ring + head % TRACE_RING_RECORDS;
+  record->inst = inst;
+  record->pc = pc;
+  record->nextPC = cpuState->pc;
+  record->in32Bit = cpuState->in32Bit;
+  record->padding[0] = record->padding[1] = 0;
+  record->regs = cpuState->lastWriteReg << 8 | cpuState->lastReadReg1 << 4 | cpuState->lastReadReg2;
+  record->regValue = cpuState->registers[cpuState->lastWriteReg];
+
+  uint8_t flags = 0;
+  if (cpuState->wroteReg) flags |= TRACE_WROTE_REG;
+  if (cpuState->readReg1) flags |= TRACE_READ_REG1;
+  if (cpuState->readReg2) flags |= TRACE_READ_REG2;
+  if (cpuState->pcModified) flags |= TRACE_PC_MODIFIED;
+  if (cpuState->halted) flags |= TRACE_HALTED;
+
+  // Port writes leave wroteMem clear so stores are told apart by opcode, a mode switch is opcode 0 either way
+  uint8_t opcode = cpuState->in32Bit ? inst >> 28 : inst >> 12;
+  bool stored = cpuState->wroteMem || opcode == 0x9 || opcode == 0xB;
+  if (stored) {
+    flags |= TRACE_STORE | (cpuState->wroteMem ? TRACE_WROTE_MEM : 0);
+    record->memAddr = cpuState->lastWriteAddr;
+  } else if (cpuState->readMem) {
+    flags |= TRACE_READ_MEM;
+    record->memAddr = cpuState->lastReadAddr;
+  } else {
+    record->memAddr = 0;
+  }
+  if (flags & (TRACE_STORE | TRACE_READ_MEM)) {
+    record->memValue = cpuState->in32Bit ? memRead32(cpuState, record->memAddr) : cpuState->memory16[record->memAddr];
+  } else {
+    record->memValue = 0;
+  }
+  record->flags = flags;
+
+  atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
+
+// Waits for every record to reach the file, returns false if any of them couldn't be written
+bool closeTrace(traceWriter *trace) {
+  if (!trace) return true;
+  atomic_store_explicit(&trace->closing, true, memory_order_release);
+  pthread_join(trace->thread, NULL);
+
+  bool ok = !trace->failed && !close(trace->fd);
+  if (!ok) puts("Trace writing error");
+  free(trace->ring);
+  free(trace);
+  return ok;
+}
@@ -0,0 +1,76 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "emulator.h"
+
+// Trace files, written by the emulator with --trace and read by xtrace. A traceHeader holding the cpu as tracing
+// started is followed by pageCount tracePages of its memory past page 0 and then one traceRecord per cycle until
+// the end of the file. Everything is little endian.
+#define TRACE_MAGIC   "XTOYTRC"
+#define TRACE_VERSION (uint16_t)1
+
+enum {
+  TRACE_WROTE_REG   = 1 << 0,
+  TRACE_READ_REG1   = 1 << 1,
+  TRACE_READ_REG2   = 1 << 2,
+  TRACE_READ_MEM    = 1 << 3,
+  TRACE_WROTE_MEM   = 1 << 4, // As the debugger shows it, writes to the I/O port don't count
+  TRACE_STORE       = 1 << 5, // memAddr was written, including the I/O port
+  TRACE_PC_MODIFIED = 1 << 6,
+  TRACE_HALTED      = 1 << 7
+};
+
+typedef struct {
+  char     magic[8];
+  uint16_t version;
+  uint16_t pc;
+  uint8_t  in32Bit;
+  uint8_t  padding[3];
+  uint32_t pageCount;
+  uint64_t cycles;
+  uint32_t registers[REG_COUNT];
+  uint32_t memory32[PAGE_WORDS_32];
+} traceHeader;
+
+typedef struct {
+  uint32_t index;
+  uint32_t words[PAGE_WORDS_32];
+} tracePage;
+
+// Everything the debugger tracks about one cycle, the register numbers are nibbles of regs: written, first read and
+// second read from the top
+typedef struct {
+  uint32_t inst;
+  uint32_t regValue;
+  uint32_t memValue;
+  uint16_t pc, nextPC;
+  uint16_t memAddr;
+  uint16_t regs;
+  uint8_t  flags;
+  uint8_t  in32Bit;
+  uint8_t  padding[2];
+} traceRecord;
+
+// Checkpoint index xtrace keeps next to a trace as TRACE.idx so show and find don't replay it from the start. A
+// traceIndexHeader is followed by checkpointCount offsets into the index, one every interval records. Each points
+// at the traceIndexBlock for the records up to the next checkpoint and then the cpu before the first of them, laid
+// out like the start of a trace as a traceHeader and its pageCount tracePages. Offsets are multiples of 8.
+#define TRACE_INDEX_MAGIC   "XTOYTIX"
+#define TRACE_INDEX_VERSION (uint16_t)1
+
+typedef struct {
+  char     magic[8];
+  uint16_t version;
+  uint16_t padding[3];
+  uint64_t traceSize;
+  uint64_t interval;
+  uint64_t checkpointCount;
+} traceIndexHeader;
+
+// Bitmaps of every pc run and every address read or stored to in a block, so find can skip the blocks that can't match
+typedef struct {
+  uint64_t pcs[BREAK_WORDS];
+  uint64_t addrs[BREAK_WORDS];
+} traceIndexBlock;
+
+#endif
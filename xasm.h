@@ -0,0 +1,304 @@
+#ifndef XASM_H
+#define XASM_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+
+enum OperandType {
+  End,
+  Zero,
+  Register,
+  Address
+};
+
+inline constexpr std::array<OperandType, 3> OperandFormatRRR = {Register, Register, Register};
+inline constexpr std::array<OperandType, 3> OperandFormatR_R = {Register, Zero, Register};
+inline constexpr std::array<OperandType, 3> OperandFormatRA  = {Register, Address,  End};
+
+// TODO: Remove registerCount and just use non End operands?
+struct Instruction {
+  std::size_t registerCount;
+
+  uint_fast8_t opcode;
+  std::array<OperandType, 3> operandTypes;
+};
+
+
+enum DirectiveName {
+  ORG,
+  WORD
+};
+
+struct Directive {
+  enum DirectiveName name;
+  uint_fast8_t argumentLength;
+};
+
+
+// A table laid out at compile time so every key has a slot of its own, a lookup is one hash and one compare. Two
+// keys hashing to the same slot make the constructor throw, which fails the constant evaluation of the table.
+template <typename Value, std::size_t SlotCount, std::size_t (*Hash)(std::string_view)>
+class PerfectHash {
+public:
+  struct Entry {
+    std::string_view key;
+    Value value;
+  };
+
+  template <std::size_t EntryCount>
+  constexpr PerfectHash(const Entry (&entries)[EntryCount]) : slots{} {
+    for (const Entry &entry : entries) {
+      Entry &slot = slots[Hash(entry.key) % SlotCount];
+      if (!slot.key.empty()) {
+        throw "PerfectHash keys collide";
+      }
+      slot = entry;
+    }
+  }
+
+  constexpr const Value *Find(std::string_view key) const {
+    const Entry &slot = slots[Hash(key) % SlotCount];
+    return !key.empty() && slot.key == key ? &slot.value : nullptr;
+  }
+
+private:
+  std::array<Entry, SlotCount> slots;
+};
+
+// The multipliers were found by searching for the smallest pair that separates all 16 mnemonics
+constexpr std::size_t MnemonicHash(std::string_view mnemonic) {
+  if (mnemonic.size() != 3) {
+    return 0;
+  }
+  return static_cast<unsigned char>(mnemonic[0]) * 2 + static_cast<unsigned char>(mnemonic[1]) * 27
+    + static_cast<unsigned char>(mnemonic[2]);
+}
+
+constexpr std::size_t DirectiveHash(std::string_view directive) {
+  return directive.size();
+}
+
+inline constexpr PerfectHash<Instruction, 32, MnemonicHash> Instructions({
+  {"hlt", {0, 0x0, {Zero, Zero, Zero}}},
+  {"add", {3, 0x1, OperandFormatRRR}},
+  {"sub", {3, 0x2, OperandFormatRRR}},
+  {"and", {3, 0x3, OperandFormatRRR}},
+  {"xor", {3, 0x4, OperandFormatRRR}},
+  {"asl", {3, 0x5, OperandFormatRRR}},
+  {"asr", {3, 0x6, OperandFormatRRR}},
+  {"lda", {2, 0x7, OperandFormatRA}},
+  {"lod", {2, 0x8, OperandFormatRA}},
+  {"str", {2, 0x9, OperandFormatRA}},
+  {"ldi", {2, 0xA, OperandFormatR_R}},
+  {"sti", {2, 0xB, OperandFormatR_R}},
+  {"brz", {2, 0xC, OperandFormatRA}},
+  {"brp", {2, 0xD, OperandFormatRA}},
+  {"jmp", {1, 0xE, {Register, Zero, Zero}}},
+  {"jsr", {2, 0xF, OperandFormatRA}}
+});
+
+// Keyed without the leading .
+inline constexpr PerfectHash<Directive, 2, DirectiveHash> Directives({
+  {"ORG", {DirectiveName::ORG, 2}},
+  {"WORD", {DirectiveName::WORD, 4}}
+});
+
+
+// A token as the front ends hand it to the assembler. Lines count from 1 and columns from 0 the way ANTLR reports
+// them, the text points into the source or into ParsedSource::strings.
+struct SourceToken {
+  std::string_view text;
+  uint32_t line, column;
+};
+
+enum class ArgumentKind {
+  Register,
+  HalfWord,
+  Word,
+  Label
+};
+
+struct SourceArgument {
+  ArgumentKind kind;
+  SourceToken token;
+};
+
+enum class StatementKind {
+  Instruction,
+  Directive,
+  Label
+};
+
+// One instruction, directive or label of the source, comments are dropped. name is the mnemonic, the directive
+// including its . or the label without its :. argumentCount counts every argument given but only the first three
+// are kept as no instruction takes more, a directive's word is its only argument.
+struct Statement {
+  StatementKind kind;
+  SourceToken name;
+  std::size_t argumentCount;
+  std::array<SourceArgument, 3> arguments;
+};
+
+struct ParsedSource {
+  std::vector<Statement> statements;
+  // Token text for front ends that can't point into the source
+  std::deque<std::string> strings;
+};
+
+
+// An error found in the source. Lines count from 1 and columns from 0, text is the token it was found at. Errors
+// from linking have no line.
+struct Diagnostic {
+  uint32_t line, column;
+  std::string text;
+  std::string message;
+};
+
+inline std::ostream &operator<<(std::ostream &out, const Diagnostic &diagnostic) {
+  if (diagnostic.line) {
+    out << "line " << diagnostic.line << ":" << diagnostic.column << (diagnostic.text.empty() ? "" : " ");
+  }
+  if (!diagnostic.text.empty()) {
+    out << "'" << diagnostic.text << "'";
+  }
+  return out << (diagnostic.line || !diagnostic.text.empty() ? ": " : "") << diagnostic.message;
+}
+
+// The hand written front end in scanner.cpp, accepting the same language as asmxtoy.g4. It stops at the first
+// syntax error, adding it to diagnostics.
+bool ParseDirect(std::string_view source, ParsedSource &parsed, std::vector<Diagnostic> &diagnostics);
+// The front end generated from asmxtoy.g4, in antlr.cpp. It isn't part of libxasm as it needs the ANTLR runtime.
+bool ParseAntlr(std::string_view source, ParsedSource &parsed, std::vector<Diagnostic> &diagnostics);
+
+typedef bool (*ParseFunction)(std::string_view source, ParsedSource &parsed, std::vector<Diagnostic> &diagnostics);
+
+
+inline constexpr std::size_t MemorySize = UINT8_MAX + 1;
+
+// The assembled program packed one word per address, xasm only has the 16 bit instructions so far
+struct Image {
+  std::array<uint16_t, MemorySize> words{};
+  std::array<bool, MemorySize> used{};
+  // The source line each word came from, for the listing
+  std::array<uint32_t, MemorySize> lines{};
+};
+
+struct Symbol {
+  std::string name;
+  std::size_t address;
+};
+
+// A word with a label in its address field that the linker has to fix up. With a symbol the label is defined in
+// another object and its address is or'd in, without one the label is in the same object and the address in the word
+// moves with the object.
+struct Relocation {
+  std::size_t address;
+  std::string symbol;
+};
+
+// An assembled program, or for AssembleObject one source of a program
+struct Assembly {
+  Image image;
+  // The labels in the order they were defined, which an object exports. Whole programs don't keep them.
+  std::vector<Symbol> symbols;
+  std::vector<Relocation> relocations;
+  std::vector<Diagnostic> diagnostics;
+};
+
+// The assembler as a library, in assembler.cpp. Nothing is shared between calls so threads can each assemble their
+// own source. Assembling stops at the first error and returns false with it in assembly.diagnostics. debug, when
+// given, gets a line for every statement and operand as it is assembled.
+bool Assemble(const ParsedSource &parsed, Assembly &assembly, std::ostream *debug = nullptr);
+// Parses source with the direct front end first
+bool Assemble(std::string_view source, Assembly &assembly, std::ostream *debug = nullptr);
+// Assembles a source as an object for Link, it is laid out from 10 like a whole program and the labels it uses but
+// doesn't define are imports. .ORG is an error as the linker moves the object as a whole.
+bool AssembleObject(const ParsedSource &parsed, Assembly &object, std::ostream *debug = nullptr);
+
+// The image as a binary .xtoyb with one segment per run of used addresses, see image.h
+std::string BinaryImage(const Image &image);
+// addr: word for every used address
+void PrintWords(const Image &image, std::ostream &out);
+// Every line of the source after the address and word assembled from it, if any
+void PrintListing(const Image &image, std::string_view source, std::ostream &out);
+
+
+// Relocatable .xtoyo objects, in linker.cpp. An ObjectHeader is followed by segmentCount segments laid out as in
+// images, then symbolCount symbols and relocationCount relocations, each an ObjectEntry and nameLength bytes of name.
+// Everything is little endian.
+inline constexpr char ObjectMagic[8] = "XTOYOBJ";
+inline constexpr uint16_t ObjectVersion = 1;
+
+struct ObjectHeader {
+  char     magic[8];
+  uint16_t version;
+  uint16_t wordBits;
+  uint32_t segmentCount;
+  uint32_t symbolCount;
+  uint32_t relocationCount;
+};
+
+struct ObjectEntry {
+  uint16_t address;
+  uint16_t nameLength;
+};
+
+std::string ObjectData(const Assembly &object);
+// Fails with a diagnostic when data isn't a whole object
+bool ReadObject(std::string_view data, Assembly &object);
+
+// Assembles every source into objects[i] using up to jobs threads, returning whether all of them assembled
+bool AssembleObjects(const std::vector<std::string_view> &sources, ParseFunction parse, std::vector<Assembly> &objects,
+    unsigned jobs);
+
+// Lays the objects out one after another from 10 in the order given and resolves the labels between them. Objects
+// can define labels with the same name, importing one of those is an error. The names are only for diagnostics, which
+// end up in program.
+bool Link(const std::vector<std::pair<std::string, Assembly>> &objects, Assembly &program);
+
+
+// The inputs of a link kept parsed and assembled between builds for xasm --watch, in incremental.cpp. Each input
+// keeps its last few versions keyed by the hash of their content. A changed source only has the lines from its first
+// change to its last parsed again, against the newest version that parsed, and only changed inputs are assembled
+// again before everything is relinked.
+class IncrementalBuild {
+public:
+  IncrementalBuild(ParseFunction parse, const std::vector<std::string> &paths);
+
+  // Rereads every input and links them into program, returning whether it linked. Diagnostics from the inputs are
+  // left in Objects() and the linker's in program.
+  bool Build(Assembly &program);
+  const std::vector<std::pair<std::string, Assembly>> &Objects() const { return objects; }
+
+  // What the last Build had to redo
+  std::size_t changedInputs = 0, parsedLines = 0;
+
+private:
+  struct Version {
+    uint64_t hash;
+    std::string text;
+    // The statements point into text, or into parsed.strings when the front end couldn't
+    ParsedSource parsed;
+    bool parsedOk = false;
+    Assembly object;
+    bool ok = false;
+  };
+
+  bool Parse(const Version *base, Version &version);
+
+  ParseFunction parse;
+  // Newest last
+  std::vector<std::vector<std::unique_ptr<Version>>> histories;
+  std::vector<std::pair<std::string, Assembly>> objects;
+};
+
+#endif
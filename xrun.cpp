@@ -0,0 +1,136 @@
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "toyemu.h"
+#include "xasm.h"
+
+
+// Cycles per toyRun call, output is passed on between calls
+static const uint64_t RunSlice = 1 << 20;
+
+static void DrainOutput(toyMachine *machine) {
+  uint32_t words[256];
+  std::size_t count;
+  while ((count = toyReadOutput(machine, words, sizeof(words) / sizeof(words[0])))) {
+    for (std::size_t i = 0; i < count; ++i) {
+      std::printf("%04" PRIX32 "\n", words[i]);
+    }
+  }
+}
+
+// Runs the loaded program until it halts, runs out of input or uses up cycleLimit, returning whether it halted
+static bool Run(toyMachine *machine, const char *name, uint64_t cycleLimit) {
+  uint64_t cycles = 0;
+  for (;;) {
+    uint64_t slice = cycleLimit - cycles < RunSlice ? cycleLimit - cycles : RunSlice;
+    toyStatus status = toyRun(machine, slice);
+    DrainOutput(machine);
+
+    toyState state;
+    toyGetState(machine, &state);
+    cycles = state.cycles;
+    switch (status) {
+      case TOY_HALTED:
+        return true;
+      case TOY_NEED_INPUT: {
+        unsigned int word;
+        std::fflush(stdout);
+        if (std::scanf("%4x", &word) != 1) {
+          std::fprintf(stderr, "%s ran out of input at pc %02X\n", name, state.pc);
+          return false;
+        }
+        uint32_t input = word;
+        if (toyWriteInput(machine, &input, 1) != TOY_OK) {
+          std::fprintf(stderr, "Out of memory\n");
+          return false;
+        }
+        break;
+      }
+      case TOY_CYCLE_LIMIT:
+        if (cycles >= cycleLimit) {
+          std::fprintf(stderr, "%s stopped at the cycle limit at pc %02X\n", name, state.pc);
+          return false;
+        }
+        break;
+      default:
+        std::fprintf(stderr, "%s stopped with status %d\n", name, status);
+        return false;
+    }
+  }
+}
+
+// Usage: xrun [--cycles limit] [--listing] source..., assembles each source in memory with the direct front end and
+// runs it on libtoyemu straight after, with no image files in between. The programs read hex words from stdin and
+// write them to stdout the way the emulator's --io text does. --listing prints each program's listing on stderr
+// before running it.
+int main(int argc, char *argv[]) {
+  uint64_t cycleLimit = UINT64_MAX;
+  bool listing = false;
+
+  int argi = 1;
+  for (; argi < argc && std::strncmp(argv[argi], "--", 2) == 0; ++argi) {
+    if (std::strcmp(argv[argi], "--cycles") == 0 && argi + 1 < argc) {
+      cycleLimit = std::strtoull(argv[++argi], nullptr, 10);
+    } else if (std::strcmp(argv[argi], "--listing") == 0) {
+      listing = true;
+    } else {
+      std::cerr << "Unknown option " << argv[argi] << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (argi == argc) {
+    std::cerr << "No source given" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  toyMachine *machine;
+  if (toyCreate(&machine) != TOY_OK) {
+    std::cerr << "Out of memory" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Loading an image resets the machine so one does for every source
+  Assembly assembly;
+  bool ok = true;
+  for (; argi < argc && ok; ++argi) {
+    std::ifstream file(argv[argi], std::ios::binary);
+    if (!file) {
+      std::cerr << "Cannot open " << argv[argi] << std::endl;
+      ok = false;
+      break;
+    }
+    std::stringstream source;
+    source << file.rdbuf();
+    std::string text = source.str();
+
+    if (!Assemble(text, assembly)) {
+      for (const Diagnostic &diagnostic : assembly.diagnostics) {
+        std::cerr << argv[argi] << ": " << diagnostic << std::endl;
+      }
+      ok = false;
+      break;
+    }
+    if (listing) {
+      PrintListing(assembly.image, text, std::cerr);
+    }
+
+    std::string image = BinaryImage(assembly.image);
+    if (toyLoadImage(machine, image.data(), image.size()) != TOY_OK) {
+      std::cerr << "Cannot load " << argv[argi] << std::endl;
+      ok = false;
+      break;
+    }
+    ok = Run(machine, argv[argi], cycleLimit);
+  }
+
+  std::fflush(stdout);
+  toyDestroy(machine);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,517 @@
+#include <fcntl.h>    // open, O_RDONLY
+#include <inttypes.h> // PRIu64, PRIX16, PRIX32, uint8_t, uint16_t, uint32_t, uint64_t
+#include <stdbool.h>  // bool, false, true
+#include <stdio.h>    // fclose, fopen, fwrite, printf, puts, remove
+#include <stdlib.h>   // free, malloc, qsort, realloc, strtoull, strtoul
+#include <string.h>   // memcmp, memcpy, memset, strcat, strchr, strcmp, strcpy, strlen, strncmp
+#include <sys/mman.h> // MAP_FAILED, MAP_PRIVATE, mmap, munmap, PROT_READ
+#include <sys/stat.h> // fstat, stat
+#include <time.h>     // time_t
+#include <unistd.h>   // close
+
+#include "emulator.h"
+#include "trace.h"
+
+// Offline viewer for --trace files.
+//   xtrace TRACE                 summary of the trace
+//   xtrace TRACE show CYCLE...   the cpu after each of those cycles the way the debugger prints it
+//   xtrace TRACE find KEY=HEX... every cycle matching all of pc, inst, reg (written), read, write (addresses) and
+//                                value (register or memory value)
+// show and find by pc or address go through the checkpoint index in TRACE.idx, built the first time it's needed.
+
+// Records between checkpoints, each costs about 16KB for its bitmaps plus the pages in use
+#define INDEX_INTERVAL (uint64_t)65536
+
+typedef struct {
+  const char        *data;
+  size_t            size;
+  const traceHeader *header;
+  const tracePage   *pages;
+  const traceRecord *records;
+  uint64_t          recordCount;
+  time_t            modified;
+} traceFile;
+
+// See trace.h, either mapped from TRACE.idx or built in memory by replaying the trace
+typedef struct {
+  char     *data;
+  size_t   size, capacity;
+  bool     mapped;
+  uint64_t interval, checkpointCount;
+} traceIndex;
+
+enum {
+  FIND_PC,
+  FIND_INST,
+  FIND_REG,
+  FIND_READ,
+  FIND_WRITE,
+  FIND_VALUE,
+  FIND_KEY_COUNT
+};
+
+static const char *findKeys[FIND_KEY_COUNT] = {"pc", "inst", "reg", "read", "write", "value"};
+
+
+static bool openTraceFile(traceFile *trace, char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    puts("Path is invalid");
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) || (size_t)info.st_size < sizeof(traceHeader)) {
+    puts("Not a trace file");
+    close(fd);
+    return false;
+  }
+
+  trace->size = info.st_size;
+  trace->modified = info.st_mtime;
+  trace->data = mmap(NULL, trace->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (trace->data == MAP_FAILED) {
+    puts("File reading error");
+    return false;
+  }
+
+  trace->header = (const traceHeader *)trace->data;
+  if (memcmp(trace->header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) || trace->header->version != TRACE_VERSION) {
+    puts("Not a trace file");
+    munmap((void *)trace->data, trace->size);
+    return false;
+  }
+
+  size_t offset = sizeof(traceHeader) + (size_t)trace->header->pageCount * sizeof(tracePage);
+  if (offset > trace->size) {
+    puts("Trace is truncated");
+    munmap((void *)trace->data, trace->size);
+    return false;
+  }
+  trace->pages = (const tracePage *)(trace->data + sizeof(traceHeader));
+  trace->records = (const traceRecord *)(trace->data + offset);
+  trace->recordCount = (trace->size - offset) / sizeof(traceRecord);
+  return true;
+}
+
+// The cpu as tracing started or at a checkpoint
+static void startCpu(cpu *cpuState, const traceHeader *header, const tracePage *pages) {
+  memset(cpuState, 0, sizeof(cpu));
+  cpuState->debug = true;
+  cpuState->pc = cpuState->oldPC = header->pc;
+  cpuState->in32Bit = header->in32Bit;
+  cpuState->cycles = header->cycles;
+  memcpy(cpuState->registers, header->registers, sizeof(cpuState->registers));
+  memcpy(cpuState->memory32, header->memory32, sizeof(cpuState->memory32));
+  for (uint32_t i = 0; i < header->pageCount; ++i) {
+    const tracePage *page = pages + i;
+    if (page->index && page->index < PAGE_COUNT) {
+      memCopy32(cpuState, page->index * PAGE_WORDS_32, page->words, PAGE_WORDS_32);
+    }
+  }
+}
+
+static void storeWord(cpu *cpuState, uint16_t addr, uint32_t word, bool in32Bit) {
+  if (in32Bit) {
+    memWrite32(cpuState, addr, word);
+  } else {
+    cpuState->memory16[addr & ADDR_MASK_16] = word;
+  }
+}
+
+// Moves cpuState on by one cycle, leaving the tracking fields the way the reference interpreter had them
+static void applyRecord(cpu *cpuState, const traceRecord *record) {
+  uint8_t flags = record->flags;
+
+  cpuState->oldPC = record->pc;
+  cpuState->pc = record->nextPC;
+  cpuState->in32Bit = record->in32Bit;
+  cpuState->pcModified = flags & TRACE_PC_MODIFIED;
+  cpuState->halted = flags & TRACE_HALTED;
+  ++cpuState->cycles;
+
+  cpuState->wroteReg = flags & TRACE_WROTE_REG;
+  cpuState->readReg1 = flags & TRACE_READ_REG1;
+  cpuState->readReg2 = flags & TRACE_READ_REG2;
+  cpuState->lastWriteReg = record->regs >> 8 & 0xF;
+  cpuState->lastReadReg1 = record->regs >> 4 & 0xF;
+  cpuState->lastReadReg2 = record->regs & 0xF;
+  if (cpuState->wroteReg) cpuState->registers[cpuState->lastWriteReg] = record->regValue;
+
+  // Reads of the I/O port change memory too
+  cpuState->readMem = flags & TRACE_READ_MEM;
+  cpuState->wroteMem = flags & TRACE_WROTE_MEM;
+  if (cpuState->readMem) cpuState->lastReadAddr = record->memAddr;
+  if (flags & TRACE_STORE) cpuState->lastWriteAddr = record->memAddr;
+  if (flags & (TRACE_READ_MEM | TRACE_STORE)) storeWord(cpuState, record->memAddr, record->memValue, record->in32Bit);
+}
+
+static const uint64_t *indexOffsets(const traceIndex *index) {
+  return (const uint64_t *)(index->data + sizeof(traceIndexHeader));
+}
+
+static const traceIndexBlock *indexBlock(const traceIndex *index, uint64_t checkpoint) {
+  return (const traceIndexBlock *)(index->data + indexOffsets(index)[checkpoint]);
+}
+
+static const traceHeader *checkpointHeader(const traceIndex *index, uint64_t checkpoint) {
+  return (const traceHeader *)(indexBlock(index, checkpoint) + 1);
+}
+
+static bool testBit(const uint64_t *bits, uint32_t addr) {
+  return addr < MEM_SIZE_32 && bits[addr >> 6] >> (addr & 63) & 1;
+}
+
+static void setBit(uint64_t *bits, uint16_t addr) {
+  bits[addr >> 6] |= (uint64_t)1 << (addr & 63);
+}
+
+// Adds size bytes to a built index, zeroed when bytes is NULL
+static bool appendIndex(traceIndex *index, const void *bytes, size_t size) {
+  if (size > index->capacity - index->size) {
+    size_t capacity = index->capacity ? index->capacity : 65536;
+    while (size > capacity - index->size) capacity *= 2;
+    char *data = realloc(index->data, capacity);
+    if (!data) return false;
+    index->data = data;
+    index->capacity = capacity;
+  }
+  if (bytes) {
+    memcpy(index->data + index->size, bytes, size);
+  } else {
+    memset(index->data + index->size, 0, size);
+  }
+  index->size += size;
+  return true;
+}
+
+// The same layout trace.c writes at the start of a trace, padded so the next block is aligned
+static bool appendCheckpoint(traceIndex *index, cpu *cpuState) {
+  traceHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.pc = cpuState->pc;
+  header.in32Bit = cpuState->in32Bit;
+  header.cycles = cpuState->cycles;
+  memcpy(header.registers, cpuState->registers, sizeof(header.registers));
+  memcpy(header.memory32, cpuState->memory32, sizeof(header.memory32));
+  for (uint32_t i = 1; i < cpuState->pageCount; ++i) header.pageCount += cpuState->pages[i] != NULL;
+  if (!appendIndex(index, &header, sizeof(header))) return false;
+
+  for (uint32_t i = 1; i < cpuState->pageCount; ++i) {
+    if (!cpuState->pages[i]) continue;
+    tracePage page;
+    page.index = i;
+    memcpy(page.words, cpuState->pages[i]->words, sizeof(page.words));
+    if (!appendIndex(index, &page, sizeof(page))) return false;
+  }
+  return appendIndex(index, NULL, -index->size & 7);
+}
+
+// Replays the whole trace once, taking a checkpoint every INDEX_INTERVAL records and before the end
+static bool buildIndex(const traceFile *trace, traceIndex *index) {
+  traceIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_INDEX_MAGIC, sizeof(header.magic));
+  header.version = TRACE_INDEX_VERSION;
+  header.traceSize = trace->size;
+  header.interval = INDEX_INTERVAL;
+  header.checkpointCount = trace->recordCount / INDEX_INTERVAL + 1;
+
+  memset(index, 0, sizeof(traceIndex));
+  index->interval = header.interval;
+  index->checkpointCount = header.checkpointCount;
+  if (!appendIndex(index, &header, sizeof(header)) ||
+      !appendIndex(index, NULL, header.checkpointCount * sizeof(uint64_t))) {
+    free(index->data);
+    return false;
+  }
+
+  cpu cpuState;
+  startCpu(&cpuState, trace->header, trace->pages);
+  bool ok = cpuState.stop != STOP_OUT_OF_MEMORY;
+  size_t block = 0;
+  for (uint64_t i = 0; ok; ++i) {
+    if (i % INDEX_INTERVAL == 0) {
+      block = index->size;
+      ((uint64_t *)(index->data + sizeof(traceIndexHeader)))[i / INDEX_INTERVAL] = block;
+      ok = appendIndex(index, NULL, sizeof(traceIndexBlock)) && appendCheckpoint(index, &cpuState);
+    }
+    if (!ok || i == trace->recordCount) break;
+
+    // Offsets rather than pointers as appending can move the index
+    const traceRecord *record = trace->records + i;
+    traceIndexBlock *bits = (traceIndexBlock *)(index->data + block);
+    setBit(bits->pcs, record->pc);
+    if (record->flags & (TRACE_READ_MEM | TRACE_STORE)) setBit(bits->addrs, record->memAddr);
+    applyRecord(&cpuState, record);
+    ok = cpuState.stop != STOP_OUT_OF_MEMORY;
+  }
+
+  freeCpuMemory(&cpuState);
+  if (!ok) free(index->data);
+  return ok;
+}
+
+// Everything an index read from disk points at has to be inside it and belong to this trace
+static bool checkIndex(const traceFile *trace, traceIndex *index) {
+  const traceIndexHeader *header = (const traceIndexHeader *)index->data;
+  if (memcmp(header->magic, TRACE_INDEX_MAGIC, sizeof(TRACE_INDEX_MAGIC)) || header->version != TRACE_INDEX_VERSION ||
+      header->traceSize != trace->size || !header->interval ||
+      header->checkpointCount != trace->recordCount / header->interval + 1 ||
+      header->checkpointCount > (index->size - sizeof(traceIndexHeader)) / sizeof(uint64_t)) {
+    return false;
+  }
+  index->interval = header->interval;
+  index->checkpointCount = header->checkpointCount;
+
+  const uint64_t *offsets = indexOffsets(index);
+  for (uint64_t i = 0; i < index->checkpointCount; ++i) {
+    size_t room = sizeof(traceIndexBlock) + sizeof(traceHeader);
+    if (offsets[i] % 8 || offsets[i] > index->size || index->size - offsets[i] < room) return false;
+    const traceHeader *checkpoint = checkpointHeader(index, i);
+    if (checkpoint->pageCount > (index->size - offsets[i] - room) / sizeof(tracePage) ||
+        checkpoint->cycles != trace->header->cycles + i * index->interval) {
+      return false;
+    }
+  }
+
+  // The first checkpoint is the start of the trace, which catches an index left from another trace of the same size
+  const traceHeader *start = checkpointHeader(index, 0);
+  return !memcmp(start, trace->header, sizeof(traceHeader)) &&
+         !memcmp(start + 1, trace->pages, start->pageCount * sizeof(tracePage));
+}
+
+// Maps the index next to the trace unless it's missing, older than the trace or doesn't match it
+static bool loadIndex(const traceFile *trace, const char *path, traceIndex *index) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat info;
+  if (fstat(fd, &info) || info.st_mtime < trace->modified || (size_t)info.st_size < sizeof(traceIndexHeader)) {
+    close(fd);
+    return false;
+  }
+
+  memset(index, 0, sizeof(traceIndex));
+  index->size = index->capacity = info.st_size;
+  index->mapped = true;
+  index->data = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (index->data == MAP_FAILED) return false;
+  if (!checkIndex(trace, index)) {
+    munmap(index->data, index->size);
+    return false;
+  }
+  return true;
+}
+
+// Best effort, the index of a trace somewhere that can't be written to is just rebuilt each time
+static void saveIndex(const traceIndex *index, const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (!file) return;
+  bool ok = fwrite(index->data, 1, index->size, file) == index->size;
+  if (fclose(file) || !ok) remove(path);
+}
+
+static bool openIndex(const traceFile *trace, const char *tracePath, traceIndex *index) {
+  char *path = malloc(strlen(tracePath) + sizeof(".idx"));
+  if (!path) {
+    puts("Out of memory");
+    return false;
+  }
+  strcpy(path, tracePath);
+  strcat(path, ".idx");
+
+  bool ok = loadIndex(trace, path, index);
+  if (!ok) {
+    ok = buildIndex(trace, index);
+    if (ok) {
+      saveIndex(index, path);
+    } else {
+      puts("Out of memory");
+    }
+  }
+  free(path);
+  return ok;
+}
+
+static void freeIndex(traceIndex *index) {
+  if (index->mapped) {
+    munmap(index->data, index->size);
+  } else {
+    free(index->data);
+  }
+}
+
+static void printSummary(const traceFile *trace) {
+  const traceHeader *header = trace->header;
+  printf("%" PRIu64 " cycles traced, from cycle %" PRIu64 " to %" PRIu64 "\n", trace->recordCount,
+    header->cycles, header->cycles + trace->recordCount);
+  if (trace->recordCount) {
+    const traceRecord *last = trace->records + trace->recordCount - 1;
+    printf("Ends at pc %04" PRIX16 "%s\n", last->nextPC, last->flags & TRACE_HALTED ? ", halted" : "");
+  }
+}
+
+static int compareCycles(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Each state is rebuilt from the last checkpoint before it, or carries on from the one before when that's closer
+static bool showCycles(const traceFile *trace, const char *path, char **args, int argCount) {
+  uint64_t *cycles = malloc(argCount * sizeof(uint64_t));
+  if (!cycles) {
+    puts("Out of memory");
+    return false;
+  }
+  for (int i = 0; i < argCount; ++i) cycles[i] = strtoull(args[i], NULL, 10);
+  qsort(cycles, argCount, sizeof(uint64_t), compareCycles);
+
+  uint64_t first = trace->header->cycles;
+  uint64_t last = first + trace->recordCount;
+  if (cycles[0] < first || cycles[argCount - 1] > last) {
+    printf("Cycles must be between %" PRIu64 " and %" PRIu64 "\n", first, last);
+    free(cycles);
+    return false;
+  }
+
+  traceIndex index;
+  if (!openIndex(trace, path, &index)) {
+    free(cycles);
+    return false;
+  }
+
+  cpu cpuState;
+  bool started = false;
+  for (int i = 0; i < argCount; ++i) {
+    // At least one record is replayed after the checkpoint so the debugger's tracking fields are set
+    uint64_t target = cycles[i] - first;
+    uint64_t checkpoint = target ? (target - 1) / index.interval : 0;
+    if (!started || cpuState.cycles - first < checkpoint * index.interval) {
+      if (started) freeCpuMemory(&cpuState);
+      const traceHeader *header = checkpointHeader(&index, checkpoint);
+      startCpu(&cpuState, header, (const tracePage *)(header + 1));
+      started = true;
+    }
+    while (cpuState.cycles < cycles[i] && cpuState.stop != STOP_OUT_OF_MEMORY) {
+      applyRecord(&cpuState, trace->records + (cpuState.cycles - first));
+    }
+    // A page that couldn't be allocated would show up as memory the program never had
+    if (cpuState.stop == STOP_OUT_OF_MEMORY) {
+      puts("Out of memory");
+      freeCpuMemory(&cpuState);
+      freeIndex(&index);
+      free(cycles);
+      return false;
+    }
+    printf("Cycle %" PRIu64 "\n", cpuState.cycles);
+    printCpuState(&cpuState);
+  }
+
+  freeCpuMemory(&cpuState);
+  freeIndex(&index);
+  free(cycles);
+  return true;
+}
+
+// Prints the records from start to end matching every key in use
+static uint64_t findInBlock(const traceFile *trace, const bool *used, const uint32_t *wanted, uint64_t start,
+                            uint64_t end) {
+  uint64_t matches = 0;
+  for (uint64_t i = start; i < end; ++i) {
+    const traceRecord *record = trace->records + i;
+    bool wroteReg = record->flags & TRACE_WROTE_REG;
+    bool read = record->flags & TRACE_READ_MEM;
+    bool wrote = record->flags & TRACE_STORE;
+
+    if (used[FIND_PC] && record->pc != wanted[FIND_PC]) continue;
+    if (used[FIND_INST] && record->inst != wanted[FIND_INST]) continue;
+    if (used[FIND_REG] && (!wroteReg || (record->regs >> 8 & 0xF) != wanted[FIND_REG])) continue;
+    if (used[FIND_READ] && (!read || record->memAddr != wanted[FIND_READ])) continue;
+    if (used[FIND_WRITE] && (!wrote || record->memAddr != wanted[FIND_WRITE])) continue;
+    if (used[FIND_VALUE] && !(wroteReg && record->regValue == wanted[FIND_VALUE]) &&
+        !((read || wrote) && record->memValue == wanted[FIND_VALUE])) {
+      continue;
+    }
+
+    printf("%" PRIu64 "\tpc %04" PRIX16 "\tinst %04" PRIX32, trace->header->cycles + i + 1, record->pc, record->inst);
+    if (wroteReg) printf("\tR[%X] = %08" PRIX32, record->regs >> 8 & 0xF, record->regValue);
+    if (read || wrote) {
+      printf("\t%s M[%04" PRIX16 "] = %08" PRIX32, wrote ? "write" : "read", record->memAddr, record->memValue);
+    }
+    putchar('\n');
+    ++matches;
+  }
+  return matches;
+}
+
+// Searches for a pc or an address skip whole blocks of the index that never ran or touched it
+static bool findCycles(const traceFile *trace, const char *path, char **args, int argCount) {
+  bool used[FIND_KEY_COUNT] = {false};
+  uint32_t wanted[FIND_KEY_COUNT];
+
+  for (int i = 0; i < argCount; ++i) {
+    char *equals = strchr(args[i], '=');
+    uint8_t key = 0;
+    while (equals && key < FIND_KEY_COUNT &&
+           (strncmp(args[i], findKeys[key], equals - args[i]) || findKeys[key][equals - args[i]])) {
+      ++key;
+    }
+    if (!equals || key == FIND_KEY_COUNT) {
+      printf("Unknown search %s\n", args[i]);
+      return false;
+    }
+    used[key] = true;
+    wanted[key] = strtoul(equals + 1, NULL, 16);
+  }
+
+  traceIndex index;
+  bool indexed = used[FIND_PC] || used[FIND_READ] || used[FIND_WRITE];
+  if (indexed && !openIndex(trace, path, &index)) return false;
+  uint64_t interval = indexed ? index.interval : trace->recordCount;
+
+  uint64_t matches = 0;
+  for (uint64_t start = 0; start < trace->recordCount; start += interval) {
+    if (indexed) {
+      const traceIndexBlock *block = indexBlock(&index, start / interval);
+      if (used[FIND_PC] && !testBit(block->pcs, wanted[FIND_PC])) continue;
+      if (used[FIND_READ] && !testBit(block->addrs, wanted[FIND_READ])) continue;
+      if (used[FIND_WRITE] && !testBit(block->addrs, wanted[FIND_WRITE])) continue;
+    }
+    uint64_t end = trace->recordCount - start < interval ? trace->recordCount : start + interval;
+    matches += findInBlock(trace, used, wanted, start, end);
+  }
+
+  if (indexed) freeIndex(&index);
+  printf("%" PRIu64 " matching cycles\n", matches);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    puts("Usage: xtrace TRACE [show CYCLE... | find KEY=HEX...]");
+    return 1;
+  }
+
+  traceFile trace;
+  if (!openTraceFile(&trace, argv[1])) return 1;
+
+  bool ok = true;
+  if (argc == 2) {
+    printSummary(&trace);
+  } else if (strcmp(argv[2], "show") == 0 && argc > 3) {
+    ok = showCycles(&trace, argv[1], argv + 3, argc - 3);
+  } else if (strcmp(argv[2], "find") == 0 && argc > 3) {
+    ok = findCycles(&trace, argv[1], argv + 3, argc - 3);
+  } else {
+    printf("Unknown command %s\n", argv[2]);
+    ok = false;
+  }
+
+  munmap((void *)trace.data, trace.size);
+  return ok ? 0 : 1;
+}